@@ -122,6 +122,14 @@ contains(USE_UPNP, -) {
     win32:LIBS += -liphlpapi
 }
 
+# use: qmake "USE_SECP256K1=1" to verify signatures with libsecp256k1
+contains(USE_SECP256K1, 1) {
+    message(Building with libsecp256k1 signature verification)
+    DEFINES += USE_SECP256K1
+    INCLUDEPATH += $$SECP256K1_INCLUDE_PATH
+    LIBS += $$join(SECP256K1_LIB_PATH,,-L,) -lsecp256k1
+}
+
 
 # use: qmake "USE_DBUS=1"
 contains(USE_DBUS, 1) {
@@ -188,6 +196,16 @@ HEADERS += src/qt/bitcoingui.h \
     src/util.h \
     src/uint256.h \
     src/kernel.h \
+    src/emessagesketch.h \
+    src/blockcache.h \
+    src/merkle.h \
+    src/kernelhash.h \
+    src/sha256lanes.h \
+    src/lanehasher.h \
+    src/compactblock.h \
+    src/pubnotify.h \
+    src/addressindex.h \
+    src/blockfile.h \
     src/scrypt_mine.h \
     src/pbkdf2.h \
     src/serialize.h \
@@ -318,6 +336,14 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/rpcconsole.cpp \
     src/noui.cpp \
     src/kernel.cpp \
+    src/emessagesketch.cpp \
+    src/blockcache.cpp \
+    src/merkle.cpp \
+    src/kernelhash.cpp \
+    src/compactblock.cpp \
+    src/pubnotify.cpp \
+    src/addressindex.cpp \
+    src/blockfile.cpp \
     src/scrypt-x86.S \
     src/scrypt-x86_64.S \
     src/scrypt_mine.cpp \
@@ -394,7 +420,7 @@ QMAKE_EXTRA_COMPILERS += TSQM
 
 # "Other files" to show in Qt Creator
 OTHER_FILES += \
-    doc/*.rst doc/*.txt doc/README README.md res/bitcoin-qt.rc src/test/*.cpp src/test/*.h src/qt/test/*.cpp src/qt/test/*.h
+    doc/*.rst doc/*.txt doc/README README.md res/bitcoin-qt.rc src/test/*.cpp src/test/*.h src/bench/*.cpp src/bench/*.h src/qt/test/*.cpp src/qt/test/*.h
 
 # platform specific defaults, if not overridden on command line
 isEmpty(BOOST_LIB_SUFFIX) {
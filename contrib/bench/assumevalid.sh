@@ -0,0 +1,38 @@
+#!/bin/bash
+# Compare block import time with and without -assumevalid.
+#
+# Imports the same bootstrap file into two fresh data directories, once with
+# signature checks skipped for ancestors of the assumed valid block (the
+# default, last checkpoint) and once with -assumevalid=0, and prints the time
+# LoadExternalBlockFile reports for each.
+#
+# usage: assumevalid.sh <bootstrap.dat> [path/to/CinniCoind] [extra args...]
+
+BOOTSTRAP=$1
+DAEMON=${2:-./src/CinniCoind}
+shift
+[ $# -gt 0 ] && shift
+if [ ! -f "$BOOTSTRAP" ]; then
+    echo "usage: $0 <bootstrap.dat> [path/to/CinniCoind] [extra args...]"
+    exit 1
+fi
+
+import_time()
+{
+    local DATADIR=$(mktemp -d)
+    "$DAEMON" -datadir="$DATADIR" -loadblock="$BOOTSTRAP" -connect=0 -listen=0 \
+        -dnsseed=0 -irc=0 -upnp=0 -nosmsg -rpcpassword=bench "$@" >/dev/null 2>&1 &
+    local PID=$!
+    while kill -0 $PID 2>/dev/null; do
+        LINE=$(grep -m1 "Loaded .* blocks from external file" "$DATADIR/debug.log" 2>/dev/null)
+        [ -n "$LINE" ] && break
+        sleep 1
+    done
+    kill $PID 2>/dev/null
+    wait $PID 2>/dev/null
+    rm -rf "$DATADIR"
+    echo "${LINE:-import did not finish}"
+}
+
+echo "assumevalid=default: $(import_time "$@")"
+echo "assumevalid=0:       $(import_time -assumevalid=0 "$@")"
@@ -0,0 +1,69 @@
+#!/bin/bash
+# Time a reorganization of 500 blocks on a private -regtest chain.
+#
+# Node B mines 501 blocks and stops. Node A then mines 500 blocks of its own
+# while trying to connect to B, and B is started again. A downloads B's
+# longer branch and switches to it; the time Reorganize reports is printed,
+# once with the recent block cache and once with -blockcachesize=0.
+#
+# usage: reorg.sh [path/to/CinniCoind] [blocks]
+
+DAEMON=${1:-./src/CinniCoind}
+BLOCKS=${2:-500}
+PORTA=31915
+PORTB=31925
+COMMON="-regtest -listen -dnsseed=0 -irc=0 -upnp=0 -nosmsg -rpcuser=bench -rpcpassword=bench"
+
+rpc()
+{
+    local DATADIR=$1
+    local PORT=$2
+    shift 2
+    "$DAEMON" -regtest -datadir="$DATADIR" -rpcport=$PORT -rpcuser=bench -rpcpassword=bench "$@"
+}
+
+start()
+{
+    local DATADIR=$1
+    local PORT=$2
+    shift 2
+    "$DAEMON" $COMMON -datadir="$DATADIR" -port=$PORT -rpcport=$((PORT + 1)) "$@" >/dev/null 2>&1 &
+    PID=$!
+    until rpc "$DATADIR" $((PORT + 1)) getblockcount >/dev/null 2>&1; do sleep 1; done
+}
+
+stop()
+{
+    rpc "$1" $(($2 + 1)) stop >/dev/null 2>&1
+    wait $3 2>/dev/null
+}
+
+reorg_time()
+{
+    local DIRA=$(mktemp -d)
+    local DIRB=$(mktemp -d)
+
+    start "$DIRB" $PORTB -connect=0
+    rpc "$DIRB" $((PORTB + 1)) generate $((BLOCKS + 1)) >/dev/null
+    stop "$DIRB" $PORTB $PID
+
+    start "$DIRA" $PORTA -connect=127.0.0.1:$PORTB "$@"
+    local PIDA=$PID
+    rpc "$DIRA" $((PORTA + 1)) generate $BLOCKS >/dev/null
+
+    start "$DIRB" $PORTB -connect=0
+    local PIDB=$PID
+    while true; do
+        LINE=$(grep -m1 "REORGANIZE: done" "$DIRA/regtest/debug.log" 2>/dev/null)
+        [ -n "$LINE" ] && break
+        sleep 1
+    done
+
+    stop "$DIRA" $PORTA $PIDA
+    stop "$DIRB" $PORTB $PIDB
+    rm -rf "$DIRA" "$DIRB"
+    echo "${LINE#*REORGANIZE: }"
+}
+
+echo "reorg $BLOCKS blocks, block cache:    $(reorg_time)"
+echo "reorg $BLOCKS blocks, -blockcachesize=0: $(reorg_time -blockcachesize=0)"
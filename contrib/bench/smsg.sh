@@ -0,0 +1,63 @@
+#!/bin/bash
+# Measure the secure messaging traffic it takes a small network to sync.
+#
+# Starts a line of -regtest nodes, each connected to the one before it, and
+# has every node send messages to its own address. Once every node holds all
+# of the messages the smsg bytes each node sent and received are printed, as
+# reported in smsgbuckets stats. Run it with a build from before smsgInvTok
+# and smsgRecon to compare.
+#
+# usage: smsg.sh [path/to/CinniCoind] [nodes] [messages per node]
+
+DAEMON=${1:-./src/CinniCoind}
+NODES=${2:-4}
+MESSAGES=${3:-50}
+PORT0=31935
+COMMON="-regtest -listen -dnsseed=0 -irc=0 -upnp=0 -rpcuser=bench -rpcpassword=bench"
+
+declare -a DIRS PIDS
+
+rpc()
+{
+    local N=$1
+    shift
+    "$DAEMON" -regtest -datadir="${DIRS[$N]}" -rpcport=$((PORT0 + 10 * N + 1)) -rpcuser=bench -rpcpassword=bench "$@"
+}
+
+stat_value()
+{
+    # -- first "key" : "value" in smsgbuckets stats
+    rpc $1 smsgbuckets stats | grep -m1 "\"$2\"" | sed 's/.*: "\([0-9]*\)".*/\1/'
+}
+
+for ((N = 0; N < NODES; N++)); do
+    DIRS[$N]=$(mktemp -d)
+    CONNECT=-connect=0
+    [ $N -gt 0 ] && CONNECT=-connect=127.0.0.1:$((PORT0 + 10 * (N - 1)))
+    "$DAEMON" $COMMON -datadir="${DIRS[$N]}" -port=$((PORT0 + 10 * N)) -rpcport=$((PORT0 + 10 * N + 1)) $CONNECT >/dev/null 2>&1 &
+    PIDS[$N]=$!
+    until rpc $N getblockcount >/dev/null 2>&1; do sleep 1; done
+done
+
+START=$(date +%s)
+for ((N = 0; N < NODES; N++)); do
+    ADDR=$(rpc $N getnewaddress)
+    for ((M = 0; M < MESSAGES; M++)); do
+        rpc $N smsgsend "$ADDR" "$ADDR" "soak test message $N $M" >/dev/null
+    done
+done
+
+TOTAL=$((NODES * MESSAGES))
+for ((N = 0; N < NODES; N++)); do
+    until [ "$(stat_value $N messages)" = "$TOTAL" ]; do sleep 1; done
+done
+echo "$NODES nodes synced $TOTAL messages in $(($(date +%s) - START))s"
+
+for ((N = 0; N < NODES; N++)); do
+    echo "node $N: sent $(stat_value $N "bytes sent") bytes, received $(stat_value $N "bytes received") bytes"
+    rpc $N stop >/dev/null 2>&1
+done
+for ((N = 0; N < NODES; N++)); do
+    wait ${PIDS[$N]} 2>/dev/null
+    rm -rf "${DIRS[$N]}"
+done
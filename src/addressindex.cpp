@@ -0,0 +1,313 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "db.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+unsigned int nAddressIndexFlags = 0;
+
+// Blocks indexed per database transaction while catching up
+static const int ADDRESSINDEX_BUILD_BATCH = 200;
+
+
+bool GetAddressIndexKey(const CScript& scriptPubKey, unsigned char& nTypeRet, uint160& hashRet)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest))
+    {
+        nTypeRet = ADDRESS_TYPE_PUBKEYHASH;
+        hashRet = *pkeyID;
+        return true;
+    }
+    if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest))
+    {
+        nTypeRet = ADDRESS_TYPE_SCRIPTHASH;
+        hashRet = *pscriptID;
+        return true;
+    }
+    return false;
+}
+
+CBitcoinAddress GetAddressFromIndexKey(unsigned char nType, const uint160& hash)
+{
+    if (nType == ADDRESS_TYPE_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hash));
+    return CBitcoinAddress(CKeyID(hash));
+}
+
+
+bool CAddressIndexBatch::ConnectTransaction(CTxDB& txdb, const CTransaction& tx, int nHeight, const MapPrevTx& inputs)
+{
+    uint256 hashTx = tx.GetHash();
+    unsigned char nType;
+    uint160 hashBytes;
+
+    if (!tx.IsCoinBase())
+    {
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            MapPrevTx::const_iterator mi = inputs.find(prevout.hash);
+            if (mi == inputs.end() || prevout.n >= mi->second.second.vout.size())
+                continue;
+            const CTxOut& txout = mi->second.second.vout[prevout.n];
+            bool fAddress = GetAddressIndexKey(txout.scriptPubKey, nType, hashBytes);
+            int nPrevHeight = -1;
+
+            if (fAddress && (nAddressIndexFlags & INDEX_ADDRESS))
+            {
+                CAddressIndexKey key(nType, hashBytes, nHeight, hashTx, i, true);
+                mapAddress[key] = -txout.nValue;
+                setAddressErase.erase(key);
+
+                // An output created earlier in the batch never reaches the database
+                CAddressUnspentKey keyUnspent(nType, hashBytes, prevout.hash, prevout.n);
+                map<CAddressUnspentKey, CAddressUnspentValue>::iterator it = mapUnspent.find(keyUnspent);
+                if (it != mapUnspent.end() && !it->second.IsNull())
+                {
+                    nPrevHeight = it->second.nHeight;
+                    mapUnspent.erase(it);
+                }
+                else
+                {
+                    CAddressUnspentValue value;
+                    if (!txdb.ReadAddressUnspent(keyUnspent, value))
+                        return error("CAddressIndexBatch::ConnectTransaction() : %s:%u not in the unspent index",
+                                     prevout.hash.ToString().substr(0,10).c_str(), prevout.n);
+                    nPrevHeight = value.nHeight;
+                    mapUnspent[keyUnspent].SetNull();
+                }
+            }
+
+            if ((nAddressIndexFlags & INDEX_SPENT) || nPrevHeight >= 0)
+            {
+                if (!fAddress)
+                {
+                    nType = 0;
+                    hashBytes = 0;
+                }
+                mapSpent[CSpentIndexKey(prevout.hash, prevout.n)] = CSpentIndexValue(hashTx, i, nHeight, txout.nValue, nType, hashBytes, nPrevHeight);
+            }
+        }
+    }
+
+    if (!(nAddressIndexFlags & INDEX_ADDRESS))
+        return true;
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        if (!GetAddressIndexKey(txout.scriptPubKey, nType, hashBytes))
+            continue;
+        CAddressIndexKey key(nType, hashBytes, nHeight, hashTx, i, false);
+        mapAddress[key] = txout.nValue;
+        setAddressErase.erase(key);
+        mapUnspent[CAddressUnspentKey(nType, hashBytes, hashTx, i)] = CAddressUnspentValue(txout.nValue, txout.scriptPubKey, nHeight);
+    }
+    return true;
+}
+
+bool CAddressIndexBatch::DisconnectTransaction(CTxDB& txdb, const CTransaction& tx, int nHeight, const MapPrevTx& inputs)
+{
+    uint256 hashTx = tx.GetHash();
+    unsigned char nType;
+    uint160 hashBytes;
+
+    if (nAddressIndexFlags & INDEX_ADDRESS)
+    {
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            const CTxOut& txout = tx.vout[i];
+            if (!GetAddressIndexKey(txout.scriptPubKey, nType, hashBytes))
+                continue;
+            CAddressIndexKey key(nType, hashBytes, nHeight, hashTx, i, false);
+            mapAddress.erase(key);
+            setAddressErase.insert(key);
+            mapUnspent[CAddressUnspentKey(nType, hashBytes, hashTx, i)].SetNull();
+        }
+    }
+
+    if (tx.IsCoinBase())
+        return true;
+
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        CSpentIndexKey keySpent(prevout.hash, prevout.n);
+        if (nAddressIndexFlags & INDEX_SPENT)
+            mapSpent[keySpent].SetNull();
+
+        MapPrevTx::const_iterator mi = inputs.find(prevout.hash);
+        if (!(nAddressIndexFlags & INDEX_ADDRESS) || mi == inputs.end() || prevout.n >= mi->second.second.vout.size())
+            continue;
+        const CTxOut& txout = mi->second.second.vout[prevout.n];
+        if (!GetAddressIndexKey(txout.scriptPubKey, nType, hashBytes))
+            continue;
+
+        CAddressIndexKey key(nType, hashBytes, nHeight, hashTx, i, true);
+        mapAddress.erase(key);
+        setAddressErase.insert(key);
+
+        // The spent output is unspent again, at the height ConnectTransaction
+        // recorded for it
+        CSpentIndexValue spent;
+        if (!txdb.ReadSpentIndex(keySpent, spent) || spent.nPrevHeight < 0)
+            return error("CAddressIndexBatch::DisconnectTransaction() : no spent record for %s:%u",
+                         prevout.hash.ToString().substr(0,10).c_str(), prevout.n);
+        mapSpent[keySpent].SetNull();
+        mapUnspent[CAddressUnspentKey(nType, hashBytes, prevout.hash, prevout.n)] = CAddressUnspentValue(txout.nValue, txout.scriptPubKey, spent.nPrevHeight);
+    }
+    return true;
+}
+
+
+bool ReadBlockInputs(CTxDB& txdb, const CBlock& block, MapPrevTx& inputsRet)
+{
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (inputsRet.count(txin.prevout.hash))
+                continue;
+            pair<CTxIndex, CTransaction>& prev = inputsRet[txin.prevout.hash];
+            if (!txdb.ReadDiskTx(txin.prevout.hash, prev.second, prev.first))
+                return error("ReadBlockInputs() : %s not found", txin.prevout.hash.ToString().substr(0,10).c_str());
+        }
+    }
+    return true;
+}
+
+int64 GetAddressReceived(const vector<pair<CAddressIndexKey, int64> >& vEntries)
+{
+    // Entries of one transaction are next to each other, keys sort by
+    // height and then transaction
+    int64 nReceived = 0;
+    for (unsigned int i = 0; i < vEntries.size(); )
+    {
+        int64 nCredit = 0, nDebit = 0;
+        unsigned int j = i;
+        for (; j < vEntries.size() && vEntries[j].first.txhash == vEntries[i].first.txhash
+                                   && vEntries[j].first.nHeight == vEntries[i].first.nHeight; j++)
+        {
+            if (vEntries[j].second > 0)
+                nCredit += vEntries[j].second;
+            else
+                nDebit -= vEntries[j].second;
+        }
+        if (nCredit > nDebit)
+            nReceived += nCredit - nDebit;
+        i = j;
+    }
+    return nReceived;
+}
+
+
+uint256 GetAddressIndexBest(CTxDB& txdb)
+{
+    unsigned int nFlags;
+    uint256 hashBest;
+    if (!nAddressIndexFlags || !txdb.ReadAddressIndexBest(nFlags, hashBest))
+        return 0;
+    return hashBest;
+}
+
+bool IsAddressIndexSynced(CTxDB& txdb)
+{
+    return nAddressIndexFlags && GetAddressIndexBest(txdb) == hashBestChain;
+}
+
+bool InitAddressIndex()
+{
+    CTxDB txdb;
+    unsigned int nFlags = 0;
+    uint256 hashBest = 0;
+    bool fExists = txdb.ReadAddressIndexBest(nFlags, hashBest);
+
+    // The stored index must be on the best chain and match the options
+    if (fExists && nFlags == nAddressIndexFlags)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBest);
+        if (mi != mapBlockIndex.end() && mi->second->IsInMainChain())
+            return true;
+        printf("InitAddressIndex() : index is not on the best chain, rebuilding\n");
+    }
+    if (!fExists && !nAddressIndexFlags)
+        return true;
+
+    printf("InitAddressIndex() : clearing address index\n");
+    if (!txdb.EraseAddressIndex())
+        return error("InitAddressIndex() : EraseAddressIndex failed");
+    if (!nAddressIndexFlags)
+        return true;
+
+    // Genesis outputs can't be spent and aren't indexed, start after it
+    printf("InitAddressIndex() : building address index in the background\n");
+    return txdb.WriteAddressIndexBest(nAddressIndexFlags, pindexGenesisBlock->GetBlockHash());
+}
+
+bool BuildAddressIndexBatch()
+{
+    LOCK(cs_main);
+    CTxDB txdb;
+    uint256 hashBest = GetAddressIndexBest(txdb);
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBest);
+    if (mi == mapBlockIndex.end())
+        return false;
+    CBlockIndex* pindex = mi->second;
+    if (!pindex->pnext)
+        return false;
+
+    CAddressIndexBatch batch;
+    for (int i = 0; i < ADDRESSINDEX_BUILD_BATCH && pindex->pnext && !fShutdown; i++)
+    {
+        pindex = pindex->pnext;
+        CBlock block;
+        MapPrevTx inputs;
+        if (!block.ReadFromDisk(pindex) || !ReadBlockInputs(txdb, block, inputs))
+            return error("BuildAddressIndexBatch() : reading block %d failed", pindex->nHeight);
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            if (!batch.ConnectTransaction(txdb, tx, pindex->nHeight, inputs))
+                return error("BuildAddressIndexBatch() : indexing block %d failed", pindex->nHeight);
+    }
+
+    if (!txdb.TxnBegin())
+        return error("BuildAddressIndexBatch() : TxnBegin failed");
+    if (!txdb.WriteAddressIndexBatch(batch) || !txdb.WriteAddressIndexBest(nAddressIndexFlags, pindex->GetBlockHash()))
+    {
+        txdb.TxnAbort();
+        return error("BuildAddressIndexBatch() : write failed");
+    }
+    if (!txdb.TxnCommit())
+        return error("BuildAddressIndexBatch() : TxnCommit failed");
+
+    if (pindex->nHeight % 10000 < ADDRESSINDEX_BUILD_BATCH || !pindex->pnext)
+        printf("Address index built to height %d of %d\n", pindex->nHeight, nBestHeight);
+    return true;
+}
+
+void ThreadBuildAddressIndex(void* parg)
+{
+    // Make this thread recognisable as the address index thread
+    RenameThread("bitcoin-addrindex");
+
+    vnThreadsRunning[THREAD_ADDRESSINDEX]++;
+    try
+    {
+        // Blocks connected after catching up are indexed by ConnectBlock
+        while (!fShutdown && BuildAddressIndexBatch())
+            Sleep(10);
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadBuildAddressIndex()");
+    }
+    vnThreadsRunning[THREAD_ADDRESSINDEX]--;
+}
@@ -0,0 +1,312 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BCINNIOIN_ADDRESSINDEX_H
+#define BCINNIOIN_ADDRESSINDEX_H
+
+#include "main.h"
+#include "base58.h"
+
+#include <map>
+#include <set>
+
+class CTxDB;
+
+/** Which optional indexes are kept, from -addressindex and -spentindex.
+ *  Stored along with the index so changing them forces a rebuild. */
+enum
+{
+    INDEX_ADDRESS = (1U << 0),
+    INDEX_SPENT   = (1U << 1),
+};
+
+/** Address types in index keys */
+enum
+{
+    ADDRESS_TYPE_PUBKEYHASH = 1,
+    ADDRESS_TYPE_SCRIPTHASH = 2,
+};
+
+extern unsigned int nAddressIndexFlags;
+
+// Heights are stored big-endian in keys so that Berkeley DB's bytewise key
+// order is height order and a cursor can walk an address' history in order
+#define READWRITE_HEIGHT_BE(n)                                              \
+    {                                                                       \
+        unsigned char pchHeight[4];                                         \
+        if (!fRead)                                                         \
+            for (int i = 0; i < 4; i++)                                     \
+                pchHeight[i] = (unsigned char)((unsigned int)(n) >> (24 - 8 * i)); \
+        READWRITE(FLATDATA(pchHeight));                                     \
+        if (fRead)                                                          \
+            const_cast<int&>(n) = (int)((pchHeight[0] << 24) | (pchHeight[1] << 16) | (pchHeight[2] << 8) | pchHeight[3]); \
+    }
+
+/** One credit or debit of an address, value is the amount (negative when spent) */
+class CAddressIndexKey
+{
+public:
+    unsigned char nType;
+    uint160 hashBytes;
+    int nHeight;
+    uint256 txhash;
+    unsigned int nIndex;   // output index for credits, input index for debits
+    bool fSpending;
+
+    CAddressIndexKey()
+    {
+        SetNull();
+    }
+
+    CAddressIndexKey(unsigned char nTypeIn, const uint160& hashBytesIn, int nHeightIn, const uint256& txhashIn, unsigned int nIndexIn, bool fSpendingIn) :
+        nType(nTypeIn), hashBytes(hashBytesIn), nHeight(nHeightIn), txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn)
+    {
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nType);
+        READWRITE(hashBytes);
+        READWRITE_HEIGHT_BE(nHeight);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+        READWRITE(fSpending);
+    )
+
+    void SetNull()
+    {
+        nType = 0;
+        hashBytes = 0;
+        nHeight = 0;
+        txhash = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+
+    friend bool operator<(const CAddressIndexKey& a, const CAddressIndexKey& b)
+    {
+        if (a.nType != b.nType) return a.nType < b.nType;
+        if (a.hashBytes != b.hashBytes) return a.hashBytes < b.hashBytes;
+        if (a.nHeight != b.nHeight) return a.nHeight < b.nHeight;
+        if (a.txhash != b.txhash) return a.txhash < b.txhash;
+        if (a.nIndex != b.nIndex) return a.nIndex < b.nIndex;
+        return a.fSpending < b.fSpending;
+    }
+};
+
+/** An unspent output paying to an address */
+class CAddressUnspentKey
+{
+public:
+    unsigned char nType;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddressUnspentKey()
+    {
+        nType = 0;
+        hashBytes = 0;
+        txhash = 0;
+        nIndex = 0;
+    }
+
+    CAddressUnspentKey(unsigned char nTypeIn, const uint160& hashBytesIn, const uint256& txhashIn, unsigned int nIndexIn) :
+        nType(nTypeIn), hashBytes(hashBytesIn), txhash(txhashIn), nIndex(nIndexIn)
+    {
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nType);
+        READWRITE(hashBytes);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+    )
+
+    friend bool operator<(const CAddressUnspentKey& a, const CAddressUnspentKey& b)
+    {
+        if (a.nType != b.nType) return a.nType < b.nType;
+        if (a.hashBytes != b.hashBytes) return a.hashBytes < b.hashBytes;
+        if (a.txhash != b.txhash) return a.txhash < b.txhash;
+        return a.nIndex < b.nIndex;
+    }
+};
+
+class CAddressUnspentValue
+{
+public:
+    int64 nValue;
+    CScript script;
+    int nHeight;
+
+    CAddressUnspentValue()
+    {
+        SetNull();
+    }
+
+    CAddressUnspentValue(int64 nValueIn, const CScript& scriptIn, int nHeightIn) :
+        nValue(nValueIn), script(scriptIn), nHeight(nHeightIn)
+    {
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(script);
+        READWRITE(nHeight);
+    )
+
+    void SetNull()
+    {
+        nValue = -1;
+        script.clear();
+        nHeight = 0;
+    }
+
+    bool IsNull() const
+    {
+        return (nValue == -1);
+    }
+};
+
+/** Which input spent an output. Also written without -spentindex for
+ *  outputs paying to an address, disconnecting the spending block needs
+ *  the height of the output to put it back in the unspent index. */
+class CSpentIndexKey
+{
+public:
+    uint256 txid;
+    unsigned int nIndex;
+
+    CSpentIndexKey()
+    {
+        txid = 0;
+        nIndex = 0;
+    }
+
+    CSpentIndexKey(const uint256& txidIn, unsigned int nIndexIn) : txid(txidIn), nIndex(nIndexIn)
+    {
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txid);
+        READWRITE(nIndex);
+    )
+
+    friend bool operator<(const CSpentIndexKey& a, const CSpentIndexKey& b)
+    {
+        if (a.txid != b.txid) return a.txid < b.txid;
+        return a.nIndex < b.nIndex;
+    }
+};
+
+class CSpentIndexValue
+{
+public:
+    uint256 txid;
+    unsigned int nInputIndex;
+    int nHeight;
+    int64 nValue;
+    unsigned char nType;
+    uint160 hashBytes;
+    int nPrevHeight;    // height of the spent output, -1 if it doesn't pay to an address
+
+    CSpentIndexValue()
+    {
+        SetNull();
+    }
+
+    CSpentIndexValue(const uint256& txidIn, unsigned int nInputIndexIn, int nHeightIn, int64 nValueIn, unsigned char nTypeIn, const uint160& hashBytesIn, int nPrevHeightIn) :
+        txid(txidIn), nInputIndex(nInputIndexIn), nHeight(nHeightIn), nValue(nValueIn), nType(nTypeIn), hashBytes(hashBytesIn), nPrevHeight(nPrevHeightIn)
+    {
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txid);
+        READWRITE(nInputIndex);
+        READWRITE(nHeight);
+        READWRITE(nValue);
+        READWRITE(nType);
+        READWRITE(hashBytes);
+        READWRITE(nPrevHeight);
+    )
+
+    void SetNull()
+    {
+        txid = 0;
+        nInputIndex = 0;
+        nHeight = 0;
+        nValue = 0;
+        nType = 0;
+        hashBytes = 0;
+        nPrevHeight = -1;
+    }
+
+    bool IsNull() const
+    {
+        return (txid == 0);
+    }
+};
+
+/** Changes to the optional indexes for one or more blocks, written to
+ *  blkindex.dat in one go by CTxDB::WriteAddressIndexBatch. Later changes
+ *  to the same key replace earlier ones, so an output created and spent
+ *  inside the batch costs nothing in the unspent index. */
+class CAddressIndexBatch
+{
+public:
+    std::map<CAddressIndexKey, int64> mapAddress;
+    std::set<CAddressIndexKey> setAddressErase;
+    std::map<CAddressUnspentKey, CAddressUnspentValue> mapUnspent;  // null value: erase
+    std::map<CSpentIndexKey, CSpentIndexValue> mapSpent;           // null value: erase
+
+    bool IsEmpty() const
+    {
+        return mapAddress.empty() && setAddressErase.empty() && mapUnspent.empty() && mapSpent.empty();
+    }
+
+    /** Record tx being connected at nHeight, inputs holds the transactions it
+     *  spends. The height of each spent output comes from the unspent index. */
+    bool ConnectTransaction(CTxDB& txdb, const CTransaction& tx, int nHeight, const MapPrevTx& inputs);
+
+    /** Undo ConnectTransaction, call for the transactions of a block in reverse
+     *  order. The spent outputs go back with the height from their spent record. */
+    bool DisconnectTransaction(CTxDB& txdb, const CTransaction& tx, int nHeight, const MapPrevTx& inputs);
+};
+
+/** Index type and hash of the address an output pays to, false if it isn't
+ *  a standard address */
+bool GetAddressIndexKey(const CScript& scriptPubKey, unsigned char& nTypeRet, uint160& hashRet);
+
+/** Address a key type and hash refer to */
+CBitcoinAddress GetAddressFromIndexKey(unsigned char nType, const uint160& hash);
+
+/** Hash of the last block the optional indexes cover, 0 if they're disabled */
+uint256 GetAddressIndexBest(CTxDB& txdb);
+
+/** True if the optional indexes cover the whole best chain */
+bool IsAddressIndexSynced(CTxDB& txdb);
+
+/** Check the stored indexes against -addressindex/-spentindex at startup,
+ *  wiping them when they were disabled or built with different options */
+bool InitAddressIndex();
+
+/** Read all transactions a block spends from */
+bool ReadBlockInputs(CTxDB& txdb, const CBlock& block, MapPrevTx& inputsRet);
+
+/** Total an address received from its history. Outputs of a transaction that
+ *  also spends from the address, like a coinstake paying the stake back,
+ *  only count for what they add to the coins spent. */
+int64 GetAddressReceived(const std::vector<std::pair<CAddressIndexKey, int64> >& vEntries);
+
+/** Index the blocks after the stored best, up to a batch at a time, false
+ *  when there's nothing left to do or it failed */
+bool BuildAddressIndexBatch();
+
+/** Background thread that brings the optional indexes up to the best chain */
+void ThreadBuildAddressIndex(void* parg);
+
+#endif
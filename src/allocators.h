@@ -7,8 +7,14 @@
 
 #include <string.h>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <new>
 #include <boost/thread/mutex.hpp>
 #include <map>
+#if __cplusplus >= 201103L
+#include <type_traits>
+#endif
 
 #ifdef WIN32
 #ifdef _WIN32_WINNT
@@ -251,6 +257,157 @@ struct zero_after_free_allocator : public std::allocator<T>
     }
 };
 
+//
+// Free lists of serialization buffers by power of two size class. Streams
+// for messages, blocks and database records are created and destroyed all
+// the time, recycling their buffers keeps them off the heap.
+//
+class CStreamBufferPool
+{
+public:
+    static const size_t MIN_CLASS_SIZE = 64;
+    static const int NUM_CLASSES = 16;                   // 64 bytes to 2 MB
+    static const size_t CLASS_CACHE_BYTES = 512 * 1024;  // kept per class, at least two buffers
+
+    struct Stats
+    {
+        size_t nHeapAllocs;   // buffers allocated from the heap
+        size_t nReused;       // buffers handed out again from a free list
+        size_t nHeapFrees;    // buffers returned to the heap
+    };
+
+    static CStreamBufferPool& Instance(); // in util.cpp, never destroyed
+
+    CStreamBufferPool() : fEnabled(true)
+    {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    void* Allocate(size_t n)
+    {
+        // Pooled sizes are always rounded up, so any buffer of a class fits it
+        int nClass = GetClass(n);
+        if (nClass < NUM_CLASSES)
+        {
+            n = MIN_CLASS_SIZE << nClass;
+            boost::mutex::scoped_lock lock(mutex);
+            if (!vFree[nClass].empty())
+            {
+                void* p = vFree[nClass].back();
+                vFree[nClass].pop_back();
+                stats.nReused++;
+                return p;
+            }
+            stats.nHeapAllocs++;
+        }
+        else
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            stats.nHeapAllocs++;
+        }
+        return ::operator new(n);
+    }
+
+    void Deallocate(void* p, size_t n)
+    {
+        int nClass = GetClass(n);
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            if (fEnabled && nClass < NUM_CLASSES && vFree[nClass].size() < GetClassCacheCount(nClass))
+            {
+                vFree[nClass].push_back(p);
+                return;
+            }
+            stats.nHeapFrees++;
+        }
+        ::operator delete(p);
+    }
+
+    // Disabling stops reuse, for comparing against plain heap allocation
+    void SetEnabled(bool fEnabledIn)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        fEnabled = fEnabledIn;
+        if (!fEnabled)
+            ReleaseAll();
+    }
+
+    Stats GetStats()
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        return stats;
+    }
+
+private:
+    boost::mutex mutex;
+    std::vector<void*> vFree[NUM_CLASSES];
+    Stats stats;
+    bool fEnabled;
+
+    static int GetClass(size_t n)
+    {
+        int nClass = 0;
+        while (nClass < NUM_CLASSES && (MIN_CLASS_SIZE << nClass) < n)
+            nClass++;
+        return nClass;
+    }
+
+    static size_t GetClassCacheCount(int nClass)
+    {
+        return std::max((size_t)2, CLASS_CACHE_BYTES / (MIN_CLASS_SIZE << nClass));
+    }
+
+    void ReleaseAll()
+    {
+        for (int nClass = 0; nClass < NUM_CLASSES; nClass++)
+        {
+            for (size_t i = 0; i < vFree[nClass].size(); i++)
+                ::operator delete(vFree[nClass][i]);
+            stats.nHeapFrees += vFree[nClass].size();
+            vFree[nClass].clear();
+        }
+    }
+};
+
+//
+// Allocator that takes its buffers from CStreamBufferPool. Like
+// zero_after_free_allocator, every buffer is cleared before it goes back,
+// so nothing one stream held can be read through the next one.
+//
+template<typename T>
+struct pooled_allocator : public std::allocator<T>
+{
+    // MSVC8 default copy constructor is broken
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type  difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    pooled_allocator() throw() {}
+    pooled_allocator(const pooled_allocator& a) throw() : base(a) {}
+    template <typename U>
+    pooled_allocator(const pooled_allocator<U>& a) throw() : base(a) {}
+    ~pooled_allocator() throw() {}
+    template<typename _Other> struct rebind
+    { typedef pooled_allocator<_Other> other; };
+
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        return static_cast<T*>(CStreamBufferPool::Instance().Allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (p == NULL)
+            return;
+        memset(p, 0, sizeof(T) * n);
+        CStreamBufferPool::Instance().Deallocate(p, sizeof(T) * n);
+    }
+};
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
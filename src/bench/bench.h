@@ -0,0 +1,24 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BCINNIOIN_BENCH_H
+#define BCINNIOIN_BENCH_H
+
+#include "util.h"
+
+// Benchmarks time themselves and print what they measured. They are kept
+// out of the unit tests so the tests stay fast and only assert behaviour.
+typedef void (*BenchFunction)();
+
+class CBenchRegistration
+{
+public:
+    CBenchRegistration(const char* pszName, BenchFunction func);
+};
+
+#define BENCHMARK(name) \
+    static void name(); \
+    static CBenchRegistration name##_registration(#name, name); \
+    static void name()
+
+#endif
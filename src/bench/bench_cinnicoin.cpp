@@ -0,0 +1,63 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+#include "wallet.h"
+
+#include <map>
+#include <string>
+
+using namespace std;
+
+// What init.cpp defines for the rest of the node, as in the unit tests
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+extern void noui_connect();
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+static map<string, BenchFunction>& Benchmarks()
+{
+    static map<string, BenchFunction> mapBenchmarks;
+    return mapBenchmarks;
+}
+
+CBenchRegistration::CBenchRegistration(const char* pszName, BenchFunction func)
+{
+    Benchmarks()[pszName] = func;
+}
+
+// usage: bench_CinniCoin [name...]
+// Runs the benchmarks whose names contain any of the arguments, or all of them
+int main(int argc, char* argv[])
+{
+    fPrintToConsole = true;
+    noui_connect();
+
+    for (map<string, BenchFunction>::iterator it = Benchmarks().begin(); it != Benchmarks().end(); ++it)
+    {
+        bool fRun = argc < 2;
+        for (int i = 1; i < argc; i++)
+            if (it->first.find(argv[i]) != string::npos)
+                fRun = true;
+        if (!fRun)
+            continue;
+
+        printf("%s\n", it->first.c_str());
+        int64 nStart = GetTimeMillis();
+        it->second();
+        printf("%s: %"PRI64d" ms\n\n", it->first.c_str(), GetTimeMillis() - nStart);
+    }
+    return 0;
+}
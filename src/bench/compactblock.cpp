@@ -0,0 +1,79 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "compactblock.h"
+#include "test/fixtures.h"
+
+#include <boost/foreach.hpp>
+
+// A block travels down a line of nodes, each with its own memory pool
+// missing a couple of the block's transactions. Every hop really
+// serializes, deserializes and rebuilds the block; the link itself is
+// modelled by its latency and bandwidth.
+BENCHMARK(compactblock_propagation)
+{
+    const unsigned int nNodes = 8;
+    const unsigned int nTx = 2000;
+    const int64 nLatencyMs = 50;
+    const int64 nBytesPerMs = 1000;     // 1 MB/s
+
+    CBlock block = MakeTestBlock(nTx);
+    CTxMemPool vPool[nNodes];
+    for (unsigned int nNode = 1; nNode < nNodes; nNode++)
+        for (unsigned int i = 1; i < nTx; i++)
+            if ((i + nNode) % 500 != 0)
+                vPool[nNode].mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+
+    // inv, getdata, block
+    int64 nFullMs = 0;
+    unsigned int nFullBytes = 0;
+    for (unsigned int nNode = 1; nNode < nNodes; nNode++)
+    {
+        int64 nStart = GetTimeMillis();
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << block;
+        unsigned int nBytes = ss.size();
+        CBlock blockRead;
+        ss >> blockRead;
+        blockRead.BuildMerkleTree();
+        nFullMs += 3 * nLatencyMs + nBytes / nBytesPerMs + (GetTimeMillis() - nStart);
+        nFullBytes += nBytes;
+    }
+
+    // cmpctblock, then getblocktxn and blocktxn for what the pool lacks
+    int64 nCompactMs = 0;
+    unsigned int nCompactBytes = 0, nRoundTrips = 0;
+    CBlock blockRelay = block;
+    for (unsigned int nNode = 1; nNode < nNodes; nNode++)
+    {
+        int64 nStart = GetTimeMillis();
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << CCompactBlock(blockRelay);
+        unsigned int nBytes = ss.size();
+        CCompactBlock cmpctblock;
+        ss >> cmpctblock;
+        CPartialBlock partial;
+        std::vector<unsigned short> vMissing;
+        partial.Init(cmpctblock, vPool[nNode], vMissing);
+        int64 nHopMs = nLatencyMs;
+        if (!vMissing.empty())
+        {
+            CBlockTxResponse resp;
+            BOOST_FOREACH(unsigned short nIndex, vMissing)
+                resp.vtx.push_back(blockRelay.vtx[nIndex]);
+            partial.Fill(resp.vtx);
+            nHopMs += 2 * nLatencyMs;
+            nBytes += ::GetSerializeSize(resp, SER_NETWORK, PROTOCOL_VERSION);
+            nRoundTrips++;
+        }
+        partial.block.BuildMerkleTree();
+        blockRelay = partial.block;
+        nCompactMs += nHopMs + nBytes / nBytesPerMs + (GetTimeMillis() - nStart);
+        nCompactBytes += nBytes;
+    }
+
+    printf("block of %u tx over %u hops: full %"PRI64d" ms / %u bytes, compact %"PRI64d" ms / %u bytes with %u round trips\n",
+           nTx, nNodes - 1, nFullMs, nFullBytes, nCompactMs, nCompactBytes, nRoundTrips);
+}
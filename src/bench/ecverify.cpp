@@ -0,0 +1,39 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "key.h"
+
+#include <boost/foreach.hpp>
+
+// Signature verifications with each ECDSA backend
+BENCHMARK(ecverify)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    std::vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+
+    std::vector<uint256> vHash;
+    std::vector<std::vector<unsigned char> > vSig;
+    for (int n = 0; n < 500; n++)
+    {
+        vHash.push_back(Hash(BEGIN(n), END(n)));
+        std::vector<unsigned char> vchSig;
+        key.Sign(vHash.back(), vchSig);
+        vSig.push_back(vchSig);
+    }
+
+    BOOST_FOREACH(const std::string& strName, GetECVerifierNames())
+    {
+        CECVerifier* verifier = GetECVerifier(strName);
+        unsigned int nValid = 0;
+        int64 nStart = GetTimeMillis();
+        for (unsigned int n = 0; n < vHash.size(); n++)
+            if (verifier->Verify(vchPubKey, vHash[n], vSig[n]))
+                nValid++;
+        int64 nElapsed = GetTimeMillis() - nStart;
+        printf("ecverify %s: %"PRIszu" verifications in %"PRI64d" ms, %u valid\n",
+               strName.c_str(), vHash.size(), nElapsed, nValid);
+    }
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "kernel.h"
+#include "kernelhash.h"
+#include "test/fixtures.h"
+
+#include <boost/foreach.hpp>
+
+// Modifier lookups of a staker checking kernels for coins of every age,
+// about a selection interval of blocks behind the best block
+BENCHMARK(stake_modifier_index)
+{
+    std::vector<CBlockIndex> vIndex(50000);
+    MakeTestChain(vIndex, 0, 1400000000, 0);
+    BuildStakeModifierIndex(&vIndex[0]);
+    const int64 nInterval = 17 * 60 * 60;
+    const unsigned int nFromEnd = vIndex.size() - 2 * nInterval / 60;
+
+    unsigned int nLookups = 0, nWalkFound = 0, nIndexFound = 0;
+    int64 nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < nFromEnd; i += 7, nLookups++)
+        if (WalkStakeModifierBlock(&vIndex[i], nInterval))
+            nWalkFound++;
+    int64 nWalkTime = GetTimeMillis() - nStart;
+
+    nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < nFromEnd; i += 7)
+        if (FindStakeModifierBlock(i, vIndex[i].GetBlockTime() + nInterval))
+            nIndexFound++;
+    int64 nIndexTime = GetTimeMillis() - nStart;
+
+    printf("%u stake modifier lookups: pnext walk %"PRI64d" ms (%u found), index %"PRI64d" ms (%u found)\n",
+           nLookups, nWalkTime, nWalkFound, nIndexTime, nIndexFound);
+    RewindStakeModifierIndex(-1);
+}
+
+// A 60 second search window over a few hundred coins with each kernel hasher
+BENCHMARK(kernel_hash)
+{
+    std::vector<unsigned char> vKernels;
+    for (unsigned int nCoin = 0; nCoin < 300; nCoin++)
+    {
+        for (unsigned int nTimeTx = 1400100000; nTimeTx > 1400100000 - 60; nTimeTx--)
+        {
+            CDataStream ss(SER_GETHASH, 0);
+            ss << (uint64)(0x1234567890abcdefULL ^ nCoin) << 1400000000U + nCoin << 81U + nCoin << 1400000100U + nCoin << nCoin % 3 << nTimeTx;
+            vKernels.insert(vKernels.end(), ss.begin(), ss.end());
+        }
+    }
+    unsigned int nCount = vKernels.size() / STAKE_KERNEL_SIZE;
+    std::vector<uint256> vHash(nCount);
+
+    int64 nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        const unsigned char* pkernel = &vKernels[0] + i * STAKE_KERNEL_SIZE;
+        vHash[i] = Hash(pkernel, pkernel + STAKE_KERNEL_SIZE);
+    }
+    int64 nReferenceTime = GetTimeMillis() - nStart;
+
+    BOOST_FOREACH(const std::string& strName, GetKernelHasherNames())
+    {
+        nStart = GetTimeMillis();
+        GetKernelHasher(strName)->Hash(&vKernels[0], nCount, &vHash[0]);
+        int64 nElapsed = GetTimeMillis() - nStart;
+        printf("kernelhash %s: %u kernels in %"PRI64d" ms, Hash() %"PRI64d" ms\n",
+               strName.c_str(), nCount, nElapsed, nReferenceTime);
+    }
+}
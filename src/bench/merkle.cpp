@@ -0,0 +1,65 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+#include "test/fixtures.h"
+
+#include <boost/foreach.hpp>
+
+// Merkle trees of large blocks with each hasher, and extra nonce rolls
+// updating only the coinbase branch against a full rebuild
+BENCHMARK(merkle_tree)
+{
+    const unsigned int vTxCount[] = { 2000, 2500, 4000 };
+    const unsigned int nRounds = 50;
+    BOOST_FOREACH(unsigned int nTx, vTxCount)
+    {
+        CBlock block = MakeTestBlock(nTx);
+        std::vector<uint256> vLeaves;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            vLeaves.push_back(tx.GetHash());
+
+        std::vector<uint256> vReference;
+        int64 nStart = GetTimeMillis();
+        for (unsigned int i = 0; i < nRounds; i++)
+            ReferenceMerkleTree(vLeaves, vReference);
+        int64 nReferenceTime = GetTimeMillis() - nStart;
+
+        BOOST_FOREACH(const std::string& strName, GetMerkleHasherNames())
+        {
+            SelectMerkleHasher(strName);
+            std::vector<uint256> vTree;
+            nStart = GetTimeMillis();
+            for (unsigned int i = 0; i < nRounds; i++)
+            {
+                vTree.clear();
+                vTree.insert(vTree.end(), vLeaves.begin(), vLeaves.end());
+                ComputeMerkleTree(vTree);
+            }
+            int64 nElapsed = GetTimeMillis() - nStart;
+            printf("merklehash %s: %u trees of %u tx in %"PRI64d" ms, Hash() %"PRI64d" ms\n",
+                   strName.c_str(), nRounds, nTx, nElapsed, nReferenceTime);
+        }
+        SelectMerkleHasher(GetMerkleHasherNames()[0]);
+
+        block.BuildMerkleTree();
+        nStart = GetTimeMillis();
+        for (unsigned int i = 0; i < nRounds; i++)
+        {
+            block.vtx[0].vin[0].scriptSig = CScript() << nTx << i;
+            block.hashMerkleRoot = block.UpdateCoinbaseMerkleRoot();
+        }
+        int64 nUpdateTime = GetTimeMillis() - nStart;
+        nStart = GetTimeMillis();
+        for (unsigned int i = 0; i < nRounds; i++)
+        {
+            block.vtx[0].vin[0].scriptSig = CScript() << nTx << i;
+            block.BuildMerkleTree();
+        }
+        int64 nRebuildTime = GetTimeMillis() - nStart;
+        printf("%u extra nonce rolls on %u tx: coinbase branch %"PRI64d" ms, full rebuild %"PRI64d" ms\n",
+               nRounds, nTx, nUpdateTime, nRebuildTime);
+    }
+}
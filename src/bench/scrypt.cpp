@@ -0,0 +1,59 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "scrypt_mine.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+static void ScanThread(unsigned int nStart, unsigned int nEnd, unsigned int* pnHashes)
+{
+    bool fHugePages;
+    void* scratchbuf = scrypt_miner_buffer_alloc(&fHugePages);
+    block_header header;
+    header.version = 1;
+    header.prev_block = 0;
+    header.merkle_root = 0;
+    header.timestamp = 1400001167;
+    header.bits = 0x1e0fffff;
+    header.nonce = nStart;
+    *pnHashes = 0;
+    while (header.nonce < nEnd)
+    {
+        unsigned int nHashes;
+        block_header res_header;
+        uint256 result;
+        unsigned int nNonce = scanhash_scrypt(&header, scratchbuf, nEnd, nHashes, UBEGIN(result), &res_header);
+        *pnHashes += nHashes;
+        if (nNonce == (unsigned int) -1)
+            break;
+        header.nonce = nNonce + 1;
+    }
+    scrypt_miner_buffer_free(scratchbuf);
+}
+
+// Threads scanning disjoint nonce ranges of one header, the way the
+// proof-of-work miner threads share a block
+BENCHMARK(scanhash_threads)
+{
+    const unsigned int nPerThread = 0x200;
+    unsigned int nThreads = std::max(1U, std::min(8U, (unsigned int)boost::thread::hardware_concurrency()));
+    for (unsigned int n = 1; n <= nThreads; n *= 2)
+    {
+        std::vector<unsigned int> vHashes(n);
+        boost::thread_group threads;
+        int64 nStart = GetTimeMillis();
+        for (unsigned int i = 0; i < n; i++)
+            threads.create_thread(boost::bind(&ScanThread, i * nPerThread, (i + 1) * nPerThread, &vHashes[i]));
+        threads.join_all();
+        int64 nElapsed = std::max(GetTimeMillis() - nStart, (int64)1);
+
+        unsigned int nTotal = 0;
+        for (unsigned int i = 0; i < n; i++)
+            nTotal += vHashes[i];
+        printf("scrypt %u threads: %u hashes in %"PRI64d" ms, %.0f hash/s\n",
+               n, nTotal, nElapsed, 1000.0 * nTotal / nElapsed);
+    }
+}
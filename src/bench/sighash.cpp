@@ -0,0 +1,29 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "script.h"
+#include "test/fixtures.h"
+
+// Signature hashes of every input of a 1000 input consolidation
+BENCHMARK(sighash_context)
+{
+    CTransaction txTo = MakeTestTx(0, 1000);
+    CScript scriptCode = txTo.vout[0].scriptPubKey;
+
+    std::vector<uint256> vHash(txTo.vin.size());
+    int64 nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        vHash[i] = SignatureHash(scriptCode, txTo, i, SIGHASH_ALL);
+    int64 nPlain = GetTimeMillis() - nStart;
+
+    nStart = GetTimeMillis();
+    CSignatureHashContext sighash(txTo);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        vHash[i] = sighash.SignatureHash(scriptCode, i, SIGHASH_ALL);
+    int64 nContext = GetTimeMillis() - nStart;
+
+    printf("sighash of %"PRIszu" inputs: %"PRI64d" ms, with context %"PRI64d" ms\n",
+           txTo.vin.size(), nPlain, nContext);
+}
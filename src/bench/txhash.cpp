@@ -0,0 +1,38 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+#include "test/fixtures.h"
+
+// The hashes a relayed transaction goes through: relay, mempool accept,
+// inventory, block template, merkle root, block connect and wallet sync
+BENCHMARK(tx_hash_cache)
+{
+    const int nHashesPerTx = 8;
+    std::vector<CTransaction> vtx;
+    for (unsigned int i = 0; i < 500; i++)
+        vtx.push_back(MakeTestTx(i, 2));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vtx;
+    std::vector<CTransaction> vtxRead;
+    ss >> vtxRead;
+
+    // Built in memory every call hashes, read from a stream only the first
+    uint256 hash;
+    int64 nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        for (int j = 0; j < nHashesPerTx; j++)
+            hash = vtx[i].GetHash();
+    int64 nPlainTime = GetTimeMillis() - nStart;
+
+    nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < vtxRead.size(); i++)
+        for (int j = 0; j < nHashesPerTx; j++)
+            hash = vtxRead[i].GetHash();
+    int64 nCachedTime = GetTimeMillis() - nStart;
+
+    printf("%d hashes of %"PRIszu" transactions: %"PRI64d" ms, cached %"PRI64d" ms\n",
+           nHashesPerTx, vtx.size(), nPlainTime, nCachedTime);
+}
@@ -0,0 +1,124 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+using namespace std;
+
+CBlockCache blockCache(16 * 1024 * 1024);
+
+void CBlockCache::Limit()
+{
+    while (nSize > nMaxSize && !listBlocks.empty())
+    {
+        nSize -= listBlocks.back().nSize;
+        mapBlocks.erase(listBlocks.back().hash);
+        listBlocks.pop_back();
+    }
+}
+
+void CBlockCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    LOCK(cs);
+    nMaxSize = nMaxSizeIn;
+    Limit();
+}
+
+size_t CBlockCache::GetMaxSize() const
+{
+    LOCK(cs);
+    return nMaxSize;
+}
+
+void CBlockCache::Add(const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    unsigned int nBlockSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+
+    LOCK(cs);
+    if (nBlockSize > nMaxSize)
+        return;
+    map<uint256, list_type::iterator>::iterator mi = mapBlocks.find(hash);
+    if (mi != mapBlocks.end())
+    {
+        listBlocks.splice(listBlocks.begin(), listBlocks, mi->second);
+        return;
+    }
+
+    listBlocks.push_front(CEntry());
+    CEntry& entry = listBlocks.front();
+    entry.hash = hash;
+    entry.nSize = nBlockSize;
+    entry.block = block;
+    entry.block.vMerkleTree.clear();
+    mapBlocks[hash] = listBlocks.begin();
+    nSize += nBlockSize;
+    Limit();
+}
+
+bool CBlockCache::Get(const uint256& hash, CBlock& block)
+{
+    LOCK(cs);
+    map<uint256, list_type::iterator>::iterator mi = mapBlocks.find(hash);
+    if (mi == mapBlocks.end())
+    {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    listBlocks.splice(listBlocks.begin(), listBlocks, mi->second);
+    block = mi->second->block;
+    return true;
+}
+
+void CBlockCache::Erase(const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, list_type::iterator>::iterator mi = mapBlocks.find(hash);
+    if (mi == mapBlocks.end())
+        return;
+    nSize -= mi->second->nSize;
+    listBlocks.erase(mi->second);
+    mapBlocks.erase(mi);
+}
+
+void CBlockCache::Clear()
+{
+    LOCK(cs);
+    listBlocks.clear();
+    mapBlocks.clear();
+    nSize = 0;
+}
+
+bool CBlockCache::Read(CBlock& block, const CBlockIndex* pindex)
+{
+    if (Get(pindex->GetBlockHash(), block))
+        return true;
+    return block.ReadFromDisk(pindex);
+}
+
+size_t CBlockCache::size() const
+{
+    LOCK(cs);
+    return listBlocks.size();
+}
+
+size_t CBlockCache::GetSize() const
+{
+    LOCK(cs);
+    return nSize;
+}
+
+uint64 CBlockCache::GetHits() const
+{
+    LOCK(cs);
+    return nHits;
+}
+
+uint64 CBlockCache::GetMisses() const
+{
+    LOCK(cs);
+    return nMisses;
+}
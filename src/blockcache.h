@@ -0,0 +1,64 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BCINNIOIN_BLOCKCACHE_H
+#define BCINNIOIN_BLOCKCACHE_H
+
+#include "main.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+
+/** Recently accepted blocks, least recently used dropped first.
+ *
+ * Reorganize and SetBestChain read the blocks they connect and disconnect
+ * from here, so switching to a branch that was just received doesn't read
+ * every block of both branches back from the block files.
+ */
+class CBlockCache
+{
+private:
+    struct CEntry
+    {
+        uint256 hash;
+        unsigned int nSize;
+        CBlock block;
+    };
+    typedef std::list<CEntry> list_type;
+
+    mutable CCriticalSection cs;
+    list_type listBlocks; // most recently used first
+    std::map<uint256, list_type::iterator> mapBlocks;
+    size_t nMaxSize;
+    size_t nSize;
+    uint64 nHits;
+    uint64 nMisses;
+
+    void Limit();
+
+public:
+    CBlockCache(size_t nMaxSizeIn = 0) : nMaxSize(nMaxSizeIn), nSize(0), nHits(0), nMisses(0) { }
+
+    // Maximum serialized size of the cached blocks in bytes
+    void SetMaxSize(size_t nMaxSizeIn);
+    size_t GetMaxSize() const;
+
+    void Add(const CBlock& block);
+    bool Get(const uint256& hash, CBlock& block);
+    void Erase(const uint256& hash);
+    void Clear();
+
+    // Read the block of pindex, from the cache when it is there
+    bool Read(CBlock& block, const CBlockIndex* pindex);
+
+    size_t size() const;
+    size_t GetSize() const;
+    uint64 GetHits() const;
+    uint64 GetMisses() const;
+};
+
+extern CBlockCache blockCache;
+
+#endif
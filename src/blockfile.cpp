@@ -0,0 +1,96 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+#include "sync.h"
+#include "util.h"
+
+#include <list>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+bool fBlockFileMmap = true;
+
+// Most recently used mapping first. Readers hold their own reference,
+// so evicting or invalidating an entry never unmaps memory in use.
+static CCriticalSection cs_blockfilemap;
+static list<CBlockFileMappingRef> listBlockFileMappings;
+
+
+boost::filesystem::path BlockFilePath(unsigned int nFile)
+{
+    string strBlockFn = strprintf("blk%04u.dat", nFile);
+    return GetDataDir() / strBlockFn;
+}
+
+
+CBlockFileMapping::CBlockFileMapping(unsigned int nFileIn) :
+    mapping(BlockFilePath(nFileIn).string().c_str(), boost::interprocess::read_only),
+    region(mapping, boost::interprocess::read_only),
+    nFile(nFileIn)
+{
+}
+
+
+CBlockFileMappingRef GetBlockFileMapping(unsigned int nFile, size_t nMinSize)
+{
+    if (!fBlockFileMmap || nFile < 1 || nFile == (unsigned int)-1)
+        return CBlockFileMappingRef();
+
+    LOCK(cs_blockfilemap);
+    for (list<CBlockFileMappingRef>::iterator it = listBlockFileMappings.begin(); it != listBlockFileMappings.end(); ++it)
+    {
+        if ((*it)->nFile != nFile)
+            continue;
+        CBlockFileMappingRef ref = *it;
+        listBlockFileMappings.erase(it);
+        if (ref->size() >= nMinSize)
+        {
+            listBlockFileMappings.push_front(ref);
+            return ref;
+        }
+        // File grew since it was mapped, map it again below
+        break;
+    }
+
+    CBlockFileMappingRef ref;
+    try {
+        ref.reset(new CBlockFileMapping(nFile));
+    }
+    catch (std::exception& e) {
+        // Missing or empty file, or out of address space on 32-bit builds
+        printf("GetBlockFileMapping() : unable to map blk%04u.dat : %s\n", nFile, e.what());
+        return CBlockFileMappingRef();
+    }
+    if (ref->size() < nMinSize)
+        return CBlockFileMappingRef();
+
+    listBlockFileMappings.push_front(ref);
+    while (listBlockFileMappings.size() > MAX_BLOCKFILE_MAPPINGS)
+        listBlockFileMappings.pop_back();
+    return ref;
+}
+
+
+void InvalidateBlockFileMapping(unsigned int nFile)
+{
+    LOCK(cs_blockfilemap);
+    for (list<CBlockFileMappingRef>::iterator it = listBlockFileMappings.begin(); it != listBlockFileMappings.end(); ++it)
+    {
+        if ((*it)->nFile == nFile)
+        {
+            listBlockFileMappings.erase(it);
+            return;
+        }
+    }
+}
+
+
+void CloseBlockFileMappings()
+{
+    LOCK(cs_blockfilemap);
+    listBlockFileMappings.clear();
+}
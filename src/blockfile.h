@@ -0,0 +1,56 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BCINNIOIN_BLOCKFILE_H
+#define BCINNIOIN_BLOCKFILE_H
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+/** Number of blk000N.dat files kept mapped at once */
+static const unsigned int MAX_BLOCKFILE_MAPPINGS = 8;
+
+/** Read-only memory mapping of a whole blk000N.dat file */
+class CBlockFileMapping
+{
+private:
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+
+public:
+    unsigned int nFile;
+
+    explicit CBlockFileMapping(unsigned int nFileIn);
+
+    const char* begin() const { return (const char*)region.get_address(); }
+    const char* end() const   { return begin() + region.get_size(); }
+    size_t size() const       { return region.get_size(); }
+
+    // True if [nPos, nPos + nLen) lies inside the mapped range
+    bool Contains(size_t nPos, size_t nLen) const
+    {
+        return nPos <= size() && nLen <= size() - nPos;
+    }
+};
+
+typedef boost::shared_ptr<const CBlockFileMapping> CBlockFileMappingRef;
+
+extern bool fBlockFileMmap;
+
+boost::filesystem::path BlockFilePath(unsigned int nFile);
+
+/** Return a mapping of blk file nFile that covers at least nMinSize bytes.
+ *  Recently used mappings are kept in a small LRU; a mapping is recreated
+ *  when the file has grown past it. Returns an empty ref if mapping is
+ *  disabled or fails, in which case callers fall back to stdio. */
+CBlockFileMappingRef GetBlockFileMapping(unsigned int nFile, size_t nMinSize);
+
+/** Drop the cached mapping of nFile, called after appending to it */
+void InvalidateBlockFileMapping(unsigned int nFile);
+
+/** Unmap everything, called at shutdown */
+void CloseBlockFileMappings();
+
+#endif
@@ -64,6 +64,23 @@ namespace Checkpoints
         return NULL;
     }
 
+    uint256 GetLatestHardenedCheckpoint()
+    {
+        MapCheckpoints& checkpoints = (fTestNet ? mapCheckpointsTestnet : mapCheckpoints);
+
+        return checkpoints.rbegin()->second;
+    }
+
+    int GetCheckpointHeight(const uint256& hash)
+    {
+        MapCheckpoints& checkpoints = (fTestNet ? mapCheckpointsTestnet : mapCheckpoints);
+
+        BOOST_FOREACH(const MapCheckpoints::value_type& i, checkpoints)
+            if (i.second == hash)
+                return i.first;
+        return -1;
+    }
+
     // ppcoin: synchronized checkpoint (centrally broadcasted)
     uint256 hashSyncCheckpoint = 0;
     uint256 hashPendingCheckpoint = 0;
@@ -372,10 +389,10 @@ std::string CSyncCheckpoint::strMasterPrivKey = "";
 // ppcoin: verify signature of sync-checkpoint message
 bool CSyncCheckpoint::CheckSignature()
 {
-    CKey key;
-    if (!key.SetPubKey(ParseHex(CSyncCheckpoint::strMasterPubKey)))
+    CPubKey pubkey(ParseHex(CSyncCheckpoint::strMasterPubKey));
+    if (!pubkey.IsValid())
         return error("CSyncCheckpoint::CheckSignature() : SetPubKey failed");
-    if (!key.Verify(Hash(vchMsg.begin(), vchMsg.end()), vchSig))
+    if (!pubkey.Verify(Hash(vchMsg.begin(), vchMsg.end()), vchSig))
         return error("CSyncCheckpoint::CheckSignature() : verify signature failed");
 
     // Now unserialize the data
@@ -387,6 +404,9 @@ bool CSyncCheckpoint::CheckSignature()
 // ppcoin: process synchronized checkpoint
 bool CSyncCheckpoint::ProcessSyncCheckpoint(CNode* pfrom)
 {
+    if (fRegTest)
+        return false; // regtest has no sync checkpoints
+
     if (!CheckSignature())
         return false;
 
@@ -28,6 +28,12 @@ namespace Checkpoints
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
     CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
 
+    // Returns hash of the highest hardened checkpoint
+    uint256 GetLatestHardenedCheckpoint();
+
+    // Returns height of a hardened checkpoint, -1 if hash is not one
+    int GetCheckpointHeight(const uint256& hash);
+
     extern uint256 hashSyncCheckpoint;
     extern CSyncCheckpoint checkpointMessage;
     extern uint256 hashInvalidCheckpoint;
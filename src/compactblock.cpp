@@ -0,0 +1,304 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "compactblock.h"
+
+#include <limits>
+
+using namespace std;
+
+bool fCompactBlocks = true;
+
+//
+// CSipHasher
+//
+
+#define ROTL64(x, b) (uint64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; \
+    v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; \
+    v2 = ROTL64(v2, 32); \
+} while (0)
+
+CSipHasher::CSipHasher(uint64 k0, uint64 k1)
+{
+    v[0] = 0x736f6d6570736575ULL ^ k0;
+    v[1] = 0x646f72616e646f6dULL ^ k1;
+    v[2] = 0x6c7967656e657261ULL ^ k0;
+    v[3] = 0x7465646279746573ULL ^ k1;
+    tmp = 0;
+    count = 0;
+}
+
+CSipHasher& CSipHasher::Write(const unsigned char* data, size_t size)
+{
+    uint64 v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    uint64 t = tmp;
+    int c = count;
+
+    while (size--)
+    {
+        t |= ((uint64)(*(data++))) << (8 * (c % 8));
+        c++;
+        if ((c & 7) == 0)
+        {
+            v3 ^= t;
+            SIPROUND;
+            SIPROUND;
+            v0 ^= t;
+            t = 0;
+        }
+    }
+
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+    count = c;
+    tmp = t;
+    return *this;
+}
+
+uint64 CSipHasher::Finalize() const
+{
+    uint64 v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    uint64 t = tmp | (((uint64)(count & 0xff)) << 56);
+    v3 ^= t;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= t;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+//
+// CCompactBlock
+//
+
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    header.vchBlockSig = block.vchBlockSig;
+    nNonce = GetRand(std::numeric_limits<uint64>::max());
+
+    // ppcoin: the coinbase and coinstake are never in the memory pool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    uint64 k0, k1;
+    GetShortIDKeys(k0, k1);
+    vShortTxID.reserve(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+        {
+            CPrefilledTx prefilled;
+            prefilled.nIndex = i;
+            prefilled.tx = block.vtx[i];
+            vPrefilled.push_back(prefilled);
+        }
+        else
+            vShortTxID.push_back(CShortTxID(GetShortID(k0, k1, block.vtx[i].GetHash())));
+    }
+}
+
+void CCompactBlock::GetShortIDKeys(uint64& k0, uint64& k1) const
+{
+    uint256 hashKey = Hash(BEGIN(header.nVersion), END(header.nNonce), BEGIN(nNonce), END(nNonce));
+    k0 = hashKey.Get64(0);
+    k1 = hashKey.Get64(1);
+}
+
+
+//
+// CPartialBlock
+//
+
+bool CPartialBlock::Init(const CCompactBlock& cmpctblock, CTxMemPool& pool, vector<unsigned short>& vMissing)
+{
+    vMissing.clear();
+    unsigned int nTx = cmpctblock.GetTxCount();
+    if (cmpctblock.vPrefilled.empty() || nTx > std::numeric_limits<unsigned short>::max())
+        return error("CPartialBlock::Init() : bad transaction count %u", nTx);
+
+    block.SetNull();
+    block.nVersion = cmpctblock.header.nVersion;
+    block.hashPrevBlock = cmpctblock.header.hashPrevBlock;
+    block.hashMerkleRoot = cmpctblock.header.hashMerkleRoot;
+    block.nTime = cmpctblock.header.nTime;
+    block.nBits = cmpctblock.header.nBits;
+    block.nNonce = cmpctblock.header.nNonce;
+    block.vchBlockSig = cmpctblock.header.vchBlockSig;
+    block.vtx.resize(nTx);
+    vHave.assign(nTx, false);
+
+    BOOST_FOREACH(const CPrefilledTx& prefilled, cmpctblock.vPrefilled)
+    {
+        if (prefilled.nIndex >= nTx || vHave[prefilled.nIndex])
+            return error("CPartialBlock::Init() : bad prefilled index %u", prefilled.nIndex);
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // Short ids fill the remaining slots in order
+    map<uint64, unsigned int> mapSlot;
+    unsigned int nSlot = 0;
+    BOOST_FOREACH(const CShortTxID& shortid, cmpctblock.vShortTxID)
+    {
+        while (vHave[nSlot])
+            nSlot++;
+        if (!mapSlot.insert(make_pair(shortid.nShortID, nSlot)).second)
+            return error("CPartialBlock::Init() : duplicate short id");
+        nSlot++;
+    }
+
+    uint64 k0, k1;
+    cmpctblock.GetShortIDKeys(k0, k1);
+    vector<bool> vCollision(nTx, false);
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTransaction>::iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end() && !mapSlot.empty(); ++mi)
+        {
+            map<uint64, unsigned int>::iterator it = mapSlot.find(CCompactBlock::GetShortID(k0, k1, (*mi).first));
+            if (it == mapSlot.end())
+                continue;
+            unsigned int n = (*it).second;
+            if (vCollision[n])
+                continue;
+            if (vHave[n])
+            {
+                // Two pool transactions share the short id, ask for it
+                block.vtx[n].SetNull();
+                vHave[n] = false;
+                vCollision[n] = true;
+                continue;
+            }
+            block.vtx[n] = (*mi).second;
+            vHave[n] = true;
+        }
+    }
+
+    for (unsigned int n = 0; n < nTx; n++)
+        if (!vHave[n])
+            vMissing.push_back(n);
+    return true;
+}
+
+bool CPartialBlock::Fill(const vector<CTransaction>& vtxMissing)
+{
+    unsigned int nMissing = std::count(vHave.begin(), vHave.end(), false);
+    if (vtxMissing.size() != nMissing)
+        return false;
+
+    unsigned int i = 0;
+    for (unsigned int n = 0; n < vHave.size(); n++)
+    {
+        if (!vHave[n])
+        {
+            block.vtx[n] = vtxMissing[i++];
+            vHave[n] = true;
+        }
+    }
+    return true;
+}
+
+bool CPartialBlock::IsComplete() const
+{
+    return std::find(vHave.begin(), vHave.end(), false) == vHave.end();
+}
+
+
+//
+// Blocks waiting for "blocktxn"
+//
+
+static CCriticalSection cs_mapPartialBlocks;
+typedef map<pair<uint256, int>, CPartialBlock> PartialBlockMap;
+static PartialBlockMap mapPartialBlocks;
+
+// Oldest partial block of nPeer, or of the peer waited on most if nPeer is -1
+static PartialBlockMap::iterator OldestPartialBlock(int nPeer)
+{
+    if (nPeer == -1)
+    {
+        map<int, unsigned int> mapCount;
+        BOOST_FOREACH(const PAIRTYPE(const PAIRTYPE(uint256, int), CPartialBlock)& item, mapPartialBlocks)
+            if (++mapCount[item.first.second] > mapCount[nPeer])
+                nPeer = item.first.second;
+    }
+
+    PartialBlockMap::iterator miOldest = mapPartialBlocks.end();
+    for (PartialBlockMap::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); ++mi)
+        if ((*mi).first.second == nPeer && (miOldest == mapPartialBlocks.end() || (*mi).second.nTimeReceived < (*miOldest).second.nTimeReceived))
+            miOldest = mi;
+    return miOldest;
+}
+
+void AddPartialBlock(const uint256& hashBlock, const CPartialBlock& partial, vector<pair<uint256, int> >& vDropped)
+{
+    LOCK(cs_mapPartialBlocks);
+    pair<uint256, int> key(hashBlock, partial.nPeer);
+    mapPartialBlocks.erase(key);
+
+    // A peer announcing more blocks than it answers for only displaces its
+    // own, then the peer waited on most gives way
+    unsigned int nPeerBlocks = 0;
+    BOOST_FOREACH(const PAIRTYPE(const PAIRTYPE(uint256, int), CPartialBlock)& item, mapPartialBlocks)
+        if (item.first.second == partial.nPeer)
+            nPeerBlocks++;
+    for (; nPeerBlocks >= MAX_PARTIAL_BLOCKS_PER_PEER; nPeerBlocks--)
+    {
+        PartialBlockMap::iterator mi = OldestPartialBlock(partial.nPeer);
+        vDropped.push_back((*mi).first);
+        mapPartialBlocks.erase(mi);
+    }
+    while (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+    {
+        PartialBlockMap::iterator mi = OldestPartialBlock(-1);
+        vDropped.push_back((*mi).first);
+        mapPartialBlocks.erase(mi);
+    }
+
+    mapPartialBlocks[key] = partial;
+}
+
+bool TakePartialBlock(const uint256& hashBlock, int nPeer, CPartialBlock& partial)
+{
+    LOCK(cs_mapPartialBlocks);
+    PartialBlockMap::iterator mi = mapPartialBlocks.find(make_pair(hashBlock, nPeer));
+    if (mi == mapPartialBlocks.end())
+        return false;
+    partial = (*mi).second;
+    mapPartialBlocks.erase(mi);
+    return true;
+}
+
+void ExpirePartialBlocks(vector<pair<uint256, int> >& vExpired)
+{
+    LOCK(cs_mapPartialBlocks);
+    int64 nNow = GetTime();
+    for (PartialBlockMap::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end();)
+    {
+        if ((*mi).second.nTimeReceived < nNow - PARTIAL_BLOCK_TIMEOUT)
+        {
+            vExpired.push_back((*mi).first);
+            mapPartialBlocks.erase(mi++);
+        }
+        else
+            ++mi;
+    }
+}
@@ -0,0 +1,196 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BCINNIOIN_COMPACTBLOCK_H
+#define BCINNIOIN_COMPACTBLOCK_H
+
+#include "main.h"
+
+/** Seconds a partially reconstructed block waits for its "blocktxn" reply */
+static const int64 PARTIAL_BLOCK_TIMEOUT = 60;
+/** Number of partially reconstructed blocks kept at once */
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+/** Number of them waiting on any one peer */
+static const unsigned int MAX_PARTIAL_BLOCKS_PER_PEER = 2;
+/** "getblocktxn" is answered with a full block for blocks deeper than this */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+
+extern bool fCompactBlocks;
+
+/** SipHash-2-4 keyed hash */
+class CSipHasher
+{
+private:
+    uint64 v[4];
+    uint64 tmp;
+    int count;
+
+public:
+    CSipHasher(uint64 k0, uint64 k1);
+    CSipHasher& Write(const unsigned char* data, size_t size);
+    uint64 Finalize() const;
+};
+
+/** Short transaction id of a compact block: the low 48 bits */
+static const uint64 SHORTTXID_MASK = 0xffffffffffffULL;
+
+/** A short transaction id, serialized in 6 bytes */
+class CShortTxID
+{
+public:
+    uint64 nShortID;
+
+    CShortTxID(uint64 nShortIDIn=0) : nShortID(nShortIDIn) { }
+
+    IMPLEMENT_SERIALIZE
+    (
+        unsigned int nLow = (unsigned int)(nShortID & 0xffffffff);
+        unsigned short nHigh = (unsigned short)((nShortID >> 32) & 0xffff);
+        READWRITE(nLow);
+        READWRITE(nHigh);
+        if (fRead)
+            const_cast<CShortTxID*>(this)->nShortID = (uint64)nLow | ((uint64)nHigh << 32);
+    )
+};
+
+/** A transaction sent in full inside a compact block */
+class CPrefilledTx
+{
+public:
+    unsigned short nIndex;
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** Compact block announcement ("cmpctblock"): the block header and signature,
+ *  a 48 bit SipHash of every transaction id keyed by the block hash and a
+ *  random nonce, and the coinbase and coinstake in full. The receiver rebuilds
+ *  the block from its memory pool and asks for what it lacks with
+ *  "getblocktxn". */
+class CCompactBlock
+{
+public:
+    CBlock header;      // header and vchBlockSig only, vtx is empty
+    uint64 nNonce;
+    std::vector<CShortTxID> vShortTxID;
+    std::vector<CPrefilledTx> vPrefilled;
+
+    CCompactBlock()
+    {
+        nNonce = 0;
+    }
+
+    explicit CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlock* pheader = const_cast<CBlock*>(&header);
+        READWRITE(pheader->nVersion);
+        READWRITE(pheader->hashPrevBlock);
+        READWRITE(pheader->hashMerkleRoot);
+        READWRITE(pheader->nTime);
+        READWRITE(pheader->nBits);
+        READWRITE(pheader->nNonce);
+        READWRITE(pheader->vchBlockSig);
+        READWRITE(nNonce);
+        READWRITE(vShortTxID);
+        READWRITE(vPrefilled);
+    )
+
+    unsigned int GetTxCount() const
+    {
+        return vShortTxID.size() + vPrefilled.size();
+    }
+
+    // ppcoin: the coinstake is prefilled second
+    bool IsProofOfStake() const
+    {
+        return vPrefilled.size() > 1 && vPrefilled[1].nIndex == 1 && vPrefilled[1].tx.IsCoinStake();
+    }
+
+    /** SipHash keys of the short ids: SHA256d of the header and nNonce */
+    void GetShortIDKeys(uint64& k0, uint64& k1) const;
+
+    static uint64 GetShortID(uint64 k0, uint64 k1, const uint256& hashTx)
+    {
+        return CSipHasher(k0, k1).Write((const unsigned char*)BEGIN(hashTx), sizeof(hashTx)).Finalize() & SHORTTXID_MASK;
+    }
+};
+
+/** Indexes of the transactions of a block missing after reconstruction
+ *  ("getblocktxn") */
+class CBlockTxRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned short> vIndex;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndex);
+    )
+};
+
+/** Reply to "getblocktxn", the requested transactions in order ("blocktxn") */
+class CBlockTxResponse
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being rebuilt from a compact block and the memory pool */
+class CPartialBlock
+{
+public:
+    CBlock block;
+    std::vector<bool> vHave;
+    int nPeer;          // CNode::nNodeId the compact block came from
+    int64 nTimeReceived;
+
+    CPartialBlock()
+    {
+        nPeer = -1;
+        nTimeReceived = 0;
+    }
+
+    /** Fill in the block from a compact block and pool. Returns false if the
+     *  compact block is malformed. Indexes still missing are returned in
+     *  vMissing; a short id matching more than one pool transaction is
+     *  treated as missing. */
+    bool Init(const CCompactBlock& cmpctblock, CTxMemPool& pool, std::vector<unsigned short>& vMissing);
+
+    /** Fill the missing slots, in order, from a "blocktxn" reply. Returns
+     *  false if the number of transactions doesn't match. */
+    bool Fill(const std::vector<CTransaction>& vtxMissing);
+
+    bool IsComplete() const;
+};
+
+/** Remember a partially reconstructed block until its "blocktxn" arrives
+ *  from partial.nPeer. Each peer's partial blocks are kept apart, so a
+ *  second peer announcing the same block doesn't replace the first. The
+ *  partial blocks dropped to make room are returned in vDropped with the
+ *  peer they were asked from, so the caller can fetch them whole. */
+void AddPartialBlock(const uint256& hashBlock, const CPartialBlock& partial, std::vector<std::pair<uint256, int> >& vDropped);
+
+/** Take the partial block hashBlock requested from node nPeer. */
+bool TakePartialBlock(const uint256& hashBlock, int nPeer, CPartialBlock& partial);
+
+/** Drop the partial blocks whose "blocktxn" didn't arrive in time, returning
+ *  them in vExpired with the peer they were asked from. */
+void ExpirePartialBlocks(std::vector<std::pair<uint256, int> >& vExpired);
+
+#endif
@@ -552,6 +552,25 @@ bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
+bool CTxDB::ReadBlockUndo(uint256 hash, CBlockUndo& blockundo)
+{
+    assert(!fClient);
+    blockundo.vPrevTxIndex.clear();
+    return Read(make_pair(string("blockundo"), hash), blockundo);
+}
+
+bool CTxDB::WriteBlockUndo(uint256 hash, const CBlockUndo& blockundo)
+{
+    assert(!fClient);
+    return Write(make_pair(string("blockundo"), hash), blockundo);
+}
+
+bool CTxDB::EraseBlockUndo(uint256 hash)
+{
+    assert(!fClient);
+    return Erase(make_pair(string("blockundo"), hash));
+}
+
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
     return Read(string("hashBestChain"), hashBestChain);
@@ -592,6 +611,186 @@ bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
     return Write(string("strCheckpointPubKey"), strPubKey);
 }
 
+bool CTxDB::ReadAddressIndexBest(unsigned int& nFlags, uint256& hashBest)
+{
+    pair<unsigned int, uint256> best;
+    if (!Read(string("addressindex"), best))
+        return false;
+    nFlags = best.first;
+    hashBest = best.second;
+    return true;
+}
+
+bool CTxDB::WriteAddressIndexBest(unsigned int nFlags, uint256 hashBest)
+{
+    return Write(string("addressindex"), make_pair(nFlags, hashBest));
+}
+
+bool CTxDB::WriteAddressIndexBatch(const CAddressIndexBatch& batch)
+{
+    for (map<CAddressIndexKey, int64>::const_iterator it = batch.mapAddress.begin(); it != batch.mapAddress.end(); ++it)
+        if (!Write(make_pair(string("addrtx"), it->first), it->second))
+            return false;
+    BOOST_FOREACH(const CAddressIndexKey& key, batch.setAddressErase)
+        if (!Erase(make_pair(string("addrtx"), key)))
+            return false;
+    for (map<CAddressUnspentKey, CAddressUnspentValue>::const_iterator it = batch.mapUnspent.begin(); it != batch.mapUnspent.end(); ++it)
+    {
+        if (it->second.IsNull() ? !Erase(make_pair(string("addrutxo"), it->first))
+                                : !Write(make_pair(string("addrutxo"), it->first), it->second))
+            return false;
+    }
+    for (map<CSpentIndexKey, CSpentIndexValue>::const_iterator it = batch.mapSpent.begin(); it != batch.mapSpent.end(); ++it)
+    {
+        if (it->second.IsNull() ? !Erase(make_pair(string("spentidx"), it->first))
+                                : !Write(make_pair(string("spentidx"), it->first), it->second))
+            return false;
+    }
+    return true;
+}
+
+// Erase all records whose key is (strPrefix, K), a chunk at a time so the
+// cursor is never open while erasing
+template<typename K>
+bool CTxDB::EraseRange(const string& strPrefix)
+{
+    while (true)
+    {
+        Dbc* pcursor = GetCursor();
+        if (!pcursor)
+            return false;
+        vector<K> vKeys;
+        unsigned int fFlags = DB_SET_RANGE;
+        while (vKeys.size() < 10000)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            if (fFlags == DB_SET_RANGE)
+                ssKey << strPrefix;
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+            fFlags = DB_NEXT;
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                pcursor->close();
+                return false;
+            }
+            string strType;
+            ssKey >> strType;
+            if (strType != strPrefix)
+                break;
+            K key;
+            ssKey >> key;
+            vKeys.push_back(key);
+        }
+        pcursor->close();
+
+        if (vKeys.empty())
+            return true;
+        BOOST_FOREACH(const K& key, vKeys)
+            if (!Erase(make_pair(strPrefix, key)))
+                return false;
+    }
+}
+
+bool CTxDB::EraseAddressIndex()
+{
+    return Erase(string("addressindex")) &&
+           EraseRange<CAddressIndexKey>("addrtx") &&
+           EraseRange<CAddressUnspentKey>("addrutxo") &&
+           EraseRange<CSpentIndexKey>("spentidx");
+}
+
+bool CTxDB::ReadAddressIndex(unsigned char nType, const uint160& hashBytes, vector<pair<CAddressIndexKey, int64> >& vEntries,
+                             int nStartHeight, int nEndHeight)
+{
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+    unsigned int fFlags = DB_SET_RANGE;
+    while (true)
+    {
+        // Keys sort by address then height, so start at the first key of
+        // the address at nStartHeight and stop at the first one past it
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("addrtx"), CAddressIndexKey(nType, hashBytes, nStartHeight, 0, 0, false));
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        CAddressIndexKey key;
+        ssKey >> strType;
+        if (strType != "addrtx")
+            break;
+        ssKey >> key;
+        if (key.nType != nType || key.hashBytes != hashBytes || (nEndHeight > 0 && key.nHeight > nEndHeight))
+            break;
+        int64 nValue;
+        ssValue >> nValue;
+        vEntries.push_back(make_pair(key, nValue));
+    }
+    pcursor->close();
+    return true;
+}
+
+bool CTxDB::ReadAddressUnspentIndex(unsigned char nType, const uint160& hashBytes, vector<pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent)
+{
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+    unsigned int fFlags = DB_SET_RANGE;
+    while (true)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("addrutxo"), CAddressUnspentKey(nType, hashBytes, 0, 0));
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        CAddressUnspentKey key;
+        ssKey >> strType;
+        if (strType != "addrutxo")
+            break;
+        ssKey >> key;
+        if (key.nType != nType || key.hashBytes != hashBytes)
+            break;
+        CAddressUnspentValue value;
+        ssValue >> value;
+        vUnspent.push_back(make_pair(key, value));
+    }
+    pcursor->close();
+    return true;
+}
+
+bool CTxDB::ReadAddressUnspent(const CAddressUnspentKey& key, CAddressUnspentValue& value)
+{
+    return Read(make_pair(string("addrutxo"), key), value);
+}
+
+bool CTxDB::ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    return Read(make_pair(string("spentidx"), key), value);
+}
+
 CBlockIndex static * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -651,6 +850,7 @@ bool CTxDB::LoadBlockIndex()
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
     bnBestChainTrust = pindexBest->bnChainTrust;
+    BuildStakeModifierIndex(pindexGenesisBlock);
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
       hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
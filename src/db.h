@@ -6,6 +6,7 @@
 #define BCINNIOIN_DB_H
 
 #include "main.h"
+#include "addressindex.h"
 
 #include <map>
 #include <string>
@@ -16,6 +17,7 @@
 class CAddress;
 class CAddrMan;
 class CBlockLocator;
+class CBlockUndo;
 class CDiskBlockIndex;
 class CDiskTxPos;
 class CMasterKey;
@@ -119,7 +121,7 @@ protected:
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        ssKey.ReserveFor(key);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
@@ -156,13 +158,13 @@ protected:
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        ssKey.ReserveFor(key);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(10000);
+        ssValue.ReserveFor(value);
         ssValue << value;
         Dbt datValue(&ssValue[0], ssValue.size());
 
@@ -185,7 +187,7 @@ protected:
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        ssKey.ReserveFor(key);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
@@ -205,7 +207,7 @@ protected:
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        ssKey.ReserveFor(key);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
@@ -336,6 +338,9 @@ public:
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadBlockUndo(uint256 hash, CBlockUndo& blockundo);
+    bool WriteBlockUndo(uint256 hash, const CBlockUndo& blockundo);
+    bool EraseBlockUndo(uint256 hash);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
@@ -345,8 +350,21 @@ public:
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+
+    // Optional address and spent output indexes, see addressindex.h
+    bool ReadAddressIndexBest(unsigned int& nFlags, uint256& hashBest);
+    bool WriteAddressIndexBest(unsigned int nFlags, uint256 hashBest);
+    bool WriteAddressIndexBatch(const CAddressIndexBatch& batch);
+    bool EraseAddressIndex();
+    bool ReadAddressIndex(unsigned char nType, const uint160& hashBytes, std::vector<std::pair<CAddressIndexKey, int64> >& vEntries,
+                          int nStartHeight = 0, int nEndHeight = 0);
+    bool ReadAddressUnspentIndex(unsigned char nType, const uint160& hashBytes, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent);
+    bool ReadAddressUnspent(const CAddressUnspentKey& key, CAddressUnspentValue& value);
+    bool ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
 private:
     bool LoadBlockIndexGuts();
+    template<typename K>
+    bool EraseRange(const std::string& strPrefix);
 };
 
 
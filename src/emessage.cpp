@@ -11,6 +11,7 @@ Notes:
         -nosmsg             Disable secure messaging (fNoSmsg)
         -debugsmsg          Show extra debug messages (fDebugSmsg)
         -smsgscanchain      Scan the block chain for public key addresses on startup
+        -smsgmaxmem=<n>     MB of bucket tokens to keep in memory (nSecMsgMaxTokens)
     
     
     Wallet Locked
@@ -19,18 +20,44 @@ Notes:
         When the wallet is unlocked all the messages in wl files are scanned.
     
     
+    Bucket Index
+        Each bucket file <time>_01.dat has an index <time>_01.idx, a record of SMSG_INDEX_LEN bytes
+        is appended for every message stored. An index that doesn't reach the end of its bucket
+        file is rebuilt at startup.
+        Buckets keep their count and digest in memory, the tokens of the least recently used are
+        dropped once more than nSecMsgMaxTokens are held and read back from the index when needed.
+    
+    
+    Store Manifest
+        smsgStore/manifest.lst lists the files of each bucket, "<time> <SMSG_FILE_ flags>" per line.
+        New files are added to it before they are written, removed files are saved lazily.
+        Startup and rescans read the manifest instead of the directory, a store without one
+        is listed from the directory once.
+        Buckets are put in the expiry wheel smsgExpiry when created, each ThreadSecureMsg tick
+        only looks at the slots passed since the last.
+    
+    
     Address Whitelist
         Owned Addresses are stored in smsgAddresses vector
         Saved to smsg.ini
         Modify options using the smsglocalkeys rpc command or edit the smsg.ini file (with client closed)
-        
-    
+
+
+    Locking
+        Each bucket's tokens and files are under SecureMsgBucketLock(bucketTime), take it before
+        cs_smsgBuckets, which only guards which buckets are in smsgBuckets.
+        Hold one bucket lock at a time.
+        smsgAddresses, smsgOptions and the public key db are under cs_smsgAddresses.
+
+
 */
 
 #include "emessage.h"
 
 #include <stdint.h>
 #include <time.h>
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <stdexcept>
 #include <sstream>
@@ -51,6 +78,7 @@ Notes:
 #include "base58.h"
 #include "db.h"
 #include "init.h" // pwalletMain
+#include "emessagesketch.h"
 
 
 #include "lz4/lz4.c"
@@ -78,6 +106,7 @@ boost::signals2::signal<void (SecOutboxMsg& outboxHdr)> NotifySecMsgOutboxChange
 boost::signals2::signal<void ()> NotifySecMsgWalletUnlocked;
 
 bool fSecMsgEnabled = false;
+uint64_t nSecMsgMaxTokens = (uint64_t)SMSG_DEFAULT_MAXMEM * 1024 * 1024 / sizeof(SecMsgToken);
 
 std::map<int64_t, SecMsgBucket> smsgBuckets;
 std::vector<SecMsgAddress>      smsgAddresses;
@@ -85,12 +114,28 @@ SecMsgOptions                   smsgOptions;
 
 uint32_t nPeerIdCounter = 1;
 
+// -- tokens of newly stored messages, waiting to be sent to peers in smsgInvTok
+std::deque<std::pair<int64_t, SecMsgToken> > smsgAnnounce;
+uint64_t nAnnounceSeqBase = 1;          // sequence number of smsgAnnounce.front()
+
+SecMsgNetStats smsgNetStats;
 
+SecMsgExpiryWheel smsgExpiry;
 
-CCriticalSection cs_smsg;               // all except inbox, outbox and sendQueue
+// -- files in smsgStore, saved to smsgStore/manifest.lst
+std::map<int64_t, uint32_t> smsgManifest; // bucket time, SMSG_FILE_ flags
+bool fManifestDirty = false;
+
+
+
+CCriticalSection cs_smsgBuckets;        // which buckets are in smsgBuckets, the expiry wheel and the announce queue
+CCriticalSection cs_smsgBucket[SMSG_BUCKET_LOCKS]; // the contents and file of each bucket, see SecureMsgBucketLock
+CCriticalSection cs_smsgAddresses;      // smsgAddresses, smsgOptions and the public key db
 CCriticalSection cs_smsgInbox;
 CCriticalSection cs_smsgOutbox;
 CCriticalSection cs_smsgSendQueue;
+CCriticalSection cs_smsgNetStats;
+CCriticalSection cs_smsgManifest;       // smsgManifest
 
 
 namespace fs = boost::filesystem;
@@ -155,34 +200,688 @@ bool SecMsgCrypter::Decrypt(unsigned char* chCiphertext, uint32_t nCipher, std::
     if (fOk) fOk = EVP_DecryptFinal_ex(&ctx, (&vchPlaintext[0])+nPLen, &nFLen);
     EVP_CIPHER_CTX_cleanup(&ctx);
 
-    if (!fOk)
+    if (!fOk)
+        return false;
+    
+    vchPlaintext.resize(nPLen + nFLen);
+    
+    return true;
+};
+
+bool SecMsgBucket::AddToken(const SecMsgToken& token)
+{
+    if (!fLoaded)
+    {
+        printf("Error: SecMsgBucket::AddToken() bucket is not loaded.\n");
+        return false;
+    };
+    
+    // -- tokens mostly arrive in time order, so this is usually near the end
+    std::vector<SecMsgToken>::iterator it = std::lower_bound(vTokens.begin(), vTokens.end(), token);
+    if (it != vTokens.end() && *it == token)
+        return false;
+    vTokens.insert(it, token);
+    nTokens++;
+    
+    // -- the digest is a sum, the same for the same tokens whatever order they were added in
+    unsigned char data[16];
+    memcpy(data, &token.timestamp, 8);
+    memcpy(data+8, token.sample, 8);
+    nDigest += XXH32(data, 16, 1);
+    
+    fHashStale = true;
+    timeChanged = GetTime();
+    return true;
+};
+
+const SecMsgToken* SecMsgBucket::FindToken(const SecMsgToken& token) const
+{
+    std::vector<SecMsgToken>::const_iterator it = std::lower_bound(vTokens.begin(), vTokens.end(), token);
+    if (it == vTokens.end() || !(*it == token))
+        return NULL;
+    return &(*it);
+};
+
+uint32_t SecMsgBucket::GetHash(uint32_t nPeerVersion)
+{
+    if (nPeerVersion >= 2)
+        return nDigest;
+    
+    if (fHashStale)
+        hashBucket();
+    return hash;
+};
+
+void SecMsgBucket::hashBucket()
+{
+    // -- hash sent to peers before smsg version 2, runs through every token
+    if (fDebugSmsg)
+        printf("SecMsgBucket::hashBucket()\n");
+    
+    fHashStale = false;
+    
+    std::vector<SecMsgToken>::iterator it;
+    
+    void* state = XXH32_init(1);
+    
+    for (it = vTokens.begin(); it != vTokens.end(); ++it)
+    {
+        XXH32_update(state, it->sample, 8);
+    };
+    
+    hash = XXH32_digest(state);
+    
+    if (fDebugSmsg)
+        printf("Hashed %"PRIszu" messages, hash %u\n", vTokens.size(), hash);
+};
+
+bool SecMsgBucket::Unload()
+{
+    // -- free vTokens, SecureMsgLoadBucket reads them back from the index file
+    if (!fLoaded || !fIndexed || vTokens.empty())
+        return false;
+    
+    // -- nothing can be added while unloaded, so hash stays valid
+    if (fHashStale)
+        hashBucket();
+    
+    std::vector<SecMsgToken>().swap(vTokens);
+    fLoaded = false;
+    return true;
+};
+
+CCriticalSection& SecureMsgBucketLock(int64_t bucketTime)
+{
+    // -- buckets SMSG_BUCKET_LOCKS apart share a lock, but never more than one is held at a time
+    return cs_smsgBucket[((uint64_t)bucketTime / SMSG_BUCKET_LEN) % SMSG_BUCKET_LOCKS];
+};
+
+void SecMsgExpiryWheel::Schedule(int64_t bucketTime)
+{
+    slots[((uint64_t)bucketTime / SMSG_BUCKET_LEN) % SMSG_EXPIRY_SLOTS].insert(bucketTime);
+    if (nNext == 0 || bucketTime < nNext)
+        nNext = bucketTime - (bucketTime % SMSG_BUCKET_LEN);
+};
+
+void SecMsgExpiryWheel::TakeExpired(int64_t cutoffTime, std::vector<int64_t>& vExpired)
+{
+    // -- turn the wheel up to cutoffTime, taking out the buckets older than it
+    //    only the slots passed since the last turn are looked at
+    if (nNext == 0 || nNext >= cutoffTime)
+        return;
+    
+    uint64_t nSlots = (cutoffTime - nNext + SMSG_BUCKET_LEN - 1) / SMSG_BUCKET_LEN;
+    if (nSlots > SMSG_EXPIRY_SLOTS)
+        nSlots = SMSG_EXPIRY_SLOTS;
+    
+    for (uint64_t i = 0; i < nSlots; ++i)
+    {
+        std::set<int64_t>& slot = slots[((uint64_t)nNext / SMSG_BUCKET_LEN + i) % SMSG_EXPIRY_SLOTS];
+        std::set<int64_t>::iterator it = slot.begin();
+        while (it != slot.end())
+        {
+            if (*it < cutoffTime)
+            {
+                vExpired.push_back(*it);
+                slot.erase(it++);
+            } else
+                ++it;
+        };
+    };
+    
+    // -- the slot holding cutoffTime isn't done until it's passed
+    nNext = cutoffTime - (cutoffTime % SMSG_BUCKET_LEN);
+};
+
+void SecMsgExpiryWheel::Clear()
+{
+    for (uint32_t i = 0; i < SMSG_EXPIRY_SLOTS; ++i)
+        slots[i].clear();
+    nNext = 0;
+};
+
+static SecMsgBucket& SecureMsgGetBucket(int64_t bucketTime)
+{
+    // -- must lock SecureMsgBucketLock(bucketTime) before calling, bucket is created if needed
+    LOCK(cs_smsgBuckets);
+    std::map<int64_t, SecMsgBucket>::iterator it = smsgBuckets.find(bucketTime);
+    if (it != smsgBuckets.end())
+        return it->second;
+    smsgExpiry.Schedule(bucketTime);
+    return smsgBuckets[bucketTime];
+};
+
+SecMsgBucket* SecureMsgFindBucket(int64_t bucketTime)
+{
+    // -- must lock SecureMsgBucketLock(bucketTime) before calling and while using the bucket
+    LOCK(cs_smsgBuckets);
+    std::map<int64_t, SecMsgBucket>::iterator it = smsgBuckets.find(bucketTime);
+    if (it == smsgBuckets.end())
+        return NULL;
+    return &it->second;
+};
+
+void SecureMsgGetBucketTimes(std::vector<int64_t>& vTimes)
+{
+    // -- the buckets may be gone by the time each is locked, use SecureMsgFindBucket
+    LOCK(cs_smsgBuckets);
+    vTimes.clear();
+    vTimes.reserve(smsgBuckets.size());
+    std::map<int64_t, SecMsgBucket>::iterator it;
+    for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+        vTimes.push_back(it->first);
+};
+
+void SecureMsgEraseBucket(int64_t bucketTime)
+{
+    // -- must lock SecureMsgBucketLock(bucketTime) before calling
+    LOCK(cs_smsgBuckets);
+    smsgBuckets.erase(bucketTime);
+};
+
+static void SecureMsgClearBuckets()
+{
+    std::vector<int64_t> vTimes;
+    SecureMsgGetBucketTimes(vTimes);
+    BOOST_FOREACH(int64_t bucketTime, vTimes)
+    {
+        LOCK(SecureMsgBucketLock(bucketTime));
+        SecureMsgEraseBucket(bucketTime);
+    };
+    
+    LOCK(cs_smsgBuckets);
+    smsgExpiry.Clear();
+};
+
+static fs::path SecureMsgStorePath()
+{
+    return GetDataDir() / "smsgStore";
+};
+
+static fs::path SecureMsgBucketPath(const fs::path& pathStore, int64_t bucketTime, const char* pszSuffix)
+{
+    return pathStore / (boost::lexical_cast<std::string>(bucketTime) + pszSuffix);
+};
+
+static fs::path SecureMsgBucketPath(int64_t bucketTime, const char* pszSuffix)
+{
+    return SecureMsgBucketPath(SecureMsgStorePath(), bucketTime, pszSuffix);
+};
+
+int SecureMsgWriteManifest(const fs::path& pathStore, const std::map<int64_t, uint32_t>& mapFiles)
+{
+    // -- write the list of bucket files to pathStore/manifest.lst, replacing it in one rename
+    fs::path pathManifest = pathStore / "manifest.lst";
+    fs::path pathTmp = pathStore / "manifest.lst.tmp";
+    
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathTmp.string().c_str(), "w")))
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+    
+    std::map<int64_t, uint32_t>::const_iterator it;
+    for (it = mapFiles.begin(); it != mapFiles.end(); ++it)
+    {
+        if (fprintf(fp, "%"PRI64d" %u\n", (int64)it->first, it->second) < 0)
+        {
+            printf("Error writing manifest: %s\n", strerror(errno));
+            fclose(fp);
+            return 1;
+        };
+    };
+    
+    fflush(fp);
+    FileCommit(fp);
+    fclose(fp);
+    
+    if (!RenameOver(pathTmp, pathManifest))
+    {
+        printf("Error renaming %s.\n", pathTmp.string().c_str());
+        return 1;
+    };
+    
+    return 0;
+};
+
+int SecureMsgReadManifest(const fs::path& pathStore, std::map<int64_t, uint32_t>& mapFiles)
+{
+    /* read the list of bucket files from pathStore/manifest.lst into mapFiles
+        
+        returns
+            0 success
+            1 error
+            2 manifest does not exist
+    */
+    
+    fs::path pathManifest = pathStore / "manifest.lst";
+    
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathManifest.string().c_str(), "r")))
+    {
+        if (errno == ENOENT)
+            return 2;
+        printf("Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+    
+    char cLine[128];
+    while (fgets(cLine, sizeof(cLine), fp))
+    {
+        int64 bucketTime;
+        uint32_t nFlags;
+        if (sscanf(cLine, "%"PRI64d" %u", &bucketTime, &nFlags) != 2)
+        {
+            printf("Skipping line of manifest: %s", cLine);
+            continue;
+        };
+        mapFiles[bucketTime] |= nFlags;
+    };
+    
+    fclose(fp);
+    return 0;
+};
+
+int SecureMsgListStore(const fs::path& pathStore, std::map<int64_t, uint32_t>& mapFiles)
+{
+    // -- list the bucket files by reading the store directory, only needed when there is no manifest yet
+    fs::directory_iterator itend;
+    
+    try {
+        for (fs::directory_iterator itd(pathStore) ; itd != itend ; ++itd)
+        {
+            if (!fs::is_regular_file(itd->status()))
+                continue;
+            
+            std::string fileType = (*itd).path().extension().string();
+            if (fileType.compare(".dat") != 0)
+                continue;
+            
+            // time_noFile.dat, time_noFile_wl.dat
+            std::string fileName = (*itd).path().filename().string();
+            size_t sep = fileName.find_first_of("_");
+            if (sep == std::string::npos)
+                continue;
+            
+            int64_t fileTime;
+            try {
+                fileTime = boost::lexical_cast<int64_t>(fileName.substr(0, sep));
+            } catch (boost::bad_lexical_cast&)
+            {
+                continue;
+            };
+            
+            mapFiles[fileTime] |= boost::algorithm::ends_with(fileName, "_wl.dat") ? SMSG_FILE_WL : SMSG_FILE_DAT;
+        };
+    } catch (const fs::filesystem_error& ex)
+    {
+        printf("Error reading message store directory, %s.\n", ex.what());
+        return 1;
+    };
+    
+    return 0;
+};
+
+static int SecureMsgSaveManifest()
+{
+    // -- must lock cs_smsgManifest before calling
+    if (SecureMsgWriteManifest(SecureMsgStorePath(), smsgManifest) != 0)
+        return 1;
+    fManifestDirty = false;
+    return 0;
+};
+
+static bool SecureMsgManifestAdd(int64_t bucketTime, uint32_t nFlags)
+{
+    // -- record new files before they are written, so they are found again at startup
+    {
+        LOCK(cs_smsgManifest);
+        uint32_t& nFiles = smsgManifest[bucketTime];
+        if ((nFiles & nFlags) == nFlags)
+            return true;
+        nFiles |= nFlags;
+        if (SecureMsgSaveManifest() != 0)
+        {
+            nFiles &= ~nFlags;
+            return false;
+        };
+    }
+    
+    LOCK(cs_smsgBuckets);
+    smsgExpiry.Schedule(bucketTime);
+    return true;
+};
+
+static void SecureMsgFlushManifest()
+{
+    // -- removed files are written out lazily, a manifest listing a missing file is harmless
+    LOCK(cs_smsgManifest);
+    if (fManifestDirty)
+        SecureMsgSaveManifest();
+};
+
+void SecureMsgRemoveBucketFiles(int64_t bucketTime, uint32_t nFlags)
+{
+    // -- remove the files of a bucket listed in the manifest, nFlags are SMSG_FILE_ flags
+    //    must lock SecureMsgBucketLock(bucketTime) before calling
+    uint32_t nFiles;
+    {
+        LOCK(cs_smsgManifest);
+        std::map<int64_t, uint32_t>::iterator it = smsgManifest.find(bucketTime);
+        if (it == smsgManifest.end())
+            return;
+        nFiles = it->second & nFlags;
+        if (!nFiles)
+            return;
+        it->second &= ~nFiles;
+        if (it->second == 0)
+            smsgManifest.erase(it);
+        fManifestDirty = true;
+    }
+    
+    std::vector<fs::path> vPaths;
+    if (nFiles & SMSG_FILE_DAT)
+    {
+        vPaths.push_back(SecureMsgBucketPath(bucketTime, "_01.dat"));
+        vPaths.push_back(SecureMsgBucketPath(bucketTime, "_01.idx"));
+    };
+    if (nFiles & SMSG_FILE_WL)
+        vPaths.push_back(SecureMsgBucketPath(bucketTime, "_01_wl.dat"));
+    
+    BOOST_FOREACH(const fs::path& path, vPaths)
+    {
+        try {
+            fs::remove(path);
+        } catch (const fs::filesystem_error& ex)
+        {
+            printf("Error removing bucket file %s.\n", ex.what());
+        };
+    };
+};
+
+static void SecureMsgManifestTimes(uint32_t nFlags, std::vector<int64_t>& vTimes)
+{
+    // -- times of the buckets with any of the files in nFlags
+    LOCK(cs_smsgManifest);
+    vTimes.clear();
+    std::map<int64_t, uint32_t>::iterator it;
+    for (it = smsgManifest.begin(); it != smsgManifest.end(); ++it)
+        if (it->second & nFlags)
+            vTimes.push_back(it->first);
+};
+
+static void SecureMsgIndexRecord(const SecMsgToken& token, uint32_t nSize, unsigned char* p)
+{
+    memcpy(p, &token.timestamp, 8);
+    memcpy(p+8, token.sample, 8);
+    memcpy(p+16, &token.offset, 4);
+    memcpy(p+20, &nSize, 4);
+};
+
+int SecureMsgReadIndex(const fs::path& pathStore, int64_t bucketTime, std::vector<SecMsgToken>& vTokens, uint64_t& nDataEnd)
+{
+    /* read the tokens of a bucket from its index file, <time>_01.idx
+        nDataEnd is set to the end of the last message indexed in the bucket file
+        
+        returns
+            0 success
+            1 error
+            2 index file does not exist
+    */
+    
+    vTokens.clear();
+    nDataEnd = 0;
+    
+    fs::path fullpath = SecureMsgBucketPath(pathStore, bucketTime, "_01.idx");
+    
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(fullpath.string().c_str(), "rb")))
+    {
+        if (errno == ENOENT)
+            return 2;
+        printf("Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+    
+    unsigned char record[SMSG_INDEX_LEN];
+    size_t nRead;
+    while ((nRead = fread(record, sizeof(unsigned char), SMSG_INDEX_LEN, fp)) == SMSG_INDEX_LEN)
+    {
+        SecMsgToken token;
+        uint32_t nSize;
+        memcpy(&token.timestamp, record, 8);
+        memcpy(token.sample, record+8, 8);
+        memcpy(&token.offset, record+16, 4);
+        memcpy(&nSize, record+20, 4);
+        
+        vTokens.push_back(token);
+        if (token.offset + (uint64_t)nSize > nDataEnd)
+            nDataEnd = token.offset + (uint64_t)nSize;
+    };
+    
+    fclose(fp);
+    
+    if (nRead != 0)
+    {
+        printf("Index file %s is truncated.\n", fullpath.string().c_str());
+        return 1;
+    };
+    
+    return 0;
+};
+
+static int SecureMsgWriteIndex(const fs::path& pathStore, int64_t bucketTime, const std::vector<unsigned char>& vchRecords, const char* pszMode)
+{
+    // -- pszMode is "ab" to add records, "wb" to replace the index
+    fs::path fullpath = SecureMsgBucketPath(pathStore, bucketTime, "_01.idx");
+    
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(fullpath.string().c_str(), pszMode)))
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+    
+    if (vchRecords.size() > 0
+        && fwrite(&vchRecords[0], sizeof(unsigned char), vchRecords.size(), fp) != vchRecords.size())
+    {
+        printf("fwrite failed: %s\n", strerror(errno));
+        fclose(fp);
+        return 1;
+    };
+    
+    fclose(fp);
+    return 0;
+};
+
+int SecureMsgIndexBucketFile(const fs::path& pathStore, int64_t bucketTime, std::vector<SecMsgToken>& vTokens)
+{
+    /* read the message headers of a bucket file and write its index again
+        
+        returns
+            0 success
+            1 error, vTokens has the messages that could be read but the index is not written
+    */
+    
+    vTokens.clear();
+    
+    fs::path fullpath = SecureMsgBucketPath(pathStore, bucketTime, "_01.dat");
+    
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(fullpath.string().c_str(), "rb")))
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+    
+    SecureMessage smsg;
+    std::vector<unsigned char> vchRecords;
+    bool fOk = true;
+    for (;;)
+    {
+        long int ofs = ftell(fp);
+        SecMsgToken token;
+        token.offset = ofs;
+        errno = 0;
+        if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+        {
+            if (errno != 0)
+            {
+                printf("fread header failed: %s\n", strerror(errno));
+                fOk = false;
+            };
+            break;
+        };
+        token.timestamp = smsg.timestamp;
+        
+        if (smsg.nPayload < 8)
+        {
+            if (fseek(fp, smsg.nPayload, SEEK_CUR) != 0)
+            {
+                printf("fseek, strerror: %s.\n", strerror(errno));
+                fOk = false;
+                break;
+            };
+            continue;
+        };
+        
+        if (fread(token.sample, sizeof(unsigned char), 8, fp) != 8)
+        {
+            printf("fread data failed: %s\n", strerror(errno));
+            fOk = false;
+            break;
+        };
+        
+        if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
+        {
+            printf("fseek, strerror: %s.\n", strerror(errno));
+            fOk = false;
+            break;
+        };
+        
+        vTokens.push_back(token);
+        
+        size_t nd = vchRecords.size();
+        vchRecords.resize(nd + SMSG_INDEX_LEN);
+        SecureMsgIndexRecord(token, SMSG_HDR_LEN + smsg.nPayload, &vchRecords[nd]);
+    };
+    
+    fclose(fp);
+    
+    if (!fOk)
+        return 1;
+    
+    return SecureMsgWriteIndex(pathStore, bucketTime, vchRecords, "wb");
+};
+
+int SecureMsgLoadBucketFile(const fs::path& pathStore, int64_t bucketTime, std::vector<SecMsgToken>& vTokens)
+{
+    /* read the tokens of a bucket file at startup, from its index unless it doesn't cover the whole bucket file
+        
+        returns
+            0 success, read from the index
+            1 error, the bucket file can't be read
+            2 success, the index was written again
+            3 error, vTokens has the messages that could be read but the index is not written
+    */
+    
+    fs::path fullpath = SecureMsgBucketPath(pathStore, bucketTime, "_01.dat");
+    uint64_t nFileSize;
+    try {
+        nFileSize = fs::file_size(fullpath);
+    } catch (const fs::filesystem_error& ex)
+    {
+        printf("Error reading size of bucket file %s, %s.\n", fullpath.string().c_str(), ex.what());
+        return 1;
+    };
+    
+    uint64_t nDataEnd;
+    if (SecureMsgReadIndex(pathStore, bucketTime, vTokens, nDataEnd) == 0
+        && nDataEnd == nFileSize)
+        return 0;
+    
+    printf("Indexing bucket file %s.\n", fullpath.filename().string().c_str());
+    if (SecureMsgIndexBucketFile(pathStore, bucketTime, vTokens) != 0)
+        return 3;
+    return 2;
+};
+
+static bool SecureMsgLoadBucket(int64_t bucketTime, SecMsgBucket& bucket)
+{
+    // -- make sure the tokens of a bucket are in memory, reading them from its index file if unloaded
+    //    must lock SecureMsgBucketLock(bucketTime) before calling
+    bucket.nLastUsed = GetTime();
+    if (bucket.fLoaded)
+        return true;
+    
+    std::vector<SecMsgToken> vTokens;
+    uint64_t nDataEnd;
+    if (SecureMsgReadIndex(SecureMsgStorePath(), bucketTime, vTokens, nDataEnd) != 0)
+    {
+        printf("Error: could not read index of bucket %"PRI64d".\n", bucketTime);
         return false;
+    };
     
-    vchPlaintext.resize(nPLen + nFLen);
+    std::sort(vTokens.begin(), vTokens.end());
+    vTokens.erase(std::unique(vTokens.begin(), vTokens.end()), vTokens.end());
+    if (vTokens.size() != bucket.nTokens)
+        printf("Warning: index of bucket %"PRI64d" has %"PRIszu" messages, expected %u.\n", bucketTime, vTokens.size(), bucket.nTokens);
+    
+    bucket.vTokens.swap(vTokens);
+    bucket.nTokens = bucket.vTokens.size();
+    bucket.fLoaded = true;
     
+    if (fDebugSmsg)
+        printf("Loaded %u messages of bucket %"PRI64d".\n", bucket.nTokens, bucketTime);
     return true;
 };
 
-void SecMsgBucket::hashBucket()
+static void SecureMsgTrimMemory()
 {
-    if (fDebugSmsg)
-        printf("SecMsgBucket::hashBucket()\n");
+    // -- unload the least recently used buckets while more than nSecMsgMaxTokens are in memory
+    std::vector<int64_t> vTimes;
+    SecureMsgGetBucketTimes(vTimes);
     
-    timeChanged = GetTime();
+    uint64_t nInMemory = 0;
+    std::vector<std::pair<int64_t, int64_t> > vLoaded; // last used, bucket time
+    BOOST_FOREACH(int64_t bucketTime, vTimes)
+    {
+        LOCK(SecureMsgBucketLock(bucketTime));
+        SecMsgBucket* pbucket = SecureMsgFindBucket(bucketTime);
+        if (!pbucket || !pbucket->fLoaded)
+            continue;
+        nInMemory += pbucket->vTokens.size();
+        vLoaded.push_back(std::make_pair(pbucket->nLastUsed, bucketTime));
+    };
     
-    std::set<SecMsgToken>::iterator it;
+    if (nInMemory <= nSecMsgMaxTokens)
+        return;
     
-    void* state = XXH32_init(1);
+    std::sort(vLoaded.begin(), vLoaded.end());
     
-    for (it = setTokens.begin(); it != setTokens.end(); ++it)
+    uint32_t nUnloaded = 0;
+    for (uint32_t i = 0; i < vLoaded.size() && nInMemory > nSecMsgMaxTokens; ++i)
     {
-        XXH32_update(state, it->sample, 8);
+        int64_t bucketTime = vLoaded[i].second;
+        LOCK(SecureMsgBucketLock(bucketTime));
+        SecMsgBucket* pbucket = SecureMsgFindBucket(bucketTime);
+        if (!pbucket)
+            continue;
+        uint32_t nTokens = pbucket->vTokens.size();
+        if (!pbucket->Unload())
+            continue;
+        nInMemory -= nTokens;
+        nUnloaded++;
     };
     
-    hash = XXH32_digest(state);
-    
     if (fDebugSmsg)
-        printf("Hashed %"PRIszu" messages, hash %u\n", setTokens.size(), hash);
+        printf("Unloaded %u buckets, %"PRI64u" messages are in memory.\n", nUnloaded, nInMemory);
 };
 
 bool CSmesgInboxDB::NextSmesg(Dbc* pcursor, unsigned int fFlags, std::vector<unsigned char>& vchKey, SecInboxMsg& smsgInbox)
@@ -388,6 +1087,254 @@ bool CSmesgSendQueueDB::NextSmesg(Dbc* pcursor, unsigned int fFlags, std::vector
 
 
 
+static const char* smsgCommands[] = {
+    "smsgInv", "smsgInvTok", "smsgRecon", "smsgShow", "smsgHave", "smsgWant", "smsgMsg",
+    "smsgMatch", "smsgPing", "smsgPong", "smsgDisabled", "smsgIgnore", NULL
+};
+
+static void SecureMsgCountSent(const char* pszCommand, uint64_t nBytes)
+{
+    LOCK(cs_smsgNetStats);
+    smsgNetStats.mapBytesSent[pszCommand] += nBytes;
+};
+
+static void SecureMsgCountRecv(const std::string& strCommand, uint64_t nBytes)
+{
+    // -- anything not in smsgCommands is counted together, a peer can't grow the map
+    std::string strKey = "other";
+    for (const char** psz = smsgCommands; *psz; ++psz)
+    {
+        if (strCommand == *psz)
+        {
+            strKey = strCommand;
+            break;
+        };
+    };
+    
+    LOCK(cs_smsgNetStats);
+    smsgNetStats.mapBytesRecv[strKey] += nBytes;
+};
+
+static void SecureMsgPush(CNode* pnode, const char* pszCommand)
+{
+    // -- 24 is the size of the message header
+    SecureMsgCountSent(pszCommand, 24);
+    pnode->PushMessage(pszCommand);
+};
+
+static void SecureMsgPush(CNode* pnode, const char* pszCommand, const std::vector<unsigned char>& vchData)
+{
+    SecureMsgCountSent(pszCommand, 24 + ::GetSerializeSize(vchData, SER_NETWORK, PROTOCOL_VERSION));
+    pnode->PushMessage(pszCommand, vchData);
+};
+
+static void SecureMsgPushPong(CNode* pnode)
+{
+    // -- smsgPong carries the protocol version, peers from before SMSG_PROTOCOL_VERSION send none
+    uint32_t nVersion = SMSG_PROTOCOL_VERSION;
+    SecureMsgCountSent("smsgPong", 24 + sizeof(nVersion));
+    pnode->PushMessage("smsgPong", nVersion);
+};
+
+void SecureMsgGetNetStats(SecMsgNetStats& stats)
+{
+    LOCK(cs_smsgNetStats);
+    stats = smsgNetStats;
+};
+
+static void SecureMsgPushHave(CNode* pnode, int64_t time, SecMsgBucket& bucket)
+{
+    // -- send all the tokens of a bucket
+    //    must lock SecureMsgBucketLock(time) before calling
+    if (!SecureMsgLoadBucket(time, bucket))
+        return;
+    
+    std::vector<SecMsgToken>& vTokens = bucket.vTokens;
+    std::vector<unsigned char> vchDataOut;
+    try {
+        vchDataOut.resize(8 + 16 * vTokens.size());
+    } catch (std::exception& e) {
+        printf("vchDataOut.resize %"PRIszu" threw: %s.\n", 8 + 16 * vTokens.size(), e.what());
+        return;
+    };
+    memcpy(&vchDataOut[0], &time, 8);
+    
+    unsigned char* p = &vchDataOut[8];
+    std::vector<SecMsgToken>::iterator it;
+    for (it = vTokens.begin(); it != vTokens.end(); ++it)
+    {
+        memcpy(p, &it->timestamp, 8);
+        memcpy(p+8, &it->sample, 8);
+        
+        p += 16;
+    };
+    SecureMsgPush(pnode, "smsgHave", vchDataOut);
+};
+
+static bool SecureMsgWantTokens(CNode* pfrom, std::vector<unsigned char>& vchData)
+{
+    // -- peer has the messages of the tokens in vchData, in the format of smsgHave
+    //    ask for the ones this node doesn't have
+    if (vchData.size() < 8)
+        return false;
+    
+    int n = (vchData.size() - 8) / 16;
+    
+    int64_t time;
+    memcpy(&time, &vchData[0], 8);
+    
+    // -- Check time valid:
+    int64_t now = GetTime();
+    if (time < now - SMSG_RETENTION)
+    {
+        if (fDebugSmsg)
+            printf("Not interested in peer bucket %"PRI64d", has expired.\n", time);
+        return false;
+    };
+    if (time > now + SMSG_TIME_LEEWAY)
+    {
+        if (fDebugSmsg)
+            printf("Not interested in peer bucket %"PRI64d", in the future.\n", time);
+        pfrom->Misbehaving(1);
+        return false;
+    };
+    
+    LOCK(SecureMsgBucketLock(time));
+    SecMsgBucket& bucket = SecureMsgGetBucket(time);
+    
+    if (bucket.nLockCount > 0)
+    {
+        // -- keep the tokens, they are asked for once the bucket is released
+        std::vector<unsigned char>& vchPending = bucket.mapPending[pfrom->smsgData.nPeerId];
+        uint32_t nKeep = std::min((uint32_t)n, SMSG_MAX_PENDING - std::min(SMSG_MAX_PENDING, (uint32_t)vchPending.size() / 16));
+        vchPending.insert(vchPending.end(), vchData.begin() + 8, vchData.begin() + 8 + 16 * nKeep);
+        if (fDebugSmsg)
+            printf("Bucket %"PRI64d" lock count %u, waiting for message data from peer %u, %u tokens pending.\n",
+                time, bucket.nLockCount, bucket.nLockPeerId, nKeep);
+        return false;
+    }; 
+    
+    if (fDebugSmsg)
+        printf("Sifting through bucket %"PRI64d".\n", time);
+    
+    if (!SecureMsgLoadBucket(time, bucket))
+        return false;
+    
+    std::vector<unsigned char> vchDataOut;
+    vchDataOut.resize(8);
+    memcpy(&vchDataOut[0], &vchData[0], 8);
+    
+    SecMsgToken token;
+    unsigned char* p = &vchData[8];
+    
+    for (int i = 0; i < n; ++i)
+    {
+        memcpy(&token.timestamp, p, 8);
+        memcpy(&token.sample, p+8, 8);
+        
+        if (!bucket.FindToken(token))
+        {
+            int nd = vchDataOut.size();
+            try {
+                vchDataOut.resize(nd + 16);
+            } catch (std::exception& e) {
+                printf("vchDataOut.resize %d threw: %s.\n", nd + 16, e.what());
+                continue;
+            };
+            
+            memcpy(&vchDataOut[nd], p, 16);
+        };
+        
+        p += 16;
+    };
+    
+    if (vchDataOut.size() > 8)
+    {
+        if (fDebugSmsg)
+        {
+            printf("Asking peer for  %"PRIszu" messages.\n", (vchDataOut.size() - 8) / 16);
+            printf("Locking bucket %"PRIszu" for peer %u.\n", time, pfrom->smsgData.nPeerId);
+        };
+        bucket.nLockCount   = 3; // lock this bucket for at most 3 * SMSG_THREAD_DELAY seconds, unset when peer sends smsgMsg
+        bucket.nLockPeerId  = pfrom->smsgData.nPeerId;
+        SecureMsgPush(pfrom, "smsgWant", vchDataOut);
+    };
+    
+    return true;
+};
+
+static void SecureMsgWantPending(int64_t time, SecMsgBucket& bucket)
+{
+    // -- ask for the tokens peers offered while the bucket was locked, until it's locked again
+    //    must lock SecureMsgBucketLock(time) before calling
+    while (bucket.nLockCount == 0 && !bucket.mapPending.empty())
+    {
+        std::map<uint32_t, std::vector<unsigned char> >::iterator it = bucket.mapPending.begin();
+        uint32_t nPeerId = it->first;
+        std::vector<unsigned char> vchData;
+        vchData.resize(8);
+        memcpy(&vchData[0], &time, 8);
+        vchData.insert(vchData.end(), it->second.begin(), it->second.end());
+        bucket.mapPending.erase(it);
+        
+        // -- tokens of peers that have disconnected are dropped
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->smsgData.nPeerId != nPeerId)
+                continue;
+            SecureMsgWantTokens(pnode, vchData);
+            break;
+        };
+    };
+};
+
+static bool SecureMsgBuildSketch(int64_t time, SecMsgBucket& bucket, SecMsgSketch& sketch)
+{
+    // -- must lock SecureMsgBucketLock(time) before calling
+    if (!SecureMsgLoadBucket(time, bucket))
+        return false;
+    
+    unsigned char token[SMSG_TOKEN_LEN];
+    std::vector<SecMsgToken>::iterator it;
+    for (it = bucket.vTokens.begin(); it != bucket.vTokens.end(); ++it)
+    {
+        memcpy(token, &it->timestamp, 8);
+        memcpy(token+8, &it->sample, 8);
+        sketch.Insert(token);
+    };
+    return true;
+};
+
+static void SecureMsgAnnounceTokens(CNode* pto)
+{
+    // -- send the peer the tokens stored since it was last sent any
+    //    must lock cs_smsgBuckets before calling
+    uint64_t nSeqEnd = nAnnounceSeqBase + smsgAnnounce.size();
+    uint64_t nSeq = pto->smsgData.nAnnounceSeq > nAnnounceSeqBase ? pto->smsgData.nAnnounceSeq : nAnnounceSeqBase;
+    
+    while (nSeq < nSeqEnd)
+    {
+        uint32_t nTokens = nSeqEnd - nSeq < SMSG_MAX_ANNOUNCE ? nSeqEnd - nSeq : SMSG_MAX_ANNOUNCE;
+        
+        std::vector<unsigned char> vchData;
+        vchData.resize(4 + 16 * nTokens);
+        memcpy(&vchData[0], &nTokens, 4);
+        
+        unsigned char* p = &vchData[4];
+        for (uint32_t i = 0; i < nTokens; ++i, ++nSeq, p += 16)
+        {
+            SecMsgToken& token = smsgAnnounce[nSeq - nAnnounceSeqBase].second;
+            memcpy(p, &token.timestamp, 8);
+            memcpy(p+8, &token.sample, 8);
+        };
+        
+        if (fDebugSmsg)
+            printf("Announcing %u new messages to peer %u.\n", nTokens, pto->smsgData.nPeerId);
+        SecureMsgPush(pto, "smsgInvTok", vchData);
+    };
+};
+
 void ThreadSecureMsg(void* parg)
 {
     // -- bucket management thread
@@ -414,87 +1361,71 @@ void ThreadSecureMsg(void* parg)
         if (fDebugSmsg)
             printf("SecureMsgThread %"PRI64d" \n", now);
         
-        int64_t cutoffTime = now - SMSG_RETENTION;
+        // -- expire buckets older than SMSG_RETENTION, the wheel only holds the buckets due
+        std::vector<int64_t> vExpired;
+        {
+            LOCK(cs_smsgBuckets);
+            smsgExpiry.TakeExpired(now - SMSG_RETENTION, vExpired);
+        }
+        BOOST_FOREACH(int64_t bucketTime, vExpired)
+        {
+            LOCK(SecureMsgBucketLock(bucketTime));
+            if (fDebugSmsg)
+                printf("Removing bucket %"PRI64d" \n", (int64)bucketTime);
+            
+            // -- a wl file stores incoming messages when wallet is locked
+            SecureMsgRemoveBucketFiles(bucketTime, SMSG_FILE_DAT | SMSG_FILE_WL);
+            SecureMsgEraseBucket(bucketTime);
+        };
+        SecureMsgFlushManifest();
         
+        std::vector<int64_t> vTimes;
+        SecureMsgGetBucketTimes(vTimes);
+        BOOST_FOREACH(int64_t bucketTime, vTimes)
         {
-            LOCK(cs_smsg);
-            std::map<int64_t, SecMsgBucket>::iterator it;
-            it = smsgBuckets.begin();
+            LOCK(SecureMsgBucketLock(bucketTime));
+            SecMsgBucket* pbucket = SecureMsgFindBucket(bucketTime);
+            if (!pbucket)
+                continue;
             
-            while (it != smsgBuckets.end())
+            // -- tick down nLockCount, so will eventually expire if peer never sends data
+            if (pbucket->nLockCount > 0)
             {
-                //if (fDebugSmsg)
-                //    printf("Checking bucket %"PRI64d", size %"PRIszu" \n", it->first, it->second.setTokens.size());
-                if (it->first < cutoffTime)
+                pbucket->nLockCount--;
+                
+                if (pbucket->nLockCount == 0)     // lock timed out
                 {
-                    if (fDebugSmsg)
-                        printf("Removing bucket %"PRI64d" \n", it->first);
-                    std::string fileName = boost::lexical_cast<std::string>(it->first) + "_01.dat";
-                    fs::path fullPath = GetDataDir() / "smsgStore" / fileName;
-                    if (fs::exists(fullPath))
-                    {
-                        try {
-                            fs::remove(fullPath);
-                        } catch (const fs::filesystem_error& ex)
-                        {
-                            printf("Error removing bucket file %s.\n", ex.what());
-                        };
-                    } else
-                        printf("Path %s does not exist \n", fullPath.string().c_str());
-                    
-                    // -- look for a wl file, it stores incoming messages when wallet is locked
-                    fileName = boost::lexical_cast<std::string>(it->first) + "_01_wl.dat";
-                    fullPath = GetDataDir() / "smsgStore" / fileName;
-                    if (fs::exists(fullPath))
-                    {
-                        try {
-                            fs::remove(fullPath);
-                        } catch (const fs::filesystem_error& ex)
-                        {
-                            printf("Error removing wallet locked file %s.\n", ex.what());
-                        };
-                    };
+                    uint32_t    nPeerId     = pbucket->nLockPeerId;
+                    int64_t     ignoreUntil = GetTime() + SMSG_TIME_IGNORE;
                     
-                    smsgBuckets.erase(it++);
-                } else
-                {
-                    // -- tick down nLockCount, so will eventually expire if peer never sends data
-                    if (it->second.nLockCount > 0)
+                    if (fDebugSmsg)
+                        printf("Lock on bucket %"PRI64d" for peer %u timed out.\n", bucketTime, nPeerId);
+                    // -- look through the nodes for the peer that locked this bucket
+                    LOCK(cs_vNodes);
+                    BOOST_FOREACH(CNode* pnode, vNodes)
                     {
-                        it->second.nLockCount--;
+                        if (pnode->smsgData.nPeerId != nPeerId)
+                            continue;
+                        pnode->smsgData.ignoreUntil = ignoreUntil;
                         
-                        if (it->second.nLockCount == 0)     // lock timed out
-                        {
-                            uint32_t    nPeerId     = it->second.nLockPeerId;
-                            int64_t     ignoreUntil = GetTime() + SMSG_TIME_IGNORE;
-                            
-                            if (fDebugSmsg)
-                                printf("Lock on bucket %"PRI64d" for peer %u timed out.\n", it->first, nPeerId);
-                            // -- look through the nodes for the peer that locked this bucket
-                            LOCK(cs_vNodes);
-                            BOOST_FOREACH(CNode* pnode, vNodes)
-                            {
-                                if (pnode->smsgData.nPeerId != nPeerId)
-                                    continue;
-                                pnode->smsgData.ignoreUntil = ignoreUntil;
-                                
-                                // -- alert peer that they are being ignored
-                                std::vector<unsigned char> vchData;
-                                vchData.resize(8);
-                                memcpy(&vchData[0], &ignoreUntil, 8);
-                                pnode->PushMessage("smsgIgnore", vchData);
-                                
-                                if (fDebugSmsg)
-                                    printf("This node will ignore peer %u until %"PRI64d".\n", nPeerId, ignoreUntil);
-                                break;
-                            };
-                            it->second.nLockPeerId = 0;
-                        }; // if (it->second.nLockCount == 0)
+                        // -- alert peer that they are being ignored
+                        std::vector<unsigned char> vchData;
+                        vchData.resize(8);
+                        memcpy(&vchData[0], &ignoreUntil, 8);
+                        SecureMsgPush(pnode, "smsgIgnore", vchData);
+                        
+                        if (fDebugSmsg)
+                            printf("This node will ignore peer %u until %"PRI64d".\n", nPeerId, ignoreUntil);
+                        break;
                     };
-                    ++it;
-                }; // ! if (it->first < cutoffTime)
+                    pbucket->nLockPeerId = 0;
+                    pbucket->mapPending.erase(nPeerId);
+                    SecureMsgWantPending(bucketTime, *pbucket);
+                }; // if (pbucket->nLockCount == 0)
             };
-        }; // LOCK(cs_smsg);
+        };
+        
+        SecureMsgTrimMemory();
     };
     
     printf("ThreadSecureMsg exited.\n");
@@ -557,16 +1488,13 @@ void ThreadSecureMsgPow(void* parg)
                 
                 
                 // -- add to message store
+                if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload) != 0)
                 {
-                    LOCK(cs_smsg);
-                    if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
-                    {
-                        printf("SecMsgPow: Could not place message in buckets, message removed.\n");
-                        pcursor->close();
-                        dbSendQueue.EraseSmesg(vchKey);
-                        continue;
-                    };
-                }
+                    printf("SecMsgPow: Could not place message in buckets, message removed.\n");
+                    pcursor->close();
+                    dbSendQueue.EraseSmesg(vchKey);
+                    continue;
+                };
                 
                 // -- test if message was sent to self
                 if (SecureMsgScanMessage(pHeader, pPayload, psmsg->nPayload, true) != 0)
@@ -627,7 +1555,7 @@ std::string fsReadable(uint64_t nBytes)
 int SecureMsgBuildBucketSet()
 {
     /*
-        Build the bucket set by scanning the files in the smsgStore dir.
+        Build the bucket set from the files listed in the smsgStore manifest.
         
         smsgBuckets should be empty
     */
@@ -640,7 +1568,6 @@ int SecureMsgBuildBucketSet()
     uint32_t nMessages      = 0;
     
     fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
     
     
     if (!fs::exists(pathSmsgDir)
@@ -650,116 +1577,86 @@ int SecureMsgBuildBucketSet()
         return 0; // not an error
     }
     
-    
-    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
     {
-        if (!fs::is_regular_file(itd->status()))
-            continue;
+        LOCK(cs_smsgManifest);
+        smsgManifest.clear();
         
-        std::string fileType = (*itd).path().extension().string();
-        
-        if (fileType.compare(".dat") != 0)
+        // -- stores from before the manifest are listed once from the directory
+        if (SecureMsgReadManifest(pathSmsgDir, smsgManifest) != 0)
+        {
+            printf("Building secure message store manifest.\n");
+            if (SecureMsgListStore(pathSmsgDir, smsgManifest) != 0
+                || SecureMsgSaveManifest() != 0)
+            {
+                printf("Could not read the message store manifest.\n");
+                return 1;
+            };
+        };
+    }
+    
+    std::vector<int64_t> vFileTimes;
+    SecureMsgManifestTimes(SMSG_FILE_DAT | SMSG_FILE_WL, vFileTimes);
+    BOOST_FOREACH(int64_t fileTime, vFileTimes)
+    {
+        if (fileTime < now - SMSG_RETENTION)
+        {
+            printf("Dropping bucket %"PRI64d", expired.\n", (int64)fileTime);
+            LOCK(SecureMsgBucketLock(fileTime));
+            SecureMsgRemoveBucketFiles(fileTime, SMSG_FILE_DAT | SMSG_FILE_WL);
             continue;
-            
-        std::string fileName = (*itd).path().filename().string();
+        };
         
+        // -- wl files are only scanned when the wallet is unlocked, they expire with the bucket
+        LOCK(cs_smsgBuckets);
+        smsgExpiry.Schedule(fileTime);
+    };
+    
+    SecureMsgManifestTimes(SMSG_FILE_DAT, vFileTimes);
+    BOOST_FOREACH(int64_t fileTime, vFileTimes)
+    {
+        fs::path fullPath = SecureMsgBucketPath(fileTime, "_01.dat");
+        std::string fileName = fullPath.filename().string();
         
         if (fDebugSmsg)
             printf("Processing file: %s.\n", fileName.c_str());
         
         nFiles++;
         
-        // TODO files must be split if > 2GB
-        // time_noFile.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
-        
-        std::string stime = fileName.substr(0, sep);
-        
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
-        
-        if (fileTime < now - SMSG_RETENTION)
-        {
-            printf("Dropping file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error& ex)
-            {
-                printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
-            continue;
-        };
-        
-        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
+        std::vector<SecMsgToken> vTokens;
+        int rv = SecureMsgLoadBucketFile(pathSmsgDir, fileTime, vTokens);
+        if (rv == 1)
         {
-            if (fDebugSmsg)
-                printf("Skipping wallet locked file: %s.\n", fileName.c_str());
+            LOCK(SecureMsgBucketLock(fileTime));
+            SecureMsgRemoveBucketFiles(fileTime, SMSG_FILE_DAT);
             continue;
         };
+        bool fIndexed = rv != 3;
         
-        
-        SecureMessage smsg;
-        std::set<SecMsgToken>& tokenSet = smsgBuckets[fileTime].setTokens;
+        std::sort(vTokens.begin(), vTokens.end());
         
         {
-            LOCK(cs_smsg);
-            FILE *fp;
+            LOCK(SecureMsgBucketLock(fileTime));
+            SecMsgBucket& bucket = SecureMsgGetBucket(fileTime);
             
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                printf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
+            bucket.vTokens.reserve(vTokens.size());
+            BOOST_FOREACH(const SecMsgToken& token, vTokens)
+                bucket.AddToken(token);
+            bucket.fIndexed = fIndexed;
+            bucket.nLastUsed = 0;
             
-            for (;;)
-            {
-                long int ofs = ftell(fp);
-                SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        printf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //printf("End of file.\n");
-                    };
-                    break;
-                };
-                token.timestamp = smsg.timestamp;
-                
-                if (smsg.nPayload < 8)
-                    continue;
-                
-                if (fread(token.sample, sizeof(unsigned char), 8, fp) != 8)
-                {
-                    printf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-                
-                if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
-                {
-                    printf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
-                
-                tokenSet.insert(token);
-            };
+            nMessages += bucket.size();
             
-            fclose(fp);
+            if (fDebugSmsg)
+                printf("Bucket %"PRI64d" contains %u messages.\n", fileTime, bucket.size());
         };
-        smsgBuckets[fileTime].hashBucket();
-        
-        nMessages += tokenSet.size();
-        
-        if (fDebugSmsg)
-            printf("Bucket %"PRI64d" contains %"PRIszu" messages.\n", fileTime, tokenSet.size());
     };
     
-    printf("Processed %u files, loaded %"PRIszu" buckets containing %u messages.\n", nFiles, smsgBuckets.size(), nMessages);
+    std::vector<int64_t> vTimes;
+    SecureMsgGetBucketTimes(vTimes);
+    printf("Processed %u files, loaded %"PRIszu" buckets containing %u messages.\n", nFiles, vTimes.size(), nMessages);
+    
+    SecureMsgFlushManifest();
+    SecureMsgTrimMemory();
     
     return 0;
 };
@@ -957,15 +1854,19 @@ bool SecureMsgStart(bool fDontStart, bool fScanChain)
     
     fSecMsgEnabled = true;
     
-    if (SecureMsgReadIni() != 0)
-        printf("Failed to read smsg.ini\n");
-    
-    if (smsgAddresses.size() < 1)
     {
-        printf("No address keys loaded.\n");
-        if (SecureMsgAddWalletAddresses() != 0)
-            printf("Failed to load addresses from wallet.\n");
-    };
+        LOCK(cs_smsgAddresses);
+        
+        if (SecureMsgReadIni() != 0)
+            printf("Failed to read smsg.ini\n");
+        
+        if (smsgAddresses.size() < 1)
+        {
+            printf("No address keys loaded.\n");
+            if (SecureMsgAddWalletAddresses() != 0)
+                printf("Failed to load addresses from wallet.\n");
+        };
+    }
     
     if (fScanChain)
     {
@@ -999,8 +1900,13 @@ bool SecureMsgShutdown()
     
     printf("Stopping secure messaging.\n");
     
-    if (SecureMsgWriteIni() != 0)
-        printf("Failed to save smsg.ini\n");
+    {
+        LOCK(cs_smsgAddresses);
+        if (SecureMsgWriteIni() != 0)
+            printf("Failed to save smsg.ini\n");
+    }
+    
+    SecureMsgFlushManifest();
     
     fSecMsgEnabled = false;
     // -- main program will wait 5 seconds for threads to terminate.
@@ -1017,9 +1923,10 @@ bool SecureMsgEnable()
         return false;
     };
     
+    fSecMsgEnabled = true;
+    
     {
-        LOCK(cs_smsg);
-        fSecMsgEnabled = true;
+        LOCK(cs_smsgAddresses);
         
         smsgAddresses.clear(); // should be empty already
         if (SecureMsgReadIni() != 0)
@@ -1031,17 +1938,16 @@ bool SecureMsgEnable()
             if (SecureMsgAddWalletAddresses() != 0)
                 printf("Failed to load addresses from wallet.\n");
         };
-        
-        smsgBuckets.clear(); // should be empty already
-        
-        if (SecureMsgBuildBucketSet() != 0)
-        {
-            printf("SecureMsgEnable: could not load bucket sets, secure messaging disabled.\n");
-            fSecMsgEnabled = false;
-            return false;
-        };
-        
-    }; // LOCK(cs_smsg);
+    }; // LOCK(cs_smsgAddresses);
+    
+    SecureMsgClearBuckets(); // should be empty already
+    
+    if (SecureMsgBuildBucketSet() != 0)
+    {
+        printf("SecureMsgEnable: could not load bucket sets, secure messaging disabled.\n");
+        fSecMsgEnabled = false;
+        return false;
+    };
     
     // -- start threads
     if (!NewThread(ThreadSecureMsg, NULL)
@@ -1057,8 +1963,8 @@ bool SecureMsgEnable()
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
         {
-            pnode->PushMessage("smsgPing");
-            pnode->PushMessage("smsgPong"); // Send pong as have missed initial ping sent by peer when it connected
+            SecureMsgPush(pnode, "smsgPing");
+            SecureMsgPushPong(pnode); // Send pong as have missed initial ping sent by peer when it connected
         };
     }
     
@@ -1075,38 +1981,34 @@ bool SecureMsgDisable()
         return false;
     };
     
+    fSecMsgEnabled = false;
+    
+    // -- clear smsgBuckets
+    SecureMsgClearBuckets();
+    SecureMsgFlushManifest();
+    
+    // -- tell each smsg enabled peer that this node is disabling
     {
-        LOCK(cs_smsg);
-        fSecMsgEnabled = false;
-        
-        // -- clear smsgBuckets
-        std::map<int64_t, SecMsgBucket>::iterator it;
-        it = smsgBuckets.begin();
-        for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
         {
-            it->second.setTokens.clear();
+            if (!pnode->smsgData.fEnabled)
+                continue;
+            
+            SecureMsgPush(pnode, "smsgDisabled");
+            pnode->smsgData.fEnabled = false;
         };
-        smsgBuckets.clear();
-        
-        // -- tell each smsg enabled peer that this node is disabling
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (!pnode->smsgData.fEnabled)
-                    continue;
-                
-                pnode->PushMessage("smsgDisabled");
-                pnode->smsgData.fEnabled = false;
-            };
-        }
+    }
     
+    {
+        LOCK(cs_smsgAddresses);
+        
         if (SecureMsgWriteIni() != 0)
             printf("Failed to save smsg.ini\n");
         
         smsgAddresses.clear();
         
-    }; // LOCK(cs_smsg);
+    }; // LOCK(cs_smsgAddresses);
     
     
     
@@ -1130,10 +2032,9 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
     if (fDebugSmsg)
         printf("SecureMsgReceiveData() %s %s.\n", pfrom->addrName.c_str(), strCommand.c_str());
     
-    {
-    // break up?
-    LOCK(cs_smsg);
+    SecureMsgCountRecv(strCommand, 24 + vRecv.size());
     
+    // -- each handler locks the buckets it works on one at a time, see SecureMsgBucketLock
     if (strCommand == "smsgInv")
     {
         std::vector<unsigned char> vchData;
@@ -1154,7 +2055,11 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             return false;
         };
         
-        uint32_t nBuckets       = smsgBuckets.size();
+        uint32_t nBuckets;
+        {
+            LOCK(cs_smsgBuckets);
+            nBuckets            = smsgBuckets.size();
+        }
         uint32_t nLocked        = 0;    // no. of locked buckets on this node
         uint32_t nInvBuckets;           // no. of bucket headers sent by peer in smsgInv
         memcpy(&nInvBuckets, &vchData[0], 4);
@@ -1219,26 +2124,53 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                 continue;
             };
             
+            LOCK(SecureMsgBucketLock(time));
+            SecMsgBucket& bucket = SecureMsgGetBucket(time);
+            uint32_t nHash = bucket.GetHash(pfrom->smsgData.nVersion);
+            
             if (fDebugSmsg)
             {
                 printf("peer bucket %"PRI64d" %u %u.\n", time, ncontent, hash);
-                printf("this bucket %"PRI64d" %"PRIszu" %u.\n", time, smsgBuckets[time].setTokens.size(), smsgBuckets[time].hash);
+                printf("this bucket %"PRI64d" %u %u.\n", time, bucket.size(), nHash);
             };
             
-            if (smsgBuckets[time].nLockCount > 0)
+            if (bucket.nLockCount > 0)
             {
                 if (fDebugSmsg)
-                    printf("Bucket is locked %u, waiting for peer %u to send data.\n", smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                    printf("Bucket is locked %u, waiting for peer %u to send data.\n", bucket.nLockCount, bucket.nLockPeerId);
                 nLocked++;
                 continue;
             };
             
             // -- if this node has more than the peer node, peer node will pull from this
             //    if then peer node has more this node will pull fom peer
-            if (smsgBuckets[time].setTokens.size() < ncontent
-                || (smsgBuckets[time].setTokens.size() == ncontent
-                    && smsgBuckets[time].hash != hash)) // if same amount in buckets check hash
+            uint32_t nHave = bucket.size();
+            if (nHave < ncontent
+                || (nHave == ncontent
+                    && nHash != hash)) // if same amount in buckets check hash
             {
+                // -- a sketch sized for the difference in counts is usually much smaller than
+                //    the peer's list of tokens, if it doesn't decode the peer sends the list
+                if (pfrom->smsgData.nVersion >= 1)
+                {
+                    uint32_t nCells = SecMsgSketch::CellsFor(ncontent - nHave + 8);
+                    SecMsgSketch sketch(nCells);
+                    if (nCells * SMSG_SKETCH_CELL_LEN < 16 * (uint64_t)ncontent
+                        && SecureMsgBuildSketch(time, bucket, sketch))
+                    {
+                        if (fDebugSmsg)
+                            printf("Sending sketch of bucket %"PRI64d", %u cells.\n", time, nCells);
+                        
+                        std::vector<unsigned char> vchRecon;
+                        vchRecon.resize(12);
+                        memcpy(&vchRecon[0], &time, 8);
+                        memcpy(&vchRecon[8], &nCells, 4);
+                        sketch.Write(vchRecon);
+                        SecureMsgPush(pfrom, "smsgRecon", vchRecon);
+                        continue;
+                    };
+                };
+                
                 if (fDebugSmsg)
                     printf("Requesting contents of bucket %"PRI64d".\n", time);
                 
@@ -1254,7 +2186,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         memcpy(&vchDataOut[0], &nShowBuckets, 4);
         if (vchDataOut.size() > 4)
         {
-            pfrom->PushMessage("smsgShow", vchDataOut);
+            SecureMsgPush(pfrom, "smsgShow", vchDataOut);
         } else
         if (nLocked < 1) // Don't report buckets as matched if any are locked
         {
@@ -1262,7 +2194,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             //    peer will still request buckets from this node if needed (< ncontent)
             vchDataOut.resize(8);
             memcpy(&vchDataOut[0], &now, 8);
-            pfrom->PushMessage("smsgMatch", vchDataOut);
+            SecureMsgPush(pfrom, "smsgMatch", vchDataOut);
             if (fDebugSmsg)
                 printf("Sending smsgMatch, %"PRI64d".\n", now);
         };
@@ -1285,43 +2217,22 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         if (fDebugSmsg)
             printf("smsgShow: peer wants to see content of %u buckets.\n", nBuckets);
         
-        std::map<int64_t, SecMsgBucket>::iterator itb;
-        std::set<SecMsgToken>::iterator it;
-        
-        std::vector<unsigned char> vchDataOut;
         int64_t time;
         unsigned char* pIn = &vchData[4];
         for (uint32_t i = 0; i < nBuckets; ++i, pIn += 8)
         {
             memcpy(&time, pIn, 8);
             
-            itb = smsgBuckets.find(time);
-            if (itb == smsgBuckets.end())
+            LOCK(SecureMsgBucketLock(time));
+            SecMsgBucket* pbucket = SecureMsgFindBucket(time);
+            if (!pbucket)
             {
                 if (fDebugSmsg)
                     printf("Don't have bucket %"PRI64d".\n", time);
                 continue;
             };
             
-            std::set<SecMsgToken>& tokenSet = (*itb).second.setTokens;
-            
-            try {
-                vchDataOut.resize(8 + 16 * tokenSet.size());
-            } catch (std::exception& e) {
-                printf("vchDataOut.resize %"PRIszu" threw: %s.\n", 8 + 16 * tokenSet.size(), e.what());
-                continue;
-            };
-            memcpy(&vchDataOut[0], &time, 8);
-            
-            unsigned char* p = &vchDataOut[8];
-            for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
-            {
-                memcpy(p, &it->timestamp, 8);
-                memcpy(p+8, &it->sample, 8);
-                
-                p += 16;
-            };
-            pfrom->PushMessage("smsgHave", vchDataOut);
+            SecureMsgPushHave(pfrom, time, *pbucket);
         };
         
         
@@ -1332,81 +2243,144 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         std::vector<unsigned char> vchData;
         vRecv >> vchData;
         
-        if (vchData.size() < 8)
+        SecureMsgWantTokens(pfrom, vchData);
+    } else
+    if (strCommand == "smsgInvTok")
+    {
+        // -- peer has stored new messages, tokens are sent as they arrive
+        std::vector<unsigned char> vchData;
+        vRecv >> vchData;
+        
+        if (vchData.size() < 4)
+        {
+            pfrom->Misbehaving(1);
+            return false;
+        };
+        
+        if (GetTime() < pfrom->smsgData.ignoreUntil)
             return false;
         
-        int n = (vchData.size() - 8) / 16;
+        uint32_t nTokens;
+        memcpy(&nTokens, &vchData[0], 4);
+        if (nTokens > SMSG_MAX_ANNOUNCE
+            || vchData.size() < 4 + nTokens * 16)
+        {
+            printf("smsgInvTok, bad token count %u, %"PRIszu" bytes.\n", nTokens, vchData.size());
+            pfrom->Misbehaving(1);
+            return false;
+        };
+        
+        // -- group the tokens by bucket and sift them as if the peer sent smsgHave
+        std::map<int64_t, std::vector<unsigned char> > mapHave;
+        unsigned char* p = &vchData[4];
+        for (uint32_t i = 0; i < nTokens; ++i, p += 16)
+        {
+            int64_t timestamp;
+            memcpy(&timestamp, p, 8);
+            int64_t bucket = timestamp - (timestamp % SMSG_BUCKET_LEN);
+            
+            std::vector<unsigned char>& vchHave = mapHave[bucket];
+            if (vchHave.empty())
+            {
+                vchHave.resize(8);
+                memcpy(&vchHave[0], &bucket, 8);
+            };
+            vchHave.insert(vchHave.end(), p, p + 16);
+        };
+        
+        std::map<int64_t, std::vector<unsigned char> >::iterator it;
+        for (it = mapHave.begin(); it != mapHave.end(); ++it)
+            SecureMsgWantTokens(pfrom, it->second);
+    } else
+    if (strCommand == "smsgRecon")
+    {
+        // -- peer sent a sketch of its copy of a bucket, see smsgInv
+        std::vector<unsigned char> vchData;
+        vRecv >> vchData;
+        
+        if (vchData.size() < 12)
+        {
+            pfrom->Misbehaving(1);
+            return false;
+        };
+        
+        if (GetTime() < pfrom->smsgData.ignoreUntil)
+            return false;
         
         int64_t time;
+        uint32_t nCells;
         memcpy(&time, &vchData[0], 8);
+        memcpy(&nCells, &vchData[8], 4);
         
-        // -- Check time valid:
-        int64_t now = GetTime();
-        if (time < now - SMSG_RETENTION)
+        // -- a sketch only answers a bucket this node sent in smsgInv, decoding is not free
+        if (pfrom->smsgData.setInvBuckets.erase(time) == 0)
         {
-            if (fDebugSmsg)
-                printf("Not interested in peer bucket %"PRI64d", has expired.\n", time);
+            printf("smsgRecon, bucket %"PRI64d" was not offered to peer %u.\n", time, pfrom->smsgData.nPeerId);
+            pfrom->Misbehaving(1);
             return false;
         };
-        if (time > now + SMSG_TIME_LEEWAY)
+        
+        SecMsgSketch sketchPeer;
+        if (nCells > SMSG_SKETCH_MAX_CELLS
+            || vchData.size() < 12 + nCells * SMSG_SKETCH_CELL_LEN
+            || !sketchPeer.Read(&vchData[12], nCells))
         {
-            if (fDebugSmsg)
-                printf("Not interested in peer bucket %"PRI64d", in the future.\n", time);
+            printf("smsgRecon, bad sketch of %u cells, %"PRIszu" bytes.\n", nCells, vchData.size());
             pfrom->Misbehaving(1);
             return false;
         };
         
-        if (smsgBuckets[time].nLockCount > 0)
+        LOCK(SecureMsgBucketLock(time));
+        SecMsgBucket* pbucket = SecureMsgFindBucket(time);
+        if (!pbucket)
         {
             if (fDebugSmsg)
-                printf("Bucket %"PRI64d" lock count %u, waiting for message data from peer %u.\n", time, smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                printf("Don't have bucket %"PRI64d".\n", time);
             return false;
-        }; 
+        };
         
-        if (fDebugSmsg)
-            printf("Sifting through bucket %"PRI64d".\n", time);
+        SecMsgSketch sketch(nCells);
+        if (!SecureMsgBuildSketch(time, *pbucket, sketch))
+            return false;
+        sketch.Subtract(sketchPeer);
         
-        std::vector<unsigned char> vchDataOut;
-        vchDataOut.resize(8);
-        memcpy(&vchDataOut[0], &vchData[0], 8);
+        std::vector<unsigned char> vchOnlyHere, vchOnlyThere;
+        if (!sketch.Decode(vchOnlyHere, vchOnlyThere))
+        {
+            if (fDebugSmsg)
+                printf("Sketch of bucket %"PRI64d" didn't decode, sending all tokens.\n", time);
+            {
+                LOCK(cs_smsgNetStats);
+                smsgNetStats.nReconFailed++;
+            }
+            SecureMsgPushHave(pfrom, time, *pbucket);
+            return true;
+        };
         
-        std::set<SecMsgToken>& tokenSet = smsgBuckets[time].setTokens;
-        std::set<SecMsgToken>::iterator it;
-        SecMsgToken token;
-        unsigned char* p = &vchData[8];
+        {
+            LOCK(cs_smsgNetStats);
+            smsgNetStats.nReconciled++;
+        }
+        if (fDebugSmsg)
+            printf("Bucket %"PRI64d" reconciled, %"PRIszu" messages only here, %"PRIszu" only on peer.\n",
+                time, vchOnlyHere.size() / 16, vchOnlyThere.size() / 16);
         
-        for (int i = 0; i < n; ++i)
+        if (vchOnlyHere.size() > 0)
         {
-            memcpy(&token.timestamp, p, 8);
-            memcpy(&token.sample, p+8, 8);
-            
-            it = tokenSet.find(token);
-            if (it == tokenSet.end())
-            {
-                int nd = vchDataOut.size();
-                try {
-                    vchDataOut.resize(nd + 16);
-                } catch (std::exception& e) {
-                    printf("vchDataOut.resize %d threw: %s.\n", nd + 16, e.what());
-                    continue;
-                };
-                
-                memcpy(&vchDataOut[nd], p, 16);
-            };
-            
-            p += 16;
+            std::vector<unsigned char> vchDataOut;
+            vchDataOut.resize(8);
+            memcpy(&vchDataOut[0], &time, 8);
+            vchDataOut.insert(vchDataOut.end(), vchOnlyHere.begin(), vchOnlyHere.end());
+            SecureMsgPush(pfrom, "smsgHave", vchDataOut);
         };
         
-        if (vchDataOut.size() > 8)
+        if (vchOnlyThere.size() > 0)
         {
-            if (fDebugSmsg)
-            {
-                printf("Asking peer for  %"PRIszu" messages.\n", (vchDataOut.size() - 8) / 16);
-                printf("Locking bucket %"PRIszu" for peer %u.\n", time, pfrom->smsgData.nPeerId);
-            };
-            smsgBuckets[time].nLockCount   = 3; // lock this bucket for at most 3 * SMSG_THREAD_DELAY seconds, unset when peer sends smsgMsg
-            smsgBuckets[time].nLockPeerId  = pfrom->smsgData.nPeerId;
-            pfrom->PushMessage("smsgWant", vchDataOut);
+            std::vector<unsigned char> vchWant;
+            vchWant.resize(8);
+            memcpy(&vchWant[0], &time, 8);
+            vchWant.insert(vchWant.end(), vchOnlyThere.begin(), vchOnlyThere.end());
+            SecureMsgWantTokens(pfrom, vchWant);
         };
     } else
     if (strCommand == "smsgWant")
@@ -1428,17 +2402,19 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         uint32_t nBunch = 0;
         memcpy(&time, &vchData[0], 8);
         
-        std::map<int64_t, SecMsgBucket>::iterator itb;
-        itb = smsgBuckets.find(time);
-        if (itb == smsgBuckets.end())
+        LOCK(SecureMsgBucketLock(time));
+        SecMsgBucket* pbucket = SecureMsgFindBucket(time);
+        if (!pbucket)
         {
             if (fDebugSmsg)
                 printf("Don't have bucket %"PRI64d".\n", time);
             return false;
         };
         
-        std::set<SecMsgToken>& tokenSet = itb->second.setTokens;
-        std::set<SecMsgToken>::iterator it;
+        if (!SecureMsgLoadBucket(time, *pbucket))
+            return false;
+        
+        const SecMsgToken* pToken;
         SecMsgToken token;
         unsigned char* p = &vchData[8];
         for (int i = 0; i < n; ++i)
@@ -1446,15 +2422,14 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             memcpy(&token.timestamp, p, 8);
             memcpy(&token.sample, p+8, 8);
             
-            it = tokenSet.find(token);
-            if (it == tokenSet.end())
+            if (!(pToken = pbucket->FindToken(token)))
             {
                 if (fDebugSmsg)
                     printf("Don't have wanted message %"PRI64d".\n", token.timestamp);
             } else
             {
-                //printf("Have message at %"PRI64d".\n", it->offset); // DEBUG
-                token.offset = it->offset;
+                //printf("Have message at %u.\n", pToken->offset); // DEBUG
+                token.offset = pToken->offset;
                 //printf("winb before SecureMsgRetrieve %"PRI64d".\n", token.timestamp);
                 
                 // -- place in vchOne so if SecureMsgRetrieve fails it won't corrupt vchBunch
@@ -1485,7 +2460,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             
             memcpy(&vchBunch[0], &nBunch, 4);
             memcpy(&vchBunch[4], &time, 8);
-            pfrom->PushMessage("smsgMsg", vchBunch);
+            SecureMsgPush(pfrom, "smsgMsg", vchBunch);
         };
     } else
     if (strCommand == "smsgMsg")
@@ -1532,13 +2507,18 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
     if (strCommand == "smsgPing")
     {
         // -- smsgPing is the initial message, send reply
-        pfrom->PushMessage("smsgPong");
+        SecureMsgPushPong(pfrom);
     } else
     if (strCommand == "smsgPong")
     {
+        uint32_t nVersion = 0;
+        if (vRecv.size() >= sizeof(nVersion))
+            vRecv >> nVersion;
+        
         if (fDebugSmsg)
-             printf("Peer replied, secure messaging enabled.\n");
+             printf("Peer replied, secure messaging enabled, protocol version %u.\n", nVersion);
         
+        pfrom->smsgData.nVersion = nVersion;
         pfrom->smsgData.fEnabled = true;
     } else
     if (strCommand == "smsgDisabled")
@@ -1577,8 +2557,6 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         // Unknown message
     };
     
-    }; //  LOCK(cs_smsg);
-    
     return true;
 };
 
@@ -1601,7 +2579,7 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle)
         if (fDebugSmsg)
             printf("SecureMsgSendData() new node %s, peer id %u.\n", pto->addrName.c_str(), pto->smsgData.nPeerId);
         // -- Send smsgPing once, do nothing until receive 1st smsgPong (then set fEnabled)
-        pto->PushMessage("smsgPing");
+        SecureMsgPush(pto, "smsgPing");
         pto->smsgData.lastSeen = GetTime();
         return true;
     } else
@@ -1613,8 +2591,10 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle)
     };
     
     // -- When nWakeCounter == 0, resend bucket inventory.  
+    bool fWake = false;
     if (pto->smsgData.nWakeCounter < 1)
     {
+        fWake = true;
         pto->smsgData.lastMatched = 0;
         pto->smsgData.nWakeCounter = 10 + GetRandInt(300);  // set to a random time between [10, 300] * SMSG_SEND_DELAY seconds
         
@@ -1624,60 +2604,89 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle)
     };
     pto->smsgData.nWakeCounter--;
     
+    // -- peers that know smsgInvTok are sent the tokens of new messages as they are stored,
+    //    and the bucket inventory only on first contact and when nWakeCounter expires
+    if (pto->smsgData.nVersion >= 1)
+    {
+        bool fFirst = pto->smsgData.nAnnounceSeq == 0;
+        {
+            LOCK(cs_smsgBuckets);
+            if (!fFirst)
+                SecureMsgAnnounceTokens(pto);
+            pto->smsgData.nAnnounceSeq = nAnnounceSeqBase + smsgAnnounce.size();
+        }
+        
+        if (!fFirst && !fWake)
+        {
+            pto->smsgData.lastSeen = GetTime();
+            return true;
+        };
+    };
+    
+    std::vector<int64_t> vTimes;
+    SecureMsgGetBucketTimes(vTimes);
+    
+    uint32_t nBuckets = vTimes.size();
+    if (nBuckets > 0) // no need to send keep alive pkts, coin messages already do that
     {
-        LOCK(cs_smsg);
-        std::map<int64_t, SecMsgBucket>::iterator it;
+        std::vector<unsigned char> vchData;
+        // should reserve?
+        vchData.reserve(4 + nBuckets*16); // timestamp + size + hash
         
-        uint32_t nBuckets = smsgBuckets.size();
-        if (nBuckets > 0) // no need to send keep alive pkts, coin messages already do that
+        uint32_t nBucketsShown = 0;
+        vchData.resize(4);
+        
+        unsigned char* p = &vchData[4];
+        BOOST_FOREACH(int64_t bucketTime, vTimes)
         {
-            std::vector<unsigned char> vchData;
-            // should reserve?
-            vchData.reserve(4 + nBuckets*16); // timestamp + size + hash
+            LOCK(SecureMsgBucketLock(bucketTime));
+            SecMsgBucket* pbucket = SecureMsgFindBucket(bucketTime);
+            if (!pbucket)
+                continue;
             
-            uint32_t nBucketsShown = 0;
-            vchData.resize(4);
+            uint32_t nMessages = pbucket->size();
             
-            unsigned char* p = &vchData[4];
-            for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
-            {
-                SecMsgBucket &bkt = it->second;
-                
-                uint32_t nMessages = bkt.setTokens.size();
-                
-                if (bkt.timeChanged < pto->smsgData.lastMatched     // peer has this bucket
-                    || nMessages < 1)                               // this bucket is empty
-                    continue; 
-                
-                
-                uint32_t hash = bkt.hash;
-                
-                try {
-                    vchData.resize(vchData.size() + 16);
-                } catch (std::exception& e) {
-                    printf("vchData.resize %"PRIszu" threw: %s.\n", vchData.size() + 16, e.what());
-                    continue;
-                };
-                memcpy(p, &it->first, 8);
-                memcpy(p+8, &nMessages, 4);
-                memcpy(p+12, &hash, 4);
-                
-                p += 16;
-                nBucketsShown++;
-                //if (fDebug)
-                //    printf("Sending bucket %"PRI64d", size %d \n", it->first, it->second.size());
+            if (pbucket->timeChanged < pto->smsgData.lastMatched   // peer has this bucket
+                || nMessages < 1)                                   // this bucket is empty
+                continue; 
+            
+            
+            uint32_t hash = pbucket->GetHash(pto->smsgData.nVersion);
+            
+            try {
+                vchData.resize(vchData.size() + 16);
+            } catch (std::exception& e) {
+                printf("vchData.resize %"PRIszu" threw: %s.\n", vchData.size() + 16, e.what());
+                continue;
             };
+            memcpy(p, &bucketTime, 8);
+            memcpy(p+8, &nMessages, 4);
+            memcpy(p+12, &hash, 4);
+            
+            p += 16;
+            nBucketsShown++;
+            //if (fDebug)
+            //    printf("Sending bucket %"PRI64d", size %d \n", bucketTime, nMessages);
+        };
+        
+        if (vchData.size() > 4)
+        {
+            memcpy(&vchData[0], &nBucketsShown, 4);
+            if (fDebugSmsg)
+                printf("Sending %d bucket headers.\n", nBucketsShown);
             
-            if (vchData.size() > 4)
+            std::set<int64_t>& setInv = pto->smsgData.setInvBuckets;
+            setInv.erase(setInv.begin(), setInv.lower_bound(now - SMSG_RETENTION));
+            for (uint32_t i = 0; i < nBucketsShown; ++i)
             {
-                memcpy(&vchData[0], &nBucketsShown, 4);
-                if (fDebugSmsg)
-                    printf("Sending %d bucket headers.\n", nBucketsShown);
-                
-                pto->PushMessage("smsgInv", vchData);
+                int64_t bucketTime;
+                memcpy(&bucketTime, &vchData[4 + i * 16], 8);
+                setInv.insert(bucketTime);
             };
+            
+            SecureMsgPush(pto, "smsgInv", vchData);
         };
-    }
+    };
     
     pto->smsgData.lastSeen = GetTime();
     
@@ -1689,7 +2698,7 @@ static int SecureMsgInsertAddress(CKeyID& hashKey, CPubKey& pubKey, CSmesgPubKey
 {
     /* insert key hash and public key to addressdb
         
-        should have LOCK(cs_smsg) where db is opened
+        should have LOCK(cs_smsgAddresses) where db is opened
         
         returns
             0 success
@@ -1726,7 +2735,7 @@ int SecureMsgInsertAddress(CKeyID& hashKey, CPubKey& pubKey)
 {
     int rv;
     {
-        LOCK(cs_smsg);
+        LOCK(cs_smsgAddresses);
         CSmesgPubKeyDB addrpkdb("cr+");
         
         rv = SecureMsgInsertAddress(hashKey, pubKey, addrpkdb);
@@ -1738,7 +2747,7 @@ int SecureMsgInsertAddress(CKeyID& hashKey, CPubKey& pubKey)
 static bool ScanBlock(CBlock& block, CTxDB& txdb, CSmesgPubKeyDB& addrpkdb,
     uint32_t& nTransactions, uint32_t& nInputs, uint32_t& nPubkeys, uint32_t& nDuplicates)
 {
-    // -- should have LOCK(cs_smsg) where db is opened
+    // -- should have LOCK(cs_smsgAddresses) where db is opened
     BOOST_FOREACH(CTransaction& tx, block.vtx)
     {
         if (!tx.IsStandard())
@@ -1862,7 +2871,7 @@ bool SecureMsgScanBlock(CBlock& block)
     uint32_t nDuplicates    = 0;
     
     {
-        LOCK(cs_smsg);
+        LOCK(cs_smsgAddresses);
         
         CSmesgPubKeyDB addrpkdb("cw");
         CTxDB txdb("r");
@@ -1896,7 +2905,7 @@ bool ScanChainForPublicKeys(CBlockIndex* pindexStart)
     uint32_t nDuplicates    = 0;
     
     {
-        LOCK(cs_smsg);
+        LOCK(cs_smsgAddresses);
     
         CSmesgPubKeyDB addrpkdb("cw");
         CTxDB txdb("r");
@@ -1969,7 +2978,6 @@ bool SecureMsgScanBuckets()
     uint32_t nFoundMessages = 0;
     
     fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
     
     if (!fs::exists(pathSmsgDir)
         || !fs::is_directory(pathSmsgDir))
@@ -1981,58 +2989,27 @@ bool SecureMsgScanBuckets()
     SecureMessage smsg;
     std::vector<unsigned char> vchData;
     
-    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    std::vector<int64_t> vFileTimes;
+    SecureMsgManifestTimes(SMSG_FILE_DAT, vFileTimes);
+    BOOST_FOREACH(int64_t fileTime, vFileTimes)
     {
-        if (!fs::is_regular_file(itd->status()))
-            continue;
-        
-        std::string fileType = (*itd).path().extension().string();
-        
-        if (fileType.compare(".dat") != 0)
+        // -- expired buckets are left for ThreadSecureMsg to remove
+        if (fileTime < now - SMSG_RETENTION)
             continue;
-            
-        std::string fileName = (*itd).path().filename().string();
         
+        fs::path fullPath = SecureMsgBucketPath(fileTime, "_01.dat");
+        std::string fileName = fullPath.filename().string();
         
         if (fDebugSmsg)
             printf("Processing file: %s.\n", fileName.c_str());
         
         nFiles++;
         
-        // TODO files must be split if > 2GB
-        // time_noFile.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
-        
-        std::string stime = fileName.substr(0, sep);
-        
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
-        
-        if (fileTime < now - SMSG_RETENTION)
-        {
-            printf("Dropping file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error& ex)
-            {
-                printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
-            continue;
-        };
-        
-        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
-        {
-            if (fDebugSmsg)
-                printf("Skipping wallet locked file: %s.\n", fileName.c_str());
-            continue;
-        };
-        
         {
-            LOCK(cs_smsg);
+            LOCK(SecureMsgBucketLock(fileTime));
             FILE *fp;
             errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            if (!(fp = fopen(fullPath.string().c_str(), "rb")))
             {
                 printf("Error opening file: %s\n", strerror(errno));
                 continue;
@@ -2084,15 +3061,6 @@ bool SecureMsgScanBuckets()
             };
             
             fclose(fp);
-            
-            // -- remove wl file when scanned
-            try {
-                fs::remove((*itd).path());
-            } catch (const boost::filesystem::filesystem_error& ex)
-            {
-                printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
-            };
         };
     };
     
@@ -2126,7 +3094,6 @@ int SecureMsgWalletUnlocked()
     uint32_t nFoundMessages = 0;
     
     fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
     
     if (!fs::exists(pathSmsgDir)
         || !fs::is_directory(pathSmsgDir))
@@ -2138,51 +3105,35 @@ int SecureMsgWalletUnlocked()
     SecureMessage smsg;
     std::vector<unsigned char> vchData;
     
-    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    std::vector<int64_t> vFileTimes;
+    SecureMsgManifestTimes(SMSG_FILE_WL, vFileTimes);
+    BOOST_FOREACH(int64_t fileTime, vFileTimes)
     {
-        if (!fs::is_regular_file(itd->status()))
-            continue;
-        
-        std::string fileName = (*itd).path().filename().string();
-        
-        if (!boost::algorithm::ends_with(fileName, "_wl.dat"))
-            continue;
+        fs::path fullPath = SecureMsgBucketPath(fileTime, "_01_wl.dat");
+        std::string fileName = fullPath.filename().string();
         
         if (fDebugSmsg)
             printf("Processing file: %s.\n", fileName.c_str());
         
         nFiles++;
         
-        // TODO files must be split if > 2GB
-        // time_noFile_wl.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
-        
-        std::string stime = fileName.substr(0, sep);
-        
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
-        
         if (fileTime < now - SMSG_RETENTION)
         {
             printf("Dropping wallet locked file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const boost::filesystem::filesystem_error& ex)
-            {
-                printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
-            };
+            LOCK(SecureMsgBucketLock(fileTime));
+            SecureMsgRemoveBucketFiles(fileTime, SMSG_FILE_WL);
             continue;
         };
         
         {
-            LOCK(cs_smsg);
+            LOCK(SecureMsgBucketLock(fileTime));
             FILE *fp;
             errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            if (!(fp = fopen(fullPath.string().c_str(), "rb")))
             {
                 printf("Error opening file: %s\n", strerror(errno));
+                if (errno == ENOENT)
+                    SecureMsgRemoveBucketFiles(fileTime, SMSG_FILE_WL);
                 continue;
             };
             
@@ -2234,16 +3185,12 @@ int SecureMsgWalletUnlocked()
             fclose(fp);
             
             // -- remove wl file when scanned
-            try {
-                fs::remove((*itd).path());
-            } catch (const boost::filesystem::filesystem_error& ex)
-            {
-                printf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
-            };
+            SecureMsgRemoveBucketFiles(fileTime, SMSG_FILE_WL);
         };
     };
     
+    SecureMsgFlushManifest();
+    
     printf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
     
     // -- notify gui
@@ -2262,7 +3209,7 @@ int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeTy
     // TODO: default recv and recvAnon
     
     {
-        LOCK(cs_smsg);
+        LOCK(cs_smsgAddresses);
         
         switch(mode)
         {
@@ -2282,7 +3229,7 @@ int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeTy
                 break;
         }
         
-    }; // LOCK(cs_smsg);
+    }; // LOCK(cs_smsgAddresses);
     
     
     return 0;
@@ -2323,7 +3270,14 @@ int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32
     MessageData msg; // placeholder
     bool fOwnMessage = false;
     
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    // -- decrypt with a copy, so cs_smsgAddresses isn't held while trying each address
+    std::vector<SecMsgAddress> vAddresses;
+    {
+        LOCK(cs_smsgAddresses);
+        vAddresses = smsgAddresses;
+    }
+    
+    for (std::vector<SecMsgAddress>::iterator it = vAddresses.begin(); it != vAddresses.end(); ++it)
     {
         if (!it->fReceiveEnabled)
             continue;
@@ -2464,6 +3418,7 @@ int SecureMsgGetStoredKey(CKeyID& ckid, CPubKey& cpkOut)
         printf("SecureMsgGetStoredKey().\n");
     
     try {
+        LOCK(cs_smsgAddresses);
         CSmesgPubKeyDB addrpkdb("r");
         
         if (!addrpkdb.ReadPK(ckid, cpkOut))
@@ -2543,7 +3498,7 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char>& vchData)
     if (fDebugSmsg)
         printf("SecureMsgRetrieve() %"PRI64d".\n", token.timestamp);
     
-    // -- has cs_smsg lock from SecureMsgReceiveData
+    // -- has the bucket lock from SecureMsgReceiveData
     
     fs::path pathSmsgDir = GetDataDir() / "smsgStore";
     
@@ -2639,17 +3594,16 @@ int SecureMsgReceive(CNode* pfrom, std::vector<unsigned char>& vchData)
         return 1;
     };
     
-    std::map<int64_t, SecMsgBucket>::iterator itb;
-    
     if (nBunch == 0 || nBunch > 500)
     {
         printf("Error: Invalid no. messages received in bunch %u, for bucket %"PRI64d".\n", nBunch, bktTime);
         pfrom->Misbehaving(1);
         
         // -- release lock on bucket if it exists
-        itb = smsgBuckets.find(bktTime);
-        if (itb != smsgBuckets.end())
-            itb->second.nLockCount = 0;
+        LOCK(SecureMsgBucketLock(bktTime));
+        SecMsgBucket* pbucket = SecureMsgFindBucket(bktTime);
+        if (pbucket)
+            pbucket->nLockCount = 0;
         return 1;
     };
     
@@ -2679,8 +3633,8 @@ int SecureMsgReceive(CNode* pfrom, std::vector<unsigned char>& vchData)
             continue;
         };
         
-        // -- store message, but don't hash bucket
-        if (SecureMsgStore(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, false) != 0)
+        // -- store message
+        if (SecureMsgStore(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload) != 0)
         {
             // message dropped
             break; // continue?
@@ -2695,17 +3649,19 @@ int SecureMsgReceive(CNode* pfrom, std::vector<unsigned char>& vchData)
     };
     
     // -- if messages have been added, bucket must exist now
-    itb = smsgBuckets.find(bktTime);
-    if (itb == smsgBuckets.end())
+    LOCK(SecureMsgBucketLock(bktTime));
+    SecMsgBucket* pbucket = SecureMsgFindBucket(bktTime);
+    if (!pbucket)
     {
         if (fDebugSmsg)
             printf("Don't have bucket %"PRI64d".\n", bktTime);
         return 1;
     };
     
-    itb->second.nLockCount  = 0; // this node has received data from peer, release lock
-    itb->second.nLockPeerId = 0;
-    itb->second.hashBucket();
+    pbucket->nLockCount  = 0; // this node has received data from peer, release lock
+    pbucket->nLockPeerId = 0;
+    
+    SecureMsgWantPending(bktTime, *pbucket);
     
     return 0;
 };
@@ -2755,6 +3711,13 @@ int SecureMsgStoreUnscanned(unsigned char *pHeader, unsigned char *pPayload, uin
     std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01_wl.dat";
     fs::path fullpath = pathSmsgDir / fileName;
     
+    LOCK(SecureMsgBucketLock(bucket));
+    if (!SecureMsgManifestAdd(bucket, SMSG_FILE_WL))
+    {
+        printf("Error: could not add %s to the manifest.\n", fileName.c_str());
+        return 1;
+    };
+    
     FILE *fp;
     errno = 0;
     if (!(fp = fopen(fullpath.string().c_str(), "ab")))
@@ -2777,7 +3740,7 @@ int SecureMsgStoreUnscanned(unsigned char *pHeader, unsigned char *pPayload, uin
 };
 
 
-int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool fUpdateBucket)
+int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload)
 {
     if (fDebugSmsg)
         printf("SecureMsgStore()\n");
@@ -2818,15 +3781,15 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
     int64_t bucket = psmsg->timestamp - (psmsg->timestamp % SMSG_BUCKET_LEN);
     
     {
-        // -- must lock cs_smsg before calling
-        //LOCK(cs_smsg);
+        LOCK(SecureMsgBucketLock(bucket));
         
         SecMsgToken token(psmsg->timestamp, pPayload, nPayload, 0);
         
-        std::set<SecMsgToken>& tokenSet = smsgBuckets[bucket].setTokens;
-        std::set<SecMsgToken>::iterator it;
-        it = tokenSet.find(token);
-        if (it != tokenSet.end())
+        SecMsgBucket& bkt = SecureMsgGetBucket(bucket);
+        if (!SecureMsgLoadBucket(bucket, bkt))
+            return 1;
+        
+        if (bkt.FindToken(token))
         {
             printf("Already have message.\n");
             if (fDebugSmsg)
@@ -2841,7 +3804,7 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
                 printf(" sample %s\n", ValueString(vchShow).c_str());
                 /*
                 printf("\nmessages in bucket:\n");
-                for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
+                for (it = bkt.vTokens.begin(); it != bkt.vTokens.end(); ++it)
                 {
                     printf("message ts: %"PRI64d, (*it).timestamp);
                     vchShow.resize(8);
@@ -2856,6 +3819,12 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
         std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
         fs::path fullpath = pathSmsgDir / fileName;
         
+        if (!SecureMsgManifestAdd(bucket, SMSG_FILE_DAT))
+        {
+            printf("Error: could not add %s to the manifest.\n", fileName.c_str());
+            return 1;
+        };
+        
         FILE *fp;
         errno = 0;
         if (!(fp = fopen(fullpath.string().c_str(), "ab")))
@@ -2875,6 +3844,15 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
         
         ofs = ftell(fp);
         
+        // -- the index keeps 32 bit offsets
+        if (ofs < 0
+            || (uint64_t)ofs + SMSG_HDR_LEN + nPayload > 0xFFFFFFFFULL)
+        {
+            printf("Bucket file %s is full.\n", fileName.c_str());
+            fclose(fp);
+            return 1;
+        };
+        
         if (fwrite(pHeader, sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN
             || fwrite(pPayload, sizeof(unsigned char), nPayload, fp) != nPayload)
         {
@@ -2885,13 +3863,30 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
         
         fclose(fp);
         
-        token.offset = ofs;
+        token.offset = (uint32_t)ofs;
+        
+        //printf("token.offset: %u\n", token.offset); // DEBUG
+        bkt.AddToken(token);
         
-        //printf("token.offset: %"PRI64d"\n", token.offset); // DEBUG
-        tokenSet.insert(token);
+        // -- a bucket that couldn't be indexed stays in memory, the index is rebuilt at startup
+        std::vector<unsigned char> vchRecord(SMSG_INDEX_LEN);
+        SecureMsgIndexRecord(token, SMSG_HDR_LEN + nPayload, &vchRecord[0]);
+        if (SecureMsgWriteIndex(SecureMsgStorePath(), bucket, vchRecord, "ab") != 0)
+        {
+            printf("Error indexing message in bucket %"PRI64d".\n", bucket);
+            bkt.fIndexed = false;
+        };
         
-        if (fUpdateBucket)
-            smsgBuckets[bucket].hashBucket();
+        // -- queue the token to be announced to peers, the oldest are dropped after SMSG_ANNOUNCE_KEEP
+        {
+            LOCK(cs_smsgBuckets);
+            smsgAnnounce.push_back(std::make_pair(now, token));
+            while (smsgAnnounce.front().first < now - SMSG_ANNOUNCE_KEEP)
+            {
+                smsgAnnounce.pop_front();
+                nAnnounceSeqBase++;
+            };
+        }
     };
     
     //if (fDebugSmsg)
@@ -2899,9 +3894,9 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
     return 0;
 };
 
-int SecureMsgStore(SecureMessage& smsg, bool fUpdateBucket)
+int SecureMsgStore(SecureMessage& smsg)
 {
-    return SecureMsgStore(&smsg.hash[0], smsg.pPayload, smsg.nPayload, fUpdateBucket);
+    return SecureMsgStore(&smsg.hash[0], smsg.pPayload, smsg.nPayload);
 };
   
 int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload)
@@ -18,8 +18,23 @@ const unsigned int SMSG_SEND_DELAY      = 2;                 // in seconds, Secu
 const unsigned int SMSG_THREAD_DELAY    = 20;
 
 const unsigned int SMSG_TIME_LEEWAY     = 60;
+const unsigned int SMSG_BUCKET_LOCKS    = SMSG_RETENTION / SMSG_BUCKET_LEN + 4;  // enough for each bucket held to have its own lock
 const unsigned int SMSG_TIME_IGNORE     = 90;                // seconds that a peer is ignored for if they fail to deliver messages for a smsgWant
 
+const unsigned int SMSG_PROTOCOL_VERSION = 2;                // 1: smsgInvTok announcements and smsgRecon bucket sketches
+                                                             // 2: bucket hash in smsgInv is SecMsgBucket::nDigest
+const unsigned int SMSG_ANNOUNCE_KEEP   = 60;                // seconds newly stored tokens stay queued for announcing to peers
+const unsigned int SMSG_MAX_ANNOUNCE    = 1000;              // most tokens in one smsgInvTok
+const unsigned int SMSG_MAX_PENDING     = 4 * SMSG_MAX_ANNOUNCE; // most tokens kept per peer for a locked bucket
+
+const unsigned int SMSG_INDEX_LEN       = 24;                // bytes of each record in a bucket index file, timestamp8 + sample8 + offset4 + size4
+const unsigned int SMSG_DEFAULT_MAXMEM  = 32;                // MB of tokens held in memory, -smsgmaxmem
+const unsigned int SMSG_EXPIRY_SLOTS    = SMSG_RETENTION / SMSG_BUCKET_LEN + 4;  // slots in the expiry wheel, one bucket length each
+
+// files of a bucket listed in the store manifest
+#define SMSG_FILE_DAT               (1 << 0)    // <time>_01.dat and its index <time>_01.idx
+#define SMSG_FILE_WL                (1 << 1)    // <time>_01_wl.dat, messages received while the wallet was locked
+
 
 const unsigned int SMSG_MAX_MSG_BYTES   = 4096;              // the user input part
 
@@ -33,6 +48,7 @@ const unsigned int SMSG_MAX_MSG_WORST = LZ4_COMPRESSBOUND(SMSG_MAX_MSG_BYTES+SMS
 
 
 extern bool fSecMsgEnabled;
+extern uint64_t nSecMsgMaxTokens;
 
 /** Inbox db changed.
  * @note called with lock cs_smsgInbox held.
@@ -55,11 +71,28 @@ extern boost::signals2::signal<void ()> NotifySecMsgWalletUnlocked;
 class SecMsgAddress;
 class SecMsgOptions;
 
+/** Bytes of smsg traffic by command, and how bucket reconciliations went */
+class SecMsgNetStats
+{
+public:
+    SecMsgNetStats()
+    {
+        nReconciled     = 0;
+        nReconFailed    = 0;
+    };
+    
+    std::map<std::string, uint64_t>     mapBytesSent;
+    std::map<std::string, uint64_t>     mapBytesRecv;
+    uint64_t                            nReconciled;    // smsgRecon sketches decoded
+    uint64_t                            nReconFailed;   // smsgRecon sketches answered with the whole bucket
+};
+
 extern std::map<int64_t, SecMsgBucket>  smsgBuckets;
 extern std::vector<SecMsgAddress>       smsgAddresses;
 extern SecMsgOptions                    smsgOptions;
 
-extern CCriticalSection cs_smsg;            // all except inbox and outbox
+extern CCriticalSection cs_smsgBuckets;     // which buckets are in smsgBuckets, and the announce queue
+extern CCriticalSection cs_smsgAddresses;   // smsgAddresses, smsgOptions and the public key db
 extern CCriticalSection cs_smsgInbox;
 extern CCriticalSection cs_smsgOutbox;
 extern CCriticalSection cs_smsgSendQueue;
@@ -377,6 +410,37 @@ std::string getTimeString(int64_t timestamp, char *buffer, size_t nBuffer);
 std::string fsReadable(uint64_t nBytes);
 
 
+class SecMsgExpiryWheel
+{
+// -- buckets due to expire, by bucket time, slot is (time / SMSG_BUCKET_LEN) % SMSG_EXPIRY_SLOTS
+public:
+    SecMsgExpiryWheel()
+    {
+        nNext = 0;
+    };
+    
+    void Schedule(int64_t bucketTime);
+    void TakeExpired(int64_t cutoffTime, std::vector<int64_t>& vExpired);
+    void Clear();
+    
+    std::set<int64_t>           slots[SMSG_EXPIRY_SLOTS];
+    int64_t                     nNext;          // bucket time of the first slot not yet expired
+};
+
+
+CCriticalSection& SecureMsgBucketLock(int64_t bucketTime);
+SecMsgBucket* SecureMsgFindBucket(int64_t bucketTime);
+void SecureMsgGetBucketTimes(std::vector<int64_t>& vTimes);
+void SecureMsgEraseBucket(int64_t bucketTime);
+void SecureMsgRemoveBucketFiles(int64_t bucketTime, uint32_t nFlags);
+
+int SecureMsgWriteManifest(const boost::filesystem::path& pathStore, const std::map<int64_t, uint32_t>& mapFiles);
+int SecureMsgReadManifest(const boost::filesystem::path& pathStore, std::map<int64_t, uint32_t>& mapFiles);
+int SecureMsgListStore(const boost::filesystem::path& pathStore, std::map<int64_t, uint32_t>& mapFiles);
+int SecureMsgReadIndex(const boost::filesystem::path& pathStore, int64_t bucketTime, std::vector<SecMsgToken>& vTokens, uint64_t& nDataEnd);
+int SecureMsgIndexBucketFile(const boost::filesystem::path& pathStore, int64_t bucketTime, std::vector<SecMsgToken>& vTokens);
+int SecureMsgLoadBucketFile(const boost::filesystem::path& pathStore, int64_t bucketTime, std::vector<SecMsgToken>& vTokens);
+
 int SecureMsgBuildBucketSet();
 int SecureMsgAddWalletAddresses();
 
@@ -391,6 +455,7 @@ bool SecureMsgDisable();
 
 bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRecv);
 bool SecureMsgSendData(CNode* pto, bool fSendTrickle);
+void SecureMsgGetNetStats(SecMsgNetStats& stats);
 
 
 bool SecureMsgScanBlock(CBlock& block);
@@ -415,8 +480,8 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char>& vchData);
 int SecureMsgReceive(CNode* pfrom, std::vector<unsigned char>& vchData);
 
 int SecureMsgStoreUnscanned(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload);
-int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool fUpdateBucket);
-int SecureMsgStore(SecureMessage& smsg, bool fUpdateBucket);
+int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload);
+int SecureMsgStore(SecureMessage& smsg);
 
 
 
@@ -54,10 +54,12 @@ public:
 };
 
 
+// -- tokens are kept for every message held, pack them to 20 bytes
+#pragma pack(push, 4)
 class SecMsgToken
 {
 public:
-    SecMsgToken(int64_t ts, unsigned char* p, int np, long int o)
+    SecMsgToken(int64_t ts, unsigned char* p, int np, uint32_t o)
     {
         timestamp = ts;
         
@@ -80,11 +82,18 @@ public:
         return timestamp < y.timestamp;
     }
     
+    bool operator ==(const SecMsgToken & y) const
+    {
+        return timestamp == y.timestamp
+            && memcmp(sample, y.sample, 8) == 0;
+    }
+    
     int64_t                     timestamp;    // doesn't need to be full 64 bytes?
     unsigned char               sample[8];    // first 8 bytes of payload - a hash
-    int64_t                     offset;       // offset
+    uint32_t                    offset;       // offset in the bucket file, which is kept under 4GB
     
 };
+#pragma pack(pop)
 
 
 class SecMsgBucket
@@ -93,19 +102,37 @@ public:
     SecMsgBucket()
     {
         timeChanged     = 0;
+        nDigest         = 0;
         hash            = 0;
+        fHashStale      = false;
+        nTokens         = 0;
+        fLoaded         = true;
+        fIndexed        = true;
+        nLastUsed       = 0;
         nLockCount      = 0;
         nLockPeerId     = 0;
     };
     ~SecMsgBucket() {};
     
+    bool AddToken(const SecMsgToken& token);
+    const SecMsgToken* FindToken(const SecMsgToken& token) const;
+    uint32_t size() const { return nTokens; };
+    uint32_t GetHash(uint32_t nPeerVersion);
     void hashBucket();
+    bool Unload();
     
     int64_t                     timeChanged;
-    uint32_t                    hash;           // token set should get ordered the same on each node
+    uint32_t                    nDigest;        // sum of the hashes of each token, updated as tokens are added
+    uint32_t                    hash;           // token set should get ordered the same on each node, for peers before smsg version 2
+    bool                        fHashStale;     // tokens were added since hash was computed
     uint32_t                    nLockCount;     // set when smsgWant first sent, unset at end of smsgMsg, ticks down in ThreadSecureMsg()
     uint32_t                    nLockPeerId;    // id of peer that bucket is locked for
-    std::set<SecMsgToken>       setTokens;
+    std::map<uint32_t, std::vector<unsigned char> > mapPending; // peer id, tokens the peer offered while the bucket was locked
+    uint32_t                    nTokens;        // no. of messages, kept while vTokens is unloaded
+    bool                        fLoaded;        // vTokens is in memory, else it's read from the bucket's index file when needed
+    bool                        fIndexed;       // the index file holds every token, the bucket can be unloaded
+    int64_t                     nLastUsed;      // when vTokens was last needed, least recently used buckets are unloaded first
+    std::vector<SecMsgToken>    vTokens;        // sorted
     
 };
 
@@ -121,6 +148,8 @@ public:
         ignoreUntil     = 0;
         nWakeCounter    = 0;
         nPeerId         = 0;
+        nVersion        = 0;
+        nAnnounceSeq    = 0;
         fEnabled        = false;
     };
     
@@ -131,6 +160,9 @@ public:
     int64_t                     ignoreUntil;
     uint32_t                    nWakeCounter;
     uint32_t                    nPeerId;
+    uint32_t                    nVersion;       // smsg protocol version the peer sent in smsgPong
+    uint64_t                    nAnnounceSeq;   // next newly stored token to announce to the peer
+    std::set<int64_t>           setInvBuckets;  // buckets in the last smsgInv sent, the peer may answer each with one smsgRecon
     bool                        fEnabled;
     
 };
@@ -0,0 +1,202 @@
+// Copyright (c) 2014 The CinniCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "emessagesketch.h"
+
+// Every token goes into one cell of each third of the table
+static const uint32_t SKETCH_HASHES = 3;
+
+
+static uint64_t ReadLE64(const unsigned char* p)
+{
+    uint64_t n = 0;
+    for (int i = 7; i >= 0; --i)
+        n = (n << 8) | p[i];
+    return n;
+}
+
+static void WriteLE32(unsigned char* p, uint32_t n)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = n >> (8 * i);
+}
+
+static uint32_t ReadLE32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t SketchHash(const unsigned char* pToken, uint64_t nSeed)
+{
+    // -- tokens are a timestamp and part of a payload hash, a few rounds of
+    //    mixing are enough to spread them over the cells
+    uint64_t h = nSeed * 0x9e3779b97f4a7c15ULL;
+    h ^= ReadLE64(pToken);
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h ^= ReadLE64(pToken + 8);
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint32_t SketchCheck(const unsigned char* pToken)
+{
+    return (uint32_t) SketchHash(pToken, SKETCH_HASHES + 1);
+}
+
+
+SecMsgSketch::SecMsgSketch(uint32_t nCellsIn)
+{
+    nCellsIn = ((nCellsIn + SKETCH_HASHES - 1) / SKETCH_HASHES) * SKETCH_HASHES;
+    Cell cell;
+    memset(&cell, 0, sizeof(cell));
+    vCells.assign(nCellsIn, cell);
+}
+
+uint32_t SecMsgSketch::CellsFor(uint32_t nDiff)
+{
+    if (nDiff > SMSG_SKETCH_MAX_CELLS)
+        return SMSG_SKETCH_MAX_CELLS;
+    uint32_t nCells = 2 * nDiff + 12;
+    nCells = ((nCells + SKETCH_HASHES - 1) / SKETCH_HASHES) * SKETCH_HASHES;
+    return nCells < SMSG_SKETCH_MAX_CELLS ? nCells : SMSG_SKETCH_MAX_CELLS;
+}
+
+uint32_t SecMsgSketch::CellIndex(const unsigned char* pToken, uint32_t nHash) const
+{
+    uint32_t nPart = vCells.size() / SKETCH_HASHES;
+    return nHash * nPart + SketchHash(pToken, nHash + 1) % nPart;
+}
+
+bool SecMsgSketch::IsPure(uint32_t nCell) const
+{
+    const Cell& cell = vCells[nCell];
+    return (cell.count == 1 || cell.count == -1)
+        && cell.check == SketchCheck(cell.key);
+}
+
+void SecMsgSketch::Update(const unsigned char* pToken, int32_t nDelta)
+{
+    if (vCells.empty())
+        return;
+    uint32_t check = SketchCheck(pToken);
+    for (uint32_t i = 0; i < SKETCH_HASHES; ++i)
+    {
+        Cell& cell = vCells[CellIndex(pToken, i)];
+        cell.count += nDelta;
+        for (uint32_t k = 0; k < SMSG_TOKEN_LEN; ++k)
+            cell.key[k] ^= pToken[k];
+        cell.check ^= check;
+    };
+}
+
+void SecMsgSketch::Insert(const unsigned char* pToken)
+{
+    Update(pToken, 1);
+}
+
+void SecMsgSketch::Erase(const unsigned char* pToken)
+{
+    Update(pToken, -1);
+}
+
+bool SecMsgSketch::Subtract(const SecMsgSketch& other)
+{
+    if (other.vCells.size() != vCells.size())
+        return false;
+    for (uint32_t i = 0; i < vCells.size(); ++i)
+    {
+        vCells[i].count -= other.vCells[i].count;
+        for (uint32_t k = 0; k < SMSG_TOKEN_LEN; ++k)
+            vCells[i].key[k] ^= other.vCells[i].key[k];
+        vCells[i].check ^= other.vCells[i].check;
+    };
+    return true;
+}
+
+bool SecMsgSketch::Decode(std::vector<unsigned char>& vchOnlyHere, std::vector<unsigned char>& vchOnlyThere) const
+{
+    vchOnlyHere.clear();
+    vchOnlyThere.clear();
+
+    SecMsgSketch sketch(*this);
+
+    // -- peel from a worklist of pure cells, taking a token out only changes
+    //    its own cells so only those need looking at again
+    std::vector<uint32_t> vPure;
+    for (uint32_t i = 0; i < sketch.vCells.size(); ++i)
+        if (sketch.IsPure(i))
+            vPure.push_back(i);
+
+    uint32_t nPeeled = 0;
+    while (!vPure.empty())
+    {
+        uint32_t nCell = vPure.back();
+        vPure.pop_back();
+        if (!sketch.IsPure(nCell))
+            continue;
+
+        // -- a valid difference can't have more tokens than cells, a crafted sketch could peel on
+        if (++nPeeled > sketch.vCells.size())
+            return false;
+
+        // -- a pure cell holds one token, take it out of all its cells
+        const Cell& cell = sketch.vCells[nCell];
+        int32_t count = cell.count;
+        unsigned char token[SMSG_TOKEN_LEN];
+        memcpy(token, cell.key, SMSG_TOKEN_LEN);
+        std::vector<unsigned char>& vchOut = count == 1 ? vchOnlyHere : vchOnlyThere;
+        vchOut.insert(vchOut.end(), token, token + SMSG_TOKEN_LEN);
+        sketch.Update(token, -count);
+
+        for (uint32_t i = 0; i < SKETCH_HASHES; ++i)
+        {
+            uint32_t nTouched = sketch.CellIndex(token, i);
+            if (sketch.IsPure(nTouched))
+                vPure.push_back(nTouched);
+        };
+    };
+
+    for (uint32_t i = 0; i < sketch.vCells.size(); ++i)
+    {
+        const Cell& cell = sketch.vCells[i];
+        if (cell.count != 0 || cell.check != 0)
+            return false;
+        for (uint32_t k = 0; k < SMSG_TOKEN_LEN; ++k)
+            if (cell.key[k] != 0)
+                return false;
+    };
+    return true;
+}
+
+void SecMsgSketch::Write(std::vector<unsigned char>& vchData) const
+{
+    uint32_t nStart = vchData.size();
+    vchData.resize(nStart + vCells.size() * SMSG_SKETCH_CELL_LEN);
+    unsigned char* p = &vchData[nStart];
+    for (uint32_t i = 0; i < vCells.size(); ++i, p += SMSG_SKETCH_CELL_LEN)
+    {
+        WriteLE32(p, (uint32_t)vCells[i].count);
+        memcpy(p + 4, vCells[i].key, SMSG_TOKEN_LEN);
+        WriteLE32(p + 4 + SMSG_TOKEN_LEN, vCells[i].check);
+    };
+}
+
+bool SecMsgSketch::Read(const unsigned char* p, uint32_t nCellsIn)
+{
+    if (nCellsIn == 0
+        || nCellsIn % SKETCH_HASHES != 0
+        || nCellsIn > SMSG_SKETCH_MAX_CELLS)
+        return false;
+
+    vCells.resize(nCellsIn);
+    for (uint32_t i = 0; i < nCellsIn; ++i, p += SMSG_SKETCH_CELL_LEN)
+    {
+        vCells[i].count = (int32_t)ReadLE32(p);
+        memcpy(vCells[i].key, p + 4, SMSG_TOKEN_LEN);
+        vCells[i].check = ReadLE32(p + 4 + SMSG_TOKEN_LEN);
+    };
+    return true;
+}
@@ -0,0 +1,69 @@
+// Copyright (c) 2014 The CinniCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef CINNICOIN_EMESSAGE_SKETCH_H
+#define CINNICOIN_EMESSAGE_SKETCH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// length of a token on the wire, timestamp8 + sample8
+const unsigned int SMSG_TOKEN_LEN = 16;
+
+// bytes of one sketch cell on the wire, count4 + key16 + check4
+const unsigned int SMSG_SKETCH_CELL_LEN = 4 + SMSG_TOKEN_LEN + 4;
+
+// most cells a peer may send for one bucket
+const unsigned int SMSG_SKETCH_MAX_CELLS = 3 * 4096;
+
+
+/** Invertible bloom lookup table over the tokens of a bucket.
+ *
+ * Two nodes with sketches of the same size over their copies of a bucket
+ * subtract one from the other, what is left are the tokens only one of them
+ * has. These decode as long as the difference is small for the number of
+ * cells, so a bucket that differs in a few messages is reconciled by sending
+ * a sketch sized for the difference instead of every token in it.
+ */
+class SecMsgSketch
+{
+public:
+    class Cell
+    {
+    public:
+        int32_t         count;
+        unsigned char   key[SMSG_TOKEN_LEN];
+        uint32_t        check;
+    };
+
+    SecMsgSketch(uint32_t nCellsIn = 0);
+
+    // Cells needed to decode about nDiff differences
+    static uint32_t CellsFor(uint32_t nDiff);
+
+    uint32_t size() const { return vCells.size(); }
+
+    void Insert(const unsigned char* pToken);
+    void Erase(const unsigned char* pToken);
+
+    // this -= other, both must have the same number of cells
+    bool Subtract(const SecMsgSketch& other);
+
+    // Peel the difference into the tokens with a positive count (only in
+    // this sketch) and a negative count (only in the one subtracted).
+    // Returns false if some cells could not be peeled.
+    bool Decode(std::vector<unsigned char>& vchOnlyHere, std::vector<unsigned char>& vchOnlyThere) const;
+
+    void Write(std::vector<unsigned char>& vchData) const;
+    bool Read(const unsigned char* p, uint32_t nCellsIn);
+
+private:
+    std::vector<Cell> vCells;
+
+    uint32_t CellIndex(const unsigned char* pToken, uint32_t nHash) const;
+    bool IsPure(uint32_t nCell) const;
+    void Update(const unsigned char* pToken, int32_t nDelta);
+};
+
+#endif // CINNICOIN_EMESSAGE_SKETCH_H
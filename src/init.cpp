@@ -11,12 +11,17 @@
 #include "ui_interface.h"
 #include "checkpoints.h"
 #include "emessage.h"
+#include "pubnotify.h"
+#include "compactblock.h"
+#include "kernelhash.h"
+#include "blockcache.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/convenience.hpp>
 #include <boost/interprocess/sync/file_lock.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/join.hpp>
 #include <openssl/crypto.h>
 
 #ifndef WIN32
@@ -81,6 +86,7 @@ void Shutdown(void* parg)
         bitdb.Flush(false);
         StopNode();
         bitdb.Flush(true);
+        CloseBlockFileMappings();
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
         delete pwalletMain;
@@ -232,12 +238,18 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -maxsigcachesize=<n>   " + _("Limit the signature cache to <n> megabytes, not entries as in earlier versions (default: 32)") + "\n" +
+        "  -blockcachesize=<n>    " + _("Keep up to <n> megabytes of recent blocks in memory for reorganizations (default: 16)") + "\n" +
+        "  -ecverify=<name>       " + _("ECDSA signature verification backend:") + " " + boost::algorithm::join(GetECVerifierNames(), ", ") + " " + _("(default: first)") + "\n" +
+        "  -kernelhash=<name>     " + _("Stake kernel hashing backend:") + " " + boost::algorithm::join(GetKernelHasherNames(), ", ") + " " + _("(default: first)") + "\n" +
+        "  -merklehash=<name>     " + _("Merkle tree hashing backend:") + " " + boost::algorithm::join(GetMerkleHasherNames(), ", ") + " " + _("(default: first)") + "\n" +
+        "  -blockfilemmap         " + _("Read blocks and transactions from memory mapped block files (default: 1)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
         "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n"
         "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n" +
-        "  -port=<port>           " + _("Listen for connections on <port> (default: 31813 or testnet: 31814)") + "\n" +
+        "  -port=<port>           " + _("Listen for connections on <port> (default: 31813, testnet: 31814 or regtest: 31815)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
@@ -250,6 +262,7 @@ std::string HelpMessage()
         "  -bind=<addr>           " + _("Bind to given address. Use [host]:port notation for IPv6") + "\n" +
         "  -dnsseed               " + _("Find peers using DNS lookup (default: 0)") + "\n" +
         "  -nosynccheckpoints     " + _("Disable sync checkpoints (default: 0)") + "\n" +
+        "  -compactblocks         " + _("Relay new blocks as compact blocks to peers that support them (default: 1)") + "\n" +
         "  -banscore=<n>          " + _("Threshold for disconnecting misbehaving peers (default: 100)") + "\n" +
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
@@ -270,6 +283,7 @@ std::string HelpMessage()
         "  -daemon                " + _("Run in the background as a daemon and accept commands") + "\n" +
 #endif
         "  -testnet               " + _("Use the test network") + "\n" +
+        "  -regtest               " + _("Use a private test chain whose blocks can be generated instantly") + "\n" +
         "  -debug                 " + _("Output extra debugging information. Implies all other -debug* options") + "\n" +
         "  -debugnet              " + _("Output extra network debugging information") + "\n" +
         "  -logtimestamps         " + _("Prepend debug output with timestamp") + "\n" +
@@ -280,18 +294,30 @@ std::string HelpMessage()
 #endif
         "  -rpcuser=<user>        " + _("Username for JSON-RPC connections") + "\n" +
         "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n" +
-        "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 31812 or testnet: 31814)") + "\n" +
+        "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 31814, testnet: 31812 or regtest: 31816)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
+        "  -pubnotify=<port>      " + _("Publish block and transaction notifications to clients on 127.0.0.1:<port>") + "\n" +
+#ifndef WIN32
+        "  -pubnotifyunix=<path>  " + _("Publish notifications on the Unix domain socket <path>") + "\n" +
+#endif
+        "  -pubnotifyraw          " + _("Include serialized blocks and transactions in notifications (default: 0)") + "\n" +
+        "  -pubnotifybuffer=<n>   " + _("Maximum bytes of notifications queued per client before dropping them (default: 16777216)") + "\n" +
 		"  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
+        "  -keypoolmin=<n>        " + _("Refill the key pool in the background when fewer than <n> keys are left (default: half of -keypool)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
+        "  -walletverify          " + _("Fully verify every private key when loading the wallet") + "\n" +
+        "  -addressindex          " + _("Maintain an index of the transactions and unspent outputs of every address (default: 0)") + "\n" +
+        "  -spentindex            " + _("Maintain an index of which input spent each output (default: 0)") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
+        "  -assumevalid=<hex>     " + _("Skip signature checks for ancestors of this checkpoint block, 0 to check all (default: last checkpoint)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
+        "  -importbatch=<n>       " + _("Commit imported blocks to disk every <n> blocks (default: 500)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -307,6 +333,7 @@ std::string HelpMessage()
         "\n" + _("Secure messaging options:") + "\n" +
         "  -nosmsg                                  " + _("Disable secure messaging.") + "\n" +
         "  -debugsmsg                               " + _("Log extra debug messages.") + "\n" +
+        "  -smsgmaxmem=<n>                          " + _("Keep at most <n> MB of message tokens in memory (default: 32)") + "\n" +
         "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n";
 
     return strUsage;
@@ -366,6 +393,17 @@ bool AppInit2()
         SoftSetBoolArg("-irc", true);
     }
 
+    // a private chain for local tests: it shares the testnet genesis block and
+    // addresses but never looks for peers on its own
+    fRegTest = GetBoolArg("-regtest");
+    if (fRegTest) {
+        fTestNet = true;
+        SoftSetBoolArg("-irc", false);
+        SoftSetBoolArg("-dnsseed", false);
+        SoftSetBoolArg("-discover", false);
+        SoftSetBoolArg("-upnp", false);
+    }
+
     if (mapArgs.count("-bind")) {
         // when specifying an explicit binding address, you want to listen on it
         // even when -connect or -proxy is specified
@@ -414,8 +452,23 @@ bool AppInit2()
         fDebugSmsg = GetBoolArg("-debugsmsg");
     }
     fNoSmsg = GetBoolArg("-nosmsg");
+    nSecMsgMaxTokens = std::max((int64)1, GetArg("-smsgmaxmem", SMSG_DEFAULT_MAXMEM)) * 1024 * 1024 / sizeof(SecMsgToken);
     
     bitdb.SetDetach(GetBoolArg("-detachdb", false));
+    fBlockFileMmap = GetBoolArg("-blockfilemmap", true);
+    fCompactBlocks = GetBoolArg("-compactblocks", true);
+
+    hashAssumeValid = Checkpoints::GetLatestHardenedCheckpoint();
+    if (mapArgs.count("-assumevalid"))
+    {
+        // Without headers first sync a block is only known once it has been
+        // downloaded, so only a checkpoint can say which blocks lead to it
+        hashAssumeValid.SetHex(mapArgs["-assumevalid"]);
+        if (hashAssumeValid != 0 && Checkpoints::GetCheckpointHeight(hashAssumeValid) < 0)
+            return InitError(strprintf(_("-assumevalid must be 0 or the hash of a checkpoint: '%s'"), mapArgs["-assumevalid"].c_str()));
+    }
+    if (hashAssumeValid != 0)
+        printf("Assuming ancestors of block %s have valid signatures\n", hashAssumeValid.ToString().c_str());
 
 #if !defined(WIN32) && !defined(QT_GUI)
     fDaemon = GetBoolArg("-daemon");
@@ -458,6 +511,35 @@ bool AppInit2()
             InitWarning(_("Warning: -paytxfee is set very high! This is the transaction fee you will pay if you send a transaction."));
     }
 
+    // -maxsigcachesize used to be an entry count (default 50000). Anything
+    // too large to be megabytes is most likely one of those.
+    if (GetArg("-maxsigcachesize", CSignatureCache::DEFAULT_CACHE_MB) > CSignatureCache::MAX_CACHE_MB)
+    {
+        InitWarning(strprintf(_("Warning: -maxsigcachesize is now in megabytes, ignoring %s and using the default of %d MB."),
+                              mapArgs["-maxsigcachesize"].c_str(), (int)CSignatureCache::DEFAULT_CACHE_MB));
+        mapArgs["-maxsigcachesize"] = strprintf("%d", (int)CSignatureCache::DEFAULT_CACHE_MB);
+    }
+
+    if (mapArgs.count("-ecverify"))
+    {
+        if (!SelectECVerifier(mapArgs["-ecverify"]))
+            return InitError(strprintf(_("Unknown -ecverify backend: '%s'"), mapArgs["-ecverify"].c_str()));
+    }
+
+    if (mapArgs.count("-kernelhash"))
+    {
+        if (!SelectKernelHasher(mapArgs["-kernelhash"]))
+            return InitError(strprintf(_("Unknown -kernelhash backend: '%s'"), mapArgs["-kernelhash"].c_str()));
+    }
+
+    if (mapArgs.count("-merklehash"))
+    {
+        if (!SelectMerkleHasher(mapArgs["-merklehash"]))
+            return InitError(strprintf(_("Unknown -merklehash backend: '%s'"), mapArgs["-merklehash"].c_str()));
+    }
+
+    blockCache.SetMaxSize(std::max((int64)0, GetArg("-blockcachesize", 16)) * 1024 * 1024);
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     std::string strDataDir = GetDataDir().string();
@@ -497,6 +579,7 @@ bool AppInit2()
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("CinniCoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    printf("Using ECDSA verifier %s\n", GetSelectedECVerifier()->GetName());
     if (!fLogTimestamps)
         printf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
@@ -701,6 +784,13 @@ bool AppInit2()
     }
     printf(" block index %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    nAddressIndexFlags = (GetBoolArg("-addressindex") ? INDEX_ADDRESS : 0) |
+                         (GetBoolArg("-spentindex") ? INDEX_SPENT : 0);
+    if (!InitAddressIndex())
+        return InitError(_("Error initializing the address index"));
+    if (nAddressIndexFlags && !NewThread(ThreadBuildAddressIndex, NULL))
+        printf("Error: NewThread(ThreadBuildAddressIndex) failed\n");
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -877,6 +967,10 @@ bool AppInit2()
     if (!NewThread(StartNode, NULL))
         InitError(_("Error: could not start node"));
 
+    std::string strPubNotifyError;
+    if (!StartPubNotify(strPubNotifyError))
+        return InitError(strPubNotifyError);
+
     if (fServer)
         NewThread(ThreadRPCServer, NULL);
 
@@ -5,6 +5,7 @@
 #include <boost/assign/list_of.hpp>
 
 #include "kernel.h"
+#include "kernelhash.h"
 #include "db.h"
 
 using namespace std;
@@ -37,6 +38,79 @@ static bool GetLastStakeModifier(const CBlockIndex* pindex, uint64& nStakeModifi
     return true;
 }
 
+// Stake modifier index: modifier generating blocks of the main chain in
+// height order, each with the latest timestamp up to it. Timestamps are not
+// monotonic, the running maximum is what makes them binary searchable.
+struct CStakeModifierIndexEntry
+{
+    const CBlockIndex* pindex;
+    int64 nMaxTime;
+};
+
+static CCriticalSection cs_vStakeModifierIndex;
+static vector<CStakeModifierIndexEntry> vStakeModifierIndex;
+
+static bool StakeModifierHeightLess(int nHeight, const CStakeModifierIndexEntry& entry)
+{
+    return nHeight < entry.pindex->nHeight;
+}
+
+static bool StakeModifierMaxTimeLess(const CStakeModifierIndexEntry& entry, int64 nTime)
+{
+    return entry.nMaxTime < nTime;
+}
+
+void AddToStakeModifierIndex(const CBlockIndex* pindex)
+{
+    if (!pindex->GeneratedStakeModifier())
+        return;
+    LOCK(cs_vStakeModifierIndex);
+    while (!vStakeModifierIndex.empty() && vStakeModifierIndex.back().pindex->nHeight >= pindex->nHeight)
+        vStakeModifierIndex.pop_back();
+    CStakeModifierIndexEntry entry;
+    entry.pindex = pindex;
+    entry.nMaxTime = pindex->GetBlockTime();
+    if (!vStakeModifierIndex.empty())
+        entry.nMaxTime = max(entry.nMaxTime, vStakeModifierIndex.back().nMaxTime);
+    vStakeModifierIndex.push_back(entry);
+}
+
+void RewindStakeModifierIndex(int nHeight)
+{
+    LOCK(cs_vStakeModifierIndex);
+    while (!vStakeModifierIndex.empty() && vStakeModifierIndex.back().pindex->nHeight > nHeight)
+        vStakeModifierIndex.pop_back();
+}
+
+void BuildStakeModifierIndex(const CBlockIndex* pindexGenesis)
+{
+    RewindStakeModifierIndex(-1);
+    for (const CBlockIndex* pindex = pindexGenesis; pindex; pindex = pindex->pnext)
+        AddToStakeModifierIndex(pindex);
+}
+
+const CBlockIndex* FindStakeModifierBlock(int nHeight, int64 nTime)
+{
+    LOCK(cs_vStakeModifierIndex);
+    vector<CStakeModifierIndexEntry>::const_iterator begin = vStakeModifierIndex.begin(), end = vStakeModifierIndex.end();
+    vector<CStakeModifierIndexEntry>::const_iterator it = upper_bound(begin, end, nHeight, StakeModifierHeightLess);
+    if (it == end)
+        return NULL;
+
+    // A block below nHeight carrying a later timestamp hides the answer
+    // from the running maximum, look at each block instead
+    if (it != begin && (it - 1)->nMaxTime >= nTime)
+    {
+        for (; it != end; ++it)
+            if (it->pindex->GetBlockTime() >= nTime)
+                return it->pindex;
+        return NULL;
+    }
+
+    it = lower_bound(it, end, nTime, StakeModifierMaxTimeLess);
+    return it == end ? NULL : it->pindex;
+}
+
 // Get selection interval section (in seconds)
 static int64 GetStakeModifierSelectionIntervalSection(int nSection)
 {
@@ -219,11 +293,15 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier
     int64 nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
     const CBlockIndex* pindex = pindexFrom;
 
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+    // find the stake modifier later by a selection interval
+    if (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
     {
-        if (!pindex->pnext)
+        // pnext is only set below the best block of the main chain
+        if (pindexFrom->pnext)
+            pindex = FindStakeModifierBlock(pindexFrom->nHeight, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval);
+        if (!pindex || !pindexFrom->pnext)
         {   // reached best block; may happen if node is behind on block chain
+            pindex = pindexFrom->pnext ? pindexBest : pindexFrom;
             if (fPrintProofOfStake || (pindex->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
                 return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
                     pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, hashBlockFrom.ToString().c_str());
@@ -234,12 +312,8 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier
                 return false;
             }
         }
-        pindex = pindex->pnext;
-        if (pindex->GeneratedStakeModifier())
-        {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
-        }
+        nStakeModifierHeight = pindex->nHeight;
+        nStakeModifierTime = pindex->GetBlockTime();
     }
     nStakeModifier = pindex->nStakeModifier;
     return true;
@@ -344,6 +418,61 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+bool FindStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nTimeTxFound, uint256& hashProofOfStake)
+{
+    // Timestamps only get older, stop at the first too old to stake
+    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+    vector<unsigned int> vTimeTx;
+    for (unsigned int n = 0; n < nSearchInterval && n <= nTimeTx; n++)
+    {
+        unsigned int nTime = nTimeTx - n;
+        if (nTime < txPrev.nTime || nTimeBlockFrom + nStakeMinAge > nTime)
+            break;
+        vTimeTx.push_back(nTime);
+    }
+    if (vTimeTx.empty())
+        return false;
+
+    uint64 nStakeModifier = 0;
+    int nStakeModifierHeight = 0;
+    int64 nStakeModifierTime = 0;
+    if (!GetKernelStakeModifier(blockFrom.GetHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false))
+        return false;
+
+    // Same layout CheckStakeKernelHash serializes
+    vector<unsigned char> vKernels(vTimeTx.size() * STAKE_KERNEL_SIZE);
+    for (unsigned int i = 0; i < vTimeTx.size(); i++)
+    {
+        unsigned char* p = &vKernels[i * STAKE_KERNEL_SIZE];
+        memcpy(p, &nStakeModifier, 8);
+        memcpy(p + 8, &nTimeBlockFrom, 4);
+        memcpy(p + 12, &nTxPrevOffset, 4);
+        memcpy(p + 16, &txPrev.nTime, 4);
+        memcpy(p + 20, &prevout.n, 4);
+        memcpy(p + 24, &vTimeTx[i], 4);
+    }
+    vector<uint256> vHash(vTimeTx.size());
+    HashStakeKernels(&vKernels[0], vTimeTx.size(), &vHash[0]);
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    int64 nValueIn = txPrev.vout[prevout.n].nValue;
+    for (unsigned int i = 0; i < vTimeTx.size(); i++)
+    {
+        int64 nTimeWeight = min((int64)vTimeTx[i] - txPrev.nTime, (int64)nStakeMaxAge) - nStakeMinAge;
+        CBigNum bnCoinDayWeight = CBigNum(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
+        if (CBigNum(vHash[i]) > bnCoinDayWeight * bnTargetPerCoinDay)
+            continue;
+
+        // Confirm with the reference implementation before staking on it
+        if (!CheckStakeKernelHash(nBits, blockFrom, nTxPrevOffset, txPrev, prevout, vTimeTx[i], hashProofOfStake) || hashProofOfStake != vHash[i])
+            return error("FindStakeKernelHash() : %s kernel hash mismatch", GetSelectedKernelHasher()->GetName());
+        nTimeTxFound = vTimeTx[i];
+        return true;
+    }
+    return false;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake)
 {
@@ -17,10 +17,26 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Index of the main chain blocks that generated a stake modifier, kept in
+// step with the pnext links so that finding the modifier of a kernel is a
+// binary search instead of a walk along the chain
+void AddToStakeModifierIndex(const CBlockIndex* pindex);
+void RewindStakeModifierIndex(int nHeight);
+void BuildStakeModifierIndex(const CBlockIndex* pindexGenesis);
+
+// First main chain block above nHeight that generated a stake modifier with
+// a timestamp of at least nTime, NULL if there is none yet
+const CBlockIndex* FindStakeModifierBlock(int nHeight, int64 nTime);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, bool fPrintProofOfStake=false);
 
+// Check the stake kernels of one coin for the timestamps nTimeTx down to
+// nTimeTx - nSearchInterval + 1, hashing them all in one batch. Sets
+// nTimeTxFound and hashProofOfStake to the latest timestamp meeting the target.
+bool FindStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nTimeTxFound, uint256& hashProofOfStake);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake);
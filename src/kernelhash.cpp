@@ -0,0 +1,100 @@
+// Copyright (c) 2012-2013 The PPCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kernelhash.h"
+#include "sha256lanes.h"
+
+using namespace std;
+
+template<typename V, int N>
+static inline __attribute__((always_inline)) void HashKernelLanes(const unsigned char* pkernels, uint256* phash)
+{
+    V s[8], w[16];
+
+    // First block: the kernel and its padding
+    for (int i = 0; i < 7; i++)
+        SHA256LoadLanes<V, N>(w[i], pkernels, STAKE_KERNEL_SIZE, i);
+    w[7] = SHA256_SPLAT(V, 0x80000000);
+    for (int i = 8; i < 15; i++)
+        w[i] = SHA256_SPLAT(V, 0);
+    w[15] = SHA256_SPLAT(V, STAKE_KERNEL_SIZE * 8);
+    for (int i = 0; i < 8; i++)
+        s[i] = SHA256_SPLAT(V, SHA256_IV[i]);
+    SHA256TransformLanes(s, w);
+
+    // Second block: the first hash and its padding
+    SHA256DFinishLanes<V, N>(s, phash);
+}
+
+static void HashKernels1(const unsigned char* pkernels, uint256* phash)
+{
+    HashKernelLanes<unsigned int, 1>(pkernels, phash);
+}
+
+#ifdef USE_SHA256_X86
+__attribute__((target("sse4.1"))) static void HashKernels4(const unsigned char* pkernels, uint256* phash)
+{
+    HashKernelLanes<v4u32, 4>(pkernels, phash);
+}
+
+__attribute__((target("avx2"))) static void HashKernels8(const unsigned char* pkernels, uint256* phash)
+{
+    HashKernelLanes<v8u32, 8>(pkernels, phash);
+}
+
+__attribute__((target("avx512f"))) static void HashKernels16(const unsigned char* pkernels, uint256* phash)
+{
+    HashKernelLanes<v16u32, 16>(pkernels, phash);
+}
+
+static void HashKernelsSHANI(const unsigned char* pkernels, uint256* phash)
+{
+    unsigned char block[64];
+    unsigned int state[8];
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, pkernels, STAKE_KERNEL_SIZE);
+    block[STAKE_KERNEL_SIZE] = 0x80;
+    block[63] = STAKE_KERNEL_SIZE * 8;
+    memcpy(state, SHA256_IV, sizeof(state));
+    SHA256TransformSHANI(state, block);
+    SHA256DFinishSHANI(state, phash);
+}
+#endif
+
+static CLaneHasherRegistry<STAKE_KERNEL_SIZE>& GetKernelHashers()
+{
+    // Constructed on first use; the first entry is the default
+#ifdef USE_SHA256_X86
+    static CLaneHasherRegistry<STAKE_KERNEL_SIZE> registry(HashKernels1, HashKernelsSHANI, HashKernels4, HashKernels8, HashKernels16);
+#else
+    static CLaneHasherRegistry<STAKE_KERNEL_SIZE> registry(HashKernels1, NULL, NULL, NULL, NULL);
+#endif
+    return registry;
+}
+
+vector<string> GetKernelHasherNames()
+{
+    return GetKernelHashers().GetNames();
+}
+
+CKernelHasher* GetKernelHasher(const string& strName)
+{
+    return GetKernelHashers().Get(strName);
+}
+
+bool SelectKernelHasher(const string& strName)
+{
+    return GetKernelHashers().Select(strName);
+}
+
+CKernelHasher* GetSelectedKernelHasher()
+{
+    return GetKernelHashers().GetSelected();
+}
+
+void HashStakeKernels(const unsigned char* pkernels, unsigned int nCount, uint256* phash)
+{
+    GetSelectedKernelHasher()->Hash(pkernels, nCount, phash);
+}
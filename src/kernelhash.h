@@ -0,0 +1,36 @@
+// Copyright (c) 2012-2013 The PPCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef PPCOIN_KERNELHASH_H
+#define PPCOIN_KERNELHASH_H
+
+#include "lanehasher.h"
+#include "uint256.h"
+
+#include <string>
+#include <vector>
+
+// Serialized stake kernel: nStakeModifier, nTimeBlockFrom, nTxPrevOffset,
+// txPrev.nTime, prevout.n and nTimeTx
+static const unsigned int STAKE_KERNEL_SIZE = 28;
+
+/** Double SHA-256 of many stake kernels at once.
+ *
+ * A kernel fits in a single SHA-256 block, so each hash is two compressions
+ * and the SIMD backends run one kernel per vector lane. Backends that the
+ * CPU doesn't support are not listed.
+ */
+typedef CLaneHasher<STAKE_KERNEL_SIZE> CKernelHasher;
+
+// Names of the backends this CPU supports, the default first
+std::vector<std::string> GetKernelHasherNames();
+// Look up a backend by name, NULL if it is not available
+CKernelHasher* GetKernelHasher(const std::string& strName);
+// Select the backend used by HashStakeKernels
+bool SelectKernelHasher(const std::string& strName);
+CKernelHasher* GetSelectedKernelHasher();
+
+// Hash kernels with the backend selected with -kernelhash
+void HashStakeKernels(const unsigned char* pkernels, unsigned int nCount, uint256* phash);
+
+#endif // PPCOIN_KERNELHASH_H
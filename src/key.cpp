@@ -4,9 +4,16 @@
 
 #include <map>
 
+#include <boost/foreach.hpp>
+#include <boost/thread/tss.hpp>
+
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
 
+#ifdef USE_SECP256K1
+#include <secp256k1.h>
+#endif
+
 #include "key.h"
 
 // Generate a private key from just the secret parameter
@@ -194,7 +201,7 @@ void CKey::MakeNewKey(bool fCompressed)
     fSet = true;
 }
 
-bool CKey::SetPrivKey(const CPrivKey& vchPrivKey)
+bool CKey::SetPrivKey(const CPrivKey& vchPrivKey, bool fSkipCheck)
 {
     const unsigned char* pbegin = &vchPrivKey[0];
     if (d2i_ECPrivateKey(&pkey, &pbegin, vchPrivKey.size()))
@@ -202,7 +209,7 @@ bool CKey::SetPrivKey(const CPrivKey& vchPrivKey)
         // In testing, d2i_ECPrivateKey can return true
         // but fill in pkey with a key that fails
         // EC_KEY_check_key, so:
-        if (EC_KEY_check_key(pkey))
+        if (fSkipCheck ? EC_KEY_get0_private_key(pkey) && EC_KEY_get0_public_key(pkey) : EC_KEY_check_key(pkey))
         {
             fSet = true;
             return true;
@@ -416,3 +423,199 @@ bool CKey::IsValid()
     key2.SetSecret(secret, fCompr);
     return GetPubKey() == key2.GetPubKey();
 }
+
+
+//
+// ECDSA verification backends
+//
+
+// Reference path: a fresh OpenSSL EC_KEY per signature, as CKey does
+class CECVerifierOpenSSL : public CECVerifier
+{
+public:
+    const char* GetName() const { return "openssl"; }
+
+    bool Verify(const std::vector<unsigned char>& vchPubKey, const uint256& hash, const std::vector<unsigned char>& vchSig)
+    {
+        CKey key;
+        if (!key.SetPubKey(vchPubKey))
+            return false;
+        if (vchSig.empty())
+            return false;
+        return key.Verify(hash, vchSig);
+    }
+};
+
+// OpenSSL with one shared secp256k1 group carrying a precomputed table of
+// generator multiples, and a per-thread EC_KEY that is reused instead of
+// building the curve for every signature.
+class CECVerifierOpenSSLPrecomp : public CECVerifier
+{
+private:
+    struct CThreadKey
+    {
+        EC_KEY* pkey;
+        EC_POINT* ppoint;
+
+        CThreadKey(const EC_GROUP* group)
+        {
+            pkey = EC_KEY_new();
+            if (pkey == NULL || !EC_KEY_set_group(pkey, group))
+                throw key_error("CECVerifierOpenSSLPrecomp : EC_KEY_set_group failed");
+            ppoint = EC_POINT_new(EC_KEY_get0_group(pkey));
+            if (ppoint == NULL)
+                throw key_error("CECVerifierOpenSSLPrecomp : EC_POINT_new failed");
+        }
+
+        ~CThreadKey()
+        {
+            EC_POINT_free(ppoint);
+            EC_KEY_free(pkey);
+        }
+    };
+
+    EC_GROUP* group;
+    boost::thread_specific_ptr<CThreadKey> threadKey;
+
+public:
+    CECVerifierOpenSSLPrecomp()
+    {
+        group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        if (group == NULL)
+            throw key_error("CECVerifierOpenSSLPrecomp : EC_GROUP_new_by_curve_name failed");
+        // Copies of the group made by EC_KEY_set_group share this table
+        EC_GROUP_precompute_mult(group, NULL);
+    }
+
+    ~CECVerifierOpenSSLPrecomp()
+    {
+        EC_GROUP_free(group);
+    }
+
+    const char* GetName() const { return "openssl-precomp"; }
+
+    bool Verify(const std::vector<unsigned char>& vchPubKey, const uint256& hash, const std::vector<unsigned char>& vchSig)
+    {
+        if (vchPubKey.empty() || vchSig.empty())
+            return false;
+
+        CThreadKey* p = threadKey.get();
+        if (p == NULL)
+        {
+            p = new CThreadKey(group);
+            threadKey.reset(p);
+        }
+
+        // Same decoding o2i_ECPublicKey does in CKey::SetPubKey
+        const EC_GROUP* pgroup = EC_KEY_get0_group(p->pkey);
+        if (!EC_POINT_oct2point(pgroup, p->ppoint, &vchPubKey[0], vchPubKey.size(), NULL))
+            return false;
+        if (!EC_KEY_set_public_key(p->pkey, p->ppoint))
+            return false;
+
+        // -1 = error, 0 = bad sig, 1 = good
+        return ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), p->pkey) == 1;
+    }
+};
+
+#ifdef USE_SECP256K1
+// libsecp256k1: dedicated field and group arithmetic with precomputed
+// tables and the GLV endomorphism. Signatures it can't parse strictly are
+// handed to OpenSSL so lax DER encodings in old blocks keep verifying the
+// same way, and high-S signatures are normalized because OpenSSL accepts them.
+class CECVerifierSecp256k1 : public CECVerifier
+{
+private:
+    secp256k1_context* ctx;
+    CECVerifier* pfallback;
+
+public:
+    CECVerifierSecp256k1(CECVerifier* pfallbackIn) : pfallback(pfallbackIn)
+    {
+        ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+        if (ctx == NULL)
+            throw key_error("CECVerifierSecp256k1 : secp256k1_context_create failed");
+    }
+
+    ~CECVerifierSecp256k1()
+    {
+        secp256k1_context_destroy(ctx);
+    }
+
+    const char* GetName() const { return "secp256k1"; }
+
+    bool Verify(const std::vector<unsigned char>& vchPubKey, const uint256& hash, const std::vector<unsigned char>& vchSig)
+    {
+        if (vchPubKey.empty() || vchSig.empty())
+            return false;
+
+        secp256k1_pubkey pubkey;
+        secp256k1_ecdsa_signature sig;
+        if (!secp256k1_ec_pubkey_parse(ctx, &pubkey, &vchPubKey[0], vchPubKey.size()) ||
+            !secp256k1_ecdsa_signature_parse_der(ctx, &sig, &vchSig[0], vchSig.size()))
+            return pfallback->Verify(vchPubKey, hash, vchSig);
+
+        secp256k1_ecdsa_signature_normalize(ctx, &sig, &sig);
+        return secp256k1_ecdsa_verify(ctx, &sig, (const unsigned char*)&hash, &pubkey) == 1;
+    }
+};
+#endif
+
+static std::vector<CECVerifier*>& GetECVerifiers()
+{
+    // Constructed on first use; the first entry is the default
+    static CECVerifierOpenSSL verifierOpenSSL;
+    static CECVerifierOpenSSLPrecomp verifierPrecomp;
+#ifdef USE_SECP256K1
+    static CECVerifierSecp256k1 verifierSecp256k1(&verifierPrecomp);
+#endif
+    static std::vector<CECVerifier*> vVerifiers;
+    if (vVerifiers.empty())
+    {
+#ifdef USE_SECP256K1
+        vVerifiers.push_back(&verifierSecp256k1);
+#endif
+        vVerifiers.push_back(&verifierPrecomp);
+        vVerifiers.push_back(&verifierOpenSSL);
+    }
+    return vVerifiers;
+}
+
+static CECVerifier* pverifierSelected = NULL;
+
+std::vector<std::string> GetECVerifierNames()
+{
+    std::vector<std::string> vNames;
+    BOOST_FOREACH(CECVerifier* pverifier, GetECVerifiers())
+        vNames.push_back(pverifier->GetName());
+    return vNames;
+}
+
+CECVerifier* GetECVerifier(const std::string& strName)
+{
+    BOOST_FOREACH(CECVerifier* pverifier, GetECVerifiers())
+        if (strName == pverifier->GetName())
+            return pverifier;
+    return NULL;
+}
+
+bool SelectECVerifier(const std::string& strName)
+{
+    CECVerifier* pverifier = GetECVerifier(strName);
+    if (pverifier == NULL)
+        return false;
+    pverifierSelected = pverifier;
+    return true;
+}
+
+CECVerifier* GetSelectedECVerifier()
+{
+    if (pverifierSelected == NULL)
+        pverifierSelected = GetECVerifiers()[0];
+    return pverifierSelected;
+}
+
+bool CPubKey::Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const
+{
+    return GetSelectedECVerifier()->Verify(vchPubKey, hash, vchSig);
+}
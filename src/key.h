@@ -96,8 +96,32 @@ public:
     std::vector<unsigned char> Raw() const {
         return vchPubKey;
     }
+
+    // Verify a DER encoded signature of hash with the selected ECDSA backend
+    bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
+};
+
+/** Backend used to verify ECDSA signatures against serialized public keys.
+ *
+ * Script signature checks, block signatures, alerts and sync checkpoints
+ * all verify through the backend selected with -ecverify.
+ */
+class CECVerifier
+{
+public:
+    virtual ~CECVerifier() { }
+    virtual const char* GetName() const = 0;
+    virtual bool Verify(const std::vector<unsigned char>& vchPubKey, const uint256& hash, const std::vector<unsigned char>& vchSig) = 0;
 };
 
+// Names of the backends compiled in, the default first
+std::vector<std::string> GetECVerifierNames();
+// Look up a backend by name, NULL if it is not available
+CECVerifier* GetECVerifier(const std::string& strName);
+// Select the backend used by CPubKey::Verify
+bool SelectECVerifier(const std::string& strName);
+CECVerifier* GetSelectedECVerifier();
+
 
 // secure_allocator is defined in allocators.h
 // CPrivKey is a serialized private key, with all parameters included (279 bytes)
@@ -134,7 +158,9 @@ public:
     bool IsCompressed() const;
 
     void MakeNewKey(bool fCompressed);
-    bool SetPrivKey(const CPrivKey& vchPrivKey);
+    // fSkipCheck skips the EC_KEY_check_key consistency test, which costs a
+    // couple of point multiplications and dominates loading large wallets
+    bool SetPrivKey(const CPrivKey& vchPrivKey, bool fSkipCheck = false);
     bool SetSecret(const CSecret& vchSecret, bool fCompressed = false);
     CSecret GetSecret(bool &fCompressed) const;
     CPrivKey GetPrivKey() const;
@@ -60,6 +60,27 @@ bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut)
     return false;
 }
 
+void CBasicKeyStore::GetCScripts(ScriptMap& mapScriptsOut) const
+{
+    LOCK(cs_KeyStore);
+    mapScriptsOut = mapScripts;
+}
+
+CKeyStoreSnapshot::CKeyStoreSnapshot(const CBasicKeyStore& keystore)
+{
+    keystore.GetKeys(setKeys);
+    keystore.GetCScripts(mapScripts);
+}
+
+bool CKeyStoreSnapshot::GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const
+{
+    ScriptMap::const_iterator mi = mapScripts.find(hash);
+    if (mi == mapScripts.end())
+        return false;
+    redeemScriptOut = (*mi).second;
+    return true;
+}
+
 bool CCryptoKeyStore::SetCrypted()
 {
     {
@@ -152,6 +173,13 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
     return true;
 }
 
+void CCryptoKeyStore::RemoveKey(const CKeyID &address)
+{
+    LOCK(cs_KeyStore);
+    mapKeys.erase(address);
+    mapCryptedKeys.erase(address);
+}
+
 bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
 {
     {
@@ -95,6 +95,29 @@ public:
     virtual bool AddCScript(const CScript& redeemScript);
     virtual bool HaveCScript(const CScriptID &hash) const;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
+    void GetCScripts(ScriptMap& mapScriptsOut) const;
+};
+
+/** Read-only copy of which keys and scripts a key store holds, without
+ * the secrets. It is never modified after construction, so ::IsMine can
+ * run against it from several threads without taking cs_KeyStore.
+ */
+class CKeyStoreSnapshot : public CKeyStore
+{
+private:
+    std::set<CKeyID> setKeys;
+    ScriptMap mapScripts;
+
+public:
+    CKeyStoreSnapshot(const CBasicKeyStore& keystore);
+
+    bool AddKey(const CKey& key) { return false; }
+    bool HaveKey(const CKeyID &address) const { return setKeys.count(address) > 0; }
+    bool GetKey(const CKeyID &address, CKey& keyOut) const { return false; }
+    void GetKeys(std::set<CKeyID> &setAddress) const { setAddress = setKeys; }
+    bool AddCScript(const CScript& redeemScript) { return false; }
+    bool HaveCScript(const CScriptID &hash) const { return mapScripts.count(hash) > 0; }
+    bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
@@ -121,6 +144,9 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    // forget a key that was added but could not be stored
+    void RemoveKey(const CKeyID &address);
+
 public:
     CCryptoKeyStore() : fUseCrypto(false)
     {
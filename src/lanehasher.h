@@ -0,0 +1,39 @@
+// Copyright (c) 2012-2013 The PPCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef PPCOIN_LANEHASHER_H
+#define PPCOIN_LANEHASHER_H
+
+#include "uint256.h"
+
+/** Batch hasher backend for messages of SIZE bytes: nLanes messages per call
+ * of the lane function, the rest one at a time with the single lane one. */
+template<unsigned int SIZE>
+class CLaneHasher
+{
+public:
+    typedef void (*HashLanesFunc)(const unsigned char* pin, uint256* pout);
+
+    CLaneHasher(const char* pszNameIn, unsigned int nLanesIn, HashLanesFunc pfnLanesIn, HashLanesFunc pfnOneIn) :
+        pszName(pszNameIn), nLanes(nLanesIn), pfnLanes(pfnLanesIn), pfnOne(pfnOneIn) { }
+
+    const char* GetName() const { return pszName; }
+
+    // Hash nCount messages stored back to back from pin into pout
+    void Hash(const void* pin, unsigned int nCount, uint256* pout) const
+    {
+        const unsigned char* p = (const unsigned char*)pin;
+        for (; nCount >= nLanes; nCount -= nLanes, p += nLanes * SIZE, pout += nLanes)
+            pfnLanes(p, pout);
+        for (; nCount > 0; nCount--, p += SIZE, pout++)
+            pfnOne(p, pout);
+    }
+
+private:
+    const char* pszName;
+    unsigned int nLanes;
+    HashLanesFunc pfnLanes;
+    HashLanesFunc pfnOne;
+};
+
+#endif // PPCOIN_LANEHASHER_H
@@ -13,8 +13,12 @@
 #include "scrypt_mine.h"
 
 #include "emessage.h"
+#include "pubnotify.h"
+#include "compactblock.h"
+#include "blockcache.h"
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/random/mersenne_twister.hpp>
@@ -34,16 +38,22 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
+bool fImporting = false;
+uint256 hashAssumeValid = 0;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 uint256 hashGenesisBlock = hashGenesisBlockOfficial;
+static const int BLOCK_UNDO_DEPTH = 1000; // blocks back that keep their undo information
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
 static CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
 
 static CBigNum bnProofOfWorkLimitTestNet(~uint256(0) >> 20);
 static CBigNum bnProofOfStakeLimitTestNet(~uint256(0) >> 20);
 
+static CBigNum bnProofOfWorkLimitRegTest(~uint256(0) >> 1);
+static CBigNum bnProofOfStakeLimitRegTest(~uint256(0) >> 1);
+
 unsigned int nStakeMinAge = 60 * 60 * 24 * 3;   // minimum age for coin age: 3d
 unsigned int nStakeMaxAge = 60 * 60 * 24 * 100; // stake age of full weight: 100d
 unsigned int nStakeTargetSpacing = 15;          // 15 sec block spacing
@@ -65,8 +75,9 @@ multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 map<uint256, uint256> mapProofOfStake;
 
-map<uint256, CDataStream*> mapOrphanTransactions;
-map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+map<uint256, COrphanTx> mapOrphanTransactions;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
+map<int, set<uint256> > mapOrphanTransactionsByPeer;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -190,16 +201,12 @@ void ResendWalletTransactions()
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CDataStream& vMsg)
+bool AddOrphanTx(const CTransaction& tx, int nPeer)
 {
-    CTransaction tx;
-    CDataStream(vMsg) >> tx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
-    CDataStream* pvMsg = new CDataStream(vMsg);
-
     // Ignore big transactions, to avoid a
     // send-big-orphans memory exhaustion attack. If a peer has a legitimate
     // large transaction with a missing parent then we assume
@@ -207,16 +214,28 @@ bool AddOrphanTx(const CDataStream& vMsg)
     // have been mined or received.
     // 10,000 orphans, each of which is at most 5,000 bytes big is
     // at most 500 megabytes of orphans:
-    if (pvMsg->size() > 5000)
+    unsigned int nSize = tx.GetTxSize();
+    if (nSize > MAX_ORPHAN_TX_SIZE)
     {
-        printf("ignoring large orphan tx (size: %"PRIszu", hash: %s)\n", pvMsg->size(), hash.ToString().substr(0,10).c_str());
-        delete pvMsg;
+        printf("ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString().substr(0,10).c_str());
         return false;
     }
 
-    mapOrphanTransactions[hash] = pvMsg;
+    // One peer can't fill the pool and push out everyone else's orphans
+    set<uint256>& setPeer = mapOrphanTransactionsByPeer[nPeer];
+    if (setPeer.size() >= MAX_ORPHAN_TRANSACTIONS_PER_PEER)
+    {
+        printf("ignoring orphan tx %s, peer %d has %"PRIszu" orphans\n", hash.ToString().substr(0,10).c_str(), nPeer, setPeer.size());
+        return false;
+    }
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.nPeer = nPeer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(make_pair(hash, pvMsg));
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    setPeer.insert(hash);
 
     printf("stored orphan tx %s (mapsz %"PRIszu")\n", hash.ToString().substr(0,10).c_str(),
         mapOrphanTransactions.size());
@@ -225,37 +244,115 @@ bool AddOrphanTx(const CDataStream& vMsg)
 
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
     {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
+    }
+    map<int, set<uint256> >::iterator itPeer = mapOrphanTransactionsByPeer.find(it->second.nPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end())
+    {
+        itPeer->second.erase(hash);
+        if (itPeer->second.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
     }
-    delete pvMsg;
-    mapOrphanTransactions.erase(hash);
+    mapOrphanTransactions.erase(it);
 }
 
 unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
     unsigned int nEvicted = 0;
+
+    // Sweep out expired orphans every few minutes
+    static int64 nNextSweep;
+    int64 nNow = GetTime();
+    if (nNextSweep <= nNow)
+    {
+        vector<uint256> vExpired;
+        for (map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+            if (it->second.nTimeExpire <= nNow)
+                vExpired.push_back(it->first);
+        BOOST_FOREACH(const uint256& hash, vExpired)
+            EraseOrphanTx(hash);
+        nEvicted += vExpired.size();
+        nNextSweep = nNow + ORPHAN_TX_EXPIRE_TIME / 4;
+        if (!vExpired.empty())
+            printf("LimitOrphanTxSize() : removed %"PRIszu" expired orphan tx\n", vExpired.size());
+    }
+
     while (mapOrphanTransactions.size() > nMaxOrphans)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CDataStream*>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        // Evict a random orphan of the peer holding the most
+        map<int, set<uint256> >::iterator itPeer = mapOrphanTransactionsByPeer.begin();
+        for (map<int, set<uint256> >::iterator it = itPeer; it != mapOrphanTransactionsByPeer.end(); ++it)
+            if (it->second.size() > itPeer->second.size())
+                itPeer = it;
+        set<uint256>::iterator it = itPeer->second.lower_bound(GetRandHash());
+        if (it == itPeer->second.end())
+            it = itPeer->second.begin();
+        EraseOrphanTx(*it);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+// Queue the orphans spending tx's outputs to be retried on behalf of pfrom
+void static AddOrphanWork(CNode* pfrom, const CTransaction& tx)
+{
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (itPrev != mapOrphanTransactionsByPrev.end())
+            pfrom->setOrphanWork.insert(itPrev->second.begin(), itPrev->second.end());
+    }
+}
+
+// Retry up to ORPHAN_WORK_BATCH queued orphans of pfrom, the rest waits for
+// the next round of the message handler so other peers get their turn
+static const int ORPHAN_WORK_BATCH = 10;
+
+void static ProcessOrphanWork(CNode* pfrom)
+{
+    CTxDB txdb("r");
+    int nTried = 0;
+    while (!pfrom->setOrphanWork.empty() && nTried < ORPHAN_WORK_BATCH)
+    {
+        uint256 hash = *pfrom->setOrphanWork.begin();
+        pfrom->setOrphanWork.erase(pfrom->setOrphanWork.begin());
+        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+        if (it == mapOrphanTransactions.end())
+            continue;
+        nTried++;
+
+        CTransaction tx = it->second.tx;
+        CInv inv(MSG_TX, hash);
+        bool fMissingInputs = false;
+        if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs))
+        {
+            printf("   accepted orphan tx %s\n", hash.ToString().substr(0,10).c_str());
+            SyncWithWallets(tx, NULL, true);
+            RelayMessage(inv, tx);
+            mapAlreadyAskedFor.erase(inv);
+            AddOrphanWork(pfrom, tx);
+            EraseOrphanTx(hash);
+        }
+        else if (!fMissingInputs)
+        {
+            // invalid orphan
+            EraseOrphanTx(hash);
+            printf("   removed invalid orphan tx %s\n", hash.ToString().substr(0,10).c_str());
+        }
+    }
+}
+
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -458,7 +555,7 @@ bool CTransaction::CheckTransaction() const
     if (vout.empty())
         return DoS(10, error("CTransaction::CheckTransaction() : vout empty"));
     // Size limits
-    if (::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
+    if (GetTxSize() > MAX_BLOCK_SIZE)
         return DoS(100, error("CTransaction::CheckTransaction() : size limits failed"));
 
     // Check for negative or overflow output values
@@ -517,7 +614,7 @@ int64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
     int64 nBaseFee = (mode == GMF_RELAY) ? MIN_RELAY_TX_FEE : MIN_TX_FEE;
 
     //unsigned int nBytes = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
-    if (nBytes == 0) nBytes = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+    if (nBytes == 0) nBytes = GetTxSize();
     unsigned int nNewBlockSize = nBlockSize + nBytes;
     int64 nMinFee = (1 + (int64)nBytes / 1000) * nBaseFee;
 
@@ -630,7 +727,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         // reasonable number of ECDSA signature verifications.
 
         int64 nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        unsigned int nSize = tx.GetTxSize();
 
         // Don't accept it if it can't get into a block
         int64 txMinFee = tx.GetMinFee(1000, false, GMF_RELAY, nSize);
@@ -709,6 +806,8 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
     }
+    if (fPubNotify)
+        PubNotifyTransaction(tx);
     return true;
 }
 
@@ -1035,8 +1134,8 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
         bnTargetLimit = bnProofOfStakeLimit;
     }
 
-    if (pindexLast == NULL)
-        return bnTargetLimit.GetCompact(); // genesis block
+    if (pindexLast == NULL || fRegTest)
+        return bnTargetLimit.GetCompact(); // genesis block, regtest never retargets
 
     const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
     if (pindexPrev->pprev == NULL)
@@ -1093,6 +1192,39 @@ int GetNumBlocksOfPeers()
     return std::max(cPeerBlockCounts.median(), Checkpoints::GetTotalBlocksEstimate());
 }
 
+// Blocks that are ancestors of the assumed valid block skip script and
+// signature checks in ConnectInputs; everything else is still checked.
+// -assumevalid only takes checkpoint hashes: until the block itself is in
+// the index, the hardcoded checkpoint pins the chain up to its height,
+// which is as much as the old rule trusted.
+static vector<const CBlockIndex*> vAssumeValidChain;
+static uint256 hashAssumeValidChain = 0;
+
+bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0 || pindex == NULL)
+        return false;
+
+    if (hashAssumeValidChain != hashAssumeValid)
+    {
+        vAssumeValidChain.clear();
+        hashAssumeValidChain = hashAssumeValid;
+    }
+
+    if (vAssumeValidChain.empty())
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashAssumeValid);
+        if (mi == mapBlockIndex.end())
+            return pindex->nHeight <= Checkpoints::GetCheckpointHeight(hashAssumeValid);
+
+        // Remember the chain leading to it, so the ancestor test is a lookup
+        vAssumeValidChain.resize(mi->second->nHeight + 1);
+        for (const CBlockIndex* p = mi->second; p; p = p->pprev)
+            vAssumeValidChain[p->nHeight] = p;
+    }
+    return pindex->nHeight < (int)vAssumeValidChain.size() && vAssumeValidChain[pindex->nHeight] == pindex;
+}
+
 bool IsInitialBlockDownload()
 {
     if (pindexBest == NULL || nBestHeight < Checkpoints::GetTotalBlocksEstimate())
@@ -1330,6 +1462,18 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+
+        // Skip ECDSA signature verification when connecting blocks (fBlock=true)
+        // that are ancestors of the assumed valid block (-assumevalid, by default
+        // the last blockchain checkpoint). This is safe because block merkle hashes
+        // are still computed and checked, and spends and amounts are still verified.
+        bool fCheckSignatures = !(fBlock && IsAssumedValid(pindexBlock));
+
+        // Serialize the parts of the signature hash shared by all inputs once
+        auto_ptr<CSignatureHashContext> psighash;
+        if (fCheckSignatures)
+            psighash.reset(new CSignatureHashContext(*this));
+
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1343,17 +1487,14 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
             if (!txindex.vSpent[prevout.n].IsNull())
                 return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString().substr(0,10).c_str(), txindex.vSpent[prevout.n].ToString().c_str());
 
-            // Skip ECDSA signature verification when connecting blocks (fBlock=true)
-            // before the last blockchain checkpoint. This is safe because block merkle hashes are
-            // still computed and checked, and any change will be caught at the next checkpoint.
-            if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
+            if (fCheckSignatures)
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0, psighash.get()))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
-                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0))
+                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0, psighash.get()))
                         return error("ConnectInputs() : %s P2SH VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
@@ -1452,10 +1593,49 @@ bool CTransaction::ClientConnectInputs()
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // Read the spent transactions for the address index before their
+    // spent pointers are cleared
+    bool fIndexAddresses = nAddressIndexFlags && GetAddressIndexBest(txdb) == pindex->GetBlockHash();
+    MapPrevTx mapIndexInputs;
+    if (fIndexAddresses && !ReadBlockInputs(txdb, *this, mapIndexInputs))
+        return error("DisconnectBlock() : ReadBlockInputs failed");
+
+    // Blocks connected by older versions have no undo information and
+    // look up the spent pointer of every input instead
+    CBlockUndo blockundo;
+    bool fUndo = txdb.ReadBlockUndo(pindex->GetBlockHash(), blockundo);
+
     // Disconnect in reverse order
+    CAddressIndexBatch batch;
     for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
+    {
+        if (fUndo)
+        {
+            // An entry already gone, like that of a duplicate, is not an error
+            if (!txdb.EraseTxIndex(vtx[i]))
+                return error("DisconnectBlock() : EraseTxIndex failed");
+        }
+        else if (!vtx[i].DisconnectInputs(txdb))
             return false;
+        if (fIndexAddresses && !batch.DisconnectTransaction(txdb, vtx[i], pindex->nHeight, mapIndexInputs))
+            return error("DisconnectBlock() : address index failed");
+    }
+
+    if (fUndo)
+    {
+        // Put back the index entries the block spent from
+        for (unsigned int i = 0; i < blockundo.vPrevTxIndex.size(); i++)
+            if (!txdb.UpdateTxIndex(blockundo.vPrevTxIndex[i].first, blockundo.vPrevTxIndex[i].second))
+                return error("DisconnectBlock() : UpdateTxIndex failed");
+        if (!txdb.EraseBlockUndo(pindex->GetBlockHash()))
+            return error("DisconnectBlock() : EraseBlockUndo failed");
+    }
+
+    if (fIndexAddresses)
+    {
+        if (!txdb.WriteAddressIndexBatch(batch) || !txdb.WriteAddressIndexBest(nAddressIndexFlags, hashPrevBlock))
+            return error("DisconnectBlock() : writing address index failed");
+    }
 
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
@@ -1505,10 +1685,17 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    CBlockUndo blockundo;
+    set<uint256> setUndoTx;
     int64 nFees = 0;
     int64 nValueIn = 0;
     int64 nValueOut = 0;
     unsigned int nSigOps = 0;
+
+    // Index addresses only while the optional indexes are caught up with the
+    // chain, ThreadBuildAddressIndex handles the blocks before that
+    bool fIndexAddresses = !fJustCheck && nAddressIndexFlags && pindex->pprev && GetAddressIndexBest(txdb) == hashPrevBlock;
+    CAddressIndexBatch batch;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         uint256 hashTx = tx.GetHash();
@@ -1528,7 +1715,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         if (!fJustCheck)
-            nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+            nTxPos += tx.GetTxSize();
 
         MapPrevTx mapInputs;
         if (tx.IsCoinBase())
@@ -1556,11 +1743,19 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (!tx.IsCoinStake())
                 nFees += nTxValueIn - nTxValueOut;
 
+            // Remember the index entries of earlier transactions before this
+            // block first spends from them
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                if (!mapQueuedChanges.count(txin.prevout.hash) && setUndoTx.insert(txin.prevout.hash).second)
+                    blockundo.vPrevTxIndex.push_back(make_pair(txin.prevout.hash, mapInputs[txin.prevout.hash].first));
+
             if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash))
                 return false;
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+        if (fIndexAddresses && !batch.ConnectTransaction(txdb, tx, pindex->nHeight, mapInputs))
+            return error("ConnectBlock() : address index failed");
     }
 
     // ppcoin: track money supply and mint amount info
@@ -1583,6 +1778,26 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
+    if (!txdb.WriteBlockUndo(pindex->GetBlockHash(), blockundo))
+        return error("ConnectBlock() : WriteBlockUndo failed");
+
+    // Deeper blocks than a reorganization is expected to reach are
+    // disconnected without undo information, drop theirs every 100 blocks
+    if (pindex->nHeight % 100 == 0)
+    {
+        const CBlockIndex* pindexUndo = pindex;
+        for (int i = 0; pindexUndo && i < BLOCK_UNDO_DEPTH; i++)
+            pindexUndo = pindexUndo->pprev;
+        for (int i = 0; pindexUndo && i < 100; i++, pindexUndo = pindexUndo->pprev)
+            if (!txdb.EraseBlockUndo(pindexUndo->GetBlockHash()))
+                return error("ConnectBlock() : EraseBlockUndo failed");
+    }
+
+    if (fIndexAddresses)
+    {
+        if (!txdb.WriteAddressIndexBatch(batch) || !txdb.WriteAddressIndexBest(nAddressIndexFlags, pindex->GetBlockHash()))
+            return error("ConnectBlock() : writing address index failed");
+    }
 
     uint256 prevHash = 0;
     if(pindex->pprev)
@@ -1643,12 +1858,17 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     printf("REORGANIZE: Disconnect %"PRIszu" blocks; %s..%s\n", vDisconnect.size(), pfork->GetBlockHash().ToString().substr(0,20).c_str(), pindexBest->GetBlockHash().ToString().substr(0,20).c_str());
     printf("REORGANIZE: Connect %"PRIszu" blocks; %s..%s\n", vConnect.size(), pfork->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->GetBlockHash().ToString().substr(0,20).c_str());
 
+    // Long reorganizations report their progress every few seconds
+    int64 nStart = GetTimeMillis();
+    int64 nLastProgress = nStart;
+
     // Disconnect shorter branch
     vector<CTransaction> vResurrect;
-    BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
+    for (unsigned int i = 0; i < vDisconnect.size(); i++)
     {
+        CBlockIndex* pindex = vDisconnect[i];
         CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        if (!blockCache.Read(block, pindex))
             return error("Reorganize() : ReadFromDisk for disconnect failed");
         if (!block.DisconnectBlock(txdb, pindex))
             return error("Reorganize() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
@@ -1657,6 +1877,12 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
             if (!(tx.IsCoinBase() || tx.IsCoinStake()))
                 vResurrect.push_back(tx);
+
+        if (GetTimeMillis() - nLastProgress > 5000)
+        {
+            nLastProgress = GetTimeMillis();
+            printf("REORGANIZE: disconnected %u of %"PRIszu" blocks\n", i + 1, vDisconnect.size());
+        }
     }
 
     // Connect longer branch
@@ -1665,7 +1891,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     {
         CBlockIndex* pindex = vConnect[i];
         CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        if (!blockCache.Read(block, pindex))
             return error("Reorganize() : ReadFromDisk for connect failed");
         if (!block.ConnectBlock(txdb, pindex))
         {
@@ -1676,6 +1902,12 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         // Queue memory transactions to delete
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
             vDelete.push_back(tx);
+
+        if (GetTimeMillis() - nLastProgress > 5000)
+        {
+            nLastProgress = GetTimeMillis();
+            printf("REORGANIZE: connected %u of %"PRIszu" blocks\n", i + 1, vConnect.size());
+        }
     }
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("Reorganize() : WriteHashBestChain failed");
@@ -1694,6 +1926,11 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
 
+    // ppcoin: follow the new branch in the stake modifier index
+    RewindStakeModifierIndex(pfork->nHeight);
+    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+        AddToStakeModifierIndex(pindex);
+
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
         tx.AcceptToMemoryPool(txdb, false);
@@ -1702,7 +1939,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CTransaction& tx, vDelete)
         mempool.remove(tx);
 
-    printf("REORGANIZE: done\n");
+    printf("REORGANIZE: done in %"PRI64d" ms\n", GetTimeMillis() - nStart);
 
     return true;
 }
@@ -1725,6 +1962,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    AddToStakeModifierIndex(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1747,6 +1985,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        AddToStakeModifierIndex(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1784,7 +2023,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vpindexSecondary)
         {
             CBlock block;
-            if (!block.ReadFromDisk(pindex))
+            if (!blockCache.Read(block, pindex))
             {
                 printf("SetBestChain() : ReadFromDisk failed\n");
                 break;
@@ -1839,6 +2078,9 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
             strMiscWarning = _("Warning: This version is obsolete, upgrade required!");
     }
 
+    if (fPubNotify)
+        PubNotifyBlock(*this);
+
     std::string strCmd = GetArg("-blocknotify", "");
 
     if (!fIsInitialDownload && !strCmd.empty())
@@ -2141,17 +2383,41 @@ bool CBlock::AcceptBlock()
     unsigned int nBlockPos = 0;
     if (!WriteToDisk(nFile, nBlockPos))
         return error("AcceptBlock() : WriteToDisk failed");
+    blockCache.Add(*this);
     if (!AddToBlockIndex(nFile, nBlockPos))
         return error("AcceptBlock() : AddToBlockIndex failed");
 
-    // Relay inventory, but don't relay old inventory during initial block download
+    // Relay inventory, but don't relay old inventory during initial block download.
+    // Peers that asked for compact blocks are sent one straight away.
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        CInv inv(MSG_BLOCK, hash);
+        CCompactBlock cmpctblock;
+        bool fCmpctBlock = false;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (!pnode->fPreferCompact)
+            {
+                pnode->PushInventory(inv);
+                continue;
+            }
+            {
+                LOCK(pnode->cs_inventory);
+                if (pnode->setInventoryKnown.count(inv))
+                    continue;
+                pnode->setInventoryKnown.insert(inv);
+            }
+            if (!fCmpctBlock)
+            {
+                cmpctblock = CCompactBlock(*this);
+                fCmpctBlock = true;
+            }
+            pnode->PushMessage("cmpctblock", cmpctblock);
+        }
     }
 
     // ppcoin: check pending sync-checkpoint
@@ -2194,7 +2460,9 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
 }
 
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+// psetChecked holds the hashes of blocks that already passed CheckBlock on a
+// bulk import worker thread
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, const std::set<uint256>* psetChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2210,7 +2478,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
 
     // Preliminary checks
-    if (!pblock->CheckBlock())
+    if (!(psetChecked && psetChecked->count(hash)) && !pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // ppcoin: verify hash target and signature of coinstake tx
@@ -2391,12 +2659,9 @@ bool CBlock::CheckBlockSignature() const
         if (whichType == TX_PUBKEY)
         {
             valtype& vchPubKey = vSolutions[0];
-            CKey key;
-            if (!key.SetPubKey(vchPubKey))
-                return false;
             if (vchBlockSig.empty())
                 return false;
-            return key.Verify(GetHash(), vchBlockSig);
+            return CPubKey(vchPubKey).Verify(GetHash(), vchBlockSig);
         }
     }
     else
@@ -2412,12 +2677,9 @@ bool CBlock::CheckBlockSignature() const
             {
                 // Verify
                 valtype& vchPubKey = vSolutions[0];
-                CKey key;
-                if (!key.SetPubKey(vchPubKey))
-                    continue;
                 if (vchBlockSig.empty())
                     continue;
-                if(!key.Verify(GetHash(), vchBlockSig))
+                if (!CPubKey(vchPubKey).Verify(GetHash(), vchBlockSig))
                     continue;
 
                 return true;
@@ -2447,13 +2709,6 @@ bool CheckDiskSpace(uint64 nAdditionalBytes)
 }
 
 
-static filesystem::path BlockFilePath(unsigned int nFile)
-{
-    string strBlockFn = strprintf("blk%04u.dat", nFile);
-    return GetDataDir() / strBlockFn;
-}
-
-
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
 {
     if ((nFile < 1) || (nFile == (unsigned int) -1))
@@ -2515,6 +2770,22 @@ bool LoadBlockIndex(bool fAllowNew)
         nStakeTargetSpacing = 3 * 60; // test block spacing is 3 minutes
     }
 
+    if (fRegTest)
+    {
+        pchMessageStart[0] = 0xfa;
+        pchMessageStart[1] = 0xbf;
+        pchMessageStart[2] = 0xb5;
+        pchMessageStart[3] = 0xda;
+
+        bnProofOfStakeLimit = bnProofOfStakeLimitRegTest; // about every hash and kernel meets the target
+        bnProofOfWorkLimit = bnProofOfWorkLimitRegTest;
+        nStakeMinAge = 60; // coins can stake after a minute
+        nStakeMaxAge = 60 * 60;
+        nModifierInterval = 60;
+        nCoinbaseMaturity = 10;
+        nStakeTargetSpacing = 60;
+    }
+
     //
     // Load block index
     //
@@ -2546,7 +2817,7 @@ bool LoadBlockIndex(bool fAllowNew)
         block.hashMerkleRoot = block.BuildMerkleTree();
         block.nVersion = 1;
         block.nTime    = nChainStartTime;
-        block.nBits    = bnProofOfWorkLimit.GetCompact();
+        block.nBits    = bnProofOfWorkLimitTestNet.GetCompact(); // regtest shares the testnet genesis block
         block.nNonce   = 586144;
 
         if (false  && (block.GetHash() != hashGenesisBlock))
@@ -2686,62 +2957,236 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
+// Blocks read ahead of the one being connected during a bulk import
+static const unsigned int MAX_IMPORT_QUEUE = 1000;
+
+/** Pipeline used by LoadExternalBlockFile.
+ *
+ * One thread reads and deserializes blocks from the file ahead of time, a pool
+ * of worker threads runs the context-free CheckBlock() checks (scrypt header
+ * hash, merkle root, block signature) in parallel, and the calling thread
+ * connects them in file order under cs_main.
+ */
+class CBlockImporter
 {
-    int64 nStart = GetTimeMillis();
+private:
+    struct CImportItem
+    {
+        CBlock block;
+        uint256 hash;
+        bool fChecked;
+        bool fValid;    // passed CheckBlock
+    };
+
+    CWaitableCriticalSection cs;
+    boost::condition_variable cond;
+    std::deque<boost::shared_ptr<CImportItem> > queue;
+    unsigned int nNextCheck; // first item in queue not yet taken by a worker
+    bool fReadDone;
+    bool fAbort;
+    FILE* file;
+
+    unsigned int FindMessageStart(unsigned int nPos)
+    {
+        unsigned char pchData[65536];
+        while (!fAbort && !fRequestShutdown)
+        {
+            if (fseek(file, nPos, SEEK_SET) != 0)
+                break;
+            int nRead = fread(pchData, 1, sizeof(pchData), file);
+            if (nRead < (int)sizeof(pchMessageStart))
+                break;
+            for (unsigned char* p = pchData; (p = (unsigned char*)memchr(p, pchMessageStart[0], pchData + nRead - p)) != NULL; p++)
+            {
+                if (p + sizeof(pchMessageStart) > pchData + nRead)
+                    break;
+                if (memcmp(p, pchMessageStart, sizeof(pchMessageStart)) == 0)
+                {
+                    nPos += p - pchData;
+                    fseek(file, nPos, SEEK_SET);
+                    return nPos;
+                }
+            }
+            nPos += nRead + 1 - sizeof(pchMessageStart);
+        }
+        return (unsigned int)-1;
+    }
 
-    int nLoaded = 0;
+    void ThreadRead()
     {
-        LOCK(cs_main);
+        RenameThread("bitcoin-loadblk");
+        std::vector<char> vchBlock;
+        unsigned int nPos = 0;
         try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown)
+            while (!fAbort && !fRequestShutdown)
             {
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
-                } while(!fRequestShutdown);
-                if (nPos == (unsigned int)-1)
+                // Blocks are normally stored back to back, only rescan for
+                // the message start when the data doesn't line up
+                unsigned char pchHeader[sizeof(pchMessageStart) + sizeof(unsigned int)];
+                if (fread(pchHeader, 1, sizeof(pchHeader), file) != sizeof(pchHeader))
                     break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                unsigned int nSize = 0;
+                memcpy(&nSize, pchHeader + sizeof(pchMessageStart), sizeof(nSize));
+                if (memcmp(pchHeader, pchMessageStart, sizeof(pchMessageStart)) != 0 || nSize == 0 || nSize > MAX_BLOCK_SIZE)
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    if (ProcessBlock(NULL,&block))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                    }
+                    if ((nPos = FindMessageStart(nPos + 1)) == (unsigned int)-1)
+                        break;
+                    continue;
+                }
+                vchBlock.resize(nSize);
+                if (fread(&vchBlock[0], 1, nSize, file) != nSize)
+                    break;
+
+                boost::shared_ptr<CImportItem> item(new CImportItem());
+                item->fChecked = false;
+                item->fValid = false;
+                try {
+                    CSpanStream stream(&vchBlock[0], &vchBlock[0] + nSize, SER_DISK, CLIENT_VERSION);
+                    stream >> item->block;
+                }
+                catch (std::exception &e) {
+                    if ((nPos = FindMessageStart(nPos + 1)) == (unsigned int)-1)
+                        break;
+                    continue;
                 }
+                nPos += sizeof(pchHeader) + nSize;
+
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (queue.size() >= MAX_IMPORT_QUEUE && !fAbort)
+                    cond.wait(lock);
+                queue.push_back(item);
+                cond.notify_all();
             }
         }
         catch (std::exception &e) {
-            printf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+            printf("%s() : I/O error caught during load\n", __PRETTY_FUNCTION__);
+        }
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        fReadDone = true;
+        cond.notify_all();
+    }
+
+    void ThreadCheck()
+    {
+        RenameThread("bitcoin-chkblk");
+        while (true)
+        {
+            boost::shared_ptr<CImportItem> item;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (nNextCheck >= queue.size() && !fReadDone && !fAbort)
+                    cond.wait(lock);
+                if (fAbort || nNextCheck >= queue.size())
+                    return;
+                item = queue[nNextCheck++];
+            }
+
+            // A block failing here is left out of the checked set, ProcessBlock
+            // will check it again and report why it was rejected
+            uint256 hash = item->block.GetHash();
+            bool fValid = item->block.CheckBlock();
+
+            boost::unique_lock<boost::mutex> lock(cs);
+            item->hash = hash;
+            item->fValid = fValid;
+            item->fChecked = true;
+            cond.notify_all();
         }
     }
+
+    boost::shared_ptr<CImportItem> Next()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!fAbort && !(queue.empty() ? fReadDone : queue.front()->fChecked))
+            cond.wait(lock);
+        if (fAbort || queue.empty())
+            return boost::shared_ptr<CImportItem>();
+        boost::shared_ptr<CImportItem> item = queue.front();
+        queue.pop_front();
+        nNextCheck--;
+        cond.notify_all();
+        return item;
+    }
+
+    void Abort()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fAbort = true;
+        cond.notify_all();
+    }
+
+    // Make everything imported so far durable. Individual blocks are written
+    // without syncing the block file while importing.
+    static void CommitBatch()
+    {
+        unsigned int nFile;
+        FILE* fileCommit = AppendBlockFile(nFile);
+        if (fileCommit)
+        {
+            FileCommit(fileCommit);
+            fclose(fileCommit);
+        }
+        bitdb.dbenv.log_flush(NULL);
+    }
+
+public:
+    CBlockImporter(FILE* fileIn) : nNextCheck(0), fReadDone(false), fAbort(false), file(fileIn)
+    {
+    }
+
+    int Run()
+    {
+        int nThreads = boost::thread::hardware_concurrency();
+        if (nThreads < 1)
+            nThreads = 1;
+        if (nThreads > 8)
+            nThreads = 8;
+        int nBatch = std::max((int)GetArg("-importbatch", 500), 1);
+
+        boost::thread_group threads;
+        threads.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+
+        int nLoaded = 0;
+        fImporting = true;
+        try {
+            boost::shared_ptr<CImportItem> item;
+            std::set<uint256> setChecked;
+            while (!fRequestShutdown && (item = Next()))
+            {
+                LOCK(cs_main);
+                if (mapBlockIndex.count(item->hash))
+                    continue;
+                if (item->fValid)
+                    setChecked.insert(item->hash);
+                bool fAccepted = ProcessBlock(NULL, &item->block, &setChecked);
+                setChecked.erase(item->hash);
+                if (fAccepted && ++nLoaded % nBatch == 0)
+                    CommitBatch();
+            }
+        }
+        catch (std::exception &e) {
+            PrintExceptionContinue(&e, "LoadExternalBlockFile()");
+        }
+        fImporting = false;
+        CommitBatch();
+
+        Abort();
+        threads.join_all();
+        return nLoaded;
+    }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn)
+{
+    int64 nStart = GetTimeMillis();
+
+    CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+    CBlockImporter importer(blkdat);
+    int nLoaded = importer.Run();
+
     printf("Loaded %i blocks from external file in %"PRI64d"ms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
@@ -2831,6 +3276,50 @@ string GetWarnings(string strFor)
 //
 
 
+// Ask for a block in full, when a compact block can't be used
+void static PushGetBlock(CNode* pfrom, const uint256& hash)
+{
+    pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hash)));
+}
+
+// Ask for the blocks of dropped partial blocks in full, from the peers they
+// were waiting on, so they don't stall until someone else relays them
+void static PushGetBlocksDropped(const vector<pair<uint256, int> >& vDropped)
+{
+    if (vDropped.empty())
+        return;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(const PAIRTYPE(uint256, int)& item, vDropped)
+    {
+        if (mapBlockIndex.count(item.first) || mapOrphanBlocks.count(item.first))
+            continue;
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->nNodeId == item.second)
+                PushGetBlock(pnode, item.first);
+    }
+}
+
+// Hand a block rebuilt from a compact block to ProcessBlock. A short id
+// collision puts the wrong transaction in the block, in which case it no
+// longer matches its merkle root and is fetched whole instead.
+void static ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s doesn't match its merkle root, requesting full block\n", inv.hash.ToString().substr(0,20).c_str());
+        PushGetBlock(pfrom, inv.hash);
+        return;
+    }
+
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+
+    if (fSecMsgEnabled)
+        SecureMsgScanBlock(block);
+}
+
 bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
     switch (inv.type)
@@ -2988,6 +3477,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 Checkpoints::checkpointMessage.RelayTo(pfrom);
         }
 
+        // Ask to be sent new blocks as compact blocks
+        if (fCompactBlocks && pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", true);
+
         pfrom->fSuccessfullyConnected = true;
 
         printf("receive version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", pfrom->nVersion, pfrom->nStartingHeight, addrMe.ToString().c_str(), addrFrom.ToString().c_str(), pfrom->addr.ToString().c_str());
@@ -3191,7 +3684,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     if (mempool.exists(inv.hash)) {
                         CTransaction tx = mempool.lookup(inv.hash);
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
+                        ss.ReserveFor(tx);
                         ss << tx;
                         pfrom->PushMessage("tx", ss);
                     }
@@ -3293,8 +3786,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CDataStream vMsg(vRecv);
         CTxDB txdb("r");
         CTransaction tx;
@@ -3309,47 +3800,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             SyncWithWallets(tx, NULL, true);
             RelayMessage(inv, vMsg);
             mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+            EraseOrphanTx(inv.hash);
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                uint256 hashPrev = vWorkQueue[i];
-                for (map<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
-                    CInv inv(MSG_TX, tx.GetHash());
-                    bool fMissingInputs2 = false;
-
-                    if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayMessage(inv, vMsg);
-                        mapAlreadyAskedFor.erase(inv);
-                        vWorkQueue.push_back(inv.hash);
-                        vEraseQueue.push_back(inv.hash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid orphan
-                        vEraseQueue.push_back(inv.hash);
-                        printf("   removed invalid orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                    }
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            // Orphans that depended on this one are retried from
+            // ProcessMessages, a few at a time
+            AddOrphanWork(pfrom, tx);
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(vMsg);
+            AddOrphanTx(tx, pfrom->nNodeId);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
@@ -3380,6 +3839,124 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounce;
+        vRecv >> fAnnounce;
+        pfrom->fPreferCompact = fCompactBlocks && fAnnounce;
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        printf("received compact block %s (%u tx)\n", hash.ToString().substr(0,20).c_str(), cmpctblock.GetTxCount());
+
+        CInv inv(MSG_BLOCK, hash);
+        pfrom->AddInventoryKnown(inv);
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            return true;
+
+        // Check the proof of work before scanning the memory pool for it
+        if (!cmpctblock.IsProofOfStake() && !CheckProofOfWork(hash, cmpctblock.header.nBits))
+        {
+            pfrom->Misbehaving(50);
+            return error("message cmpctblock : proof of work failed");
+        }
+
+        // Without its parent the block would only be an orphan, fetch it
+        // whole so the orphan handling asks for the blocks in between
+        CPartialBlock partial;
+        vector<unsigned short> vMissing;
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock) || !partial.Init(cmpctblock, mempool, vMissing))
+        {
+            PushGetBlock(pfrom, hash);
+            return true;
+        }
+
+        if (vMissing.empty())
+        {
+            ProcessCompactBlock(pfrom, partial.block);
+            return true;
+        }
+
+        if (fDebugNet)
+            printf("compact block %s missing %"PRIszu" of %u tx\n", hash.ToString().substr(0,20).c_str(), vMissing.size(), cmpctblock.GetTxCount());
+        partial.nPeer = pfrom->nNodeId;
+        partial.nTimeReceived = GetTime();
+        vector<pair<uint256, int> > vDropped;
+        AddPartialBlock(hash, partial, vDropped);
+        PushGetBlocksDropped(vDropped);
+
+        CBlockTxRequest req;
+        req.hashBlock = hash;
+        req.vIndex.swap(vMissing);
+        pfrom->PushMessage("getblocktxn", req);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTxRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return true;
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("message getblocktxn : ReadFromDisk failed for %s", req.hashBlock.ToString().substr(0,20).c_str());
+
+        // Old blocks are not worth the round trip, send them whole
+        if ((*mi).second->nHeight < nBestHeight - MAX_BLOCKTXN_DEPTH)
+        {
+            pfrom->PushMessage("block", block);
+            return true;
+        }
+
+        CBlockTxResponse resp;
+        resp.hashBlock = req.hashBlock;
+        resp.vtx.reserve(req.vIndex.size());
+        BOOST_FOREACH(unsigned short nIndex, req.vIndex)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("message getblocktxn index %u out of range", nIndex);
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTxResponse resp;
+        vRecv >> resp;
+
+        // Unrequested, or the partial block was dropped: fetch it whole
+        CPartialBlock partial;
+        if (!TakePartialBlock(resp.hashBlock, pfrom->nNodeId, partial))
+        {
+            if (!mapBlockIndex.count(resp.hashBlock) && !mapOrphanBlocks.count(resp.hashBlock))
+                PushGetBlock(pfrom, resp.hashBlock);
+            return true;
+        }
+
+        if (!partial.Fill(resp.vtx))
+        {
+            pfrom->Misbehaving(20);
+            PushGetBlock(pfrom, resp.hashBlock);
+            return error("message blocktxn size() = %"PRIszu" doesn't match request", resp.vtx.size());
+        }
+        ProcessCompactBlock(pfrom, partial.block);
+    }
+
+
     else if (strCommand == "getaddr")
     {
         pfrom->vAddrToSend.clear();
@@ -3525,6 +4102,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
 bool ProcessMessages(CNode* pfrom)
 {
+    // Finish retrying the orphans this peer's transactions resolved before
+    // reading more from it
+    if (!pfrom->setOrphanWork.empty())
+    {
+        {
+            LOCK(cs_main);
+            ProcessOrphanWork(pfrom);
+        }
+        if (!pfrom->setOrphanWork.empty())
+            return true;
+    }
+
     CDataStream& vRecv = pfrom->vRecv;
     if (vRecv.empty())
         return true;
@@ -3668,6 +4257,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Resend wallet transactions that haven't gotten in a block yet
         ResendWalletTransactions();
 
+        // Fetch whole the compact blocks whose missing transactions never came
+        vector<pair<uint256, int> > vExpired;
+        ExpirePartialBlocks(vExpired);
+        PushGetBlocksDropped(vExpired);
+
         // Address refresh broadcast
         static int64 nLastRebroadcast;
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
@@ -4049,7 +4643,7 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
             if (fMissingInputs) continue;
 
             // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = tx.GetTxSize();
             dPriority /= nTxSize;
 
             // This is a more accurate fee-per-kilobyte than is used by the client code, because the
@@ -4087,7 +4681,7 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
             vecPriority.pop_back();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = tx.GetTxSize();
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
@@ -4207,8 +4801,10 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].ClearCache();
 
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    // Only the coinbase changed since the last call for this block
+    pblock->hashMerkleRoot = pblock->UpdateCoinbaseMerkleRoot();
 }
 
 
@@ -4301,10 +4897,220 @@ static bool fGenerateBitcoins = false;
 static bool fLimitProcessors = false;
 static int nLimitProcessors = -1;
 
-void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
+// Nonces a proof-of-work thread claims at a time
+static const unsigned int MINER_NONCE_RANGE = 0x1000;
+
+/** Block all proof-of-work miner threads are working on.
+ *
+ * Threads claim ranges of its nonces, so no two hash the same header.
+ * Whichever thread finds the block stale or its nonces used up builds a
+ * new one or rolls the extra nonce for all of them.
+ *
+ * CreateNewBlock takes cs_main, mempool.cs and cs_wallet, so a new block
+ * is built under cs_create only and cs is taken just to swap it in. The
+ * thread stats have their own lock, cs_stats, which is never held while
+ * taking another lock, so RPC calls can read them under cs_main.
+ */
+class CMinerTemplate
 {
-    void *scratchbuf = scrypt_buffer_alloc();
+private:
+    CCriticalSection cs;
+    CCriticalSection cs_create;
+    CBlock* pblock;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64 nTimeCreated;
+    unsigned int nExtraNonce;
+    unsigned int nNextNonce;
+    unsigned int nWorkId;
+
+    CCriticalSection cs_stats;
+    std::vector<CMinerThreadStats> vThreadStats;
+
+    // Whether the block must be rebuilt, updates its time if not
+    bool NeedNewBlock()
+    {
+        if (pblock == NULL || pindexPrev != pindexBest ||
+            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nTimeCreated > 60))
+            return true;
+
+        // Update nTime
+        pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, pblock->GetMaxTransactionTime());
+        pblock->nTime = max(pblock->GetBlockTime(), pindexPrev->GetBlockTime() - nMaxClockDrift);
+        pblock->UpdateTime(pindexPrev);
+        return pblock->GetBlockTime() >= (int64)pblock->vtx[0].nTime + nMaxClockDrift;  // need to update coinbase timestamp
+    }
 
+    void UpdateHashesPerSec()
+    {
+        double dTotal = 0;
+        BOOST_FOREACH(const CMinerThreadStats& stats, vThreadStats)
+            if (stats.fRunning)
+                dTotal += stats.dHashesPerSec;
+        dHashesPerSec = dTotal;
+        nHPSTimerStart = GetTimeMillis();
+    }
+
+public:
+    CMinerTemplate() : pblock(NULL), pindexPrev(NULL), nTransactionsUpdatedLast(0), nTimeCreated(0),
+                       nExtraNonce(0), nNextNonce(0), nWorkId(0) { }
+    ~CMinerTemplate() { delete pblock; }
+
+    // Claim the next range of nonces, false if no block could be created
+    bool GetWork(CWallet* pwallet, block_header& header, unsigned int& nNonceEnd, unsigned int& nWorkIdRet)
+    {
+        bool fNew;
+        {
+            LOCK(cs);
+            fNew = NeedNewBlock();
+        }
+
+        if (fNew)
+        {
+            // One thread builds, the others wait for its block
+            LOCK(cs_create);
+            {
+                LOCK(cs);
+                fNew = NeedNewBlock();
+            }
+            if (fNew)
+            {
+                unsigned int nTransactionsUpdatedNew = nTransactionsUpdated;
+                CBlockIndex* pindexPrevNew = pindexBest;
+                CBlock* pblockNew = CreateNewBlock(pwallet);
+                if (!pblockNew)
+                    return false;
+
+                LOCK(cs);
+                delete pblock;
+                pblock = pblockNew;
+                pindexPrev = pindexPrevNew;
+                nTransactionsUpdatedLast = nTransactionsUpdatedNew;
+                nTimeCreated = GetTime();
+                IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+                nNextNonce = 0;
+                nWorkId++;
+                printf("Running BitcoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
+                       ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+            }
+        }
+
+        LOCK(cs);
+        if (pblock == NULL)
+            return false;
+        if (nNextNonce >= 0xffff0000)
+        {
+            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+            nNextNonce = 0;
+            nWorkId++;
+        }
+
+        header = *(block_header*)&pblock->nVersion;
+        header.nonce = nNextNonce;
+        nNextNonce += MINER_NONCE_RANGE;
+        nNonceEnd = nNextNonce;
+        nWorkIdRet = nWorkId;
+        return true;
+    }
+
+    // Copy of the block the header of work nWorkIdIn came from, false if
+    // the miner has moved on to another block or extra nonce since
+    bool GetBlock(unsigned int nWorkIdIn, CBlock& block)
+    {
+        LOCK(cs);
+        if (pblock == NULL || nWorkIdIn != nWorkId)
+            return false;
+        block = *pblock;
+        return true;
+    }
+
+    int AddThread()
+    {
+        LOCK(cs_stats);
+        unsigned int nThread = 0;
+        while (nThread < vThreadStats.size() && vThreadStats[nThread].fRunning)
+            nThread++;
+        if (nThread == vThreadStats.size())
+            vThreadStats.push_back(CMinerThreadStats());
+        vThreadStats[nThread] = CMinerThreadStats();
+        vThreadStats[nThread].fRunning = true;
+        vThreadStats[nThread].nMeterStart = GetTimeMillis();
+        return nThread;
+    }
+
+    void RemoveThread(int nThread)
+    {
+        LOCK(cs_stats);
+        vThreadStats[nThread].fRunning = false;
+        vThreadStats[nThread].dHashesPerSec = 0;
+        UpdateHashesPerSec();
+    }
+
+    void AddHashes(int nThread, unsigned int nHashes, bool fBlock)
+    {
+        LOCK(cs_stats);
+        CMinerThreadStats& stats = vThreadStats[nThread];
+        stats.nHashes += nHashes;
+        stats.nMeterHashes += nHashes;
+        if (fBlock)
+            stats.nBlocks++;
+
+        // Meter hashes/sec
+        int64 nNow = GetTimeMillis();
+        if (nNow - stats.nMeterStart > 4000)
+        {
+            stats.dHashesPerSec = 1000.0 * stats.nMeterHashes / (nNow - stats.nMeterStart);
+            stats.nMeterStart = nNow;
+            stats.nMeterHashes = 0;
+            UpdateHashesPerSec();
+            static int64 nLogTime;
+            if (GetTime() - nLogTime > 30 * 60)
+            {
+                nLogTime = GetTime();
+                printf("hashmeter %3d CPUs %6.0f khash/s\n", vnThreadsRunning[THREAD_MINER], dHashesPerSec/1000.0);
+            }
+        }
+    }
+
+    void GetThreadStats(std::vector<CMinerThreadStats>& vStats)
+    {
+        LOCK(cs_stats);
+        vStats = vThreadStats;
+    }
+};
+
+static CMinerTemplate minerTemplate;
+
+void GetMinerThreadStats(std::vector<CMinerThreadStats>& vStats)
+{
+    minerTemplate.GetThreadStats(vStats);
+}
+
+/** Scratchpad and hash meter slot of a proof-of-work thread */
+class CMinerThread
+{
+public:
+    int nThread;
+    void* scratchbuf;
+
+    CMinerThread()
+    {
+        nThread = minerTemplate.AddThread();
+        bool fHugePages;
+        scratchbuf = scrypt_miner_buffer_alloc(&fHugePages);
+        printf("BitcoinMiner thread %d: scrypt scratchpad %s\n", nThread, scratchbuf == NULL ? "allocation failed" :
+               fHugePages ? "on huge pages" : "on normal pages");
+    }
+
+    ~CMinerThread()
+    {
+        scrypt_miner_buffer_free(scratchbuf);
+        minerTemplate.RemoveThread(nThread);
+    }
+};
+
+void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
+{
     printf("CPUMiner started for proof-of-%s\n", fProofOfStake? "stake" : "work");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
@@ -4315,6 +5121,14 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
+    auto_ptr<CMinerThread> pminer;
+    if (!fProofOfStake)
+    {
+        pminer.reset(new CMinerThread());
+        if (pminer->scratchbuf == NULL)
+            return;
+    }
+
     while (fGenerateBitcoins || fProofOfStake)
     {
         if (fShutdown)
@@ -4335,19 +5149,18 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
         }
         strMintWarning = "";
 
-        //
-        // Create new block
-        //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
-
-        auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake));
-        if (!pblock.get())
-            return;
-        IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
-
         if (fProofOfStake)
         {
+            //
+            // Create new block
+            //
+            CBlockIndex* pindexPrev = pindexBest;
+
+            auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake));
+            if (!pblock.get())
+                return;
+            IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
+
             // ppcoin: if proof-of-stake block found then process block
             if (pblock->IsProofOfStake())
             {
@@ -4366,125 +5179,59 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
             continue;
         }
 
-        printf("Running BitcoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
-               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
-
         //
-        // Pre-build hash buffers
+        // Claim a range of nonces of the shared block
         //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
-
-        FormatHashBuffers(pblock.get(), pmidstate, pdata, phash1);
-
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
-
+        block_header header;
+        unsigned int nNonceEnd, nWorkId;
+        if (!minerTemplate.GetWork(pwallet, header, nNonceEnd, nWorkId))
+            return;
+        uint256 hashTarget = CBigNum().SetCompact(header.bits).getuint256();
 
         //
         // Search
         //
-        int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-
-        unsigned int max_nonce = 0xffff0000;
-        block_header res_header;
-        uint256 result;
-
-        while (true)
+        while (header.nonce < nNonceEnd)
         {
             unsigned int nHashesDone = 0;
-            unsigned int nNonceFound;
-
-            nNonceFound = scanhash_scrypt(
-                        (block_header *)&pblock->nVersion,
-                        scratchbuf,
-                        max_nonce,
-                        nHashesDone,
-                        UBEGIN(result),
-                        &res_header
-            );
-
-            // Check if something found
-            if (nNonceFound != (unsigned int) -1)
-            {
-                if (result <= hashTarget)
-                {
-                    // Found a solution
-                    pblock->nNonce = nNonceFound;
-                    assert(result == pblock->GetHash());
-                    if (!pblock->SignBlock(*pwalletMain))
-                    {
-//                        strMintWarning = strMintMessage;
-                        break;
-                    }
-                    strMintWarning = "";
+            block_header res_header;
+            uint256 result;
 
-                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock.get(), *pwalletMain, reservekey);
-                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                    break;
-                }
-            }
-
-            // Meter hashes/sec
-            static int64 nHashCounter;
-            if (nHPSTimerStart == 0)
-            {
-                nHPSTimerStart = GetTimeMillis();
-                nHashCounter = 0;
-            }
-            else
-                nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
-            {
-                static CCriticalSection cs;
-                {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
-                    {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64 nLogTime;
-                        if (GetTime() - nLogTime > 30 * 60)
-                        {
-                            nLogTime = GetTime();
-                            printf("hashmeter %3d CPUs %6.0f khash/s\n", vnThreadsRunning[THREAD_MINER], dHashesPerSec/1000.0);
-                        }
-                    }
-                }
-            }
-
-            // Check for stop or if block needs to be rebuilt
-            if (fShutdown)
-                return;
-            if (!fGenerateBitcoins)
-                return;
-            if (fLimitProcessors && vnThreadsRunning[THREAD_MINER] > nLimitProcessors)
-                return;
-            if (vNodes.empty())
-                break;
-            if (nBlockNonce >= 0xffff0000)
+            unsigned int nNonceFound = scanhash_scrypt(&header, pminer->scratchbuf, nNonceEnd, nHashesDone,
+                                                       UBEGIN(result), &res_header);
+            minerTemplate.AddHashes(pminer->nThread, nHashesDone, false);
+            if (nNonceFound == (unsigned int) -1)
                 break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+            header.nonce = nNonceFound + 1;
+            if (result > hashTarget)
+                continue;
+
+            // Found a solution
+            CBlock block;
+            if (!minerTemplate.GetBlock(nWorkId, block))
                 break;
-            if (pindexPrev != pindexBest)
+            block.nTime = res_header.timestamp;
+            block.nNonce = nNonceFound;
+            assert(result == block.GetHash());
+            if (!block.SignBlock(*pwalletMain))
                 break;
+            strMintWarning = "";
 
-            // Update nTime every few seconds
-            pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, pblock->GetMaxTransactionTime());
-            pblock->nTime = max(pblock->GetBlockTime(), pindexPrev->GetBlockTime() - nMaxClockDrift);
-            pblock->UpdateTime(pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
-
-            if (pblock->GetBlockTime() >= (int64)pblock->vtx[0].nTime + nMaxClockDrift)
-                break;  // need to update coinbase timestamp
+            SetThreadPriority(THREAD_PRIORITY_NORMAL);
+            if (CheckWork(&block, *pwalletMain, reservekey))
+                minerTemplate.AddHashes(pminer->nThread, 0, true);
+            SetThreadPriority(THREAD_PRIORITY_LOWEST);
+            break;
         }
-    }
 
-    scrypt_buffer_free(scratchbuf);
+        // Check for stop
+        if (fShutdown)
+            return;
+        if (!fGenerateBitcoins)
+            return;
+        if (fLimitProcessors && vnThreadsRunning[THREAD_MINER] > nLimitProcessors)
+            return;
+    }
 }
 
 void static ThreadBitcoinMiner(void* parg)
@@ -10,6 +10,8 @@
 #include "net.h"
 #include "script.h"
 #include "scrypt_mine.h"
+#include "blockfile.h"
+#include "merkle.h"
 
 #include <list>
 
@@ -31,6 +33,9 @@ static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+static const unsigned int MAX_ORPHAN_TRANSACTIONS_PER_PEER = MAX_ORPHAN_TRANSACTIONS/10;
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
 static const int64 MIN_TX_FEE = 0.5 * CENT;
 static const int64 MIN_RELAY_TX_FEE = 0.5 * CENT;
@@ -70,6 +75,8 @@ extern CBigNum bnBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
+extern bool fImporting;
+extern uint256 hashAssumeValid;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
 extern int64 nLastCoinStakeSearchInterval;
@@ -93,10 +100,23 @@ class CReserveKey;
 class CTxDB;
 class CTxIndex;
 
+/** Hash meter of one proof-of-work miner thread */
+struct CMinerThreadStats
+{
+    bool fRunning;
+    int64 nHashes;
+    int64 nBlocks;
+    double dHashesPerSec;
+    int64 nMeterStart;
+    int64 nMeterHashes;
+
+    CMinerThreadStats() : fRunning(false), nHashes(0), nBlocks(0), dHashesPerSec(0), nMeterStart(0), nMeterHashes(0) { }
+};
+
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, const std::set<uint256>* psetChecked=NULL);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
@@ -107,6 +127,7 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
+void GetMinerThreadStats(std::vector<CMinerThreadStats>& vStats);
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
@@ -118,6 +139,7 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
 unsigned int ComputeMinStake(unsigned int nBase, int64 nTime, unsigned int nBlockTime);
 int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
+bool IsAssumedValid(const CBlockIndex* pindex);
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
@@ -442,11 +464,38 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+protected:
+    // Hash and serialized size, kept once computed for a transaction that
+    // was read from a stream. Copies start with an empty cache. Code that
+    // changes a transaction in place after reading it must call ClearCache.
+    // Build with -DDEBUG_TXHASHCACHE to check every cached hash.
+    mutable bool fCacheable;
+    mutable uint256 hashCached;
+    mutable unsigned int nSizeCached;
+
+public:
     CTransaction()
     {
         SetNull();
     }
 
+    CTransaction(const CTransaction& tx)
+    {
+        *this = tx;
+    }
+
+    CTransaction& operator=(const CTransaction& tx)
+    {
+        nVersion = tx.nVersion;
+        nTime = tx.nTime;
+        vin = tx.vin;
+        vout = tx.vout;
+        nLockTime = tx.nLockTime;
+        nDoS = tx.nDoS;
+        ClearCache();
+        return *this;
+    }
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(this->nVersion);
@@ -455,6 +504,12 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+        {
+            fCacheable = true;
+            hashCached = 0;
+            nSizeCached = 0;
+        }
     )
 
     void SetNull()
@@ -465,6 +520,14 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        ClearCache();
+    }
+
+    void ClearCache()
+    {
+        fCacheable = false;
+        hashCached = 0;
+        nSizeCached = 0;
     }
 
     bool IsNull() const
@@ -474,7 +537,33 @@ public:
 
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        if (hashCached != 0)
+        {
+#ifdef DEBUG_TXHASHCACHE
+            assert(hashCached == SerializeHash(*this));
+#endif
+            return hashCached;
+        }
+        uint256 hash = SerializeHash(*this);
+        if (fCacheable)
+            hashCached = hash;
+        return hash;
+    }
+
+    /** Serialized size, the same on the network and on disk */
+    unsigned int GetTxSize() const
+    {
+        if (nSizeCached != 0)
+        {
+#ifdef DEBUG_TXHASHCACHE
+            assert(nSizeCached == ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION));
+#endif
+            return nSizeCached;
+        }
+        unsigned int nSize = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+        if (fCacheable)
+            nSizeCached = nSize;
+        return nSize;
     }
 
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
@@ -596,6 +685,23 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            // Deserialize straight out of the mapped block file if we can,
+            // otherwise fall back to reading it through stdio below
+            CBlockFileMappingRef mapping = GetBlockFileMapping(pos.nFile, (size_t)pos.nTxPos + 1);
+            if (mapping)
+            {
+                try {
+                    CSpanStream stream(mapping->begin() + pos.nTxPos, mapping->end(), SER_DISK, CLIENT_VERSION);
+                    stream >> *this;
+                    return true;
+                }
+                catch (std::exception &e) {
+                }
+            }
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -821,6 +927,25 @@ public:
 };
 
 
+/** Undo information for a connected block: the index entries of the earlier
+ * transactions it spends from, as they were before the block was connected.
+ * Written next to the block's index at connect time so DisconnectBlock can
+ * put them back without looking up every input.
+ */
+class CBlockUndo
+{
+public:
+    std::vector<std::pair<uint256, CTxIndex> > vPrevTxIndex;
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(vPrevTxIndex);
+    )
+};
+
+
 
 
 
@@ -962,21 +1087,25 @@ public:
 
     uint256 BuildMerkleTree() const
     {
+        // clear() keeps the capacity, so rebuilding reuses the buffer
         vMerkleTree.clear();
         BOOST_FOREACH(const CTransaction& tx, vtx)
             vMerkleTree.push_back(tx.GetHash());
-        int j = 0;
-        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
-        {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
-            j += nSize;
-        }
-        return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+        return ComputeMerkleTree(vMerkleTree);
+    }
+
+    // Merkle root after a change to the coinbase only, rehashing just its
+    // branch of the tree left by an earlier BuildMerkleTree. The tree is
+    // rebuilt if any other transaction differs from the one it was built
+    // over, such as after a transaction was replaced by one of the same size.
+    uint256 UpdateCoinbaseMerkleRoot() const
+    {
+        if (vtx.empty() || vMerkleTree.size() != GetMerkleTreeSize(vtx.size()))
+            return BuildMerkleTree();
+        for (unsigned int i = 1; i < vtx.size(); i++)
+            if (vMerkleTree[i] != vtx[i].GetHash())
+                return BuildMerkleTree();
+        return UpdateMerkleTreeFirstLeaf(vMerkleTree, vtx.size(), vtx[0].GetHash());
     }
 
     std::vector<uint256> GetMerkleBranch(int nIndex) const
@@ -1031,29 +1160,67 @@ public:
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
+        InvalidateBlockFileMapping(nFileRet);
+        if (!fImporting && (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0))
             FileCommit(fileout);
 
         return true;
     }
 
-    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
+    bool ReadFromMapping(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions)
     {
-        SetNull();
-
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
+        // The index header written just before the block holds its length,
+        // so the block can be deserialized from exactly that span of the map
+        unsigned int nSize = 0;
+        if (nBlockPos < sizeof(nSize))
+            return false;
+        CBlockFileMappingRef mapping = GetBlockFileMapping(nFile, nBlockPos);
+        if (!mapping)
+            return false;
+        memcpy(&nSize, mapping->begin() + nBlockPos - sizeof(nSize), sizeof(nSize));
+        if (nSize > MAX_BLOCK_SIZE)
+            return false;
+        if (!mapping->Contains(nBlockPos, nSize))
+        {
+            mapping = GetBlockFileMapping(nFile, (size_t)nBlockPos + nSize);
+            if (!mapping)
+                return false;
+        }
 
-        // Read block
         try {
-            filein >> *this;
+            CSpanStream stream(mapping->begin() + nBlockPos, mapping->begin() + nBlockPos + nSize, SER_DISK, CLIENT_VERSION);
+            if (!fReadTransactions)
+                stream.nType |= SER_BLOCKHEADERONLY;
+            stream >> *this;
         }
         catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            return false;
+        }
+        return true;
+    }
+
+    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
+    {
+        SetNull();
+
+        if (!ReadFromMapping(nFile, nBlockPos, fReadTransactions))
+        {
+            SetNull();
+
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+            if (!fReadTransactions)
+                filein.nType |= SER_BLOCKHEADERONLY;
+
+            // Read block
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
         }
 
         // Check the header
@@ -1600,4 +1767,18 @@ public:
 
 extern CTxMemPool mempool;
 
+
+
+/** A transaction whose inputs aren't known yet, held until its parents
+ *  arrive. Indexed by the outpoints it spends, see AddOrphanTx. */
+struct COrphanTx
+{
+    CTransaction tx;
+    int nPeer;          // CNode::nNodeId of the peer that sent it
+    int64 nTimeExpire;
+};
+
+bool AddOrphanTx(const CTransaction& tx, int nPeer);
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+
 #endif
@@ -0,0 +1,157 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "merkle.h"
+#include "sha256lanes.h"
+
+#include <assert.h>
+
+using namespace std;
+
+template<typename V, int N>
+static inline __attribute__((always_inline)) void HashPairLanes(const unsigned char* ppairs, uint256* phash)
+{
+    V s[8], w[16];
+
+    // First block: the two child hashes
+    for (int i = 0; i < 16; i++)
+        SHA256LoadLanes<V, N>(w[i], ppairs, 64, i);
+    for (int i = 0; i < 8; i++)
+        s[i] = SHA256_SPLAT(V, SHA256_IV[i]);
+    SHA256TransformLanes(s, w);
+
+    // Second block: padding of a 64 byte message
+    w[0] = SHA256_SPLAT(V, 0x80000000);
+    for (int i = 1; i < 15; i++)
+        w[i] = SHA256_SPLAT(V, 0);
+    w[15] = SHA256_SPLAT(V, 512);
+    SHA256TransformLanes(s, w);
+
+    // Third block: the first hash and its padding
+    SHA256DFinishLanes<V, N>(s, phash);
+}
+
+static void HashPairs1(const unsigned char* ppairs, uint256* phash)
+{
+    HashPairLanes<unsigned int, 1>(ppairs, phash);
+}
+
+#ifdef USE_SHA256_X86
+__attribute__((target("sse4.1"))) static void HashPairs4(const unsigned char* ppairs, uint256* phash)
+{
+    HashPairLanes<v4u32, 4>(ppairs, phash);
+}
+
+__attribute__((target("avx2"))) static void HashPairs8(const unsigned char* ppairs, uint256* phash)
+{
+    HashPairLanes<v8u32, 8>(ppairs, phash);
+}
+
+__attribute__((target("avx512f"))) static void HashPairs16(const unsigned char* ppairs, uint256* phash)
+{
+    HashPairLanes<v16u32, 16>(ppairs, phash);
+}
+
+static void HashPairsSHANI(const unsigned char* ppairs, uint256* phash)
+{
+    static const unsigned char pchPadding[64] = { 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0 };
+    unsigned int state[8];
+    memcpy(state, SHA256_IV, sizeof(state));
+    SHA256TransformSHANI(state, ppairs);
+    SHA256TransformSHANI(state, pchPadding);
+    SHA256DFinishSHANI(state, phash);
+}
+#endif
+
+static CLaneHasherRegistry<64>& GetMerkleHashers()
+{
+    // Constructed on first use; the first entry is the default
+#ifdef USE_SHA256_X86
+    static CLaneHasherRegistry<64> registry(HashPairs1, HashPairsSHANI, HashPairs4, HashPairs8, HashPairs16);
+#else
+    static CLaneHasherRegistry<64> registry(HashPairs1, NULL, NULL, NULL, NULL);
+#endif
+    return registry;
+}
+
+vector<string> GetMerkleHasherNames()
+{
+    return GetMerkleHashers().GetNames();
+}
+
+CMerkleHasher* GetMerkleHasher(const string& strName)
+{
+    return GetMerkleHashers().Get(strName);
+}
+
+bool SelectMerkleHasher(const string& strName)
+{
+    return GetMerkleHashers().Select(strName);
+}
+
+CMerkleHasher* GetSelectedMerkleHasher()
+{
+    return GetMerkleHashers().GetSelected();
+}
+
+void HashMerklePairs(const uint256* pin, unsigned int nPairs, uint256* pout)
+{
+    GetSelectedMerkleHasher()->Hash(pin, nPairs, pout);
+}
+
+unsigned int GetMerkleTreeSize(unsigned int nLeaves)
+{
+    if (nLeaves == 0)
+        return 0;
+    unsigned int nTotal = nLeaves;
+    for (unsigned int nSize = nLeaves; nSize > 1; nSize = (nSize + 1) / 2)
+        nTotal += (nSize + 1) / 2;
+    return nTotal;
+}
+
+uint256 ComputeMerkleTree(vector<uint256>& vTree)
+{
+    unsigned int nLeaves = vTree.size();
+    if (nLeaves == 0)
+        return 0;
+    vTree.resize(GetMerkleTreeSize(nLeaves));
+
+    CMerkleHasher* phasher = GetSelectedMerkleHasher();
+    unsigned int j = 0;
+    for (unsigned int nSize = nLeaves; nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        // Adjacent nodes are contiguous, so a level is hashed in one call
+        unsigned int nPairs = nSize / 2;
+        phasher->Hash(&vTree[j], nPairs, &vTree[j + nSize]);
+        if (nSize & 1)
+        {
+            // An odd last node is paired with itself
+            uint256 pair[2] = { vTree[j + nSize - 1], vTree[j + nSize - 1] };
+            phasher->Hash(pair, 1, &vTree[j + nSize + nPairs]);
+        }
+        j += nSize;
+    }
+    return vTree.back();
+}
+
+uint256 UpdateMerkleTreeFirstLeaf(vector<uint256>& vTree, unsigned int nLeaves, const uint256& hashLeaf)
+{
+    assert(vTree.size() == GetMerkleTreeSize(nLeaves));
+    if (nLeaves == 0)
+        return 0;
+    vTree[0] = hashLeaf;
+
+    CMerkleHasher* phasher = GetSelectedMerkleHasher();
+    unsigned int j = 0;
+    for (unsigned int nSize = nLeaves; nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        phasher->Hash(&vTree[j], 1, &vTree[j + nSize]);
+        j += nSize;
+    }
+    return vTree.back();
+}
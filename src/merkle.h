@@ -0,0 +1,47 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BCINNIOIN_MERKLE_H
+#define BCINNIOIN_MERKLE_H
+
+#include "lanehasher.h"
+#include "uint256.h"
+
+#include <string>
+#include <vector>
+
+/** Double SHA-256 of many merkle node pairs at once.
+ *
+ * Each pair of 32 byte child hashes is one 64 byte SHA-256 block, so a
+ * parent is three compressions: the pair, the constant padding block and
+ * the second hash. The SIMD backends hash one pair per vector lane.
+ * Backends that the CPU doesn't support are not listed.
+ */
+typedef CLaneHasher<64> CMerkleHasher;
+
+// Names of the backends this CPU supports, the default first
+std::vector<std::string> GetMerkleHasherNames();
+// Look up a backend by name, NULL if it is not available
+CMerkleHasher* GetMerkleHasher(const std::string& strName);
+// Select the backend used by HashMerklePairs
+bool SelectMerkleHasher(const std::string& strName);
+CMerkleHasher* GetSelectedMerkleHasher();
+
+// Hash node pairs with the backend selected with -merklehash
+void HashMerklePairs(const uint256* pin, unsigned int nPairs, uint256* pout);
+
+// Number of nodes in the tree over nLeaves leaves, leaves included
+unsigned int GetMerkleTreeSize(unsigned int nLeaves);
+
+// Build the tree over the leaves already in vTree, level by level after
+// them, and return the root. vTree is resized once, so a buffer kept
+// between calls is not reallocated.
+uint256 ComputeMerkleTree(std::vector<uint256>& vTree);
+
+// Replace the first leaf of a tree built by ComputeMerkleTree and rehash
+// only the path from it to the root, which is what changes when a miner
+// rolls the extra nonce in the coinbase. Returns the new root.
+uint256 UpdateMerkleTreeFirstLeaf(std::vector<uint256>& vTree, unsigned int nLeaves, const uint256& hashLeaf);
+
+#endif // BCINNIOIN_MERKLE_H
@@ -566,6 +566,8 @@ void CNode::PushVersion()
 
 std::map<CNetAddr, int64> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
+int CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
 
 void CNode::ClearBanned()
 {
@@ -1546,9 +1548,10 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
     //
     if (fShutdown)
         return false;
+    // regtest nodes of one machine differ only by port
     if (!strDest)
         if (IsLocal(addrConnect) ||
-            FindNode((CNetAddr)addrConnect) || CNode::IsBanned(addrConnect) ||
+            (fRegTest ? FindNode((CService)addrConnect) : FindNode((CNetAddr)addrConnect)) || CNode::IsBanned(addrConnect) ||
             FindNode(addrConnect.ToStringIPPort().c_str()))
             return false;
     if (strDest && FindNode(strDest))
@@ -1616,6 +1619,7 @@ void ThreadMessageHandler2(void* parg)
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        bool fMoreWork = false;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             // Receive messages
@@ -1624,6 +1628,8 @@ void ThreadMessageHandler2(void* parg)
                 if (lockRecv)
                     ProcessMessages(pnode);
             }
+            if (!pnode->setOrphanWork.empty())
+                fMoreWork = true;
             if (fShutdown)
                 return;
 
@@ -1647,7 +1653,7 @@ void ThreadMessageHandler2(void* parg)
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        Sleep(100);
+        Sleep(fMoreWork ? 1 : 100); // orphans still to be retried
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1889,6 +1895,10 @@ void StartNode(void* parg)
     if (!NewThread(ThreadStakeMinter, pwalletMain))
         printf("Error: NewThread(ThreadStakeMinter) failed\n");
 
+    // Keep the key pool topped up so new addresses don't wait on key generation
+    if (!NewThread(ThreadKeyPoolRefill, pwalletMain))
+        printf("Error: NewThread(ThreadKeyPoolRefill) failed\n");
+
     // Generate coins in the background
     GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain);
 }
@@ -1926,7 +1936,10 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_MINTER] > 0) printf("ThreadStakeMinter still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    if (vnThreadsRunning[THREAD_KEYPOOL] > 0) printf("ThreadKeyPoolRefill still running\n");
+    if (vnThreadsRunning[THREAD_ADDRESSINDEX] > 0) printf("ThreadBuildAddressIndex still running\n");
+    if (vnThreadsRunning[THREAD_PUBNOTIFY] > 0) printf("ThreadPubNotify still running\n");
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_KEYPOOL] > 0)
         Sleep(20);
     Sleep(50);
     DumpAddresses();
@@ -107,6 +107,9 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_MINTER,
+    THREAD_KEYPOOL,
+    THREAD_ADDRESSINDEX,
+    THREAD_PUBNOTIFY,
 
     THREAD_MAX
 };
@@ -188,6 +191,9 @@ protected:
     static CCriticalSection cs_setBanned;
     int nMisbehavior;
 
+    static int nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
+
 public:
     int64 nReleaseTime;
     std::map<uint256, CRequestTracker> mapRequests;
@@ -209,6 +215,15 @@ public:
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
+
+    // unique for the life of the process, unlike the CNode pointer
+    int nNodeId;
+
+    // orphan transactions to retry, unlocked by transactions from this node
+    std::set<uint256> setOrphanWork;
+
+    // new blocks are sent as "cmpctblock" instead of announced by inv
+    bool fPreferCompact;
     
     SecMsgNode smsgData;
 
@@ -241,7 +256,12 @@ public:
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
+        fPreferCompact = false;
         setInventoryKnown.max_size(SendBufferSize() / 1000);
+        {
+            LOCK(cs_nLastNodeId);
+            nNodeId = ++nLastNodeId;
+        }
 
         // Be shy and don't send version until we hear
         if (!fInbound)
@@ -667,7 +687,7 @@ template<typename T>
 void RelayMessage(const CInv& inv, const T& a)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
+    ss.ReserveFor(a);
     ss << a;
     RelayMessage(inv, ss);
 }
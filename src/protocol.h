@@ -16,8 +16,11 @@
 #include "uint256.h"
 
 extern bool fTestNet;
+extern bool fRegTest;
 static inline unsigned short GetDefaultPort(const bool testnet = fTestNet)
 {
+    if (testnet && fRegTest)
+        return 31815;
     return testnet ? 31814 : 31813;
 }
 
@@ -0,0 +1,344 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "pubnotify.h"
+#include "main.h"
+#include "net.h"
+#include "emessage.h"
+#include "util.h"
+#include "strlcpy.h"
+
+#ifndef WIN32
+#include <sys/un.h>
+#endif
+
+#include <deque>
+
+using namespace std;
+
+bool fPubNotify = false;
+static bool fPubNotifyRaw = false;
+
+// Frames queued by the publishers and not yet handed to the clients,
+// bounded like each client's buffer
+static CCriticalSection cs_pubnotify;
+static deque<vector<char> > queuePubNotify;
+static size_t nPubNotifyQueued = 0;
+static size_t nPubNotifyBufferMax = 0;
+static map<string, unsigned int> mapPubNotifySequence;
+
+static vector<SOCKET> vhPubNotifyListen;
+static string strPubNotifyUnixPath;
+
+
+class CPubNotifyClient
+{
+public:
+    SOCKET hSocket;
+    deque<vector<char> > queue;
+    size_t nQueued;     // bytes in queue
+    size_t nSendOffset; // bytes of queue.front() already sent
+    unsigned int nDropped;
+
+    explicit CPubNotifyClient(SOCKET hSocketIn) : hSocket(hSocketIn), nQueued(0), nSendOffset(0), nDropped(0)
+    {
+    }
+
+    void Push(const vector<char>& vchFrame)
+    {
+        // Drop whole frames so the stream stays parseable, the client sees
+        // the gap in the sequence numbers
+        if (nQueued + vchFrame.size() > nPubNotifyBufferMax)
+        {
+            nDropped++;
+            return;
+        }
+        queue.push_back(vchFrame);
+        nQueued += vchFrame.size();
+    }
+
+    // Send as much as the socket takes without blocking, false if the
+    // client went away
+    bool Send()
+    {
+        while (!queue.empty())
+        {
+            const vector<char>& vchFrame = queue.front();
+            int nBytes = send(hSocket, &vchFrame[nSendOffset], vchFrame.size() - nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (nBytes < 0)
+            {
+                int nErr = WSAGetLastError();
+                return (nErr == WSAEWOULDBLOCK || nErr == WSAEMSGSIZE || nErr == WSAEINTR || nErr == WSAEINPROGRESS);
+            }
+            nSendOffset += nBytes;
+            if (nSendOffset < vchFrame.size())
+                return true;
+            nQueued -= vchFrame.size();
+            nSendOffset = 0;
+            queue.pop_front();
+        }
+        return true;
+    }
+};
+
+
+static void WriteLE32(vector<char>& vch, unsigned int n)
+{
+    for (int i = 0; i < 4; i++)
+        vch.push_back((char)(n >> (8 * i)));
+}
+
+void PubNotify(const string& strTopic, const vector<char>& vchBody)
+{
+    if (!fPubNotify)
+        return;
+
+    vector<char> vchFrame;
+    vchFrame.reserve(12 + strTopic.size() + vchBody.size());
+    WriteLE32(vchFrame, strTopic.size());
+    vchFrame.insert(vchFrame.end(), strTopic.begin(), strTopic.end());
+    WriteLE32(vchFrame, vchBody.size());
+    vchFrame.insert(vchFrame.end(), vchBody.begin(), vchBody.end());
+
+    LOCK(cs_pubnotify);
+    // The sequence number is taken even when the frame is dropped
+    WriteLE32(vchFrame, mapPubNotifySequence[strTopic]++);
+    if (nPubNotifyQueued + vchFrame.size() > nPubNotifyBufferMax)
+        return;
+    nPubNotifyQueued += vchFrame.size();
+    queuePubNotify.push_back(vector<char>());
+    queuePubNotify.back().swap(vchFrame);
+}
+
+void PubNotifyBlock(const CBlock& block)
+{
+    if (!fPubNotify)
+        return;
+    uint256 hash = block.GetHash();
+    PubNotify("hashblock", vector<char>((const char*)hash.begin(), (const char*)hash.end()));
+    if (fPubNotifyRaw)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << block;
+        PubNotify("rawblock", vector<char>(ss.begin(), ss.end()));
+    }
+}
+
+void PubNotifyTransaction(const CTransaction& tx)
+{
+    if (!fPubNotify)
+        return;
+    uint256 hash = tx.GetHash();
+    PubNotify("hashtx", vector<char>((const char*)hash.begin(), (const char*)hash.end()));
+    if (fPubNotifyRaw)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << tx;
+        PubNotify("rawtx", vector<char>(ss.begin(), ss.end()));
+    }
+}
+
+static void PubNotifySecMsgInbox(SecInboxMsg& inboxHdr)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << inboxHdr;
+    PubNotify("smsginbox", vector<char>(ss.begin(), ss.end()));
+}
+
+
+static bool SetNonBlocking(SOCKET hSocket)
+{
+#ifdef WIN32
+    u_long nOne = 1;
+    return ioctlsocket(hSocket, FIONBIO, &nOne) != SOCKET_ERROR;
+#else
+    return fcntl(hSocket, F_SETFL, O_NONBLOCK) != SOCKET_ERROR;
+#endif
+}
+
+static bool ListenPubNotify(const struct sockaddr* paddr, socklen_t len, const string& strAddr, string& strError)
+{
+    SOCKET hSocket = socket(paddr->sa_family, SOCK_STREAM, 0);
+    if (hSocket == INVALID_SOCKET)
+    {
+        strError = strprintf(_("Couldn't open notification socket (error %d)"), WSAGetLastError());
+        return false;
+    }
+    int nOne = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(hSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&nOne, sizeof(int));
+#endif
+    if (paddr->sa_family != AF_UNIX)
+        setsockopt(hSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+    if (bind(hSocket, paddr, len) == SOCKET_ERROR || listen(hSocket, SOMAXCONN) == SOCKET_ERROR || !SetNonBlocking(hSocket))
+    {
+        strError = strprintf(_("Unable to listen for notification clients on %s (error %d)"), strAddr.c_str(), WSAGetLastError());
+        closesocket(hSocket);
+        return false;
+    }
+    vhPubNotifyListen.push_back(hSocket);
+    printf("Publishing notifications on %s\n", strAddr.c_str());
+    return true;
+}
+
+static void ThreadPubNotify(void* parg)
+{
+    // Make this thread recognisable as the notification thread
+    RenameThread("bitcoin-pubntfy");
+
+    vnThreadsRunning[THREAD_PUBNOTIFY]++;
+    vector<CPubNotifyClient> vClients;
+    try
+    {
+        while (!fShutdown)
+        {
+            // Hand newly published frames to every client
+            deque<vector<char> > queue;
+            {
+                LOCK(cs_pubnotify);
+                queue.swap(queuePubNotify);
+                nPubNotifyQueued = 0;
+            }
+            BOOST_FOREACH(const vector<char>& vchFrame, queue)
+                BOOST_FOREACH(CPubNotifyClient& client, vClients)
+                    client.Push(vchFrame);
+
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 20000; // frequency to poll the publish queue
+            fd_set fdsetRecv;
+            fd_set fdsetSend;
+            FD_ZERO(&fdsetRecv);
+            FD_ZERO(&fdsetSend);
+            SOCKET hSocketMax = 0;
+            BOOST_FOREACH(SOCKET hListen, vhPubNotifyListen)
+            {
+                FD_SET(hListen, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListen);
+            }
+            BOOST_FOREACH(const CPubNotifyClient& client, vClients)
+            {
+                // Clients don't send anything, readable means closed
+                FD_SET(client.hSocket, &fdsetRecv);
+                if (!client.queue.empty())
+                    FD_SET(client.hSocket, &fdsetSend);
+                hSocketMax = max(hSocketMax, client.hSocket);
+            }
+            if (select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout) == SOCKET_ERROR)
+            {
+                Sleep(20);
+                continue;
+            }
+
+            BOOST_FOREACH(SOCKET hListen, vhPubNotifyListen)
+            {
+                if (!FD_ISSET(hListen, &fdsetRecv))
+                    continue;
+                SOCKET hSocket = accept(hListen, NULL, NULL);
+                if (hSocket == INVALID_SOCKET)
+                    continue;
+                if (!SetNonBlocking(hSocket))
+                {
+                    closesocket(hSocket);
+                    continue;
+                }
+                vClients.push_back(CPubNotifyClient(hSocket));
+                printf("Notification client connected, %"PRIszu" clients\n", vClients.size());
+            }
+
+            for (vector<CPubNotifyClient>::iterator it = vClients.begin(); it != vClients.end(); )
+            {
+                bool fOK = true;
+                if (FD_ISSET(it->hSocket, &fdsetRecv))
+                {
+                    char pchBuf[256];
+                    int nBytes = recv(it->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                    if (nBytes == 0 || (nBytes < 0 && WSAGetLastError() != WSAEWOULDBLOCK))
+                        fOK = false;
+                }
+                if (fOK && FD_ISSET(it->hSocket, &fdsetSend))
+                    fOK = it->Send();
+                if (fOK)
+                {
+                    ++it;
+                    continue;
+                }
+                if (it->nDropped)
+                    printf("Notification client dropped %u frames\n", it->nDropped);
+                closesocket(it->hSocket);
+                it = vClients.erase(it);
+                printf("Notification client disconnected, %"PRIszu" clients\n", vClients.size());
+            }
+        }
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadPubNotify()");
+    }
+
+    BOOST_FOREACH(CPubNotifyClient& client, vClients)
+        closesocket(client.hSocket);
+    BOOST_FOREACH(SOCKET& hListen, vhPubNotifyListen)
+        closesocket(hListen);
+    vhPubNotifyListen.clear();
+#ifndef WIN32
+    if (!strPubNotifyUnixPath.empty())
+        unlink(strPubNotifyUnixPath.c_str());
+#endif
+    vnThreadsRunning[THREAD_PUBNOTIFY]--;
+}
+
+bool StartPubNotify(string& strError)
+{
+    if (mapArgs.count("-pubnotify"))
+    {
+        int nPort = GetArg("-pubnotify", 0);
+        if (nPort <= 0 || nPort > 65535)
+        {
+            strError = strprintf(_("Invalid port for -pubnotify: '%s'"), mapArgs["-pubnotify"].c_str());
+            return false;
+        }
+        struct sockaddr_in sockaddr;
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sin_family = AF_INET;
+        sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sockaddr.sin_port = htons(nPort);
+        if (!ListenPubNotify((struct sockaddr*)&sockaddr, sizeof(sockaddr), strprintf("127.0.0.1:%d", nPort), strError))
+            return false;
+    }
+
+#ifndef WIN32
+    if (mapArgs.count("-pubnotifyunix"))
+    {
+        string strPath = mapArgs["-pubnotifyunix"];
+        struct sockaddr_un sockaddr;
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        if (strPath.empty() || strPath.size() >= sizeof(sockaddr.sun_path))
+        {
+            strError = strprintf(_("Invalid path for -pubnotifyunix: '%s'"), strPath.c_str());
+            return false;
+        }
+        sockaddr.sun_family = AF_UNIX;
+        strlcpy(sockaddr.sun_path, strPath.c_str(), sizeof(sockaddr.sun_path));
+        unlink(strPath.c_str()); // left behind by an earlier run
+        if (!ListenPubNotify((struct sockaddr*)&sockaddr, sizeof(sockaddr), strPath, strError))
+            return false;
+        strPubNotifyUnixPath = strPath;
+    }
+#endif
+
+    if (vhPubNotifyListen.empty())
+        return true;
+
+    fPubNotifyRaw = GetBoolArg("-pubnotifyraw");
+    nPubNotifyBufferMax = max(GetArg("-pubnotifybuffer", 16 * 1024 * 1024), (int64)MAX_BLOCK_SIZE * 2);
+    NotifySecMsgInboxChanged.connect(&PubNotifySecMsgInbox);
+    fPubNotify = true;
+
+    if (!NewThread(ThreadPubNotify, NULL))
+    {
+        strError = _("Error: could not start notification thread");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,46 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BCINNIOIN_PUBNOTIFY_H
+#define BCINNIOIN_PUBNOTIFY_H
+
+#include <string>
+#include <vector>
+
+class CBlock;
+class CTransaction;
+
+/** Push notifications for local consumers.
+ *
+ *  With -pubnotify=<port> the node listens on 127.0.0.1:<port>, and with
+ *  -pubnotifyunix=<path> on a Unix domain socket. Every connected client
+ *  receives a stream of frames, all integers little-endian:
+ *
+ *      uint32 topic length, topic, uint32 body length, body, uint32 sequence
+ *
+ *  Topics are "hashblock" and "hashtx" (the 32 byte hash), "rawblock" and
+ *  "rawtx" (the serialized block or transaction, with -pubnotifyraw) and
+ *  "smsginbox" (the serialized SecInboxMsg). The sequence number counts
+ *  frames per topic, a gap means frames were dropped because the client
+ *  fell more than -pubnotifybuffer bytes behind.
+ *
+ *  Publishing only queues the frame; a separate thread does all socket I/O
+ *  so the validation thread never waits on a slow client.
+ */
+
+extern bool fPubNotify;
+
+/** Queue a frame for all clients */
+void PubNotify(const std::string& strTopic, const std::vector<char>& vchBody);
+
+/** New best block, called from SetBestChain */
+void PubNotifyBlock(const CBlock& block);
+
+/** Transaction added to the memory pool */
+void PubNotifyTransaction(const CTransaction& tx);
+
+/** Open the sockets from -pubnotify and -pubnotifyunix and start the
+ *  publishing thread. Does nothing if neither is set. */
+bool StartPubNotify(std::string& strError);
+
+#endif
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "db.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -230,3 +231,193 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns usage and hit/miss counters of the signature cache.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("entries",    (boost::uint64_t)stats.nEntries));
+    obj.push_back(Pair("maxentries", (boost::uint64_t)stats.nMaxEntries));
+    obj.push_back(Pair("bytes",      (boost::uint64_t)stats.nBytes));
+    obj.push_back(Pair("hits",       (boost::uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",     (boost::uint64_t)stats.nMisses));
+    return obj;
+}
+
+// Parse an address argument into its index key, and make sure the index can
+// answer for it
+static void ParseIndexAddress(const Value& value, unsigned char& nType, uint160& hashBytes)
+{
+    CBitcoinAddress address(value.get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid CinniCoin address");
+    CScript script;
+    script.SetDestination(address.Get());
+    if (!GetAddressIndexKey(script, nType, hashBytes))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid CinniCoin address");
+}
+
+static void CheckAddressIndex(CTxDB& txdb, unsigned int nFlag)
+{
+    LOCK(cs_main);
+    if (!(nAddressIndexFlags & nFlag))
+        throw JSONRPCError(RPC_MISC_ERROR, nFlag == INDEX_SPENT ? "Spent index not enabled, start with -spentindex"
+                                                                : "Address index not enabled, start with -addressindex");
+    if (!IsAddressIndexSynced(txdb))
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(GetAddressIndexBest(txdb));
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Index is still being built (block %d of %d)",
+                                                     mi != mapBlockIndex.end() ? mi->second->nHeight : 0, nBestHeight));
+    }
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1)
+        throw runtime_error(
+            "getaddressbalance <address> [address...]\n"
+            "Returns the balance of the addresses and the total they have received.\n"
+            "Coins sent back to the same address, like a coinstake's, are not counted as received.\n"
+            "Requires -addressindex.");
+
+    CTxDB txdb("r");
+    CheckAddressIndex(txdb, INDEX_ADDRESS);
+
+    // An address given twice is only counted once
+    int64 nBalance = 0;
+    int64 nReceived = 0;
+    set<pair<unsigned char, uint160> > setSeen;
+    BOOST_FOREACH(const Value& value, params)
+    {
+        unsigned char nType;
+        uint160 hashBytes;
+        ParseIndexAddress(value, nType, hashBytes);
+        if (!setSeen.insert(make_pair(nType, hashBytes)).second)
+            continue;
+
+        // Unspent outputs are far fewer than history entries for busy addresses
+        vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        vector<pair<CAddressIndexKey, int64> > vEntries;
+        if (!txdb.ReadAddressUnspentIndex(nType, hashBytes, vUnspent) || !txdb.ReadAddressIndex(nType, hashBytes, vEntries))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading address index");
+        for (unsigned int i = 0; i < vUnspent.size(); i++)
+            nBalance += vUnspent[i].second.nValue;
+        nReceived += GetAddressReceived(vEntries);
+    }
+
+    Object result;
+    result.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(Pair("received", ValueFromAmount(nReceived)));
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1)
+        throw runtime_error(
+            "getaddressutxos <address> [address...]\n"
+            "Returns the unspent outputs paying to the addresses.\n"
+            "Requires -addressindex.");
+
+    CTxDB txdb("r");
+    CheckAddressIndex(txdb, INDEX_ADDRESS);
+
+    Array result;
+    set<pair<unsigned char, uint160> > setSeen;
+    BOOST_FOREACH(const Value& value, params)
+    {
+        unsigned char nType;
+        uint160 hashBytes;
+        ParseIndexAddress(value, nType, hashBytes);
+        if (!setSeen.insert(make_pair(nType, hashBytes)).second)
+            continue;
+
+        vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        if (!txdb.ReadAddressUnspentIndex(nType, hashBytes, vUnspent))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading address index");
+        for (unsigned int i = 0; i < vUnspent.size(); i++)
+        {
+            const CAddressUnspentKey& key = vUnspent[i].first;
+            const CAddressUnspentValue& unspent = vUnspent[i].second;
+            Object entry;
+            entry.push_back(Pair("address", value.get_str()));
+            entry.push_back(Pair("txid", key.txhash.GetHex()));
+            entry.push_back(Pair("vout", (int)key.nIndex));
+            entry.push_back(Pair("scriptPubKey", HexStr(unspent.script.begin(), unspent.script.end())));
+            entry.push_back(Pair("amount", ValueFromAmount(unspent.nValue)));
+            entry.push_back(Pair("height", unspent.nHeight));
+            result.push_back(entry);
+        }
+    }
+    return result;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresstxids <address> [start height] [end height]\n"
+            "Returns the ids of the transactions that pay to or spend from <address>, oldest first.\n"
+            "Requires -addressindex.");
+
+    CTxDB txdb("r");
+    CheckAddressIndex(txdb, INDEX_ADDRESS);
+
+    unsigned char nType;
+    uint160 hashBytes;
+    ParseIndexAddress(params[0], nType, hashBytes);
+    int nStart = (params.size() > 1 ? params[1].get_int() : 0);
+    int nEnd = (params.size() > 2 ? params[2].get_int() : 0);
+    if (nStart < 0 || nEnd < 0 || (nEnd > 0 && nEnd < nStart))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid height range");
+
+    vector<pair<CAddressIndexKey, int64> > vEntries;
+    if (!txdb.ReadAddressIndex(nType, hashBytes, vEntries, nStart, nEnd))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading address index");
+
+    // A transaction has an entry for every input and output involving the address
+    Array result;
+    set<uint256> setSeen;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        if (setSeen.insert(vEntries[i].first.txhash).second)
+            result.push_back(vEntries[i].first.txhash.GetHex());
+    return result;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo <txid> <vout>\n"
+            "Returns the transaction and input that spent output <vout> of <txid>.\n"
+            "Requires -spentindex.");
+
+    CTxDB txdb("r");
+    CheckAddressIndex(txdb, INDEX_SPENT);
+
+    uint256 hash;
+    hash.SetHex(params[0].get_str());
+    int nOut = params[1].get_int();
+    if (nOut < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid vout");
+
+    CSpentIndexValue spent;
+    if (!txdb.ReadSpentIndex(CSpentIndexKey(hash, nOut), spent))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to find spending transaction");
+
+    Object result;
+    result.push_back(Pair("txid", spent.txid.GetHex()));
+    result.push_back(Pair("vin", (int)spent.nInputIndex));
+    result.push_back(Pair("height", spent.nHeight));
+    result.push_back(Pair("amount", ValueFromAmount(spent.nValue)));
+    if (spent.nType)
+        result.push_back(Pair("address", GetAddressFromIndexKey(spent.nType, spent.hashBytes).ToString()));
+    return result;
+}
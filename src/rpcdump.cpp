@@ -61,16 +61,32 @@ Value importprivkey(const Array& params, bool fHelp)
         pwalletMain->MarkDirty();
         pwalletMain->SetAddressBookName(vchAddress, strLabel);
 
+        // The key's age is unknown, so the whole chain has to be rescanned
+        pwalletMain->mapKeyMetadata[vchAddress].nCreateTime = 1;
+        pwalletMain->UpdateTimeFirstKey(1);
+
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
-
-        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-        pwalletMain->ReacceptWalletTransactions();
     }
 
+    // The rescan takes cs_main and cs_wallet only while adding what it finds
+    pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+    pwalletMain->ReacceptWalletTransactions();
+
     return Value::null;
 }
 
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "Stops a running wallet rescan, for example one started by importprivkey.\n"
+            "Returns false if no rescan was running.");
+
+    return pwalletMain->AbortRescan();
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
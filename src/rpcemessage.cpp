@@ -74,6 +74,8 @@ Value smsgoptions(const Array& params, bool fHelp)
     Object result;
     //char cbuf[256];
     
+    LOCK(cs_smsgAddresses);
+    
     if (mode == "list")
     {
         result.push_back(Pair("option", std::string("newAddressRecv = ") + (smsgOptions.fNewAddressRecv ? "true" : "false")));
@@ -159,6 +161,8 @@ Value smsglocalkeys(const Array& params, bool fHelp)
     
     char cbuf[256];
     
+    LOCK(cs_smsgAddresses);
+    
     if (mode == "whitelist"
         || mode == "all")
     {
@@ -976,33 +980,39 @@ Value smsgbuckets(const Array& params, bool fHelp)
     {
         uint32_t nBuckets = 0;
         uint32_t nMessages = 0;
+        uint64_t nInMemory = 0;
         uint64_t nBytes = 0;
         {
-            LOCK(cs_smsg);
-            std::map<int64_t, SecMsgBucket>::iterator it;
-            it = smsgBuckets.begin();
+            std::vector<int64_t> vTimes;
+            SecureMsgGetBucketTimes(vTimes);
             
-            for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+            BOOST_FOREACH(int64_t bucketTime, vTimes)
             {
-                std::set<SecMsgToken>& tokenSet = it->second.setTokens;
+                LOCK(SecureMsgBucketLock(bucketTime));
+                SecMsgBucket* pbucket = SecureMsgFindBucket(bucketTime);
+                if (!pbucket)
+                    continue;
                 
-                std::string sBucket = boost::lexical_cast<std::string>(it->first);
+                std::string sBucket = boost::lexical_cast<std::string>(bucketTime);
                 std::string sFile = sBucket + "_01.dat";
                 
-                snprintf(cbuf, sizeof(cbuf), "%"PRIszu, tokenSet.size());
+                snprintf(cbuf, sizeof(cbuf), "%u", pbucket->size());
                 std::string snContents(cbuf);
                 
-                std::string sHash = boost::lexical_cast<std::string>(it->second.hash);
+                std::string sHash = boost::lexical_cast<std::string>(pbucket->nDigest);
                 
                 nBuckets++;
-                nMessages += tokenSet.size();
+                nMessages += pbucket->size();
+                if (pbucket->fLoaded)
+                    nInMemory += pbucket->vTokens.size();
                 
                 Object objM;
                 objM.push_back(Pair("bucket", sBucket));
-                objM.push_back(Pair("time", getTimeString(it->first, cbuf, sizeof(cbuf))));
+                objM.push_back(Pair("time", getTimeString(bucketTime, cbuf, sizeof(cbuf))));
                 objM.push_back(Pair("no. messages", snContents));
                 objM.push_back(Pair("hash", sHash));
-                objM.push_back(Pair("last changed", getTimeString(it->second.timeChanged, cbuf, sizeof(cbuf))));
+                objM.push_back(Pair("in memory", pbucket->fLoaded ? "yes" : "no"));
+                objM.push_back(Pair("last changed", getTimeString(pbucket->timeChanged, cbuf, sizeof(cbuf))));
                 
                 boost::filesystem::path fullPath = GetDataDir() / "smsgStore" / sFile;
 
@@ -1010,7 +1020,7 @@ Value smsgbuckets(const Array& params, bool fHelp)
                 if (!boost::filesystem::exists(fullPath))
                 {
                     // -- If there is a file for an empty bucket something is wrong.
-                    if (tokenSet.size() == 0)
+                    if (pbucket->size() == 0)
                         objM.push_back(Pair("file size", "Empty bucket."));
                     else
                         objM.push_back(Pair("file size, error", "File not found."));
@@ -1030,7 +1040,7 @@ Value smsgbuckets(const Array& params, bool fHelp)
                 
                 result.push_back(Pair("bucket", objM));
             };
-        }; // LOCK(cs_smsg);
+        };
         
         
         std::string snBuckets = boost::lexical_cast<std::string>(nBuckets);
@@ -1039,32 +1049,51 @@ Value smsgbuckets(const Array& params, bool fHelp)
         Object objM;
         objM.push_back(Pair("buckets", snBuckets));
         objM.push_back(Pair("messages", snMessages));
+        objM.push_back(Pair("messages in memory", boost::lexical_cast<std::string>(nInMemory)));
         objM.push_back(Pair("size", fsReadable(nBytes)));
         result.push_back(Pair("total", objM));
         
+        // -- smsg traffic with peers since start, in bytes
+        SecMsgNetStats netStats;
+        SecureMsgGetNetStats(netStats);
+        
+        uint64_t nSent = 0, nRecv = 0;
+        Object objSent, objRecv;
+        std::map<std::string, uint64_t>::iterator itc;
+        for (itc = netStats.mapBytesSent.begin(); itc != netStats.mapBytesSent.end(); ++itc)
+        {
+            nSent += itc->second;
+            objSent.push_back(Pair(itc->first, boost::lexical_cast<std::string>(itc->second)));
+        };
+        for (itc = netStats.mapBytesRecv.begin(); itc != netStats.mapBytesRecv.end(); ++itc)
+        {
+            nRecv += itc->second;
+            objRecv.push_back(Pair(itc->first, boost::lexical_cast<std::string>(itc->second)));
+        };
+        
+        Object objN;
+        objN.push_back(Pair("bytes sent", boost::lexical_cast<std::string>(nSent)));
+        objN.push_back(Pair("bytes received", boost::lexical_cast<std::string>(nRecv)));
+        objN.push_back(Pair("sent", objSent));
+        objN.push_back(Pair("received", objRecv));
+        objN.push_back(Pair("buckets reconciled", boost::lexical_cast<std::string>(netStats.nReconciled)));
+        objN.push_back(Pair("reconcile failed", boost::lexical_cast<std::string>(netStats.nReconFailed)));
+        result.push_back(Pair("network", objN));
+        
     } else
     if (mode == "dump")
     {
         {
-            LOCK(cs_smsg);
-            std::map<int64_t, SecMsgBucket>::iterator it;
-            it = smsgBuckets.begin();
+            std::vector<int64_t> vTimes;
+            SecureMsgGetBucketTimes(vTimes);
             
-            for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+            BOOST_FOREACH(int64_t bucketTime, vTimes)
             {
-                std::string sFile = boost::lexical_cast<std::string>(it->first) + "_01.dat";
-                
-                try {
-                    boost::filesystem::path fullPath = GetDataDir() / "smsgStore" / sFile;
-                    boost::filesystem::remove(fullPath);
-                } catch (const boost::filesystem::filesystem_error& ex)
-                {
-                    //objM.push_back(Pair("file size, error", ex.what()));
-                    printf("Error removing bucket file %s.\n", ex.what());
-                };
+                LOCK(SecureMsgBucketLock(bucketTime));
+                SecureMsgRemoveBucketFiles(bucketTime, SMSG_FILE_DAT);
+                SecureMsgEraseBucket(bucketTime);
             };
-            smsgBuckets.clear();
-        }; // LOCK(cs_smsg);
+        };
         
         result.push_back(Pair("result", "Removed all buckets."));
         
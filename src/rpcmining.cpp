@@ -50,14 +50,36 @@ Value setgenerate(const Array& params, bool fHelp)
 
 Value gethashespersec(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gethashespersec\n"
-            "Returns a recent hashes per second performance measurement while generating.");
-
-    if (GetTimeMillis() - nHPSTimerStart > 8000)
-        return (boost::int64_t)0;
-    return (boost::int64_t)dHashesPerSec;
+            "gethashespersec [verbose]\n"
+            "Returns a recent hashes per second performance measurement while generating.\n"
+            "With [verbose] true, also breaks it down by miner thread.");
+
+    boost::int64_t nHashesPerSec = 0;
+    if (GetTimeMillis() - nHPSTimerStart <= 8000)
+        nHashesPerSec = (boost::int64_t)dHashesPerSec;
+    if (params.size() == 0 || !params[0].get_bool())
+        return nHashesPerSec;
+
+    std::vector<CMinerThreadStats> vStats;
+    GetMinerThreadStats(vStats);
+    Array threads;
+    for (unsigned int i = 0; i < vStats.size(); i++)
+    {
+        if (!vStats[i].fRunning)
+            continue;
+        Object thread;
+        thread.push_back(Pair("thread",         (int)i));
+        thread.push_back(Pair("hashespersec",   nHashesPerSec ? (boost::int64_t)vStats[i].dHashesPerSec : (boost::int64_t)0));
+        thread.push_back(Pair("hashes",         (boost::int64_t)vStats[i].nHashes));
+        thread.push_back(Pair("blocks",         (boost::int64_t)vStats[i].nBlocks));
+        threads.push_back(thread);
+    }
+    Object obj;
+    obj.push_back(Pair("hashespersec", nHashesPerSec));
+    obj.push_back(Pair("threads", threads));
+    return obj;
 }
 
 
@@ -76,13 +98,60 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     obj.push_back(Pair("generate",      GetBoolArg("-gen")));
     obj.push_back(Pair("genproclimit",  (int)GetArg("-genproclimit", -1)));
-    obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
+    obj.push_back(Pair("hashespersec",  gethashespersec(Array(), false)));
     obj.push_back(Pair("networkhashps", getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",       fTestNet));
+    obj.push_back(Pair("regtest",       fRegTest));
     return obj;
 }
 
+
+Value generate(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "generate <nblocks>\n"
+            "Mine <nblocks> proof-of-work blocks on the regtest chain right away.\n"
+            "Returns the hashes of the new blocks.");
+
+    if (!fRegTest)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "generate is only available with -regtest");
+
+    int nGenerate = params[0].get_int();
+    if (nGenerate < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of blocks");
+
+    if (pwalletMain->IsLocked())
+        throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
+
+    static unsigned int nExtraNonce = 0;
+    Array blockHashes;
+    while ((int)blockHashes.size() < nGenerate)
+    {
+        if (pindexBest->nHeight >= LAST_POW_BLOCK)
+            throw JSONRPCError(RPC_MISC_ERROR, "No more PoW blocks");
+
+        CReserveKey reservekey(pwalletMain);
+        auto_ptr<CBlock> pblock(CreateNewBlock(pwalletMain));
+        if (!pblock.get())
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        IncrementExtraNonce(pblock.get(), pindexBest, nExtraNonce);
+
+        // About every other hash meets the regtest target
+        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        while (pblock->GetHash() > hashTarget)
+            ++pblock->nNonce;
+
+        if (!pblock->SignBlock(*pwalletMain))
+            throw JSONRPCError(RPC_MISC_ERROR, "Unable to sign block");
+        if (!CheckWork(pblock.get(), *pwalletMain, reservekey))
+            throw JSONRPCError(RPC_MISC_ERROR, "Generated block was not accepted");
+        blockHashes.push_back(pblock->GetHash().GetHex());
+    }
+    return blockHashes;
+}
+
 // Litecoin: Return average network hashes per second based on last number of blocks.
 Value GetNetworkHashPS(int lookup) {
     if (pindexBest == NULL)
@@ -243,8 +312,10 @@ Value getworkex(const Array& params, bool fHelp)
             pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
         else
             CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0]; // FIXME - HACK!
+        // The template is reused for the next submit, don't let it keep this coinbase's hash
+        pblock->vtx[0].ClearCache();
 
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->hashMerkleRoot = pblock->UpdateCoinbaseMerkleRoot();
 
         if (!pblock->SignBlock(*pwalletMain))
             throw JSONRPCError(-100, "Unable to sign block, wallet locked?");
@@ -363,7 +434,8 @@ Value getwork(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->vtx[0].ClearCache();
+        pblock->hashMerkleRoot = pblock->UpdateCoinbaseMerkleRoot();
 
         if (!pblock->SignBlock(*pwalletMain))
             throw JSONRPCError(-100, "Unable to sign block, wallet locked?");
@@ -3,7 +3,6 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 using namespace boost;
@@ -16,7 +15,8 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType,
+              const CSignatureHashContext* psighash=NULL);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
@@ -250,7 +250,8 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHashContext* psighash)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -941,7 +942,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signature, since there's no way for a signature to sign itself
                     scriptCode.FindAndDelete(CScript(vchSig));
 
-                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighash);
 
                     popstack(stack);
                     popstack(stack);
@@ -1001,7 +1002,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         valtype& vchPubKey = stacktop(-ikey);
 
                         // Check signature
-                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighash))
                         {
                             isig++;
                             nSigsCount--;
@@ -1121,66 +1122,172 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txToIn) : txTo(txToIn)
+{
+    // Every input as SignatureHash blanks it, then the outputs and nLockTime
+    CDataStream ss(SER_GETHASH, 0);
+    vInputPos.reserve(txTo.vin.size() + 1);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+    {
+        vInputPos.push_back(ss.size());
+        ss << txin.prevout << CScript() << txin.nSequence;
+    }
+    vInputPos.push_back(ss.size());
+    ss << txTo.vout << txTo.nLockTime;
+    vchBlanked.assign(ss.begin(), ss.end());
+
+    // Hash state in front of each input
+    CHashWriter hasher(SER_GETHASH, 0);
+    hasher << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(hasher, txTo.vin.size());
+    vPrefix.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vPrefix.push_back(hasher);
+        hasher.write(&vchBlanked[vInputPos[i]], vInputPos[i+1] - vInputPos[i]);
+    }
+}
+
+uint256 CSignatureHashContext::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (nIn >= txTo.vin.size() ||
+        (nHashType & 0x1f) == SIGHASH_NONE ||
+        (nHashType & 0x1f) == SIGHASH_SINGLE ||
+        (nHashType & SIGHASH_ANYONECANPAY))
+        return ::SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    const CTxIn& txin = txTo.vin[nIn];
+    CHashWriter hasher(vPrefix[nIn]);
+    hasher << txin.prevout << scriptCode << txin.nSequence;
+    unsigned int nSuffixPos = vInputPos[nIn+1];
+    hasher.write(&vchBlanked[nSuffixPos], vchBlanked.size() - nSuffixPos);
+    hasher << nHashType;
+    return hasher.GetHash();
+}
+
+
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
-class CSignatureCache
+uint256 CSignatureCache::Digest(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    uint256 digest;
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, (const unsigned char*)&salt, sizeof(salt));
+    SHA256_Update(&ctx, (const unsigned char*)&hash, sizeof(hash));
+    if (!vchSig.empty())
+        SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+    if (!pubKey.empty())
+        SHA256_Update(&ctx, &pubKey[0], pubKey.size());
+    SHA256_Final((unsigned char*)&digest, &ctx);
+    return digest;
+}
 
-public:
-    bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+CSignatureCache::CSignatureCache(int64 nMaxCacheMB)
+{
+    salt = GetRandHash();
+
+    // A zero digest marks an empty slot
+    if (nMaxCacheMB < 0)
+        nMaxCacheMB = 0;
+    if (nMaxCacheMB > MAX_CACHE_MB)
     {
-        LOCK(cs_sigcache);
+        printf("-maxsigcachesize=%"PRI64d" is too large, using %"PRI64d"\n", nMaxCacheMB, (int64)MAX_CACHE_MB);
+        nMaxCacheMB = MAX_CACHE_MB;
+    }
+    nBuckets = ((size_t)nMaxCacheMB << 20) / (sizeof(uint256) * BUCKET_SIZE);
+    vEntries.resize(nBuckets * BUCKET_SIZE);
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+    for (unsigned int i = 0; i < SHARDS; i++)
+        shards[i].nEntries = shards[i].nHits = shards[i].nMisses = 0;
+}
+
+bool
+CSignatureCache::Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+{
+    if (nBuckets == 0)
         return false;
-    }
 
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    uint256 digest = Digest(hash, vchSig, pubKey);
+    size_t nBucket = digest.Get64(0) % nBuckets;
+    CShard& shard = shards[nBucket % SHARDS];
+    LOCK(shard.cs);
+
+    const uint256* pentry = &vEntries[nBucket * BUCKET_SIZE];
+    for (unsigned int i = 0; i < BUCKET_SIZE; i++)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (pentry[i] == digest)
+        {
+            shard.nHits++;
+            return true;
+        }
+    }
+    shard.nMisses++;
+    return false;
+}
+
+void CSignatureCache::Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+{
+    if (nBuckets == 0)
+        return;
 
-        LOCK(cs_sigcache);
+    uint256 digest = Digest(hash, vchSig, pubKey);
+    size_t nBucket = digest.Get64(0) % nBuckets;
+    CShard& shard = shards[nBucket % SHARDS];
+    LOCK(shard.cs);
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+    uint256* pentry = &vEntries[nBucket * BUCKET_SIZE];
+    for (unsigned int i = 0; i < BUCKET_SIZE; i++)
+    {
+        if (pentry[i] == digest)
+            return;
+        if (pentry[i] == 0)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            pentry[i] = digest;
+            shard.nEntries++;
+            return;
         }
+    }
+
+    // Bucket is full. Which entry goes depends on the salted digest, so
+    // it can't be steered by someone feeding us signatures.
+    pentry[digest.Get64(1) % BUCKET_SIZE] = digest;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+void CSignatureCache::GetStats(CSignatureCacheStats& stats)
+{
+    stats.nEntries = stats.nHits = stats.nMisses = 0;
+    stats.nMaxEntries = vEntries.size();
+    stats.nBytes = vEntries.size() * sizeof(uint256);
+    for (unsigned int i = 0; i < SHARDS; i++)
+    {
+        LOCK(shards[i].cs);
+        stats.nEntries += shards[i].nEntries;
+        stats.nHits += shards[i].nHits;
+        stats.nMisses += shards[i].nMisses;
     }
-};
+}
+
+static CSignatureCache& GetSignatureCache()
+{
+    // Constructed on first use, after -maxsigcachesize has been parsed
+    static CSignatureCache signatureCache(GetArg("-maxsigcachesize", CSignatureCache::DEFAULT_CACHE_MB));
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
 
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* psighash)
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
@@ -1191,16 +1298,16 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash;
+    if (psighash && &psighash->GetTransaction() == &txTo)
+        sighash = psighash->SignatureHash(scriptCode, nIn, nHashType);
+    else
+        sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
-    if (!key.Verify(sighash, vchSig))
+    if (!CPubKey(vchPubKey).Verify(sighash, vchSig))
         return false;
 
     signatureCache.Set(sighash, vchSig, vchPubKey);
@@ -1570,13 +1677,19 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                   bool fValidatePayToScriptHash, int nHashType)
+{
+    return VerifyScript(scriptSig, scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType, NULL);
+}
+
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                  bool fValidatePayToScriptHash, int nHashType, const CSignatureHashContext* psighash)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType, psighash))
         return false;
     if (fValidatePayToScriptHash)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType, psighash))
         return false;
     if (stack.empty())
         return false;
@@ -1594,7 +1707,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType, psighash))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1609,6 +1722,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
+    txTo.ClearCache();
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
@@ -1651,7 +1765,8 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
 }
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     const CSignatureHashContext* psighash)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1662,7 +1777,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType, psighash);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -585,7 +585,36 @@ public:
 
 
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/** Signature hashes for all inputs of one transaction.
+ *
+ * SignatureHash copies and reserializes the whole transaction for every
+ * input, so checking an n input transaction hashes O(n^2) bytes. With
+ * SIGHASH_ALL the serialization only differs in the script of the input
+ * being signed: the hash state after the header and the blanked inputs
+ * before each input is kept, and the blanked inputs after it, the outputs
+ * and nLockTime are serialized once into a shared buffer. Other hash
+ * types fall back to SignatureHash.
+ *
+ * Holds a reference to txTo, which must not change while this is in use.
+ */
+class CSignatureHashContext
+{
+private:
+    const CTransaction& txTo;
+    std::vector<CHashWriter> vPrefix;
+    std::vector<char> vchBlanked;
+    std::vector<unsigned int> vInputPos;
+
+public:
+    explicit CSignatureHashContext(const CTransaction& txToIn);
+
+    const CTransaction& GetTransaction() const { return txTo; }
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHashContext* psighash=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -597,7 +626,67 @@ bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransa
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                   bool fValidatePayToScriptHash, int nHashType);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                  bool fValidatePayToScriptHash, int nHashType, const CSignatureHashContext* psighash);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     const CSignatureHashContext* psighash=NULL);
+
+/** Usage of the signature cache, reported by getsigcacheinfo */
+struct CSignatureCacheStats
+{
+    uint64 nEntries;
+    uint64 nMaxEntries;
+    uint64 nBytes;
+    uint64 nHits;
+    uint64 nMisses;
+};
+
+/** Valid signatures are remembered so transactions seen in the memory pool
+ * don't have to be verified again when they show up in a block.
+ *
+ * Only a 32 byte digest of (signature hash, signature, public key) is kept,
+ * salted with a random value picked per cache so others can't predict where
+ * an entry lands. Entries live in a fixed table of 4-way buckets; inserting
+ * into a full bucket replaces one of its entries. Buckets are spread over
+ * independently locked shards so parallel verification doesn't serialize on
+ * a single lock.
+ *
+ * The table size is given in megabytes. -maxsigcachesize used to count
+ * entries (default 50000), see AppInit2 for how old values are handled.
+ */
+class CSignatureCache
+{
+public:
+    static const unsigned int BUCKET_SIZE = 4;
+    static const int64 DEFAULT_CACHE_MB = 32;
+    static const int64 MAX_CACHE_MB = 2048; // keeps the table size within a 32-bit size_t
+
+    explicit CSignatureCache(int64 nMaxCacheMB);
+
+    bool Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey);
+    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey);
+    void GetStats(CSignatureCacheStats& stats);
+
+private:
+    static const unsigned int SHARDS = 64;
+
+    struct CShard
+    {
+        CCriticalSection cs;
+        uint64 nEntries;
+        uint64 nHits;
+        uint64 nMisses;
+    };
+
+    uint256 salt;
+    std::vector<uint256> vEntries;
+    size_t nBuckets;
+    CShard shards[SHARDS];
+
+    uint256 Digest(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const;
+};
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -29,8 +29,16 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <xmmintrin.h>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#if defined(MAP_ANONYMOUS)
+#define SCRYPT_MINER_MMAP
+#endif
+#endif
+
 #include "scrypt_mine.h"
 #include "pbkdf2.h"
 
@@ -71,6 +79,61 @@ void scrypt_buffer_free(void *scratchpad)
     free(scratchpad);
 }
 
+/* Scratchpads of the mining threads get pages of their own, huge pages when
+   the system has some reserved, so the random reads of scrypt_core miss the
+   TLB less. They are cleared by the thread that is going to use them: pages
+   are placed on the NUMA node of the CPU that first touches them.
+ */
+#ifdef SCRYPT_MINER_MMAP
+#define SCRYPT_MINER_HEADER 64
+#define SCRYPT_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+void *scrypt_miner_buffer_alloc(bool *huge_pages)
+{
+    size_t size = SCRYPT_MINER_HEADER + SCRYPT_BUFFER_SIZE;
+    void *p = MAP_FAILED;
+    *huge_pages = false;
+#ifdef MAP_HUGETLB
+    size_t size_huge = (size + SCRYPT_HUGE_PAGE_SIZE - 1) & ~(size_t)(SCRYPT_HUGE_PAGE_SIZE - 1);
+    p = mmap(NULL, size_huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        size = size_huge;
+        *huge_pages = true;
+    }
+#endif
+    if (p == MAP_FAILED)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    memset(p, 0, size);
+    *(size_t *)p = size;
+    return (char *)p + SCRYPT_MINER_HEADER;
+}
+
+void scrypt_miner_buffer_free(void *scratchpad)
+{
+    if (scratchpad == NULL)
+        return;
+    void *p = (char *)scratchpad - SCRYPT_MINER_HEADER;
+    munmap(p, *(size_t *)p);
+}
+#else
+void *scrypt_miner_buffer_alloc(bool *huge_pages)
+{
+    *huge_pages = false;
+    void *p = malloc(SCRYPT_BUFFER_SIZE);
+    if (p != NULL)
+        memset(p, 0, SCRYPT_BUFFER_SIZE);
+    return p;
+}
+
+void scrypt_miner_buffer_free(void *scratchpad)
+{
+    free(scratchpad);
+}
+#endif
+
 /* cpu and memory intensive function to transform a 80 byte buffer into a 32 byte output
    scratchpad size needs to be at least 63 + (128 * r * p) + (256 * r + 64) + (128 * r * N) bytes
    r = 1, p = 1, N = 1024
@@ -130,77 +193,54 @@ static void scrypt_3way(const void *input1, const void *input2, const void *inpu
 }
 #endif
 
+/* Scan nonces from pdata->nonce up to, not including, max_nonce. Returns the
+   first nonce whose hash ends in 16 zero bits, with the hash in result and
+   the header in res_header, or -1 once the range is done.
+ */
 unsigned int scanhash_scrypt(block_header *pdata, void *scratchbuf,
     uint32_t max_nonce, uint32_t &hash_count,
     void *result, block_header *res_header)
 {
     hash_count = 0;
-    block_header data = *pdata;
-    uint32_t hash[8];
-    unsigned char *hashc = (unsigned char *) &hash;
+    block_header data[3] = { *pdata, *pdata, *pdata };
+    uint32_t hash[3][8];
 
 #ifdef SCRYPT_3WAY
-    block_header data2 = *pdata;
-    uint32_t hash2[8];
-    unsigned char *hashc2 = (unsigned char *) &hash2;
-
-    block_header data3 = *pdata;
-    uint32_t hash3[8];
-    unsigned char *hashc3 = (unsigned char *) &hash3;
-
-    int throughput = scrypt_best_throughput();
+    uint32_t throughput = scrypt_best_throughput();
+    if (throughput > 3)
+        throughput = 3;
+#else
+    uint32_t throughput = 1;
 #endif
 
-    uint32_t n = 0;
-
-    while (true) {
-
-        data.nonce = n++;
+    uint32_t n = pdata->nonce;
+    while (n < max_nonce) {
+        uint32_t ways = throughput < max_nonce - n ? throughput : max_nonce - n;
+        for (uint32_t i = 0; i < ways; i++)
+            data[i].nonce = n++;
 
 #ifdef SCRYPT_3WAY
-        if (throughput >= 2 && n < max_nonce) {
-            data2.nonce = n++;
-            if(throughput >= 3)
-            {
-                data3.nonce = n++;
-                scrypt_3way(&data, &data2, &data3, 80, 80, 80, hash, hash2, hash3, scratchbuf);
-                hash_count += 3;
-
-                if (hashc3[31] == 0 && hashc3[30] == 0) {
-                    memcpy(result, hash3, 32);
-                    *res_header = data3;
-
-                    return data3.nonce;
-                }
-            }
-            else
-            {
-                scrypt_2way(&data, &data2, 80, 80, hash, hash2, scratchbuf);
-                hash_count += 2;
-            }
-
-            if (hashc2[31] == 0 && hashc2[30] == 0) {
-                memcpy(result, hash2, 32);
-
-                return data2.nonce;
-            }
-        } else {
-            scrypt(&data, 80, hash, scratchbuf);
-            hash_count += 1;
-        }
-#else
-        scrypt(&data, 80, hash, scratchbuf);
-        hash_count += 1;
+        if (ways == 3)
+            scrypt_3way(&data[0], &data[1], &data[2], 80, 80, 80, hash[0], hash[1], hash[2], scratchbuf);
+        else if (ways == 2)
+            scrypt_2way(&data[0], &data[1], 80, 80, hash[0], hash[1], scratchbuf);
+        else
 #endif
-        if (hashc[31] == 0 && hashc[30] == 0) {
-            memcpy(result, hash, 32);
-
-            return data.nonce;
-        }
-
-        if (n >= max_nonce) {
-            hash_count = 0xffff + 1;
-            break;
+            scrypt(&data[0], 80, hash[0], scratchbuf);
+        hash_count += ways;
+
+        /* In nonce order, so a caller resuming after a hit skips nothing.
+           The lanes past the hit are hashed again then, so they are not
+           counted here. */
+        for (uint32_t i = 0; i < ways; i++) {
+            unsigned char *hashc = (unsigned char *) hash[i];
+            if (hashc[31] == 0 && hashc[30] == 0) {
+                memcpy(result, hash[i], 32);
+                *res_header = data[i];
+                hash_count -= ways - i - 1;
+
+                return data[i].nonce;
+            }
         }
     }
 
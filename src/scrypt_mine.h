@@ -21,6 +21,10 @@ typedef struct
 void *scrypt_buffer_alloc();
 void scrypt_buffer_free(void *scratchpad);
 
+// Scratchpad of a mining thread, allocated and cleared by that thread
+void *scrypt_miner_buffer_alloc(bool *huge_pages);
+void scrypt_miner_buffer_free(void *scratchpad);
+
 unsigned int scanhash_scrypt(block_header *pdata, void *scratchbuf,
     uint32_t max_nonce, uint32_t &hash_count,
     void *result, block_header *res_header);
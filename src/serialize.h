@@ -715,7 +715,7 @@ struct ser_streamplaceholder
 class CDataStream
 {
 protected:
-    typedef std::vector<char, zero_after_free_allocator<char> > vector_type;
+    typedef std::vector<char, pooled_allocator<char> > vector_type;
     vector_type vch;
     unsigned int nReadPos;
     short state;
@@ -904,6 +904,13 @@ public:
         return true;
     }
 
+    // Make room for obj up front so serializing it doesn't reallocate
+    template<typename T>
+    void ReserveFor(const T& obj)
+    {
+        vch.reserve(vch.size() + ::GetSerializeSize(obj, nType, nVersion));
+    }
+
 
     //
     // Stream subset
@@ -1016,7 +1023,107 @@ public:
 
 
 
+/** Read-only stream over a borrowed range of memory.
+ *
+ * Deserializes in place from memory owned by someone else (a memory mapped
+ * block file, a network buffer) without copying it into a CDataStream first.
+ * The caller must keep the underlying memory alive while the stream is used.
+ */
+class CSpanStream
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+    const char* pcur;
+    short state;
+    short exceptmask;
+public:
+    int nType;
+    int nVersion;
+
+    CSpanStream(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+    {
+        assert(pendIn >= pbeginIn);
+        pbegin = pbeginIn;
+        pend = pendIn;
+        pcur = pbeginIn;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+        state = 0;
+        exceptmask = std::ios::badbit | std::ios::failbit;
+    }
+
+    const char* begin() const    { return pcur; }
+    const char* end() const      { return pend; }
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+    size_t GetPos() const        { return pcur - pbegin; }
+
+    //
+    // Stream subset
+    //
+    void setstate(short bits, const char* psz)
+    {
+        state |= bits;
+        if (state & exceptmask)
+            THROW_WITH_STACKTRACE(std::ios_base::failure(psz));
+    }
 
+    bool eof() const             { return size() == 0; }
+    bool fail() const            { return state & (std::ios::badbit | std::ios::failbit); }
+    bool good() const            { return !eof() && (state == 0); }
+    void clear(short n = 0)      { state = n; }
+    short exceptions()           { return exceptmask; }
+    short exceptions(short mask) { short prev = exceptmask; exceptmask = mask; setstate(0, "CSpanStream"); return prev; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+    void ReadVersion()           { *this >> nVersion; }
+
+    CSpanStream& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+        {
+            memset(pch, 0, nSize);
+            memcpy(pch, pcur, size());
+            pcur = pend;
+            setstate(std::ios::failbit, "CSpanStream::read() : end of data");
+            return (*this);
+        }
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CSpanStream& ignore(size_t nSize)
+    {
+        if (nSize > size())
+        {
+            pcur = pend;
+            setstate(std::ios::failbit, "CSpanStream::ignore() : end of data");
+            return (*this);
+        }
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        // Tells the size of the object if serialized to this stream
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CSpanStream& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
 
 
 
@@ -0,0 +1,255 @@
+// Copyright (c) 2012-2013 The PPCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef PPCOIN_SHA256LANES_H
+#define PPCOIN_SHA256LANES_H
+
+//
+// Lane-parallel SHA-256 for the batch hashers of stake kernels and merkle
+// trees, written once for any lane type: unsigned int for one message at a
+// time, GCC vector types for 4, 8 or 16. The always inlined bodies take on
+// the instruction set of the target attributed backend calling them.
+//
+
+#include "lanehasher.h"
+#include "uint256.h"
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const unsigned int SHA256_IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const unsigned int SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline unsigned int ReadBE32(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static inline void WriteBE32(unsigned char* p, unsigned int x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+#define SHA256_ROTR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define SHA256_Ch(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define SHA256_Maj(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define SHA256_Sigma0(x)    (SHA256_ROTR(x, 2) ^ SHA256_ROTR(x, 13) ^ SHA256_ROTR(x, 22))
+#define SHA256_Sigma1(x)    (SHA256_ROTR(x, 6) ^ SHA256_ROTR(x, 11) ^ SHA256_ROTR(x, 25))
+#define SHA256_sigma0(x)    (SHA256_ROTR(x, 7) ^ SHA256_ROTR(x, 18) ^ ((x) >> 3))
+#define SHA256_sigma1(x)    (SHA256_ROTR(x, 17) ^ SHA256_ROTR(x, 19) ^ ((x) >> 10))
+#define SHA256_SPLAT(V, x)  (V() + (unsigned int)(x))
+
+// One block per lane, the block words in w (clobbered), added into s
+template<typename V>
+static inline __attribute__((always_inline)) void SHA256TransformLanes(V* s, V* w)
+{
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++)
+    {
+        if (i >= 16)
+            w[i & 15] += SHA256_sigma1(w[(i + 14) & 15]) + w[(i + 9) & 15] + SHA256_sigma0(w[(i + 1) & 15]);
+        V t1 = h + SHA256_Sigma1(e) + SHA256_Ch(e, f, g) + SHA256_K[i] + w[i & 15];
+        V t2 = SHA256_Sigma0(a) + SHA256_Maj(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+// Load word i of N messages nStride bytes apart into v
+template<typename V, int N>
+static inline __attribute__((always_inline)) void SHA256LoadLanes(V& v, const unsigned char* p, unsigned int nStride, int i)
+{
+    unsigned int lane[N];
+    for (int j = 0; j < N; j++)
+        lane[j] = ReadBE32(p + j * nStride + 4 * i);
+    memcpy(&v, lane, sizeof(V));
+}
+
+// Second SHA-256 of double SHA-256: hash the 32 byte first hashes in s and
+// store the results in phash
+template<typename V, int N>
+static inline __attribute__((always_inline)) void SHA256DFinishLanes(V* s, uint256* phash)
+{
+    V w[16];
+    for (int i = 0; i < 8; i++)
+    {
+        w[i] = s[i];
+        s[i] = SHA256_SPLAT(V, SHA256_IV[i]);
+    }
+    w[8] = SHA256_SPLAT(V, 0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = SHA256_SPLAT(V, 0);
+    w[15] = SHA256_SPLAT(V, 256);
+    SHA256TransformLanes(s, w);
+
+    unsigned int lane[N];
+    for (int i = 0; i < 8; i++)
+    {
+        memcpy(lane, &s[i], sizeof(V));
+        for (int j = 0; j < N; j++)
+            WriteBE32((unsigned char*)&phash[j] + 4 * i, lane[j]);
+    }
+}
+
+#ifdef USE_SHA256_X86
+typedef unsigned int v4u32 __attribute__((vector_size(16)));
+typedef unsigned int v8u32 __attribute__((vector_size(32)));
+typedef unsigned int v16u32 __attribute__((vector_size(64)));
+
+// One SHA-256 block with the SHA extensions, state in natural order
+__attribute__((target("sha,sse4.1"))) static inline void SHA256TransformSHANI(unsigned int* state, const unsigned char* data)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);   // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);       // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);            // CDGH
+    __m128i abef = state0, cdgh = state1;
+
+    __m128i msg[4];
+    for (int i = 0; i < 4; i++)
+        msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), MASK);
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (i >= 4)
+        {
+            // W[t] = sigma1(W[t-2]) + W[t-7] + sigma0(W[t-15]) + W[t-16]
+            __m128i x = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+            x = _mm_add_epi32(x, _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4));
+            msg[i & 3] = _mm_sha256msg2_epu32(x, msg[(i + 3) & 3]);
+        }
+        __m128i m = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i*)&SHA256_K[4 * i]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0E));
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);                  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);               // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);            // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);               // HGFE
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+// Second SHA-256 of double SHA-256 with the SHA extensions
+static inline void SHA256DFinishSHANI(unsigned int* state, uint256* phash)
+{
+    unsigned char block[64];
+    memset(block, 0, sizeof(block));
+    for (int i = 0; i < 8; i++)
+        WriteBE32(block + 4 * i, state[i]);
+    block[32] = 0x80;
+    block[62] = 0x01;   // 256 bits
+    memcpy(state, SHA256_IV, 8 * sizeof(unsigned int));
+    SHA256TransformSHANI(state, block);
+
+    for (int i = 0; i < 8; i++)
+        WriteBE32((unsigned char*)phash + 4 * i, state[i]);
+}
+
+static inline bool CPUHasSHA()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx >> 29) & 1;
+}
+#endif
+
+/** The backends of one kind of batch hasher that this CPU supports, fastest
+ * first, and the one selected by name. Built from the lane functions of each
+ * instruction set; on other platforms only pfn1 is used. */
+template<unsigned int SIZE>
+class CLaneHasherRegistry
+{
+public:
+    typedef CLaneHasher<SIZE> Hasher;
+    typedef typename Hasher::HashLanesFunc HashLanesFunc;
+
+    CLaneHasherRegistry(HashLanesFunc pfn1, HashLanesFunc pfnSHANI, HashLanesFunc pfn4, HashLanesFunc pfn8, HashLanesFunc pfn16)
+    {
+#ifdef USE_SHA256_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            vHashers.push_back(Hasher("avx512", 16, pfn16, pfn1));
+        if (__builtin_cpu_supports("avx2"))
+            vHashers.push_back(Hasher("avx2", 8, pfn8, pfn1));
+        if (CPUHasSHA() && __builtin_cpu_supports("sse4.1"))
+            vHashers.push_back(Hasher("sha-ni", 1, pfnSHANI, pfnSHANI));
+        if (__builtin_cpu_supports("sse4.1"))
+            vHashers.push_back(Hasher("sse4.1", 4, pfn4, pfn1));
+#endif
+        vHashers.push_back(Hasher("generic", 1, pfn1, pfn1));
+        phasherSelected = &vHashers[0];
+    }
+
+    std::vector<std::string> GetNames() const
+    {
+        std::vector<std::string> vNames;
+        for (unsigned int i = 0; i < vHashers.size(); i++)
+            vNames.push_back(vHashers[i].GetName());
+        return vNames;
+    }
+
+    // NULL if it is not available
+    Hasher* Get(const std::string& strName)
+    {
+        for (unsigned int i = 0; i < vHashers.size(); i++)
+            if (strName == vHashers[i].GetName())
+                return &vHashers[i];
+        return NULL;
+    }
+
+    bool Select(const std::string& strName)
+    {
+        Hasher* phasher = Get(strName);
+        if (phasher == NULL)
+            return false;
+        phasherSelected = phasher;
+        return true;
+    }
+
+    Hasher* GetSelected() const { return phasherSelected; }
+
+private:
+    std::vector<Hasher> vHashers; // not changed after construction
+    Hasher* phasherSelected;
+};
+
+#endif // PPCOIN_SHA256LANES_H
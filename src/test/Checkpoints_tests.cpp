@@ -6,6 +6,7 @@
 #include <boost/foreach.hpp>
 
 #include "../checkpoints.h"
+#include "../main.h"
 #include "../util.h"
 
 using namespace std;
@@ -31,4 +32,52 @@ BOOST_AUTO_TEST_CASE(sanity)
     BOOST_CHECK(Checkpoints::GetTotalBlocksEstimate() >= 134444);
 }    
 
+BOOST_AUTO_TEST_CASE(assumevalid_default)
+{
+    // The default assumed valid block is the highest hardened checkpoint
+    uint256 hashLatest = Checkpoints::GetLatestHardenedCheckpoint();
+    BOOST_CHECK_EQUAL(Checkpoints::GetCheckpointHeight(hashLatest), Checkpoints::GetTotalBlocksEstimate());
+    BOOST_CHECK_EQUAL(Checkpoints::GetCheckpointHeight(uint256(1)), -1);
+}
+
+BOOST_AUTO_TEST_CASE(assumevalid_ancestors)
+{
+    uint256 hashAssumeValidOld = hashAssumeValid;
+    CBlockIndex indexLow, indexHigh;
+    indexLow.nHeight = 1;
+    indexHigh.nHeight = Checkpoints::GetTotalBlocksEstimate() + 1;
+
+    hashAssumeValid = 0;
+    BOOST_CHECK(!IsAssumedValid(&indexLow));
+
+    // Before the checkpoint block is known its height is trusted
+    hashAssumeValid = Checkpoints::GetLatestHardenedCheckpoint();
+    if (!mapBlockIndex.count(hashAssumeValid))
+    {
+        BOOST_CHECK(IsAssumedValid(&indexLow));
+        BOOST_CHECK(!IsAssumedValid(&indexHigh));
+    }
+    BOOST_CHECK(!IsAssumedValid(NULL));
+
+    // Once it's in the index only its ancestors are
+    uint256 hashTip = uint256(12345);
+    CBlockIndex index0, index1, index2, indexFork;
+    index0.nHeight = 0;
+    index1.nHeight = 1;
+    index1.pprev = &index0;
+    index2.nHeight = 2;
+    index2.pprev = &index1;
+    indexFork.nHeight = 1;
+    indexFork.pprev = &index0;
+    mapBlockIndex[hashTip] = &index1;
+    hashAssumeValid = hashTip;
+    BOOST_CHECK(IsAssumedValid(&index0));
+    BOOST_CHECK(IsAssumedValid(&index1));
+    BOOST_CHECK(!IsAssumedValid(&index2));
+    BOOST_CHECK(!IsAssumedValid(&indexFork));
+    mapBlockIndex.erase(hashTip);
+
+    hashAssumeValid = hashAssumeValidOld;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -15,11 +15,10 @@
 
 #include <stdint.h>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CDataStream& vMsg);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CDataStream*> mapOrphanTransactions;
-extern std::map<uint256, std::map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+// Tests these internal-to-main.cpp structures:
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<int, std::set<uint256> > mapOrphanTransactionsByPeer;
 
 CService ip(uint32_t i)
 {
@@ -134,14 +133,11 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CDataStream*>::iterator it;
+    std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    const CDataStream* pvMsg = it->second;
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    return tx;
+    return it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -163,9 +159,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, i % 3);
     }
 
     // ... and 50 that depend on other orphans:
@@ -182,9 +176,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, i % 3);
     }
 
     // This really-big orphan should be ignored:
@@ -208,9 +200,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        BOOST_CHECK(!AddOrphanTx(ds));
+        BOOST_CHECK(!AddOrphanTx(tx, 0));
     }
 
     // Test LimitOrphanTxSize() function:
@@ -221,6 +211,50 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     LimitOrphanTxSize(0);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansPerPeer)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    // Peer 1 floods orphans up to its limit, peer 2 adds a few
+    std::vector<CTransaction> vtx;
+    for (unsigned int i = 0; i < MAX_ORPHAN_TRANSACTIONS_PER_PEER + 10; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = i % 2;
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+        vtx.push_back(tx);
+        BOOST_CHECK_EQUAL(AddOrphanTx(tx, 1), i < MAX_ORPHAN_TRANSACTIONS_PER_PEER);
+    }
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPeer[1].size(), MAX_ORPHAN_TRANSACTIONS_PER_PEER);
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        CTransaction tx = vtx[i];
+        tx.vout[0].nValue = 2*CENT;
+        BOOST_CHECK(AddOrphanTx(tx, 2));
+    }
+
+    // Orphans are found by the outpoint they spend
+    BOOST_CHECK(mapOrphanTransactionsByPrev[vtx[0].vin[0].prevout].count(vtx[0].GetHash()));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev[vtx[0].vin[0].prevout].size(), 2U);
+    BOOST_CHECK(!mapOrphanTransactionsByPrev.count(COutPoint(vtx[0].vin[0].prevout.hash, 1)));
+
+    // Eviction takes from the flooding peer first
+    LimitOrphanTxSize(10);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPeer[2].size(), 5U);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPeer[1].size(), 5U);
+
+    LimitOrphanTxSize(0);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
@@ -246,9 +280,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, i % 3);
     }
 
     // Create a transaction that depends on orphans:
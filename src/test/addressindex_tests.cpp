@@ -0,0 +1,253 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addressindex.h"
+#include "db.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+static CScript PayTo(const CKey& key)
+{
+    CScript script;
+    script.SetDestination(key.GetPubKey().GetID());
+    return script;
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    // Serialized keys must sort like heights for cursor range scans
+    uint160 hash = 1;
+    CDataStream ss1(SER_DISK, CLIENT_VERSION), ss2(SER_DISK, CLIENT_VERSION);
+    ss1 << CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash, 255, 0, 0, false);
+    ss2 << CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash, 256, 0, 0, false);
+    BOOST_CHECK(lexicographical_compare(ss1.begin(), ss1.end(), ss2.begin(), ss2.end()));
+
+    CAddressIndexKey key;
+    ss2 >> key;
+    BOOST_CHECK_EQUAL(key.nHeight, 256);
+    BOOST_CHECK(key.hashBytes == hash);
+}
+
+static void WriteBatch(CTxDB& txdb, const CAddressIndexBatch& batch)
+{
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.WriteAddressIndexBatch(batch));
+    BOOST_CHECK(txdb.TxnCommit());
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_batch)
+{
+    unsigned int nFlagsSave = nAddressIndexFlags;
+
+    CKey key1, key2;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(true);
+    unsigned char nType;
+    uint160 hash1, hash2;
+    BOOST_CHECK(GetAddressIndexKey(PayTo(key1), nType, hash1));
+    BOOST_CHECK(nType == ADDRESS_TYPE_PUBKEYHASH);
+    BOOST_CHECK(GetAddressIndexKey(PayTo(key2), nType, hash2));
+    uint160 hashNone;
+    BOOST_CHECK(!GetAddressIndexKey(CScript() << OP_RETURN, nType, hashNone));
+
+    // txPrev pays key1 in block 5, tx1 spends it to key2 in block 10 and
+    // tx2 spends that in the same block
+    CTransaction txPrev;
+    txPrev.vin.resize(1);
+    txPrev.vout.resize(1);
+    txPrev.vout[0].nValue = 50 * COIN;
+    txPrev.vout[0].scriptPubKey = PayTo(key1);
+
+    CTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    tx1.vout.resize(1);
+    tx1.vout[0].nValue = 49 * COIN;
+    tx1.vout[0].scriptPubKey = PayTo(key2);
+
+    CTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout.resize(1);
+    tx2.vout[0].nValue = 48 * COIN;
+    tx2.vout[0].scriptPubKey = PayTo(key1);
+
+    MapPrevTx inputs;
+    inputs[txPrev.GetHash()].second = txPrev;
+    inputs[tx1.GetHash()].second = tx1;
+
+    // The address index alone still keeps the spent records it needs to
+    // disconnect blocks
+    unsigned int pnFlags[] = { INDEX_ADDRESS | INDEX_SPENT, INDEX_ADDRESS };
+    for (unsigned int n = 0; n < sizeof(pnFlags) / sizeof(pnFlags[0]); n++)
+    {
+        nAddressIndexFlags = pnFlags[n];
+        CTxDB txdb;
+        CAddressIndexBatch batchPrev;
+        BOOST_CHECK(batchPrev.ConnectTransaction(txdb, txPrev, 5, inputs));
+        WriteBatch(txdb, batchPrev);
+
+        CAddressIndexBatch batch;
+        BOOST_CHECK(batch.ConnectTransaction(txdb, tx1, 10, inputs));
+        BOOST_CHECK(batch.ConnectTransaction(txdb, tx2, 10, inputs));
+
+        // key1 spent at tx1 and received at tx2, key2 received and spent
+        BOOST_CHECK_EQUAL(batch.mapAddress.size(), 4U);
+        BOOST_CHECK_EQUAL(batch.mapAddress[CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash1, 10, tx1.GetHash(), 0, true)], -50 * COIN);
+        BOOST_CHECK_EQUAL(batch.mapAddress[CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash2, 10, tx2.GetHash(), 0, true)], -49 * COIN);
+
+        // tx1's output never reaches the unspent index, txPrev's is erased
+        // and tx2's is added
+        BOOST_CHECK_EQUAL(batch.mapUnspent.size(), 2U);
+        BOOST_CHECK(batch.mapUnspent[CAddressUnspentKey(ADDRESS_TYPE_PUBKEYHASH, hash1, txPrev.GetHash(), 0)].IsNull());
+        BOOST_CHECK_EQUAL(batch.mapUnspent[CAddressUnspentKey(ADDRESS_TYPE_PUBKEYHASH, hash1, tx2.GetHash(), 0)].nValue, 48 * COIN);
+
+        // The spent records hold the height of the outputs, from the
+        // database and from the batch
+        CSpentIndexValue spent = batch.mapSpent[CSpentIndexKey(tx1.GetHash(), 0)];
+        BOOST_CHECK(spent.txid == tx2.GetHash());
+        BOOST_CHECK_EQUAL(spent.nHeight, 10);
+        BOOST_CHECK_EQUAL(spent.nPrevHeight, 10);
+        BOOST_CHECK(spent.hashBytes == hash2);
+        BOOST_CHECK_EQUAL(batch.mapSpent[CSpentIndexKey(txPrev.GetHash(), 0)].nPrevHeight, 5);
+        WriteBatch(txdb, batch);
+
+        // Disconnecting in reverse order restores txPrev's output and
+        // removes everything the block added
+        CAddressIndexBatch undo;
+        BOOST_CHECK(undo.DisconnectTransaction(txdb, tx2, 10, inputs));
+        BOOST_CHECK(undo.DisconnectTransaction(txdb, tx1, 10, inputs));
+        BOOST_CHECK(undo.mapAddress.empty());
+        BOOST_CHECK_EQUAL(undo.setAddressErase.size(), 4U);
+        CAddressUnspentValue restored = undo.mapUnspent[CAddressUnspentKey(ADDRESS_TYPE_PUBKEYHASH, hash1, txPrev.GetHash(), 0)];
+        BOOST_CHECK_EQUAL(restored.nValue, 50 * COIN);
+        BOOST_CHECK_EQUAL(restored.nHeight, 5);
+        BOOST_CHECK(undo.mapUnspent[CAddressUnspentKey(ADDRESS_TYPE_PUBKEYHASH, hash2, tx1.GetHash(), 0)].IsNull());
+        BOOST_CHECK(undo.mapSpent[CSpentIndexKey(tx1.GetHash(), 0)].IsNull());
+        WriteBatch(txdb, undo);
+
+        // The database is back to what block 5 left
+        vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        BOOST_CHECK(txdb.ReadAddressUnspentIndex(ADDRESS_TYPE_PUBKEYHASH, hash1, vUnspent));
+        BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+        BOOST_CHECK(vUnspent.size() == 1 && vUnspent[0].first.txhash == txPrev.GetHash() && vUnspent[0].second.nHeight == 5);
+        vUnspent.clear();
+        BOOST_CHECK(txdb.ReadAddressUnspentIndex(ADDRESS_TYPE_PUBKEYHASH, hash2, vUnspent));
+        BOOST_CHECK(vUnspent.empty());
+        vector<pair<CAddressIndexKey, int64> > vEntries;
+        BOOST_CHECK(txdb.ReadAddressIndex(ADDRESS_TYPE_PUBKEYHASH, hash1, vEntries));
+        BOOST_CHECK_EQUAL(vEntries.size(), 1U);
+        CSpentIndexValue spentPrev;
+        BOOST_CHECK(!txdb.ReadSpentIndex(CSpentIndexKey(txPrev.GetHash(), 0), spentPrev));
+
+        // Without its spent record an input can't be put back
+        CAddressIndexBatch undoAgain;
+        BOOST_CHECK(!undoAgain.DisconnectTransaction(txdb, tx1, 10, inputs));
+
+        BOOST_CHECK(txdb.EraseAddressIndex());
+    }
+
+    nAddressIndexFlags = nFlagsSave;
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_received)
+{
+    uint160 hash = 1;
+    vector<pair<CAddressIndexKey, int64> > vEntries;
+    vEntries.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash, 5, 1, 0, false), 100 * COIN));
+    // Coinstake at 9 stakes the 100 and pays back 101
+    vEntries.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash, 9, 2, 0, true), -100 * COIN));
+    vEntries.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash, 9, 2, 1, false), 50 * COIN + COIN / 2));
+    vEntries.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash, 9, 2, 2, false), 50 * COIN + COIN / 2));
+    // Spend of 40 with 60 change
+    vEntries.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash, 12, 3, 0, true), -101 * COIN));
+    vEntries.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hash, 12, 3, 1, false), 60 * COIN));
+    BOOST_CHECK_EQUAL(GetAddressReceived(vEntries), 101 * COIN);
+}
+
+// Write a block to the block file with a block index entry after pindexPrev
+static CBlockIndex* AddTestBlock(CBlock& block, CBlockIndex* pindexPrev)
+{
+    unsigned int nFile, nBlockPos;
+    BOOST_REQUIRE(block.WriteToDisk(nFile, nBlockPos));
+    CBlockIndex* pindex = new CBlockIndex(nFile, nBlockPos, block);
+    pindex->phashBlock = &mapBlockIndex.insert(make_pair(block.GetHash(), pindex)).first->first;
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev->nHeight + 1;
+    pindexPrev->pnext = pindex;
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_catch_up)
+{
+    unsigned int nFlagsSave = nAddressIndexFlags;
+    nAddressIndexFlags = INDEX_ADDRESS | INDEX_SPENT;
+
+    CKey key1, key2;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(true);
+    unsigned char nType;
+    uint160 hash1, hash2;
+    GetAddressIndexKey(PayTo(key1), nType, hash1);
+    GetAddressIndexKey(PayTo(key2), nType, hash2);
+
+    // Block 1 pays key1, block 2 spends that to key2
+    CBlock block1;
+    block1.vtx.resize(1);
+    block1.vtx[0].vin.resize(1);
+    block1.vtx[0].vin[0].scriptSig = CScript() << 1;
+    block1.vtx[0].vout.resize(1);
+    block1.vtx[0].vout[0].nValue = 10 * COIN;
+    block1.vtx[0].vout[0].scriptPubKey = PayTo(key1);
+    block1.hashMerkleRoot = block1.BuildMerkleTree();
+
+    CBlock block2;
+    block2.vtx.resize(2);
+    block2.vtx[0].vin.resize(1);
+    block2.vtx[0].vin[0].scriptSig = CScript() << 2;
+    block2.vtx[0].vout.resize(1);
+    block2.vtx[1].vin.resize(1);
+    block2.vtx[1].vin[0].prevout = COutPoint(block1.vtx[0].GetHash(), 0);
+    block2.vtx[1].vout.resize(1);
+    block2.vtx[1].vout[0].nValue = 9 * COIN;
+    block2.vtx[1].vout[0].scriptPubKey = PayTo(key2);
+    block2.hashMerkleRoot = block2.BuildMerkleTree();
+
+    CTxDB txdb;
+    CBlockIndex* pindex1 = AddTestBlock(block1, pindexGenesisBlock);
+    CBlockIndex* pindex2 = AddTestBlock(block2, pindex1);
+    unsigned int nTxPos = pindex1->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(1);
+    BOOST_CHECK(txdb.UpdateTxIndex(block1.vtx[0].GetHash(), CTxIndex(CDiskTxPos(pindex1->nFile, pindex1->nBlockPos, nTxPos), 1)));
+
+    // Catch up from the genesis block like a node that just enabled it
+    BOOST_CHECK(txdb.WriteAddressIndexBest(nAddressIndexFlags, pindexGenesisBlock->GetBlockHash()));
+    BOOST_CHECK(BuildAddressIndexBatch());
+    BOOST_CHECK(!BuildAddressIndexBatch());
+    BOOST_CHECK(GetAddressIndexBest(txdb) == pindex2->GetBlockHash());
+
+    vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    BOOST_CHECK(txdb.ReadAddressUnspentIndex(ADDRESS_TYPE_PUBKEYHASH, hash1, vUnspent));
+    BOOST_CHECK(vUnspent.empty());
+    BOOST_CHECK(txdb.ReadAddressUnspentIndex(ADDRESS_TYPE_PUBKEYHASH, hash2, vUnspent));
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent.size() == 1 && vUnspent[0].second.nHeight == pindex2->nHeight);
+    vector<pair<CAddressIndexKey, int64> > vEntries;
+    BOOST_CHECK(txdb.ReadAddressIndex(ADDRESS_TYPE_PUBKEYHASH, hash1, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 2U);
+    CSpentIndexValue spent;
+    BOOST_CHECK(txdb.ReadSpentIndex(CSpentIndexKey(block1.vtx[0].GetHash(), 0), spent));
+    BOOST_CHECK(spent.txid == block2.vtx[1].GetHash());
+    BOOST_CHECK_EQUAL(spent.nPrevHeight, pindex1->nHeight);
+
+    BOOST_CHECK(txdb.EraseAddressIndex());
+    BOOST_CHECK(txdb.EraseTxIndex(block1.vtx[0]));
+    pindexGenesisBlock->pnext = NULL;
+    mapBlockIndex.erase(block1.GetHash());
+    mapBlockIndex.erase(block2.GetHash());
+    delete pindex1;
+    delete pindex2;
+    nAddressIndexFlags = nFlagsSave;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 #include "init.h"
 #include "main.h"
 #include "util.h"
+#include "fixtures.h"
 
 BOOST_AUTO_TEST_SUITE(allocator_tests)
 
@@ -112,4 +113,82 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(pooled_allocator_reuse)
+{
+    // Freed buffers come back from the pool, always cleared
+    pooled_allocator<char> alloc;
+    char* p = alloc.allocate(100);
+    memset(p, 'x', 100);
+    alloc.deallocate(p, 100);
+    char* q = alloc.allocate(120);
+    BOOST_CHECK(q == p);
+    BOOST_CHECK(q[0] == 0 && q[99] == 0);
+    alloc.deallocate(q, 120);
+
+    // Whichever stream type held it
+    {
+        CDataStream ssNet(SER_NETWORK, PROTOCOL_VERSION);
+        ssNet.reserve(100);
+        ssNet << std::string(90, 'x');
+        p = &ssNet[0];
+    }
+    q = alloc.allocate(128);
+    BOOST_CHECK(q == p);
+    BOOST_CHECK(q[0] == 0 && q[90] == 0);
+    alloc.deallocate(q, 128);
+}
+
+// Stream traffic of relaying and storing one block: serialize it for
+// sending, copy the message out of the receive buffer, read it back, relay
+// each transaction and write each one to the database
+static void StreamBlockRoundTrip(const CBlock& block)
+{
+    CDataStream ssSend(SER_NETWORK, PROTOCOL_VERSION);
+    ssSend.ReserveFor(block);
+    ssSend << block;
+
+    CDataStream vRecv(SER_NETWORK, PROTOCOL_VERSION);
+    vRecv += ssSend;
+    CDataStream vMsg(vRecv.begin(), vRecv.end(), vRecv.nType, vRecv.nVersion);
+    CBlock blockRecv;
+    vMsg >> blockRecv;
+
+    BOOST_FOREACH(const CTransaction& tx, blockRecv.vtx)
+    {
+        CDataStream ssRelay(SER_NETWORK, PROTOCOL_VERSION);
+        ssRelay.ReserveFor(tx);
+        ssRelay << tx;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.ReserveFor(tx);
+        ssValue << tx;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(pooled_stream_allocs)
+{
+    // Once the free lists are warm, streams stop going to the heap
+    CBlock block = MakeTestBlock(200);
+    const int nBlocks = 100;
+    CStreamBufferPool& pool = CStreamBufferPool::Instance();
+
+    pool.SetEnabled(false);
+    CStreamBufferPool::Stats statsStart = pool.GetStats();
+    for (int i = 0; i < nBlocks; i++)
+        StreamBlockRoundTrip(block);
+    size_t nPlain = pool.GetStats().nHeapAllocs - statsStart.nHeapAllocs;
+
+    pool.SetEnabled(true);
+    StreamBlockRoundTrip(block); // warm up the free lists
+    statsStart = pool.GetStats();
+    for (int i = 0; i < nBlocks; i++)
+        StreamBlockRoundTrip(block);
+    size_t nPooled = pool.GetStats().nHeapAllocs - statsStart.nHeapAllocs;
+
+    // Heap allocations per block: at least two per transaction without the
+    // pool, less than one with it
+    BOOST_CHECK(nPlain / nBlocks >= block.vtx.size() * 2);
+    BOOST_CHECK(nPooled < (size_t)nBlocks);
+    BOOST_CHECK(nPooled * 100 < nPlain);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,82 @@
+//
+// Unit tests for the recent block cache and block undo information
+//
+#include <boost/test/unit_test.hpp>
+
+#include "blockcache.h"
+#include "main.h"
+#include "util.h"
+#include "fixtures.h"
+
+BOOST_AUTO_TEST_SUITE(blockcache_tests)
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    CBlock block0 = MakeTestBlock(1, 0);
+    unsigned int nBlockSize = ::GetSerializeSize(block0, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Room for three blocks of this size
+    CBlockCache cache(3 * nBlockSize);
+    for (unsigned int n = 0; n < 3; n++)
+        cache.Add(MakeTestBlock(1, n));
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+    BOOST_CHECK_EQUAL(cache.GetSize(), 3U * nBlockSize);
+
+    // Using block 0 makes block 1 the least recently used
+    CBlock block;
+    BOOST_CHECK(cache.Get(block0.GetHash(), block));
+    BOOST_CHECK(block.GetHash() == block0.GetHash());
+    BOOST_CHECK(block.vtx == block0.vtx);
+    BOOST_CHECK(block.vMerkleTree.empty());
+
+    cache.Add(MakeTestBlock(1, 3));
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+    BOOST_CHECK(!cache.Get(MakeTestBlock(1, 1).GetHash(), block));
+    BOOST_CHECK(cache.Get(MakeTestBlock(1, 2).GetHash(), block));
+    BOOST_CHECK(cache.Get(MakeTestBlock(1, 3).GetHash(), block));
+    BOOST_CHECK_EQUAL(cache.GetHits(), 3U);
+    BOOST_CHECK_EQUAL(cache.GetMisses(), 1U);
+
+    // Adding a block again only uses it
+    cache.Add(block0);
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+
+    cache.Erase(block0.GetHash());
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_CHECK_EQUAL(cache.GetSize(), 2U * nBlockSize);
+    BOOST_CHECK(!cache.Get(block0.GetHash(), block));
+
+    // Blocks larger than the whole cache are not kept
+    cache.Add(MakeTestBlock(10, 4));
+    BOOST_CHECK(!cache.Get(MakeTestBlock(10, 4).GetHash(), block));
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+
+    // Shrinking drops the least recently used blocks
+    cache.SetMaxSize(nBlockSize);
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    BOOST_CHECK(cache.Get(MakeTestBlock(1, 3).GetHash(), block));
+
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+    BOOST_CHECK_EQUAL(cache.GetSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockundo_serialize)
+{
+    CBlockUndo blockundo;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        CTxIndex txindex(CDiskTxPos(1, 100 * i, 81), i + 1);
+        txindex.vSpent[0] = CDiskTxPos(2, 200, 81 + i);
+        blockundo.vPrevTxIndex.push_back(std::make_pair(Hash(BEGIN(i), END(i)), txindex));
+    }
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << blockundo;
+    CBlockUndo blockundo2;
+    ss >> blockundo2;
+    BOOST_CHECK(blockundo2.vPrevTxIndex == blockundo.vPrevTxIndex);
+    BOOST_CHECK(ss.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,194 @@
+//
+// Unit tests for compact block relay
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "compactblock.h"
+#include "util.h"
+#include "fixtures.h"
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+static CCompactBlock RoundTrip(const CCompactBlock& cmpctblock, unsigned int& nSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    nSize = ss.size();
+    CCompactBlock cmpctblockRead;
+    ss >> cmpctblockRead;
+    return cmpctblockRead;
+}
+
+BOOST_AUTO_TEST_CASE(siphash_vectors)
+{
+    // Test vectors from the SipHash paper, key 00 01 .. 0f
+    const uint64 k0 = 0x0706050403020100ULL, k1 = 0x0f0e0d0c0b0a0908ULL;
+    unsigned char vch[15];
+    for (int i = 0; i < 15; i++)
+        vch[i] = i;
+    BOOST_CHECK_EQUAL(CSipHasher(k0, k1).Finalize(), 0x726fdb47dd0e0e31ULL);
+    BOOST_CHECK_EQUAL(CSipHasher(k0, k1).Write(vch, 15).Finalize(), 0xa129ca6149be45e5ULL);
+
+    // Writing in pieces gives the same hash
+    CSipHasher hasher(k0, k1);
+    hasher.Write(vch, 3).Write(vch + 3, 9).Write(vch + 12, 3);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0xa129ca6149be45e5ULL);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_reconstruct)
+{
+    CBlock block = MakeTestBlock(100);
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilled.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxID.size(), 99U);
+    BOOST_CHECK(!cmpctblock.IsProofOfStake());
+
+    unsigned int nSize;
+    CCompactBlock cmpctblockRead = RoundTrip(cmpctblock, nSize);
+    BOOST_CHECK_EQUAL(nSize, 80 + 1 + 8 + 1 + 99 * 6 + 3 + ::GetSerializeSize(block.vtx[0], SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK(cmpctblockRead.header.GetHash() == block.GetHash());
+
+    // Everything in the pool
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        pool.mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+    pool.mapTx[MakeTestTx(1000).GetHash()] = MakeTestTx(1000);
+
+    CPartialBlock partial;
+    std::vector<unsigned short> vMissing;
+    BOOST_CHECK(partial.Init(cmpctblockRead, pool, vMissing));
+    BOOST_CHECK(vMissing.empty());
+    BOOST_CHECK(partial.IsComplete());
+    BOOST_CHECK(partial.block.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // Missing transactions are asked for and filled in
+    pool.mapTx.erase(block.vtx[7].GetHash());
+    pool.mapTx.erase(block.vtx[42].GetHash());
+    BOOST_CHECK(partial.Init(cmpctblockRead, pool, vMissing));
+    BOOST_CHECK_EQUAL(vMissing.size(), 2U);
+    BOOST_CHECK_EQUAL(vMissing[0], 7);
+    BOOST_CHECK_EQUAL(vMissing[1], 42);
+    BOOST_CHECK(!partial.IsComplete());
+
+    std::vector<CTransaction> vtxMissing;
+    vtxMissing.push_back(block.vtx[7]);
+    BOOST_CHECK(!partial.Fill(vtxMissing));
+    vtxMissing.push_back(block.vtx[42]);
+    BOOST_CHECK(partial.Fill(vtxMissing));
+    BOOST_CHECK(partial.IsComplete());
+    BOOST_CHECK(partial.block.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // Malformed prefilled index
+    cmpctblockRead.vPrefilled[0].nIndex = 100;
+    BOOST_CHECK(!partial.Init(cmpctblockRead, pool, vMissing));
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_coinstake_prefilled)
+{
+    CBlock block = MakeTestBlock(10);
+    // ppcoin: coinstake has an empty first output
+    CTransaction txCoinStake = MakeTestTx(500);
+    txCoinStake.vout.insert(txCoinStake.vout.begin(), CTxOut());
+    txCoinStake.vout[0].SetEmpty();
+    block.vtx.insert(block.vtx.begin() + 1, txCoinStake);
+    BOOST_CHECK(block.IsProofOfStake());
+
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilled.size(), 2U);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilled[1].nIndex, 1);
+    BOOST_CHECK_EQUAL(cmpctblock.GetTxCount(), block.vtx.size());
+    BOOST_CHECK(cmpctblock.IsProofOfStake());
+}
+
+static uint256 AddPartial(unsigned int n, int nPeer, int64 nTime, std::vector<std::pair<uint256, int> >& vDropped)
+{
+    CPartialBlock partial;
+    partial.nPeer = nPeer;
+    partial.nTimeReceived = nTime;
+    uint256 hash = Hash(BEGIN(n), END(n));
+    AddPartialBlock(hash, partial, vDropped);
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_partial_blocks)
+{
+    int64 nNow = GetTime();
+    std::vector<std::pair<uint256, int> > vDropped;
+    CPartialBlock partial;
+
+    // Two peers announcing the same block each get their own
+    uint256 hash = AddPartial(0, 1, nNow, vDropped);
+    AddPartial(0, 2, nNow, vDropped);
+    BOOST_CHECK(vDropped.empty());
+    BOOST_CHECK(!TakePartialBlock(hash, 3, partial));
+    BOOST_CHECK(TakePartialBlock(hash, 1, partial));
+    BOOST_CHECK_EQUAL(partial.nPeer, 1);
+    BOOST_CHECK(!TakePartialBlock(hash, 1, partial));
+    BOOST_CHECK(TakePartialBlock(hash, 2, partial));
+
+    // A peer over its share only displaces its own oldest
+    uint256 hash1 = AddPartial(1, 1, nNow - 2, vDropped);
+    AddPartial(2, 1, nNow - 1, vDropped);
+    AddPartial(3, 1, nNow, vDropped);
+    BOOST_REQUIRE_EQUAL(vDropped.size(), 1U);
+    BOOST_CHECK(vDropped[0] == std::make_pair(hash1, 1));
+
+    // When full, the peer waited on most gives way
+    for (int nPeer = 2; nPeer < (int)MAX_PARTIAL_BLOCKS; nPeer++)
+        AddPartial(100 + nPeer, nPeer, nNow - 10, vDropped);
+    BOOST_CHECK_EQUAL(vDropped.size(), 1U);
+    AddPartial(200, 1000, nNow, vDropped);
+    BOOST_REQUIRE_EQUAL(vDropped.size(), 2U);
+    BOOST_CHECK_EQUAL(vDropped[1].second, 1);
+
+    // Expired ones are handed back to be fetched whole
+    vDropped.clear();
+    SetMockTime(nNow + PARTIAL_BLOCK_TIMEOUT - 5);
+    ExpirePartialBlocks(vDropped);
+    BOOST_CHECK_EQUAL(vDropped.size(), MAX_PARTIAL_BLOCKS - 2);
+    SetMockTime(nNow + PARTIAL_BLOCK_TIMEOUT * 2);
+    ExpirePartialBlocks(vDropped);
+    BOOST_CHECK_EQUAL(vDropped.size(), MAX_PARTIAL_BLOCKS);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_propagation)
+{
+    // A block travels down a line of nodes, each with its own memory pool
+    // missing a few of the block's transactions, and is rebuilt at every hop
+    const unsigned int nNodes = 8;
+    const unsigned int nTx = 2000;
+
+    CBlock block = MakeTestBlock(nTx);
+    CTxMemPool vPool[nNodes];
+    for (unsigned int nNode = 1; nNode < nNodes; nNode++)
+        for (unsigned int i = 1; i < nTx; i++)
+            if ((i + nNode) % 500 != 0)
+                vPool[nNode].mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+
+    unsigned int nFullBytes = (nNodes - 1) * ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nCompactBytes = 0;
+    CBlock blockRelay = block;
+    for (unsigned int nNode = 1; nNode < nNodes; nNode++)
+    {
+        unsigned int nBytes;
+        CCompactBlock cmpctblock = RoundTrip(CCompactBlock(blockRelay), nBytes);
+        CPartialBlock partial;
+        std::vector<unsigned short> vMissing;
+        BOOST_CHECK(partial.Init(cmpctblock, vPool[nNode], vMissing));
+        BOOST_CHECK_EQUAL(vMissing.size(), 4U);
+
+        CBlockTxResponse resp;
+        BOOST_FOREACH(unsigned short nIndex, vMissing)
+            resp.vtx.push_back(blockRelay.vtx[nIndex]);
+        BOOST_CHECK(partial.Fill(resp.vtx));
+        BOOST_CHECK(partial.IsComplete());
+        BOOST_CHECK(partial.block.BuildMerkleTree() == block.hashMerkleRoot);
+        blockRelay = partial.block;
+        nCompactBytes += nBytes + ::GetSerializeSize(resp, SER_NETWORK, PROTOCOL_VERSION);
+    }
+    BOOST_CHECK(nCompactBytes * 5 < nFullBytes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,103 @@
+//
+// Unit tests for the secure message bucket sketches
+//
+#include <boost/test/unit_test.hpp>
+
+#include <set>
+
+#include "emessage.h"
+#include "emessagesketch.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(emessagesketch_tests)
+
+static std::vector<unsigned char> MakeToken(uint32_t n)
+{
+    std::vector<unsigned char> vchToken(SMSG_TOKEN_LEN);
+    int64_t timestamp = 1400000000 + n / 4;
+    memcpy(&vchToken[0], &timestamp, 8);
+    uint256 hash = Hash(BEGIN(n), END(n));
+    memcpy(&vchToken[8], hash.begin(), 8);
+    return vchToken;
+}
+
+static std::set<std::vector<unsigned char> > Split(const std::vector<unsigned char>& vchTokens)
+{
+    std::set<std::vector<unsigned char> > setTokens;
+    for (unsigned int i = 0; i + SMSG_TOKEN_LEN <= vchTokens.size(); i += SMSG_TOKEN_LEN)
+        setTokens.insert(std::vector<unsigned char>(vchTokens.begin() + i, vchTokens.begin() + i + SMSG_TOKEN_LEN));
+    return setTokens;
+}
+
+BOOST_AUTO_TEST_CASE(sketch_cells)
+{
+    BOOST_CHECK_EQUAL(SecMsgSketch::CellsFor(0) % 3, 0U);
+    BOOST_CHECK(SecMsgSketch::CellsFor(10) > 20U);
+    BOOST_CHECK_EQUAL(SecMsgSketch::CellsFor(1000000), SMSG_SKETCH_MAX_CELLS);
+    BOOST_CHECK_EQUAL(SecMsgSketch(10).size(), 12U);
+}
+
+BOOST_AUTO_TEST_CASE(sketch_reconcile)
+{
+    // Two copies of a bucket of 1000 messages, each missing some of the other's
+    for (uint32_t nDiff = 0; nDiff <= 40; nDiff += 5)
+    {
+        uint32_t nCells = SecMsgSketch::CellsFor(nDiff);
+        SecMsgSketch sketchA(nCells), sketchB(nCells);
+        std::set<std::vector<unsigned char> > setOnlyA, setOnlyB;
+        for (uint32_t n = 0; n < 1000 + nDiff; n++)
+        {
+            std::vector<unsigned char> vchToken = MakeToken(n);
+            if (n < 1000 || n % 2)
+                sketchA.Insert(&vchToken[0]);
+            if (n < 1000 || !(n % 2))
+                sketchB.Insert(&vchToken[0]);
+            if (n >= 1000)
+                (n % 2 ? setOnlyA : setOnlyB).insert(vchToken);
+        }
+
+        // The wire format round trips
+        std::vector<unsigned char> vchData;
+        sketchB.Write(vchData);
+        BOOST_CHECK_EQUAL(vchData.size(), nCells * SMSG_SKETCH_CELL_LEN);
+        SecMsgSketch sketchPeer;
+        BOOST_REQUIRE(sketchPeer.Read(&vchData[0], nCells));
+
+        BOOST_CHECK(sketchA.Subtract(sketchPeer));
+        std::vector<unsigned char> vchOnlyHere, vchOnlyThere;
+        BOOST_CHECK(sketchA.Decode(vchOnlyHere, vchOnlyThere));
+        BOOST_CHECK(Split(vchOnlyHere) == setOnlyA);
+        BOOST_CHECK(Split(vchOnlyThere) == setOnlyB);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sketch_overload)
+{
+    // Far more differences than cells don't decode
+    SecMsgSketch sketch(SecMsgSketch::CellsFor(4));
+    for (uint32_t n = 0; n < 200; n++)
+    {
+        std::vector<unsigned char> vchToken = MakeToken(n);
+        sketch.Insert(&vchToken[0]);
+    }
+    std::vector<unsigned char> vchOnlyHere, vchOnlyThere;
+    BOOST_CHECK(!sketch.Decode(vchOnlyHere, vchOnlyThere));
+
+    // Erasing the tokens again leaves an empty sketch
+    for (uint32_t n = 0; n < 200; n++)
+    {
+        std::vector<unsigned char> vchToken = MakeToken(n);
+        sketch.Erase(&vchToken[0]);
+    }
+    BOOST_CHECK(sketch.Decode(vchOnlyHere, vchOnlyThere));
+    BOOST_CHECK(vchOnlyHere.empty() && vchOnlyThere.empty());
+
+    SecMsgSketch sketchOther(SecMsgSketch::CellsFor(8));
+    BOOST_CHECK(!sketch.Subtract(sketchOther));
+
+    std::vector<unsigned char> vchData(SMSG_SKETCH_CELL_LEN * 4);
+    BOOST_CHECK(!sketchOther.Read(&vchData[0], 4));
+    BOOST_CHECK(!sketchOther.Read(&vchData[0], 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
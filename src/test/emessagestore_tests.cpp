@@ -0,0 +1,288 @@
+//
+// Unit tests for the secure message store: bucket digests, expiry wheel, manifest and bucket index files
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "emessage.h"
+#include "util.h"
+
+namespace fs = boost::filesystem;
+
+struct StoreSetup {
+    fs::path pathStore;
+
+    StoreSetup()
+    {
+        pathStore = fs::temp_directory_path() / strprintf("test_cinnicoin_smsg_%"PRI64d"_%d", GetTime(), (int)GetRand(100000));
+        fs::create_directories(pathStore);
+    }
+    ~StoreSetup()
+    {
+        fs::remove_all(pathStore);
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(emessagestore_tests, StoreSetup)
+
+static const int64_t nStart = 1400000000 - 1400000000 % SMSG_BUCKET_LEN;
+
+static void Touch(const fs::path& path)
+{
+    FILE* fp = fopen(path.string().c_str(), "wb");
+    BOOST_REQUIRE(fp);
+    fclose(fp);
+}
+
+static fs::path BucketPath(const fs::path& pathStore, int64_t bucketTime, const char* pszSuffix)
+{
+    return pathStore / strprintf("%"PRI64d"%s", (int64)bucketTime, pszSuffix);
+}
+
+static SecMsgToken AppendMessage(const fs::path& pathStore, int64_t bucketTime, uint32_t n)
+{
+    FILE* fp = fopen(BucketPath(pathStore, bucketTime, "_01.dat").string().c_str(), "ab");
+    BOOST_REQUIRE(fp);
+    fseek(fp, 0, SEEK_END);
+    long int ofs = ftell(fp);
+
+    std::vector<unsigned char> vchPayload(32 + n);
+    uint256 hash = Hash(BEGIN(n), END(n));
+    memcpy(&vchPayload[0], hash.begin(), 8);
+
+    SecureMessage smsg;
+    memset(&smsg.hash[0], 0, SMSG_HDR_LEN);
+    smsg.timestamp = bucketTime + n;
+    smsg.nPayload = vchPayload.size();
+
+    BOOST_REQUIRE(fwrite(&smsg.hash[0], 1, SMSG_HDR_LEN, fp) == SMSG_HDR_LEN);
+    BOOST_REQUIRE(fwrite(&vchPayload[0], 1, vchPayload.size(), fp) == vchPayload.size());
+    fclose(fp);
+
+    return SecMsgToken(smsg.timestamp, &vchPayload[0], vchPayload.size(), ofs);
+}
+
+static void CheckTokens(const std::vector<SecMsgToken>& vTokens, const std::vector<SecMsgToken>& vExpected)
+{
+    BOOST_REQUIRE_EQUAL(vTokens.size(), vExpected.size());
+    for (unsigned int i = 0; i < vTokens.size(); i++)
+    {
+        BOOST_CHECK(vTokens[i] == vExpected[i]);
+        BOOST_CHECK_EQUAL(vTokens[i].offset, vExpected[i].offset);
+    }
+}
+
+// Token of message n of a bucket, stored at offset n
+static SecMsgToken MakeBucketToken(uint32_t n)
+{
+    uint256 hash = Hash(BEGIN(n), END(n));
+    return SecMsgToken(1400000000 + n / 4, hash.begin(), 8, n);
+}
+
+BOOST_AUTO_TEST_CASE(expiry_wheel_wrap)
+{
+    // -- more buckets than slots, bucket i and i + SMSG_EXPIRY_SLOTS share a slot
+    SecMsgExpiryWheel wheel;
+    unsigned int nBuckets = SMSG_EXPIRY_SLOTS + 10;
+    for (unsigned int i = 0; i < nBuckets; i++)
+        wheel.Schedule(nStart + i * SMSG_BUCKET_LEN);
+
+    unsigned int nSlot = (nStart / SMSG_BUCKET_LEN) % SMSG_EXPIRY_SLOTS;
+    BOOST_CHECK_EQUAL(wheel.slots[nSlot].size(), 2U);
+    BOOST_CHECK_EQUAL(wheel.slots[(nSlot + 10) % SMSG_EXPIRY_SLOTS].size(), 1U);
+
+    // -- turning one bucket at a time takes out only the bucket passed, not the later one in its slot
+    std::vector<int64_t> vExpired;
+    wheel.TakeExpired(nStart, vExpired);
+    BOOST_CHECK(vExpired.empty());
+    for (unsigned int i = 0; i < nBuckets; i++)
+    {
+        vExpired.clear();
+        wheel.TakeExpired(nStart + (i + 1) * SMSG_BUCKET_LEN, vExpired);
+        BOOST_REQUIRE_EQUAL(vExpired.size(), 1U);
+        BOOST_CHECK_EQUAL(vExpired[0], nStart + i * SMSG_BUCKET_LEN);
+    }
+
+    for (unsigned int i = 0; i < SMSG_EXPIRY_SLOTS; i++)
+        BOOST_CHECK(wheel.slots[i].empty());
+}
+
+BOOST_AUTO_TEST_CASE(expiry_wheel_gap)
+{
+    SecMsgExpiryWheel wheel;
+    for (unsigned int i = 0; i < 10; i++)
+        wheel.Schedule(nStart + i * SMSG_BUCKET_LEN);
+    wheel.Schedule(nStart + (SMSG_EXPIRY_SLOTS + 3) * SMSG_BUCKET_LEN);
+
+    // -- a cutoff inside a bucket's slot takes out the buckets before it, the slot is looked at again next turn
+    std::vector<int64_t> vExpired;
+    wheel.TakeExpired(nStart + 2 * SMSG_BUCKET_LEN + 1, vExpired);
+    BOOST_CHECK_EQUAL(vExpired.size(), 3U);
+
+    // -- a gap longer than the wheel still takes out everything due
+    vExpired.clear();
+    wheel.TakeExpired(nStart + 4 * SMSG_EXPIRY_SLOTS * SMSG_BUCKET_LEN, vExpired);
+    BOOST_CHECK_EQUAL(vExpired.size(), 8U);
+
+    // -- a bucket older than the last turn moves the wheel back
+    wheel.Schedule(nStart);
+    vExpired.clear();
+    wheel.TakeExpired(nStart + SMSG_BUCKET_LEN, vExpired);
+    BOOST_REQUIRE_EQUAL(vExpired.size(), 1U);
+    BOOST_CHECK_EQUAL(vExpired[0], nStart);
+}
+
+BOOST_AUTO_TEST_CASE(manifest_roundtrip)
+{
+    std::map<int64_t, uint32_t> mapFiles, mapRead;
+    BOOST_CHECK_EQUAL(SecureMsgReadManifest(pathStore, mapRead), 2);
+
+    mapFiles[nStart] = SMSG_FILE_DAT;
+    mapFiles[nStart + SMSG_BUCKET_LEN] = SMSG_FILE_DAT | SMSG_FILE_WL;
+    mapFiles[nStart + 2 * SMSG_BUCKET_LEN] = SMSG_FILE_WL;
+    BOOST_CHECK_EQUAL(SecureMsgWriteManifest(pathStore, mapFiles), 0);
+    BOOST_CHECK(!fs::exists(pathStore / "manifest.lst.tmp"));
+
+    BOOST_CHECK_EQUAL(SecureMsgReadManifest(pathStore, mapRead), 0);
+    BOOST_CHECK(mapRead == mapFiles);
+
+    // -- writing again replaces the old list
+    mapFiles.erase(nStart);
+    BOOST_CHECK_EQUAL(SecureMsgWriteManifest(pathStore, mapFiles), 0);
+    mapRead.clear();
+    BOOST_CHECK_EQUAL(SecureMsgReadManifest(pathStore, mapRead), 0);
+    BOOST_CHECK(mapRead == mapFiles);
+}
+
+BOOST_AUTO_TEST_CASE(manifest_migrate)
+{
+    // -- a store from before the manifest, listed from the directory
+    Touch(BucketPath(pathStore, nStart, "_01.dat"));
+    Touch(BucketPath(pathStore, nStart, "_01.idx"));
+    Touch(BucketPath(pathStore, nStart + SMSG_BUCKET_LEN, "_01_wl.dat"));
+    Touch(BucketPath(pathStore, nStart + 2 * SMSG_BUCKET_LEN, "_01.dat"));
+    Touch(BucketPath(pathStore, nStart + 2 * SMSG_BUCKET_LEN, "_01_wl.dat"));
+    Touch(pathStore / "notatime_01.dat");
+    Touch(pathStore / "1400000000.dat");
+    fs::create_directories(BucketPath(pathStore, nStart + 3 * SMSG_BUCKET_LEN, "_01.dat"));
+
+    std::map<int64_t, uint32_t> mapFiles, mapExpected, mapRead;
+    mapExpected[nStart] = SMSG_FILE_DAT;
+    mapExpected[nStart + SMSG_BUCKET_LEN] = SMSG_FILE_WL;
+    mapExpected[nStart + 2 * SMSG_BUCKET_LEN] = SMSG_FILE_DAT | SMSG_FILE_WL;
+
+    BOOST_CHECK_EQUAL(SecureMsgReadManifest(pathStore, mapRead), 2);
+    BOOST_CHECK_EQUAL(SecureMsgListStore(pathStore, mapFiles), 0);
+    BOOST_CHECK(mapFiles == mapExpected);
+
+    BOOST_CHECK_EQUAL(SecureMsgWriteManifest(pathStore, mapFiles), 0);
+    BOOST_CHECK_EQUAL(SecureMsgReadManifest(pathStore, mapRead), 0);
+    BOOST_CHECK(mapRead == mapExpected);
+}
+
+BOOST_AUTO_TEST_CASE(index_rebuild)
+{
+    std::vector<SecMsgToken> vExpected, vTokens;
+    for (uint32_t n = 0; n < 3; n++)
+        vExpected.push_back(AppendMessage(pathStore, nStart, n));
+
+    fs::path pathIndex = BucketPath(pathStore, nStart, "_01.idx");
+    uint64_t nFileSize = fs::file_size(BucketPath(pathStore, nStart, "_01.dat"));
+    uint64_t nDataEnd;
+
+    // -- no index, it is built from the bucket file and read after
+    BOOST_CHECK_EQUAL(SecureMsgReadIndex(pathStore, nStart, vTokens, nDataEnd), 2);
+    BOOST_CHECK_EQUAL(SecureMsgLoadBucketFile(pathStore, nStart, vTokens), 2);
+    CheckTokens(vTokens, vExpected);
+    BOOST_CHECK_EQUAL(fs::file_size(pathIndex), 3 * SMSG_INDEX_LEN);
+
+    BOOST_CHECK_EQUAL(SecureMsgLoadBucketFile(pathStore, nStart, vTokens), 0);
+    CheckTokens(vTokens, vExpected);
+    BOOST_CHECK_EQUAL(SecureMsgReadIndex(pathStore, nStart, vTokens, nDataEnd), 0);
+    BOOST_CHECK_EQUAL(nDataEnd, nFileSize);
+
+    // -- a partial record is an error and the index is rebuilt
+    fs::resize_file(pathIndex, 2 * SMSG_INDEX_LEN + 2);
+    BOOST_CHECK_EQUAL(SecureMsgReadIndex(pathStore, nStart, vTokens, nDataEnd), 1);
+    BOOST_CHECK_EQUAL(SecureMsgLoadBucketFile(pathStore, nStart, vTokens), 2);
+    CheckTokens(vTokens, vExpected);
+    BOOST_CHECK_EQUAL(fs::file_size(pathIndex), 3 * SMSG_INDEX_LEN);
+
+    // -- whole records but short of the bucket file, the last message was not indexed
+    fs::resize_file(pathIndex, 2 * SMSG_INDEX_LEN);
+    BOOST_CHECK_EQUAL(SecureMsgReadIndex(pathStore, nStart, vTokens, nDataEnd), 0);
+    BOOST_CHECK_EQUAL(vTokens.size(), 2U);
+    BOOST_CHECK(nDataEnd < nFileSize);
+    BOOST_CHECK_EQUAL(SecureMsgLoadBucketFile(pathStore, nStart, vTokens), 2);
+    CheckTokens(vTokens, vExpected);
+
+    vExpected.push_back(AppendMessage(pathStore, nStart, 3));
+    BOOST_CHECK_EQUAL(SecureMsgLoadBucketFile(pathStore, nStart, vTokens), 2);
+    CheckTokens(vTokens, vExpected);
+    BOOST_CHECK_EQUAL(SecureMsgLoadBucketFile(pathStore, nStart, vTokens), 0);
+
+    // -- a bucket file that can't be read
+    BOOST_CHECK_EQUAL(SecureMsgLoadBucketFile(pathStore, nStart + SMSG_BUCKET_LEN, vTokens), 1);
+}
+
+BOOST_AUTO_TEST_CASE(bucket_digest)
+{
+    // The digest doesn't depend on the order tokens arrive in
+    SecMsgBucket bucketA, bucketB;
+    for (uint32_t n = 0; n < 100; n++)
+    {
+        BOOST_CHECK(bucketA.AddToken(MakeBucketToken(n)));
+        BOOST_CHECK(bucketB.AddToken(MakeBucketToken(99 - n)));
+    }
+    BOOST_CHECK_EQUAL(bucketA.nDigest, bucketB.nDigest);
+    BOOST_CHECK_EQUAL(bucketA.GetHash(SMSG_PROTOCOL_VERSION), bucketA.nDigest);
+    
+    // Adding a token again changes nothing
+    uint32_t nDigest = bucketA.nDigest;
+    BOOST_CHECK(!bucketA.AddToken(MakeBucketToken(5)));
+    BOOST_CHECK_EQUAL(bucketA.nDigest, nDigest);
+    
+    // Old peers are still sent the hash of the tokens in order
+    BOOST_CHECK(bucketA.fHashStale);
+    uint32_t nHash = bucketA.GetHash(0);
+    BOOST_CHECK(!bucketA.fHashStale);
+    BOOST_CHECK_EQUAL(nHash, bucketB.GetHash(0));
+    
+    BOOST_CHECK(bucketA.AddToken(MakeBucketToken(100)));
+    BOOST_CHECK(bucketA.nDigest != nDigest);
+    BOOST_CHECK(bucketA.GetHash(0) != nHash);
+}
+
+BOOST_AUTO_TEST_CASE(bucket_unload)
+{
+    SecMsgBucket bucket;
+    for (uint32_t n = 0; n < 50; n++)
+        BOOST_CHECK(bucket.AddToken(MakeBucketToken(49 - n)));
+    BOOST_CHECK_EQUAL(bucket.size(), 50U);
+    BOOST_CHECK(bucket.FindToken(MakeBucketToken(7)));
+    BOOST_CHECK_EQUAL(bucket.FindToken(MakeBucketToken(7))->offset, 7U);
+    BOOST_CHECK(!bucket.FindToken(MakeBucketToken(50)));
+    for (uint32_t i = 1; i < bucket.vTokens.size(); i++)
+        BOOST_CHECK(bucket.vTokens[i-1] < bucket.vTokens[i]);
+    
+    // An unloaded bucket keeps its count and hashes but no tokens
+    SecMsgBucket bucketCopy(bucket);
+    uint32_t nDigest = bucket.nDigest;
+    BOOST_CHECK(bucket.Unload());
+    BOOST_CHECK(!bucket.fLoaded);
+    BOOST_CHECK(bucket.vTokens.empty());
+    BOOST_CHECK_EQUAL(bucket.size(), 50U);
+    BOOST_CHECK_EQUAL(bucket.nDigest, nDigest);
+    BOOST_CHECK(!bucket.fHashStale);
+    BOOST_CHECK_EQUAL(bucket.GetHash(0), bucketCopy.GetHash(0));
+    BOOST_CHECK(!bucket.AddToken(MakeBucketToken(51)));
+    BOOST_CHECK(!bucket.Unload());
+    
+    // A bucket missing from the index must stay in memory
+    SecMsgBucket bucketNoIndex;
+    bucketNoIndex.AddToken(MakeBucketToken(1));
+    bucketNoIndex.fIndexed = false;
+    BOOST_CHECK(!bucketNoIndex.Unload());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
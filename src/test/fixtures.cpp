@@ -0,0 +1,91 @@
+#include <algorithm>
+
+#include "fixtures.h"
+
+CTransaction MakeTestTx(unsigned int n, unsigned int nInputs)
+{
+    CTransaction tx;
+    tx.nTime = 1400000000 + n;
+    tx.vin.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        tx.vin[i].prevout.hash = Hash(BEGIN(n), END(n));
+        tx.vin[i].prevout.n = n % 3 + i;
+        tx.vin[i].scriptSig << std::vector<unsigned char>(72, n) << std::vector<unsigned char>(33, n);
+    }
+    tx.vout.resize(2);
+    tx.vout[0].nValue = n * CENT;
+    tx.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, n) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.vout[1] = tx.vout[0];
+    return tx;
+}
+
+CBlock MakeTestBlock(unsigned int nTx, unsigned int n)
+{
+    CBlock block;
+    block.nTime = 1400000000 + n;
+    block.nBits = 0x1e0fffff;
+    block.vtx.resize(1);
+    block.vtx[0].nTime = block.nTime;
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vin[0].scriptSig << std::vector<unsigned char>(BEGIN(n), END(n));
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 5 * COIN;
+    for (unsigned int i = 1; i < nTx; i++)
+        block.vtx.push_back(MakeTestTx(i));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+void MakeTestChain(std::vector<CBlockIndex>& vIndex, unsigned int nStart, unsigned int nTimeStart, unsigned int nSeed)
+{
+    for (unsigned int i = nStart; i < vIndex.size(); i++)
+    {
+        CBlockIndex& index = vIndex[i];
+        index.nHeight = i;
+        index.nTime = nTimeStart + (i - nStart) * 60 + ((i * 7 + nSeed) % 11) * 5;
+        if ((i + nSeed) % 997 == 0)
+            index.nTime += 60 * 60;
+        if ((i + nSeed) % 2503 == 0)
+            index.nTime += 20 * 60 * 60;
+        index.pprev = i > 0 ? &vIndex[i - 1] : NULL;
+        index.pnext = NULL;
+        if (index.pprev)
+            index.pprev->pnext = &index;
+        bool fGenerated = i == 0 || index.nTime / 1800 != index.pprev->nTime / 1800;
+        index.SetStakeModifier(((uint64)nSeed << 32) | i, fGenerated);
+    }
+}
+
+uint256 ReferenceMerkleTree(const std::vector<uint256>& vLeaves, std::vector<uint256>& vTree)
+{
+    vTree = vLeaves;
+    int j = 0;
+    for (int nSize = vLeaves.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        for (int i = 0; i < nSize; i += 2)
+        {
+            int i2 = std::min(i+1, nSize-1);
+            vTree.push_back(Hash(BEGIN(vTree[j+i]),  END(vTree[j+i]),
+                                 BEGIN(vTree[j+i2]), END(vTree[j+i2])));
+        }
+        j += nSize;
+    }
+    return (vTree.empty() ? 0 : vTree.back());
+}
+
+const CBlockIndex* WalkStakeModifierBlock(const CBlockIndex* pindexFrom, int64 nInterval)
+{
+    int64 nStakeModifierTime = pindexFrom->GetBlockTime();
+    const CBlockIndex* pindex = pindexFrom;
+    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nInterval)
+    {
+        if (!pindex->pnext)
+            return NULL;
+        pindex = pindex->pnext;
+        if (pindex->GeneratedStakeModifier())
+            nStakeModifierTime = pindex->GetBlockTime();
+    }
+    return pindex;
+}
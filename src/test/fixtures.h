@@ -0,0 +1,29 @@
+//
+// Transactions, blocks and chains shaped like network traffic, and the
+// reference implementations the unit tests and benchmarks compare against
+//
+#ifndef BCINNIOIN_TEST_FIXTURES_H
+#define BCINNIOIN_TEST_FIXTURES_H
+
+#include "main.h"
+
+// Pay-to-pubkey-hash spend with a 72 byte signature and 33 byte key in each
+// input and two outputs, n makes it unique
+CTransaction MakeTestTx(unsigned int n, unsigned int nInputs = 1);
+
+// Proof-of-work block with a coinbase and nTx - 1 transactions from
+// MakeTestTx, blocks with another n differ only in time and coinbase
+CBlock MakeTestBlock(unsigned int nTx, unsigned int n = 0);
+
+// Chain of one minute blocks from nStart on with a new modifier every half
+// hour. Every so often a block is stamped hours ahead, like a miner with a
+// fast clock.
+void MakeTestChain(std::vector<CBlockIndex>& vIndex, unsigned int nStart, unsigned int nTimeStart, unsigned int nSeed);
+
+// The level by level tree CBlock::BuildMerkleTree built with Hash()
+uint256 ReferenceMerkleTree(const std::vector<uint256>& vLeaves, std::vector<uint256>& vTree);
+
+// The pnext walk GetKernelStakeModifier used before the index
+const CBlockIndex* WalkStakeModifierBlock(const CBlockIndex* pindexFrom, int64 nInterval);
+
+#endif
@@ -0,0 +1,94 @@
+//
+// Unit tests for the proof-of-stake kernel
+//
+#include <boost/test/unit_test.hpp>
+
+#include <boost/foreach.hpp>
+
+#include "kernel.h"
+#include "kernelhash.h"
+#include "util.h"
+#include "fixtures.h"
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+static bool SameBlock(const CBlockIndex* pindexA, const CBlockIndex* pindexB)
+{
+    if (!pindexA || !pindexB)
+        return pindexA == pindexB;
+    return pindexA->nHeight == pindexB->nHeight && pindexA->nStakeModifier == pindexB->nStakeModifier;
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_index)
+{
+    std::vector<CBlockIndex> vIndex(5000);
+    MakeTestChain(vIndex, 0, 1400000000, 0);
+    BuildStakeModifierIndex(&vIndex[0]);
+
+    const int64 nInterval = 17 * 60 * 60;
+    for (unsigned int i = 0; i < vIndex.size() - 1; i++)
+        BOOST_CHECK(SameBlock(FindStakeModifierBlock(i, vIndex[i].GetBlockTime() + nInterval), WalkStakeModifierBlock(&vIndex[i], nInterval)));
+    BOOST_CHECK(FindStakeModifierBlock(vIndex.size() - 100, vIndex.back().GetBlockTime() + nInterval) == NULL);
+
+    // Reorganize onto a branch forking at 3000
+    std::vector<CBlockIndex> vBranch(6000);
+    for (unsigned int i = 0; i <= 3000; i++)
+    {
+        vBranch[i] = vIndex[i];
+        vBranch[i].pprev = i > 0 ? &vBranch[i - 1] : NULL;
+        if (i > 0)
+            vBranch[i - 1].pnext = &vBranch[i];
+    }
+    MakeTestChain(vBranch, 3001, vBranch[3000].nTime + 30, 5);
+    RewindStakeModifierIndex(3000);
+    for (unsigned int i = 3001; i < vBranch.size(); i++)
+        AddToStakeModifierIndex(&vBranch[i]);
+    for (unsigned int i = 2000; i < vBranch.size() - 1; i++)
+        BOOST_CHECK(SameBlock(FindStakeModifierBlock(i, vBranch[i].GetBlockTime() + nInterval), WalkStakeModifierBlock(&vBranch[i], nInterval)));
+
+    RewindStakeModifierIndex(-1);
+    BOOST_CHECK(FindStakeModifierBlock(0, 0) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(kernel_hash_backends)
+{
+    // A 60 second search window over a few hundred coins, serialized the
+    // way CheckStakeKernelHash does it
+    std::vector<unsigned char> vKernels;
+    std::vector<uint256> vExpected;
+    for (unsigned int nCoin = 0; nCoin < 300; nCoin++)
+    {
+        for (unsigned int nTimeTx = 1400100000; nTimeTx > 1400100000 - 60; nTimeTx--)
+        {
+            CDataStream ss(SER_GETHASH, 0);
+            ss << (uint64)(0x1234567890abcdefULL ^ nCoin) << 1400000000U + nCoin << 81U + nCoin << 1400000100U + nCoin << nCoin % 3 << nTimeTx;
+            BOOST_REQUIRE_EQUAL(ss.size(), STAKE_KERNEL_SIZE);
+            vKernels.insert(vKernels.end(), ss.begin(), ss.end());
+            vExpected.push_back(Hash(ss.begin(), ss.end()));
+        }
+    }
+    unsigned int nCount = vExpected.size();
+
+    std::vector<std::string> vNames = GetKernelHasherNames();
+    BOOST_CHECK(!vNames.empty());
+    BOOST_CHECK(GetKernelHasher("no-such-backend") == NULL);
+    BOOST_CHECK(!SelectKernelHasher("no-such-backend"));
+
+    BOOST_FOREACH(const std::string& strName, vNames)
+    {
+        CKernelHasher* phasher = GetKernelHasher(strName);
+        BOOST_REQUIRE(phasher != NULL);
+
+        // Odd counts leave a partial group of lanes
+        std::vector<uint256> vHash(nCount);
+        phasher->Hash(&vKernels[0], nCount - 7, &vHash[0]);
+        phasher->Hash(&vKernels[(nCount - 7) * STAKE_KERNEL_SIZE], 7, &vHash[nCount - 7]);
+        BOOST_CHECK(vHash == vExpected);
+
+        BOOST_CHECK(SelectKernelHasher(strName));
+        BOOST_CHECK(GetSelectedKernelHasher() == phasher);
+    }
+    BOOST_CHECK(SelectKernelHasher(vNames[0]));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 
+#include <boost/foreach.hpp>
+
 #include "key.h"
 #include "base58.h"
 #include "uint256.h"
@@ -144,4 +146,83 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_ecverify_backends)
+{
+    CBitcoinSecret bsecret1, bsecret1C;
+    BOOST_CHECK(bsecret1.SetString (strSecret1));
+    BOOST_CHECK(bsecret1C.SetString(strSecret1C));
+
+    bool fCompressed;
+    CKey key1, key1C;
+    key1.SetSecret(bsecret1.GetSecret(fCompressed), false);
+    key1C.SetSecret(bsecret1C.GetSecret(fCompressed), true);
+    vector<unsigned char> vchPubKey1 = key1.GetPubKey().Raw();
+    vector<unsigned char> vchPubKey1C = key1C.GetPubKey().Raw();
+
+    vector<uint256> vHash;
+    vector<vector<unsigned char> > vSig;
+    for (int n = 0; n < 200; n++)
+    {
+        string strMsg = strprintf("Backend message %i", n);
+        vHash.push_back(Hash(strMsg.begin(), strMsg.end()));
+        vector<unsigned char> vchSig;
+        BOOST_CHECK((n % 2 ? key1C : key1).Sign(vHash.back(), vchSig));
+        vSig.push_back(vchSig);
+    }
+
+    vector<string> vNames = GetECVerifierNames();
+    BOOST_CHECK(!vNames.empty());
+    BOOST_CHECK(GetECVerifier("no-such-backend") == NULL);
+    BOOST_CHECK(!SelectECVerifier("no-such-backend"));
+
+    BOOST_FOREACH(const string& strName, vNames)
+    {
+        CECVerifier* verifier = GetECVerifier(strName);
+        BOOST_REQUIRE(verifier != NULL);
+
+        // Every backend must agree with the reference implementation,
+        // including rejecting a signature checked against the wrong hash
+        // and a public key that does not parse
+        for (unsigned int n = 0; n < vHash.size(); n++)
+        {
+            const vector<unsigned char>& vchPubKey = n % 2 ? vchPubKey1C : vchPubKey1;
+            BOOST_CHECK(verifier->Verify(vchPubKey, vHash[n], vSig[n]));
+            BOOST_CHECK(!verifier->Verify(vchPubKey, vHash[(n + 1) % vHash.size()], vSig[n]));
+        }
+        BOOST_CHECK(!verifier->Verify(vector<unsigned char>(33, 0x05), vHash[0], vSig[0]));
+        BOOST_CHECK(!verifier->Verify(vchPubKey1, vHash[0], vector<unsigned char>()));
+
+        BOOST_CHECK(SelectECVerifier(strName));
+        BOOST_CHECK(GetSelectedECVerifier() == verifier);
+        BOOST_CHECK(CPubKey(vchPubKey1).Verify(vHash[0], vSig[0]));
+    }
+    BOOST_CHECK(SelectECVerifier(vNames[0]));
+}
+
+BOOST_AUTO_TEST_CASE(key_setprivkey_skipcheck)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i == 1);
+        CPrivKey privkey = key.GetPrivKey();
+
+        // Loading without the consistency check gives the same key
+        CKey keyFast;
+        keyFast.SetPubKey(key.GetPubKey());
+        BOOST_CHECK(keyFast.SetPrivKey(privkey, true));
+        BOOST_CHECK(keyFast.GetPubKey() == key.GetPubKey());
+        BOOST_CHECK(keyFast.IsValid());
+
+        bool fCompressed, fCompressedFast;
+        BOOST_CHECK(keyFast.GetSecret(fCompressedFast) == key.GetSecret(fCompressed));
+        BOOST_CHECK_EQUAL(fCompressedFast, fCompressed);
+
+        // Garbage is still rejected
+        CPrivKey privkeyBad(privkey.begin(), privkey.begin() + 10);
+        CKey keyBad;
+        BOOST_CHECK(!keyBad.SetPrivKey(privkeyBad, true));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
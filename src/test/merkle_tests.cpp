@@ -0,0 +1,107 @@
+//
+// Unit tests for merkle tree hashing
+//
+#include <boost/test/unit_test.hpp>
+
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "util.h"
+#include "fixtures.h"
+
+BOOST_AUTO_TEST_SUITE(merkle_tests)
+
+static std::vector<uint256> MakeLeaves(unsigned int nLeaves)
+{
+    std::vector<uint256> vLeaves;
+    for (unsigned int i = 0; i < nLeaves; i++)
+        vLeaves.push_back(Hash(BEGIN(i), END(i)));
+    return vLeaves;
+}
+
+BOOST_AUTO_TEST_CASE(merkle_tree_size)
+{
+    BOOST_CHECK_EQUAL(GetMerkleTreeSize(0), 0U);
+    BOOST_CHECK_EQUAL(GetMerkleTreeSize(1), 1U);
+    BOOST_CHECK_EQUAL(GetMerkleTreeSize(2), 3U);
+    BOOST_CHECK_EQUAL(GetMerkleTreeSize(3), 6U);
+    BOOST_CHECK_EQUAL(GetMerkleTreeSize(4), 7U);
+    BOOST_CHECK_EQUAL(GetMerkleTreeSize(5), 11U);
+}
+
+BOOST_AUTO_TEST_CASE(merkle_hash_backends)
+{
+    std::vector<std::string> vNames = GetMerkleHasherNames();
+    BOOST_CHECK(!vNames.empty());
+    BOOST_CHECK(GetMerkleHasher("no-such-backend") == NULL);
+    BOOST_CHECK(!SelectMerkleHasher("no-such-backend"));
+
+    // Pair hashes against Hash(), with a partial group of lanes at the end
+    std::vector<uint256> vNodes = MakeLeaves(2 * 37);
+    std::vector<uint256> vExpected;
+    for (unsigned int i = 0; i < vNodes.size(); i += 2)
+        vExpected.push_back(Hash(BEGIN(vNodes[i]), END(vNodes[i]), BEGIN(vNodes[i+1]), END(vNodes[i+1])));
+
+    BOOST_FOREACH(const std::string& strName, vNames)
+    {
+        CMerkleHasher* phasher = GetMerkleHasher(strName);
+        BOOST_REQUIRE(phasher != NULL);
+        std::vector<uint256> vHash(vExpected.size());
+        phasher->Hash(&vNodes[0], vHash.size(), &vHash[0]);
+        BOOST_CHECK_MESSAGE(vHash == vExpected, strName);
+
+        // Whole trees of every shape up to a few levels of odd nodes
+        BOOST_CHECK(SelectMerkleHasher(strName));
+        for (unsigned int nLeaves = 0; nLeaves <= 70; nLeaves++)
+        {
+            std::vector<uint256> vLeaves = MakeLeaves(nLeaves);
+            std::vector<uint256> vReference;
+            uint256 hashRoot = ReferenceMerkleTree(vLeaves, vReference);
+            std::vector<uint256> vTree = vLeaves;
+            BOOST_CHECK(ComputeMerkleTree(vTree) == hashRoot);
+            BOOST_CHECK(vTree == vReference);
+        }
+    }
+    BOOST_CHECK(SelectMerkleHasher(vNames[0]));
+}
+
+BOOST_AUTO_TEST_CASE(merkle_coinbase_update)
+{
+    for (unsigned int nTx = 1; nTx <= 33; nTx += 4)
+    {
+        CBlock block = MakeTestBlock(nTx);
+        block.BuildMerkleTree();
+        const uint256* pbuffer = &block.vMerkleTree[0];
+
+        // Roll the extra nonce a few times
+        for (unsigned int nExtraNonce = 1; nExtraNonce < 4; nExtraNonce++)
+        {
+            block.vtx[0].vin[0].scriptSig = CScript() << nTx << nExtraNonce;
+            block.vtx[0].ClearCache();
+            uint256 hashRoot = block.UpdateCoinbaseMerkleRoot();
+            std::vector<uint256> vTree = block.vMerkleTree;
+            BOOST_CHECK(block.BuildMerkleTree() == hashRoot);
+            BOOST_CHECK(block.vMerkleTree == vTree);
+            BOOST_CHECK(&block.vMerkleTree[0] == pbuffer);
+        }
+    }
+
+    // Without a tree to update it builds one
+    CBlock block = MakeTestBlock(10);
+    block.vMerkleTree.clear();
+    uint256 hashRoot = block.UpdateCoinbaseMerkleRoot();
+    BOOST_CHECK(hashRoot == block.BuildMerkleTree());
+
+    // A tree of the same size over other transactions is not trusted
+    block.BuildMerkleTree();
+    CBlock blockOther = MakeTestBlock(10);
+    blockOther.vtx[0] = block.vtx[0];
+    blockOther.vtx[5].nLockTime++;
+    blockOther.vtx[5].ClearCache();
+    blockOther.vMerkleTree = block.vMerkleTree;
+    hashRoot = blockOther.UpdateCoinbaseMerkleRoot();
+    BOOST_CHECK(hashRoot != block.BuildMerkleTree());
+    BOOST_CHECK(hashRoot == blockOther.BuildMerkleTree());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
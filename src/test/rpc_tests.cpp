@@ -4,6 +4,7 @@
 #include "base58.h"
 #include "util.h"
 #include "bitcoinrpc.h"
+#include "protocol.h"
 
 using namespace std;
 using namespace json_spirit;
@@ -59,4 +60,21 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_generate)
+{
+    rpcfn_type generate = tableRPC["generate"]->actor;
+
+    Array params;
+    BOOST_CHECK_THROW(generate(params, false), runtime_error);
+    params.push_back(1);
+    BOOST_CHECK_THROW(generate(params, false), Object); // not on regtest
+
+    // regtest nodes listen on a port of their own
+    BOOST_CHECK_EQUAL(GetDefaultPort(true), 31814);
+    fRegTest = true;
+    BOOST_CHECK_EQUAL(GetDefaultPort(true), 31815);
+    BOOST_CHECK_EQUAL(GetDefaultPort(false), 31813);
+    fRegTest = false;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
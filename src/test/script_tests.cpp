@@ -442,4 +442,103 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_sigcache)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    CScript scriptPubKey;
+    scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vin[0].prevout.n = 0;
+    txTo.vin[0].prevout.hash = GetRandHash();
+    txTo.vout[0].nValue = 1;
+
+    uint256 hash = SignatureHash(scriptPubKey, txTo, 0, SIGHASH_ALL);
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    CScript scriptSig;
+    scriptSig << vchSig;
+
+    CSignatureCacheStats before, after;
+    GetSignatureCacheStats(before);
+
+    // First verification misses and populates the cache, the second hits it
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, true, 0));
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, true, 0));
+    GetSignatureCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nMisses, before.nMisses + 1);
+    BOOST_CHECK_EQUAL(after.nHits, before.nHits + 1);
+    BOOST_CHECK_EQUAL(after.nEntries, before.nEntries + 1);
+    BOOST_CHECK(after.nEntries <= after.nMaxEntries);
+
+    // A different transaction signed with the same key is not a hit
+    txTo.vout[0].nValue = 2;
+    BOOST_CHECK(!VerifyScript(scriptSig, scriptPubKey, txTo, 0, true, 0));
+    GetSignatureCacheStats(before);
+    BOOST_CHECK_EQUAL(before.nHits, after.nHits);
+}
+
+static void RandomTransaction(CTransaction& tx, int nInputs, int nOutputs)
+{
+    tx.vin.resize(nInputs);
+    for (int i = 0; i < nInputs; i++)
+    {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = GetRandInt(4);
+        tx.vin[i].scriptSig = CScript() << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+        tx.vin[i].nSequence = GetRandInt(2) ? std::numeric_limits<unsigned int>::max() : GetRandInt(1000);
+    }
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++)
+    {
+        tx.vout[i].nValue = GetRand(100 * COIN);
+        tx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    tx.nLockTime = GetRandInt(500000);
+}
+
+BOOST_AUTO_TEST_CASE(script_sighash_context)
+{
+    static const int nHashTypes[] = { 0, SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, 4,
+                                      SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY,
+                                      SIGHASH_SINGLE | SIGHASH_ANYONECANPAY };
+
+    CScript scriptCode;
+    scriptCode << OP_DUP << OP_CODESEPARATOR << OP_HASH160 << vector<unsigned char>(20, 7) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    // Same hashes as SignatureHash for every input and hash type,
+    // including out of range inputs and SIGHASH_SINGLE without a matching output
+    for (int nInputs = 1; nInputs <= 5; nInputs++)
+    {
+        CTransaction txTo;
+        RandomTransaction(txTo, nInputs, 3);
+        CSignatureHashContext sighash(txTo);
+        for (int i = 0; i <= nInputs; i++)
+            BOOST_FOREACH(int nHashType, nHashTypes)
+                BOOST_CHECK(sighash.SignatureHash(scriptCode, i, nHashType) == SignatureHash(scriptCode, txTo, i, nHashType));
+    }
+
+    // A signature verifies the same with and without the context
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey;
+    scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+
+    CTransaction txTo;
+    RandomTransaction(txTo, 3, 2);
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(SignatureHash(scriptPubKey, txTo, 1, SIGHASH_ALL), vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txTo.vin[1].scriptSig = CScript() << vchSig;
+
+    CSignatureHashContext sighash(txTo);
+    BOOST_CHECK(VerifyScript(txTo.vin[1].scriptSig, scriptPubKey, txTo, 1, true, 0, &sighash));
+    BOOST_CHECK(!VerifyScript(txTo.vin[1].scriptSig, scriptPubKey, txTo, 0, true, 0, &sighash));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
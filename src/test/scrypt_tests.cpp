@@ -0,0 +1,110 @@
+//
+// Unit tests for the scrypt proof-of-work scanner
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "scrypt_mine.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(scrypt_tests)
+
+// Header whose first nonce with a hash ending in 16 zero bits is 22
+static block_header MakeHeader()
+{
+    block_header header;
+    header.version = 1;
+    header.prev_block = 0;
+    header.merkle_root = 0;
+    header.timestamp = 1400001167;
+    header.bits = 0x1e0fffff;
+    header.nonce = 0;
+    return header;
+}
+
+static unsigned int Scan(void* scratchbuf, unsigned int nStart, unsigned int nEnd, unsigned int& nHashes, uint256& result)
+{
+    block_header header = MakeHeader();
+    header.nonce = nStart;
+    block_header res_header;
+    unsigned int nNonce = scanhash_scrypt(&header, scratchbuf, nEnd, nHashes, UBEGIN(result), &res_header);
+    if (nNonce != (unsigned int) -1)
+        BOOST_CHECK_EQUAL(res_header.nonce, nNonce);
+    return nNonce;
+}
+
+BOOST_AUTO_TEST_CASE(scanhash_ranges)
+{
+    bool fHugePages;
+    void* scratchbuf = scrypt_miner_buffer_alloc(&fHugePages);
+    BOOST_REQUIRE(scratchbuf != NULL);
+
+    block_header header = MakeHeader();
+    header.nonce = 22;
+    uint256 hash;
+    scrypt_hash(&header, sizeof(header), UINTBEGIN(hash), scratchbuf);
+    BOOST_CHECK(hash < (uint256(1) << 240));
+
+    unsigned int nHashes;
+    uint256 result;
+    BOOST_CHECK_EQUAL(Scan(scratchbuf, 0, 64, nHashes, result), 22U);
+    BOOST_CHECK(result == hash);
+    BOOST_CHECK_EQUAL(nHashes, 23U);
+
+    // Resuming after the hit scans the rest of the range and counts it
+    BOOST_CHECK_EQUAL(Scan(scratchbuf, 23, 64, nHashes, result), (unsigned int) -1);
+    BOOST_CHECK_EQUAL(nHashes, 41U);
+
+    // Ranges ending inside a group of lanes
+    for (unsigned int nStart = 19; nStart <= 22; nStart++)
+    {
+        BOOST_CHECK_EQUAL(Scan(scratchbuf, nStart, 23, nHashes, result), 22U);
+        BOOST_CHECK_EQUAL(nHashes, 23 - nStart);
+        BOOST_CHECK(result == hash);
+    }
+    BOOST_CHECK_EQUAL(Scan(scratchbuf, 22, 22, nHashes, result), (unsigned int) -1);
+    BOOST_CHECK_EQUAL(nHashes, 0U);
+
+    scrypt_miner_buffer_free(scratchbuf);
+}
+
+static void ScanThread(unsigned int nStart, unsigned int nEnd, unsigned int* pnHashes)
+{
+    bool fHugePages;
+    void* scratchbuf = scrypt_miner_buffer_alloc(&fHugePages);
+    block_header header = MakeHeader();
+    header.nonce = nStart;
+    *pnHashes = 0;
+    while (header.nonce < nEnd)
+    {
+        unsigned int nHashes;
+        block_header res_header;
+        uint256 result;
+        unsigned int nNonce = scanhash_scrypt(&header, scratchbuf, nEnd, nHashes, UBEGIN(result), &res_header);
+        *pnHashes += nHashes;
+        if (nNonce == (unsigned int) -1)
+            break;
+        header.nonce = nNonce + 1;
+    }
+    scrypt_miner_buffer_free(scratchbuf);
+}
+
+BOOST_AUTO_TEST_CASE(scanhash_threads)
+{
+    // Threads scanning disjoint nonce ranges of one header, the way the
+    // proof-of-work miner threads share a block
+    const unsigned int nThreads = 2;
+    const unsigned int nPerThread = 0x200;
+    std::vector<unsigned int> vHashes(nThreads);
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ScanThread, i * nPerThread, (i + 1) * nPerThread, &vHashes[i]));
+    threads.join_all();
+
+    // Lanes past a hit are hashed again on resuming but counted once
+    for (unsigned int i = 0; i < nThreads; i++)
+        BOOST_CHECK_EQUAL(vHashes[i], nPerThread);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,58 @@
+#include <boost/test/unit_test.hpp>
+
+#include "serialize.h"
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(serialize_tests)
+
+BOOST_AUTO_TEST_CASE(spanstream_read)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    vector<int> vIn(5, 7);
+    string strIn = "span";
+    ss << vIn << strIn << (uint64)42;
+
+    CSpanStream span(&ss.begin()[0], &ss.begin()[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    vector<int> vOut;
+    string strOut;
+    uint64 nOut = 0;
+    span >> vOut >> strOut;
+    BOOST_CHECK(vOut == vIn);
+    BOOST_CHECK(strOut == strIn);
+    BOOST_CHECK_EQUAL(span.size(), sizeof(nOut));
+    span >> nOut;
+    BOOST_CHECK_EQUAL(nOut, 42U);
+    BOOST_CHECK(span.empty());
+    BOOST_CHECK_EQUAL(span.GetPos(), ss.size());
+
+    // Reading past the end of the span throws like CDataStream does
+    BOOST_CHECK_THROW(span >> nOut, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(spanstream_transaction)
+{
+    CTransaction txIn;
+    txIn.vin.resize(2);
+    txIn.vin[0].prevout.n = 1;
+    txIn.vin[1].scriptSig << OP_1 << OP_2;
+    txIn.vout.resize(1);
+    txIn.vout[0].nValue = 5 * COIN;
+    txIn.vout[0].scriptPubKey << OP_TRUE;
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txIn;
+
+    // Trailing bytes after the transaction, as in a block file, are left alone
+    ss << (unsigned int)0xdeadbeef;
+
+    CSpanStream span(&ss.begin()[0], &ss.begin()[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    CTransaction txOut;
+    span >> txOut;
+    BOOST_CHECK(txOut == txIn);
+    BOOST_CHECK(txOut.GetHash() == txIn.GetHash());
+    BOOST_CHECK_EQUAL(span.size(), sizeof(unsigned int));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
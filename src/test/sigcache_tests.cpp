@@ -0,0 +1,125 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+// A distinct (sighash, signature, pubkey) triple for each n
+static void MakeEntry(unsigned int n, uint256& hash, vector<unsigned char>& vchSig, vector<unsigned char>& vchPubKey)
+{
+    hash = n;
+    vchSig.assign(72, (unsigned char)n);
+    vchSig[0] = (unsigned char)(n >> 8);
+    vchSig[1] = (unsigned char)(n >> 16);
+    vchPubKey.assign(33, 0x02);
+}
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_hit_miss)
+{
+    CSignatureCache cache(1);
+    uint256 hash;
+    vector<unsigned char> vchSig, vchPubKey;
+    MakeEntry(1, hash, vchSig, vchPubKey);
+
+    BOOST_CHECK(!cache.Get(hash, vchSig, vchPubKey));
+    cache.Set(hash, vchSig, vchPubKey);
+    BOOST_CHECK(cache.Get(hash, vchSig, vchPubKey));
+
+    // Any part of the triple differing is a miss
+    vector<unsigned char> vchSigOther(vchSig);
+    vchSigOther[10] ^= 1;
+    BOOST_CHECK(!cache.Get(hash, vchSigOther, vchPubKey));
+    BOOST_CHECK(!cache.Get(hash + 1, vchSig, vchPubKey));
+    vector<unsigned char> vchPubKeyOther(vchPubKey);
+    vchPubKeyOther[0] = 0x03;
+    BOOST_CHECK(!cache.Get(hash, vchSig, vchPubKeyOther));
+
+    // Setting it again doesn't add a second entry
+    cache.Set(hash, vchSig, vchPubKey);
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 1U);
+    BOOST_CHECK_EQUAL(stats.nHits, 1U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 4U);
+    BOOST_CHECK_EQUAL(stats.nBytes, 1U << 20);
+    BOOST_CHECK_EQUAL(stats.nMaxEntries, (1U << 20) / sizeof(uint256));
+
+    // A zero sized cache keeps nothing
+    CSignatureCache cacheOff(0);
+    cacheOff.Set(hash, vchSig, vchPubKey);
+    BOOST_CHECK(!cacheOff.Get(hash, vchSig, vchPubKey));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_eviction)
+{
+    // Four times as many signatures as the table has slots
+    CSignatureCache cache(1);
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    unsigned int nInsert = stats.nMaxEntries * 4;
+
+    uint256 hash;
+    vector<unsigned char> vchSig, vchPubKey;
+    for (unsigned int n = 0; n < nInsert; n++)
+    {
+        MakeEntry(n, hash, vchSig, vchPubKey);
+        cache.Set(hash, vchSig, vchPubKey);
+        BOOST_CHECK(n % 1000 != 0 || cache.Get(hash, vchSig, vchPubKey));
+    }
+
+    cache.GetStats(stats);
+    BOOST_CHECK(stats.nEntries <= stats.nMaxEntries);
+    BOOST_CHECK(stats.nEntries > stats.nMaxEntries * 9 / 10);
+
+    // Most of the first quarter has been replaced, the last entry is there
+    unsigned int nKept = 0;
+    for (unsigned int n = 0; n < nInsert / 4; n++)
+    {
+        MakeEntry(n, hash, vchSig, vchPubKey);
+        if (cache.Get(hash, vchSig, vchPubKey))
+            nKept++;
+    }
+    BOOST_CHECK(nKept < nInsert / 4 / 2);
+    MakeEntry(nInsert - 1, hash, vchSig, vchPubKey);
+    BOOST_CHECK(cache.Get(hash, vchSig, vchPubKey));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_salt)
+{
+    // Each cache picks its own salt, so the same signatures land in
+    // different buckets and different ones are evicted from full buckets.
+    // With the same salt both caches would keep exactly the same entries.
+    CSignatureCache cache1(1), cache2(1);
+    CSignatureCacheStats stats;
+    cache1.GetStats(stats);
+    unsigned int nInsert = stats.nMaxEntries;
+
+    uint256 hash;
+    vector<unsigned char> vchSig, vchPubKey;
+    for (unsigned int n = 0; n < nInsert; n++)
+    {
+        MakeEntry(n, hash, vchSig, vchPubKey);
+        cache1.Set(hash, vchSig, vchPubKey);
+        cache2.Set(hash, vchSig, vchPubKey);
+    }
+
+    unsigned int nKept1 = 0, nKept2 = 0, nKeptBoth = 0;
+    for (unsigned int n = 0; n < nInsert; n++)
+    {
+        MakeEntry(n, hash, vchSig, vchPubKey);
+        bool fKept1 = cache1.Get(hash, vchSig, vchPubKey);
+        bool fKept2 = cache2.Get(hash, vchSig, vchPubKey);
+        nKept1 += fKept1;
+        nKept2 += fKept2;
+        nKeptBoth += (fKept1 && fKept2);
+    }
+    BOOST_CHECK(nKept1 > nInsert / 2 && nKept1 < nInsert);
+    BOOST_CHECK(nKept2 > nInsert / 2 && nKept2 < nInsert);
+    BOOST_CHECK(nKeptBoth * 10 < nKept1 * 9);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 
 #include "main.h"
 #include "wallet.h"
+#include "fixtures.h"
 
 using namespace std;
 using namespace json_spirit;
@@ -261,4 +262,128 @@ BOOST_AUTO_TEST_CASE(test_GetThrow)
     BOOST_CHECK_THROW(t1.GetValueIn(missingInputs), runtime_error);
 }
 
+// Exposes whether a transaction's hash is cached
+class CCacheProbeTransaction : public CTransaction
+{
+public:
+    bool IsHashCached() const { return hashCached != 0; }
+};
+
+BOOST_AUTO_TEST_CASE(tx_hash_cache)
+{
+    CBasicKeyStore keystore;
+    MapPrevTx dummyInputs;
+    std::vector<CTransaction> dummyTransactions = SetupDummyInputs(keystore, dummyInputs);
+
+    // A transaction built in memory isn't cached, changing it changes its hash
+    CTransaction tx = dummyTransactions[0];
+    uint256 hashBuilt = tx.GetHash();
+    tx.vout[0].nValue++;
+    BOOST_CHECK(tx.GetHash() != hashBuilt);
+    tx.vout[0].nValue--;
+
+    // One read from a stream is
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    CCacheProbeTransaction txRead;
+    ss >> txRead;
+    BOOST_CHECK(!txRead.IsHashCached());
+    BOOST_CHECK(txRead.GetHash() == hashBuilt);
+    BOOST_CHECK(txRead.IsHashCached());
+    BOOST_CHECK_EQUAL(txRead.GetTxSize(), ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+
+    // Copies and assigned transactions start uncached and stay that way
+    CCacheProbeTransaction txCopy(txRead);
+    BOOST_CHECK(!txCopy.IsHashCached());
+    txCopy.vout[0].nValue++;
+    BOOST_CHECK(txCopy.GetHash() != hashBuilt);
+    BOOST_CHECK(!txCopy.IsHashCached());
+    CCacheProbeTransaction txAssigned;
+    txAssigned = txRead;
+    BOOST_CHECK(!txAssigned.IsHashCached());
+    txAssigned.vout[0].nValue++;
+    BOOST_CHECK(txAssigned.GetHash() == txCopy.GetHash());
+
+    // ClearCache before changing one in place
+    txRead.ClearCache();
+    txRead.vout[0].nValue++;
+    BOOST_CHECK(txRead.GetHash() == txCopy.GetHash());
+    BOOST_CHECK(!txRead.IsHashCached());
+
+    // Signing clears it too
+    CCacheProbeTransaction txSpend;
+    ss << dummyTransactions[1];
+    ss >> txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(dummyTransactions[1].GetHash(), 0);
+    txSpend.GetHash();
+    BOOST_CHECK(SignSignature(keystore, dummyTransactions[1], txSpend, 0));
+    BOOST_CHECK(!txSpend.IsHashCached());
+}
+
+BOOST_AUTO_TEST_CASE(tx_hash_cache_coinbase)
+{
+    // A miner template whose coinbase was read from a stream, as getworkex submit does
+    CBlock block;
+    block.vtx.resize(3);
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].prevout.n = i;
+        block.vtx[i].vout.resize(1);
+        block.vtx[i].vout[0].nValue = i * CENT;
+    }
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.BuildMerkleTree();
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block.vtx[0];
+    ss >> block.vtx[0];
+    block.hashMerkleRoot = block.UpdateCoinbaseMerkleRoot();
+
+    // Each new extra nonce gives the coinbase a new hash and the block a new root
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = 100;
+    unsigned int nExtraNonce = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        uint256 hashRootBefore = block.hashMerkleRoot;
+        IncrementExtraNonce(&block, &indexPrev, nExtraNonce);
+        BOOST_CHECK(block.vtx[0].GetHash() == SerializeHash(block.vtx[0]));
+        BOOST_CHECK(block.hashMerkleRoot != hashRootBefore);
+
+        // The same as the root of a block read fresh from a stream
+        CBlock blockRead;
+        ss << block.vtx;
+        ss >> blockRead.vtx;
+        BOOST_CHECK(block.hashMerkleRoot == blockRead.BuildMerkleTree());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(tx_hash_cache_once)
+{
+    // A relayed transaction is hashed for relay, mempool accept, inventory,
+    // block template, merkle root, block connect and wallet sync, but only
+    // the first of those computes it
+    std::vector<CTransaction> vtx;
+    for (unsigned int i = 0; i < 50; i++)
+        vtx.push_back(MakeTestTx(i, 2));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vtx;
+    std::vector<CCacheProbeTransaction> vtxRead;
+    ss >> vtxRead;
+
+    unsigned int nComputed = 0;
+    for (unsigned int i = 0; i < vtxRead.size(); i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            if (!vtxRead[i].IsHashCached())
+                nComputed++;
+            BOOST_CHECK(vtxRead[i].GetHash() == vtx[i].GetHash());
+        }
+    }
+    BOOST_CHECK_EQUAL(nComputed, vtx.size());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -292,4 +292,106 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(wallet_key_birth_time)
+{
+    CWallet keywallet;
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, 0);
+
+    int64 nBefore = GetTime();
+    CPubKey pubkey = keywallet.GenerateNewKey();
+    BOOST_CHECK(keywallet.mapKeyMetadata.count(pubkey.GetID()));
+    BOOST_CHECK(keywallet.nTimeFirstKey >= nBefore);
+    BOOST_CHECK(keywallet.nTimeFirstKey <= GetTime());
+
+    // An older key moves the birth time back, a newer one doesn't
+    int64 nFirst = keywallet.nTimeFirstKey;
+    keywallet.UpdateTimeFirstKey(nFirst + 1000);
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, nFirst);
+    keywallet.UpdateTimeFirstKey(nFirst - 1000);
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, nFirst - 1000);
+
+    // A key of unknown age forces a scan from the genesis block
+    keywallet.UpdateTimeFirstKey(0);
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, 1);
+    keywallet.UpdateTimeFirstKey(nFirst);
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, 1);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_keystore_snapshot)
+{
+    CWallet keywallet;
+    CPubKey pubkey1 = keywallet.GenerateNewKey();
+    CPubKey pubkey2 = keywallet.GenerateNewKey();
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+
+    CScript multisig;
+    multisig.SetMultisig(1, std::vector<CKey>(1, keyOther));
+    CScript scriptMine;
+    scriptMine.SetDestination(pubkey2.GetID());
+    BOOST_CHECK(keywallet.AddCScript(scriptMine));
+
+    CKeyStoreSnapshot snapshot(keywallet);
+
+    // Keys added after the snapshot was taken are not seen
+    CPubKey pubkey3 = keywallet.GenerateNewKey();
+
+    std::vector<CScript> vScripts;
+    vScripts.push_back(CScript() << pubkey1 << OP_CHECKSIG);
+    vScripts.push_back(CScript());
+    vScripts.back().SetDestination(pubkey1.GetID());
+    vScripts.push_back(CScript());
+    vScripts.back().SetDestination(keyOther.GetPubKey().GetID());
+    vScripts.push_back(CScript());
+    vScripts.back().SetDestination(scriptMine.GetID());
+    vScripts.push_back(multisig);
+    vScripts.push_back(CScript() << OP_RETURN);
+    BOOST_FOREACH(const CScript& script, vScripts)
+        BOOST_CHECK_EQUAL(IsMine(snapshot, script), IsMine(keywallet, script));
+
+    CScript script3;
+    script3.SetDestination(pubkey3.GetID());
+    BOOST_CHECK(IsMine(keywallet, script3));
+    BOOST_CHECK(!IsMine(snapshot, script3));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_keypool_batch)
+{
+    std::vector<CKey> vKeys;
+    GenerateNewKeys(vKeys, 200, true);
+    BOOST_CHECK_EQUAL(vKeys.size(), 200U);
+    std::set<CKeyID> setIDs;
+    BOOST_FOREACH(const CKey& key, vKeys)
+    {
+        BOOST_CHECK(key.IsCompressed());
+        BOOST_CHECK(key.GetPubKey().IsValid());
+        setIDs.insert(key.GetPubKey().GetID());
+    }
+    BOOST_CHECK_EQUAL(setIDs.size(), vKeys.size());
+
+    // Top up a wallet that isn't file backed, so nothing touches the database
+    mapArgs["-keypool"] = "20";
+    CWallet keywallet;
+    BOOST_CHECK(keywallet.TopUpKeyPool());
+    BOOST_CHECK_EQUAL(keywallet.GetKeyPoolSize(), 21);
+    BOOST_CHECK_EQUAL(keywallet.GetKeyPoolLowWater(), 10U);
+    std::set<CKeyID> setKeys;
+    keywallet.GetKeys(setKeys);
+    BOOST_CHECK_EQUAL(setKeys.size(), 21U);
+    BOOST_CHECK(keywallet.nTimeFirstKey > 1);
+
+    // Concurrent top ups reserve their batches, together they fill the pool
+    // exactly instead of each adding what was missing when it started
+    mapArgs["-keypool"] = "1200";
+    CWallet keywallet2;
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i++)
+        threads.create_thread(boost::bind(&CWallet::TopUpKeyPool, &keywallet2));
+    threads.join_all();
+    BOOST_CHECK_EQUAL(keywallet2.GetKeyPoolSize(), 1201);
+    keywallet2.GetKeys(setKeys);
+    BOOST_CHECK_EQUAL(setKeys.size(), 1201U);
+    mapArgs.erase("-keypool");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
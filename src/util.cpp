@@ -77,6 +77,7 @@ bool fServer = false;
 bool fCommandLine = false;
 string strMiscWarning;
 bool fTestNet = false;
+bool fRegTest = false;
 bool fNoListen = false;
 bool fLogTimestamps = false;
 CMedianFilter<int64> vTimeOffsets(200,0);
@@ -95,6 +96,13 @@ void locking_callback(int mode, int i, const char* file, int line)
 
 LockedPageManager LockedPageManager::instance;
 
+CStreamBufferPool& CStreamBufferPool::Instance()
+{
+    // Leaked on purpose, streams in other static objects may outlive it
+    static CStreamBufferPool* pinstance = new CStreamBufferPool();
+    return *pinstance;
+}
+
 // Init
 class CInit
 {
@@ -1109,7 +1117,9 @@ const boost::filesystem::path &GetDataDir(bool fNetSpecific)
     } else {
         path = GetDefaultDataDir();
     }
-    if (fNetSpecific && GetBoolArg("-testnet", false))
+    if (fNetSpecific && GetBoolArg("-regtest", false))
+        path /= "regtest";
+    else if (fNetSpecific && GetBoolArg("-testnet", false))
         path /= "testnet2";
 
     fs::create_directory(path);
@@ -155,6 +155,7 @@ extern bool fServer;
 extern bool fCommandLine;
 extern std::string strMiscWarning;
 extern bool fTestNet;
+extern bool fRegTest;
 extern bool fNoListen;
 extern bool fLogTimestamps;
 extern bool fReopenDebugLog;
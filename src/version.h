@@ -25,7 +25,7 @@ extern const std::string CLIENT_DATE;
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 60007;
+static const int PROTOCOL_VERSION = 60008;
 
 // earlier versions not supported as of Feb 2012, and are disconnected
 static const int MIN_PROTO_VERSION = 209;
@@ -44,6 +44,9 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" start with this version
+static const int COMPACT_BLOCKS_VERSION = 60008;
+
 #define DISPLAY_VERSION_MAJOR       1
 #define DISPLAY_VERSION_MINOR       1
 #define DISPLAY_VERSION_REVISION    0
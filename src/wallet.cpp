@@ -43,9 +43,19 @@ CPubKey CWallet::GenerateNewKey()
     if (fCompressed)
         SetMinVersion(FEATURE_COMPRPUBKEY);
 
+    CPubKey pubkey = key.GetPubKey();
+
+    // Create new metadata
+    int64 nCreationTime = GetTime();
+    {
+        LOCK(cs_wallet);
+        mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
+        UpdateTimeFirstKey(nCreationTime);
+    }
+
     if (!AddKey(key))
         throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
-    return key.GetPubKey();
+    return pubkey;
 }
 
 bool CWallet::AddKey(const CKey& key)
@@ -55,10 +65,35 @@ bool CWallet::AddKey(const CKey& key)
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
-        return CWalletDB(strWalletFile).WriteKey(key.GetPubKey(), key.GetPrivKey());
+    {
+        CPubKey pubkey = key.GetPubKey();
+        CKeyMetadata keyMeta;
+        {
+            LOCK(cs_wallet);
+            keyMeta = mapKeyMetadata[pubkey.GetID()];
+            if (pwalletdbKeyPool)
+                return pwalletdbKeyPool->WriteKey(pubkey, key.GetPrivKey(), keyMeta);
+        }
+        return CWalletDB(strWalletFile).WriteKey(pubkey, key.GetPrivKey(), keyMeta);
+    }
+    return true;
+}
+
+bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
+{
+    mapKeyMetadata[pubkey.GetID()] = meta;
+    UpdateTimeFirstKey(meta.nCreateTime);
     return true;
 }
 
+void CWallet::UpdateTimeFirstKey(int64 nCreateTime)
+{
+    if (nCreateTime <= 1)
+        nTimeFirstKey = 1; // unknown, rescans have to start at the genesis block
+    else if (nTimeFirstKey == 0 || nCreateTime < nTimeFirstKey)
+        nTimeFirstKey = nCreateTime;
+}
+
 bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char> &vchCryptedSecret)
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
@@ -68,9 +103,11 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
     {
         LOCK(cs_wallet);
         if (pwalletdbEncryption)
-            return pwalletdbEncryption->WriteCryptedKey(vchPubKey, vchCryptedSecret);
+            return pwalletdbEncryption->WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
+        else if (pwalletdbKeyPool)
+            return pwalletdbKeyPool->WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
         else
-            return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey, vchCryptedSecret);
+            return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
     }
     return false;
 }
@@ -793,31 +830,240 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Blocks read ahead of the one being committed during a rescan
+static const unsigned int MAX_RESCAN_WINDOW = 500;
+
+// Parallel rescan of the block chain for wallet transactions.
+//
+// Worker threads read blocks ahead of the scan position and test every
+// output against a snapshot of the wallet's keys and scripts. The calling
+// thread then goes through the blocks in chain order, checks inputs
+// against the transactions known to the wallet (including those found
+// earlier in this scan), and only takes cs_wallet to add the candidates.
+class CWalletScanner
+{
+private:
+    struct CScanItem
+    {
+        CBlock block;
+        std::vector<uint256> vTxHash;
+        std::vector<bool> vOutputMatch;
+        bool fRead;
+    };
+
+    CWallet* pwallet;
+    bool fUpdate;
+    CKeyStoreSnapshot keystore;
+    std::vector<CBlockIndex*> vChain;
+    set<uint256> setWalletTx;
+
+    CWaitableCriticalSection cs;
+    boost::condition_variable cond;
+    std::deque<boost::shared_ptr<CScanItem> > window; // window[0] is vChain[nCommit]
+    unsigned int nCommit;
+    unsigned int nNextRead;
+    bool fAbort;
+
+    void ThreadRead()
+    {
+        RenameThread("bitcoin-rescan");
+        while (true)
+        {
+            boost::shared_ptr<CScanItem> item(new CScanItem());
+            item->fRead = false;
+            CBlockIndex* pindex;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!fAbort && nNextRead < vChain.size() && nNextRead >= nCommit + MAX_RESCAN_WINDOW)
+                    cond.wait(lock);
+                if (fAbort || nNextRead >= vChain.size())
+                    return;
+                pindex = vChain[nNextRead++];
+                window.push_back(item);
+            }
+
+            if (!item->block.ReadFromDisk(pindex, true))
+                printf("CWalletScanner : unable to read block %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str());
+            item->vTxHash.reserve(item->block.vtx.size());
+            item->vOutputMatch.reserve(item->block.vtx.size());
+            BOOST_FOREACH(const CTransaction& tx, item->block.vtx)
+            {
+                item->vTxHash.push_back(tx.GetHash());
+                bool fMatch = false;
+                BOOST_FOREACH(const CTxOut& txout, tx.vout)
+                {
+                    if (::IsMine(keystore, txout.scriptPubKey))
+                    {
+                        fMatch = true;
+                        break;
+                    }
+                }
+                item->vOutputMatch.push_back(fMatch);
+            }
+
+            boost::unique_lock<boost::mutex> lock(cs);
+            item->fRead = true;
+            cond.notify_all();
+        }
+    }
+
+    boost::shared_ptr<CScanItem> Next()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!fAbort && nCommit < vChain.size() && (window.empty() || !window.front()->fRead))
+            cond.wait(lock);
+        if (fAbort || nCommit >= vChain.size())
+            return boost::shared_ptr<CScanItem>();
+        boost::shared_ptr<CScanItem> item = window.front();
+        window.pop_front();
+        nCommit++;
+        cond.notify_all();
+        return item;
+    }
+
+    void Abort()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fAbort = true;
+        cond.notify_all();
+    }
+
+    int Commit(CScanItem& item)
+    {
+        std::vector<unsigned int> vMatch;
+        for (unsigned int i = 0; i < item.block.vtx.size(); i++)
+        {
+            bool fMatch = item.vOutputMatch[i] || setWalletTx.count(item.vTxHash[i]);
+            BOOST_FOREACH(const CTxIn& txin, item.block.vtx[i].vin)
+            {
+                if (fMatch)
+                    break;
+                fMatch = setWalletTx.count(txin.prevout.hash);
+            }
+            if (fMatch)
+                vMatch.push_back(i);
+        }
+        if (vMatch.empty())
+            return 0;
+
+        int nFound = 0;
+        LOCK2(cs_main, pwallet->cs_wallet);
+        BOOST_FOREACH(unsigned int i, vMatch)
+        {
+            if (pwallet->AddToWalletIfInvolvingMe(item.block.vtx[i], &item.block, fUpdate))
+                nFound++;
+            if (pwallet->mapWallet.count(item.vTxHash[i]))
+                setWalletTx.insert(item.vTxHash[i]);
+        }
+        return nFound;
+    }
+
+public:
+    CWalletScanner(CWallet* pwalletIn, bool fUpdateIn) : pwallet(pwalletIn), fUpdate(fUpdateIn), keystore(*pwalletIn),
+        nCommit(0), nNextRead(0), fAbort(false)
+    {
+        LOCK(pwallet->cs_wallet);
+        BOOST_FOREACH(const PAIRTYPE(uint256, CWalletTx)& item, pwallet->mapWallet)
+            setWalletTx.insert(item.first);
+    }
+
+    int Run(CBlockIndex* pindexStart)
+    {
+        {
+            LOCK(cs_main);
+            for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+                vChain.push_back(pindex);
+        }
+        if (vChain.empty())
+            return 0;
+
+        int nThreads = boost::thread::hardware_concurrency();
+        if (nThreads < 1)
+            nThreads = 1;
+        if (nThreads > 8)
+            nThreads = 8;
+
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CWalletScanner::ThreadRead, this));
+
+        int nFound = 0;
+        int64 nLastProgress = GetTime();
+        try {
+            boost::shared_ptr<CScanItem> item;
+            while (!fShutdown && !pwallet->IsRescanAborted() && (item = Next()))
+            {
+                nFound += Commit(*item);
+                if (GetTime() >= nLastProgress + 10)
+                {
+                    nLastProgress = GetTime();
+                    printf("Still rescanning. At block %d, %d%% done\n", vChain[0]->nHeight + (int)nCommit, (int)(nCommit * 100 / vChain.size()));
+                }
+            }
+        }
+        catch (std::exception &e) {
+            PrintExceptionContinue(&e, "CWalletScanner::Run()");
+        }
+        if (nCommit < vChain.size())
+            printf("Rescan aborted at block %d\n", vChain[0]->nHeight + (int)nCommit);
+
+        Abort();
+        threads.join_all();
+        return nFound;
+    }
+};
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
-// exist in the wallet will be updated.
+// exist in the wallet will be updated. Blocks from before the wallet's
+// oldest key are skipped, allowing two hours for block timestamp drift.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
-    int ret = 0;
-
     CBlockIndex* pindex = pindexStart;
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        LOCK(cs_main);
+        int64 nTimeStart = 0;
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
-            {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
-            }
-            pindex = pindex->pnext;
+            LOCK(cs_wallet);
+            if (nTimeFirstKey > 1)
+                nTimeStart = nTimeFirstKey - 7200;
         }
+        while (pindex && pindex->GetBlockTime() < nTimeStart)
+            pindex = pindex->pnext;
+    }
+    if (pindex != pindexStart)
+        printf("ScanForWalletTransactions() : skipping to block %d, created before the oldest key\n", pindex ? pindex->nHeight : -1);
+
+    {
+        LOCK(cs_scan);
+        if (nScansRunning++ == 0)
+            fAbortRescan = false;
+    }
+    CWalletScanner scanner(this, fUpdate);
+    int ret = scanner.Run(pindex);
+    {
+        LOCK(cs_scan);
+        if (--nScansRunning == 0)
+            fAbortRescan = false;
     }
     return ret;
 }
 
+bool CWallet::AbortRescan()
+{
+    LOCK(cs_scan);
+    if (nScansRunning == 0)
+        return false;
+    fAbortRescan = true;
+    return true;
+}
+
+bool CWallet::IsRescanAborted()
+{
+    LOCK(cs_scan);
+    return fAbortRescan;
+}
+
 int CWallet::ScanForWalletTransaction(const uint256& hashTx)
 {
     CTransaction tx;
@@ -833,53 +1079,57 @@ void CWallet::ReacceptWalletTransactions()
     bool fRepeat = true;
     while (fRepeat)
     {
-        LOCK(cs_wallet);
         fRepeat = false;
         vector<CDiskTxPos> vMissingTx;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
         {
-            CWalletTx& wtx = item.second;
-            if ((wtx.IsCoinBase() && wtx.IsSpent(0)) || (wtx.IsCoinStake() && wtx.IsSpent(1)))
-                continue;
-
-            CTxIndex txindex;
-            bool fUpdated = false;
-            if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
+            LOCK2(cs_main, cs_wallet);
+            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
-                {
-                    printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %"PRIszu" != wtx.vout.size() %"PRIszu"\n", txindex.vSpent.size(), wtx.vout.size());
+                CWalletTx& wtx = item.second;
+                if ((wtx.IsCoinBase() && wtx.IsSpent(0)) || (wtx.IsCoinStake() && wtx.IsSpent(1)))
                     continue;
-                }
-                for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+
+                CTxIndex txindex;
+                bool fUpdated = false;
+                if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
                 {
-                    if (wtx.IsSpent(i))
+                    // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
+                    if (txindex.vSpent.size() != wtx.vout.size())
+                    {
+                        printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %"PRIszu" != wtx.vout.size() %"PRIszu"\n", txindex.vSpent.size(), wtx.vout.size());
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                    }
+                    for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
                     {
-                        wtx.MarkSpent(i);
-                        fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        if (wtx.IsSpent(i))
+                            continue;
+                        if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                        {
+                            wtx.MarkSpent(i);
+                            fUpdated = true;
+                            vMissingTx.push_back(txindex.vSpent[i]);
+                        }
+                    }
+                    if (fUpdated)
+                    {
+                        printf("ReacceptWalletTransactions found spent coin %snvc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
+                        wtx.MarkDirty();
+                        wtx.WriteToDisk();
                     }
                 }
-                if (fUpdated)
+                else
                 {
-                    printf("ReacceptWalletTransactions found spent coin %snvc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
-                    wtx.MarkDirty();
-                    wtx.WriteToDisk();
+                    // Re-accept any txes of ours that aren't already in a block
+                    if (!(wtx.IsCoinBase() || wtx.IsCoinStake()))
+                        wtx.AcceptWalletTransaction(txdb, false);
                 }
             }
-            else
-            {
-                // Re-accept any txes of ours that aren't already in a block
-                if (!(wtx.IsCoinBase() || wtx.IsCoinStake()))
-                    wtx.AcceptWalletTransaction(txdb, false);
-            }
         }
         if (!vMissingTx.empty())
         {
             // TODO: optimize this to scan just part of the block chain?
+            // Not under cs_main or cs_wallet, the scan reads blocks on its
+            // own threads and only locks while adding what it finds
             if (ScanForWalletTransactions(pindexGenesisBlock))
                 fRepeat = true;  // Found missing transactions: re-do re-accept.
         }
@@ -1348,7 +1598,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
                         return false;
 
                 // Limit size
-                unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+                unsigned int nBytes = wtxNew.GetTxSize();
                 if (nBytes >= MAX_BLOCK_SIZE_GEN/5)
                     return false;
                 dPriority /= nBytes;
@@ -1447,14 +1697,14 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
             continue; // only count coins meeting min age requirement
 
         bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown; n++)
         {
-            // printf(">> In.....\n");
             // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval,
+            // the whole window hashed at once
             uint256 hashProofOfStake = 0;
+            unsigned int nTimeKernel = 0;
             COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake))
+            if (FindStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime, min(nSearchInterval, (int64)nMaxStakeSearchInterval), nTimeKernel, hashProofOfStake))
             {
                // Found a kernel
                 if (fDebug && GetBoolArg("-printcoinstake"))
@@ -1467,7 +1717,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
                 {
                     if (fDebug && GetBoolArg("-printcoinstake"))
                         printf("CreateCoinStake : failed to parse kernel\n");
-                    break;
+                    continue;
                 }
                 if (fDebug && GetBoolArg("-printcoinstake"))
                     printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
@@ -1475,7 +1725,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
                 {
                     if (fDebug && GetBoolArg("-printcoinstake"))
                         printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
+                    continue;  // only support pay to public key and pay to address
                 }
                 if (whichType == TX_PUBKEYHASH) // pay to address type
                 {
@@ -1485,14 +1735,14 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
                     {
                         if (fDebug && GetBoolArg("-printcoinstake"))
                             printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
+                        continue;  // unable to find corresponding public key
                     }
                     scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
                 }
                 else
                     scriptPubKeyOut = scriptPubKeyKernel;
 
-                txNew.nTime -= n; 
+                txNew.nTime = nTimeKernel;
                 txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
                 nCredit += pcoin.first->vout[pcoin.second].nValue;
 
@@ -1506,7 +1756,6 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
                 if (fDebug && GetBoolArg("-printcoinstake"))
                     printf("CreateCoinStake : added kernel type=%d\n", whichType);
                 fKernelFound = true;
-                break;
             }
         }
         if (fKernelFound || fShutdown)
@@ -1577,7 +1826,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
         }
 
         // Limit size
-        unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
+        unsigned int nBytes = txNew.GetTxSize();
         if (nBytes >= MAX_BLOCK_SIZE_GEN/5)
             return error("CreateCoinStake : exceeded coinstake size limit");
 
@@ -1829,66 +2078,225 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
 // Mark old keypool keys as used,
 // and generate all new keys
 //
-bool CWallet::NewKeyPool()
+// Number of keys generated and written per database transaction
+static const unsigned int KEYPOOL_BATCH_SIZE = 500;
+
+static void GenerateNewKeyRange(std::vector<CKey>* pvKeys, unsigned int nBegin, unsigned int nEnd, bool fCompressed)
+{
+    for (unsigned int i = nBegin; i < nEnd && !fShutdown; i++)
+        (*pvKeys)[i].MakeNewKey(fCompressed);
+}
+
+void GenerateNewKeys(std::vector<CKey>& vKeys, unsigned int nKeys, bool fCompressed)
+{
+    RandAddSeedPerfmon();
+    vKeys.resize(nKeys);
+
+    // Not worth starting threads for the odd key
+    unsigned int nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1U, std::min(std::min(nThreads, 8U), nKeys / 64));
+    if (nThreads == 1)
+    {
+        GenerateNewKeyRange(&vKeys, 0, nKeys, fCompressed);
+        return;
+    }
+
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&GenerateNewKeyRange, &vKeys, nKeys * i / nThreads, nKeys * (i + 1) / nThreads, fCompressed));
+    threads.join_all();
+}
+
+// Generate nKeys keys without holding cs_wallet, then add them to the end
+// of the key pool. Keys, their metadata and the pool entries are written in
+// a single database transaction.
+bool CWallet::AddKeysToKeyPool(unsigned int nKeys)
 {
+    bool fCompressed;
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
-        BOOST_FOREACH(int64 nIndex, setKeyPool)
-            walletdb.ErasePool(nIndex);
-        setKeyPool.clear();
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    }
 
-        if (IsLocked())
+    std::vector<CKey> vKeys;
+    GenerateNewKeys(vKeys, nKeys, fCompressed);
+
+    // Generation stops early on shutdown, leaving the rest of vKeys unset
+    if (fShutdown)
+        return false;
+
+    LOCK(cs_wallet);
+
+    // The wallet may have been locked while the keys were generated
+    if (IsLocked())
+        return false;
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    CWalletDB* pwalletdb = NULL;
+    if (fFileBacked)
+    {
+        pwalletdb = new CWalletDB(strWalletFile);
+        if (!pwalletdb->TxnBegin())
+        {
+            delete pwalletdb;
             return false;
+        }
+        pwalletdbKeyPool = pwalletdb;
+    }
+
+    int64 nCreationTime = GetTime();
+    int64 nIndex = setKeyPool.empty() ? 1 : *setKeyPool.rbegin() + 1;
+    std::vector<int64> vIndex;
+    std::vector<CKeyID> vAdded;
+    bool fOk = true;
+    BOOST_FOREACH(const CKey& key, vKeys)
+    {
+        // Don't keep the database busy once shutdown has started, StopNode
+        // waits for this thread before the wallet is closed
+        if (fShutdown)
+        {
+            fOk = false;
+            break;
+        }
+        CPubKey pubkey = key.GetPubKey();
+        vAdded.push_back(pubkey.GetID());
+        mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
+        if (!AddKey(key) || (pwalletdb && !pwalletdb->WritePool(nIndex, CKeyPool(pubkey))))
+        {
+            fOk = error("AddKeysToKeyPool() : writing generated key failed");
+            break;
+        }
+        vIndex.push_back(nIndex++);
+    }
+
+    pwalletdbKeyPool = NULL;
+    if (pwalletdb)
+    {
+        if (!fOk)
+            pwalletdb->TxnAbort();
+        else if (!pwalletdb->TxnCommit())
+            fOk = error("AddKeysToKeyPool() : committing generated keys failed");
+        delete pwalletdb;
+    }
 
-        int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
-        for (int i = 0; i < nKeys; i++)
+    // None of the batch was stored, so none of it may stay in memory either
+    if (!fOk)
+    {
+        BOOST_FOREACH(const CKeyID& keyID, vAdded)
         {
-            int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
+            RemoveKey(keyID);
+            mapKeyMetadata.erase(keyID);
         }
-        printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
+        return false;
     }
+    UpdateTimeFirstKey(nCreationTime);
+
+    setKeyPool.insert(vIndex.begin(), vIndex.end());
+    printf("keypool added keys %"PRI64d"-%"PRI64d", size=%"PRIszu"\n", vIndex.front(), vIndex.back(), setKeyPool.size());
     return true;
 }
 
-bool CWallet::TopUpKeyPool()
+bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
+        CWalletDB walletdb(strWalletFile);
+        BOOST_FOREACH(int64 nIndex, setKeyPool)
+            walletdb.ErasePool(nIndex);
+        setKeyPool.clear();
 
         if (IsLocked())
             return false;
+    }
 
-        CWalletDB walletdb(strWalletFile);
+    int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
+    for (int64 nDone = 0; nDone < nKeys; nDone += KEYPOOL_BATCH_SIZE)
+        if (!AddKeysToKeyPool(min(nKeys - nDone, (int64)KEYPOOL_BATCH_SIZE)))
+            return false;
+    printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
+    return true;
+}
 
-        // Top up key pool
-        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
+bool CWallet::TopUpKeyPool()
+{
+    // Keys are generated in batches outside cs_wallet, so another thread
+    // may be topping up at the same time. Each batch is reserved under the
+    // lock and counts towards the target until it has been added.
+    unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL) + 1;
+    while (!fShutdown)
+    {
+        unsigned int nBatch;
         {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRI64d", size=%"PRIszu"\n", nEnd, setKeyPool.size());
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() + nKeyPoolPending >= nTargetSize)
+                break;
+            nBatch = min(nTargetSize - (unsigned int)setKeyPool.size() - nKeyPoolPending, KEYPOOL_BATCH_SIZE);
+            nKeyPoolPending += nBatch;
+        }
+        bool fAdded = false;
+        try {
+            fAdded = AddKeysToKeyPool(nBatch);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "TopUpKeyPool()");
         }
+        {
+            LOCK(cs_wallet);
+            nKeyPoolPending -= nBatch;
+        }
+        if (!fAdded)
+            return false;
     }
     return true;
 }
 
+unsigned int CWallet::GetKeyPoolLowWater()
+{
+    int64 nTargetSize = max(GetArg("-keypool", 100), 0LL);
+    return (unsigned int)max(GetArg("-keypoolmin", nTargetSize / 2), 0LL);
+}
+
+void ThreadKeyPoolRefill(void* parg)
+{
+    // Make this thread recognisable as the key pool refill thread
+    RenameThread("bitcoin-keypool");
+
+    CWallet* pwallet = (CWallet*)parg;
+    vnThreadsRunning[THREAD_KEYPOOL]++;
+    try
+    {
+        while (!fShutdown)
+        {
+            if (!pwallet->IsLocked() && pwallet->GetKeyPoolSize() < (int)pwallet->GetKeyPoolLowWater())
+                pwallet->TopUpKeyPool();
+            for (int i = 0; i < 10 && !fShutdown; i++)
+                Sleep(100);
+        }
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadKeyPoolRefill()");
+    }
+    vnThreadsRunning[THREAD_KEYPOOL]--;
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
     keypool.vchPubKey = CPubKey();
+
+    // ThreadKeyPoolRefill keeps the pool filled, only generate keys here
+    // when it has fallen behind
+    if (!IsLocked() && GetKeyPoolSize() < (int)GetKeyPoolLowWater())
+        TopUpKeyPool();
+
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
-
         // Get the oldest key
         if(setKeyPool.empty())
             return;
@@ -75,6 +75,20 @@ private:
     bool SelectCoins(int64 nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
     CWalletDB *pwalletdbEncryption;
 
+    // open database transaction that key writes go to while a key pool batch is stored
+    CWalletDB *pwalletdbKeyPool;
+
+    // keys TopUpKeyPool calls are generating and haven't added yet, guarded by cs_wallet
+    unsigned int nKeyPoolPending;
+
+    bool AddKeysToKeyPool(unsigned int nKeys);
+
+    // number of ScanForWalletTransactions calls running, and whether they
+    // were asked to stop early, guarded by cs_scan
+    CCriticalSection cs_scan;
+    int nScansRunning;
+    bool fAbortRescan;
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -88,6 +102,7 @@ public:
     std::string strWalletFile;
 
     std::set<int64> setKeyPool;
+    std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
 
 
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
@@ -101,7 +116,12 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbKeyPool = NULL;
+        nKeyPoolPending = 0;
         nOrderPosNext = 0;
+        nTimeFirstKey = 0;
+        nScansRunning = 0;
+        fAbortRescan = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -111,11 +131,17 @@ public:
         fFileBacked = true;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbKeyPool = NULL;
+        nKeyPoolPending = 0;
         nOrderPosNext = 0;
+        nTimeFirstKey = 0;
+        nScansRunning = 0;
+        fAbortRescan = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
     int64 nOrderPosNext;
+    int64 nTimeFirstKey; // 0 if there are no keys, 1 if the oldest key's birth time is unknown
     std::map<uint256, int> mapRequestCount;
 
     std::map<CTxDestination, std::string> mapAddressBook;
@@ -135,6 +161,10 @@ public:
     bool AddKey(const CKey& key);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
     bool LoadKey(const CKey& key) { return CCryptoKeyStore::AddKey(key); }
+    // Load metadata (used by LoadWallet)
+    bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
+    // Lower nTimeFirstKey to a key created at nCreateTime, 0 if unknown
+    void UpdateTimeFirstKey(int64 nCreateTime);
 
     bool LoadMinVersion(int nVersion) { nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
@@ -169,6 +199,9 @@ public:
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    // Stop running ScanForWalletTransactions calls early, false if none is running
+    bool AbortRescan();
+    bool IsRescanAborted();
     int ScanForWalletTransaction(const uint256& hashTx);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
@@ -188,6 +221,7 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool();
+    unsigned int GetKeyPoolLowWater();
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
@@ -286,6 +320,7 @@ public:
 
     int GetKeyPoolSize()
     {
+        LOCK(cs_wallet);
         return setKeyPool.size();
     }
 
@@ -861,4 +896,9 @@ private:
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+/** Generate nKeys new keys, spread over several threads when there are many */
+void GenerateNewKeys(std::vector<CKey>& vKeys, unsigned int nKeys, bool fCompressed);
+
+void ThreadKeyPoolRefill(void* parg);
+
 #endif
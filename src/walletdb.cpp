@@ -182,6 +182,74 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
 }
 
 
+// Unserialize and check a "tx" record. Doesn't touch the wallet, so it can
+// run on the wallet loader threads.
+static bool ReadWalletTx(const uint256& hash, CDataStream& ssValue, CWalletTx& wtx,
+                         bool& fUpgraded, string& strErr)
+{
+    ssValue >> wtx;
+    if (!wtx.CheckTransaction() || wtx.GetHash() != hash)
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+// Rebuild the private key of a "key" or "wkey" record. Unless fVerify is
+// set only the public key stored with the private key is compared against
+// the record, the full curve arithmetic checks are left to -walletverify.
+static bool ReadWalletKey(const string& strType, const vector<unsigned char>& vchPubKey,
+                          CDataStream& ssValue, CKey& key, bool fVerify, string& strErr)
+{
+    CPrivKey pkey;
+    if (strType == "key")
+        ssValue >> pkey;
+    else
+    {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+    const char* pszKeyType = (strType == "key" ? "CPrivKey" : "CWalletKey");
+
+    key.SetPubKey(vchPubKey);
+    if (!key.SetPrivKey(pkey, !fVerify))
+    {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    if (key.GetPubKey() != vchPubKey)
+    {
+        strErr = strprintf("Error reading wallet database: %s pubkey inconsistency", pszKeyType);
+        return false;
+    }
+    if (fVerify && !key.IsValid())
+    {
+        strErr = strprintf("Error reading wallet database: invalid %s", pszKeyType);
+        return false;
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              int& nFileVersion, vector<uint256>& vWalletUpgrade,
@@ -203,34 +271,16 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             uint256 hash;
             ssKey >> hash;
             CWalletTx& wtx = pwallet->mapWallet[hash];
-            ssValue >> wtx;
-            if (wtx.CheckTransaction() && (wtx.GetHash() == hash))
+            bool fUpgraded;
+            if (ReadWalletTx(hash, ssValue, wtx, fUpgraded, strErr))
                 wtx.BindWallet(pwallet);
             else
             {
                 pwallet->mapWallet.erase(hash);
                 return false;
             }
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
+            if (fUpgraded)
                 vWalletUpgrade.push_back(hash);
-            }
 
             if (wtx.nOrderPos == -1)
                 fAnyUnordered = true;
@@ -265,48 +315,8 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             vector<unsigned char> vchPubKey;
             ssKey >> vchPubKey;
             CKey key;
-            if (strType == "key")
-            {
-                CPrivKey pkey;
-                ssValue >> pkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(pkey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CPrivKey";
-                    return false;
-                }
-            }
-            else
-            {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(wkey.vchPrivKey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CWalletKey";
-                    return false;
-                }
-            }
+            if (!ReadWalletKey(strType, vchPubKey, ssValue, key, true, strErr))
+                return false;
             if (!pwallet->LoadKey(key))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -341,6 +351,14 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             }
             fIsEncrypted = true;
         }
+        else if (strType == "keymeta")
+        {
+            vector<unsigned char> vchPubKey;
+            ssKey >> vchPubKey;
+            CKeyMetadata keyMeta;
+            ssValue >> keyMeta;
+            pwallet->LoadKeyMetadata(vchPubKey, keyMeta);
+        }
         else if (strType == "defaultkey")
         {
             ssValue >> pwallet->vchDefaultKey;
@@ -386,6 +404,215 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+// Loads wallet records in cursor order like ReadKeyValue, but unserializes
+// transactions and rebuilds private keys on a pool of threads while the
+// cursor is still being read. Everything else is cheap and may depend on
+// the records before it, so it is left to ReadKeyValue in Merge().
+class CWalletLoader
+{
+public:
+    struct CRecord
+    {
+        CDataStream ssKey;
+        boost::shared_ptr<CDataStream> pssValue; // dropped once decoded
+        std::string strType;
+        uint256 hash;
+        CWalletTx* pwtx;              // "tx": mapWallet entry to unserialize into
+        boost::shared_ptr<CKey> pkey; // "key"/"wkey": the rebuilt key
+        bool fDecoded;                // handled by a worker instead of ReadKeyValue
+        bool fOK;
+        bool fUpgraded;
+        std::string strErr;
+
+        CRecord() : ssKey(SER_DISK, CLIENT_VERSION), pssValue(new CDataStream(SER_DISK, CLIENT_VERSION)), pwtx(NULL), fDecoded(false), fOK(false), fUpgraded(false)
+        {
+        }
+    };
+
+    // Timings for the load time breakdown, in milliseconds
+    int64 nReadTime;
+    int64 nDecodeTime;
+    int64 nMergeTime;
+
+private:
+    CWallet* pwallet;
+    bool fVerify;
+    std::deque<CRecord> records;  // deque so pointers stay valid as records are read
+    std::vector<CRecord*> vDecode;
+    unsigned int nNextDecode;
+    unsigned int nDecoded;
+    bool fReadDone;
+    CWaitableCriticalSection cs;
+    boost::condition_variable cond;
+    boost::thread_group threads;
+    int nThreads;
+
+    void Decode(CRecord& rec)
+    {
+        try {
+            if (rec.strType == "tx")
+                rec.fOK = ReadWalletTx(rec.hash, *rec.pssValue, *rec.pwtx, rec.fUpgraded, rec.strErr);
+            else
+            {
+                vector<unsigned char> vchPubKey;
+                rec.ssKey >> vchPubKey;
+                rec.pkey.reset(new CKey());
+                rec.fOK = ReadWalletKey(rec.strType, vchPubKey, *rec.pssValue, *rec.pkey, fVerify, rec.strErr);
+            }
+        }
+        catch (...) {
+            rec.fOK = false;
+        }
+        rec.pssValue.reset();
+    }
+
+    void ThreadDecode()
+    {
+        RenameThread("bitcoin-loadwlt");
+        while (true)
+        {
+            std::vector<CRecord*> vBatch;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (nNextDecode >= vDecode.size() && !fReadDone)
+                    cond.wait(lock);
+                if (nNextDecode >= vDecode.size())
+                    return;
+                unsigned int nEnd = std::min((unsigned int)vDecode.size(), nNextDecode + 64);
+                vBatch.assign(vDecode.begin() + nNextDecode, vDecode.begin() + nEnd);
+                nNextDecode = nEnd;
+            }
+            BOOST_FOREACH(CRecord* prec, vBatch)
+                Decode(*prec);
+
+            boost::unique_lock<boost::mutex> lock(cs);
+            nDecoded += vBatch.size();
+            cond.notify_all();
+        }
+    }
+
+public:
+    CWalletLoader(CWallet* pwalletIn, bool fVerifyIn) : nReadTime(0), nDecodeTime(0), nMergeTime(0), pwallet(pwalletIn), fVerify(fVerifyIn), nNextDecode(0), nDecoded(0), fReadDone(false)
+    {
+        nThreads = boost::thread::hardware_concurrency();
+        if (nThreads < 1)
+            nThreads = 1;
+        if (nThreads > 8)
+            nThreads = 8;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CWalletLoader::ThreadDecode, this));
+    }
+
+    ~CWalletLoader()
+    {
+        Finish();
+    }
+
+    int GetThreads() const { return nThreads; }
+    size_t size() const { return records.size(); }
+
+    // Slot for the next record read off the cursor
+    CRecord& Next()
+    {
+        records.push_back(CRecord());
+        return records.back();
+    }
+
+    // Give back the slot from Next() when the cursor had no more records
+    void Unread()
+    {
+        records.pop_back();
+    }
+
+    // Hand the record just filled in by Next() to the decode threads if it
+    // is worth it. Caller holds cs_wallet.
+    void Push(CRecord& rec)
+    {
+        unsigned int nKeySize = rec.ssKey.size();
+        rec.ssKey >> rec.strType;
+        if (rec.strType == "tx")
+        {
+            rec.ssKey >> rec.hash;
+            rec.pwtx = &pwallet->mapWallet[rec.hash];
+        }
+        else if (rec.strType != "key" && rec.strType != "wkey")
+        {
+            rec.ssKey.Rewind(nKeySize - rec.ssKey.size());
+            return;
+        }
+
+        rec.fDecoded = true;
+        boost::unique_lock<boost::mutex> lock(cs);
+        vDecode.push_back(&rec);
+        cond.notify_one();
+    }
+
+    // Wait for the decode threads to finish with everything read so far
+    void Finish()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fReadDone = true;
+        cond.notify_all();
+        while (nDecoded < vDecode.size())
+            cond.wait(lock);
+        lock.unlock();
+        threads.join_all();
+    }
+
+    // Add all records to the wallet in the order they were read, with the
+    // error handling of the serial loader. Caller holds cs_wallet.
+    DBErrors Merge(int& nFileVersion, vector<uint256>& vWalletUpgrade, bool& fIsEncrypted,
+                   bool& fAnyUnordered, bool& fNoncriticalErrors)
+    {
+        DBErrors result = DB_LOAD_OK;
+        BOOST_FOREACH(CRecord& rec, records)
+        {
+            bool fOK = rec.fOK;
+            if (!rec.fDecoded)
+                fOK = ReadKeyValue(pwallet, rec.ssKey, *rec.pssValue, nFileVersion,
+                                   vWalletUpgrade, fIsEncrypted, fAnyUnordered, rec.strType, rec.strErr);
+            else if (rec.strType == "tx")
+            {
+                if (fOK)
+                {
+                    rec.pwtx->BindWallet(pwallet);
+                    if (rec.fUpgraded)
+                        vWalletUpgrade.push_back(rec.hash);
+                    if (rec.pwtx->nOrderPos == -1)
+                        fAnyUnordered = true;
+                }
+                else
+                    pwallet->mapWallet.erase(rec.hash);
+            }
+            else if (fOK && !pwallet->LoadKey(*rec.pkey))
+            {
+                rec.strErr = "Error reading wallet database: LoadKey failed";
+                fOK = false;
+            }
+
+            // Try to be tolerant of single corrupt records:
+            if (!fOK)
+            {
+                // losing keys is considered a catastrophic error, anything else
+                // we assume the user can live with:
+                if (IsKeyType(rec.strType))
+                    result = DB_CORRUPT;
+                else
+                {
+                    // Leave other errors alone, if we try to fix them we might make things worse.
+                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                    if (rec.strType == "tx")
+                        // Rescan if there is a bad transaction record:
+                        SoftSetBoolArg("-rescan", true);
+                }
+            }
+            if (!rec.strErr.empty())
+                printf("%s\n", rec.strErr.c_str());
+        }
+        return result;
+    }
+};
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -414,42 +641,47 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        CWalletLoader loader(pwallet, GetBoolArg("-walletverify"));
+        int64 nStart = GetTimeMillis();
         while (true)
         {
             // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            CWalletLoader::CRecord& rec = loader.Next();
+            int ret = ReadAtCursor(pcursor, rec.ssKey, *rec.pssValue);
             if (ret == DB_NOTFOUND)
+            {
+                loader.Unread();
                 break;
+            }
             else if (ret != 0)
             {
                 printf("Error reading next record from wallet database\n");
+                pcursor->close();
                 return DB_CORRUPT;
             }
+            loader.Push(rec);
+        }
+        pcursor->close();
+        int64 nRead = GetTimeMillis();
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
-                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr))
+        loader.Finish();
+        int64 nDecoded = GetTimeMillis();
+
+        result = loader.Merge(nFileVersion, vWalletUpgrade, fIsEncrypted, fAnyUnordered, fNoncriticalErrors);
+        printf("LoadWallet() : %"PRIszu" records, read %"PRI64d"ms, decode %"PRI64d"ms more on %d threads, merge %"PRI64d"ms\n",
+               loader.size(), nRead - nStart, nDecoded - nRead, loader.GetThreads(), GetTimeMillis() - nDecoded);
+
+        // Keys written before key metadata existed have no known birth time
+        set<CKeyID> setKeys;
+        pwallet->GetKeys(setKeys);
+        BOOST_FOREACH(const CKeyID& keyID, setKeys)
+        {
+            if (!pwallet->mapKeyMetadata.count(keyID))
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else
-                {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
-                }
+                pwallet->UpdateTimeFirstKey(0);
+                break;
             }
-            if (!strErr.empty())
-                printf("%s\n", strErr.c_str());
         }
-        pcursor->close();
     }
     catch (...)
     {
@@ -477,7 +709,11 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         WriteVersion(CLIENT_VERSION);
 
     if (fAnyUnordered)
+    {
+        int64 nStart = GetTimeMillis();
         result = ReorderTransactions(pwallet);
+        printf("LoadWallet() : reordered transactions %"PRI64d"ms\n", GetTimeMillis() - nStart);
+    }
 
     return result;
 }